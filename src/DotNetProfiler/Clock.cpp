@@ -0,0 +1,64 @@
+#include "StdAfx.h"
+#include "Clock.h"
+
+bool CClock::s_useTsc;
+UINT64 CClock::s_startTimestamp;
+LONG64 CClock::s_startCounter;
+
+// Calibrate waits until at least this long after Start, so the measured frequency is good
+// to within a few parts per million.
+const LONG64 MinCalibrationMilliseconds = 50;
+
+static bool HasInvariantTsc()
+{
+	int info[4];
+	__cpuid(info, 0x80000000);
+	if ((unsigned int)info[0] < 0x80000007)
+	{
+		return false;
+	}
+	__cpuid(info, 0x80000007);
+	return (info[3] & (1 << 8)) != 0; // EDX bit 8: TscInvariant
+}
+
+void CClock::Start()
+{
+	s_useTsc = HasInvariantTsc();
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	s_startTimestamp = Now();
+	s_startCounter = counter.QuadPart;
+}
+
+void CClock::Calibrate(ClockCalibration& calibration)
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	LONG64 minElapsed = frequency.QuadPart * MinCalibrationMilliseconds / 1000;
+	if (counter.QuadPart - s_startCounter < minElapsed)
+	{
+		DWORD remaining = (DWORD)((minElapsed - (counter.QuadPart - s_startCounter)) * 1000 / frequency.QuadPart) + 1;
+		Sleep(remaining);
+	}
+
+	// read the two clocks as close together as we can.
+	UINT64 timestamp = Now();
+	QueryPerformanceCounter(&counter);
+
+	calibration.qpcFrequency = frequency.QuadPart;
+	calibration.qpcBase = counter.QuadPart;
+	calibration.base = timestamp;
+	if (s_useTsc)
+	{
+		double elapsed = (double)(counter.QuadPart - s_startCounter) / (double)frequency.QuadPart;
+		calibration.frequency = (UINT64)((double)(timestamp - s_startTimestamp) / elapsed);
+	}
+	else
+	{
+		calibration.frequency = frequency.QuadPart;
+	}
+}
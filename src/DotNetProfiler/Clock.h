@@ -0,0 +1,49 @@
+#pragma once
+
+#include <intrin.h>
+
+// how to turn raw timestamps into time, this is written into the SharedMemoryHeader.
+struct ClockCalibration
+{
+	UINT64 frequency;    // timestamp ticks per second
+	UINT64 base;         // timestamp taken at the same moment as qpcBase
+	LONG64 qpcBase;      // QueryPerformanceCounter at that moment
+	LONG64 qpcFrequency; // QueryPerformanceFrequency
+};
+
+// The clock the Enter/Leave hooks use to stamp their records.  On processors with an invariant
+// time stamp counter this is just rdtsc, which is cheap enough to read on every call.  The
+// counter's frequency isn't reported anywhere so it is measured against QueryPerformanceCounter
+// between Start and Calibrate.  Where the TSC isn't reliable we fall back on the
+// performance counter itself.
+class CClock
+{
+public:
+	// called once when the profiler is initialized.
+	static void Start();
+
+	// measures the timestamp frequency, the longer since Start the more accurate it is.
+	static void Calibrate(ClockCalibration& calibration);
+
+	// whether Now is rdtsc, the x64 hook stubs read it themselves if so.
+	static bool UsesTsc()
+	{
+		return s_useTsc;
+	}
+
+	static UINT64 Now()
+	{
+		if (s_useTsc)
+		{
+			return __rdtsc();
+		}
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return (UINT64)counter.QuadPart;
+	}
+
+private:
+	static bool s_useTsc;
+	static UINT64 s_startTimestamp;
+	static LONG64 s_startCounter;
+};
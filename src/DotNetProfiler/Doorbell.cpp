@@ -0,0 +1,66 @@
+#include "StdAfx.h"
+#include "Doorbell.h"
+
+CDoorbell::CDoorbell()
+{
+	_sharedMemory = NULL;
+	_thread = NULL;
+	_stopEvent = NULL;
+}
+
+CDoorbell::~CDoorbell()
+{
+	Stop();
+}
+
+void CDoorbell::Start(CSharedMemory* sharedMemory)
+{
+	Stop();
+
+	_sharedMemory = sharedMemory;
+	_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	_thread = CreateThread(NULL, 0, &DoorbellThread, (PVOID)this, 0, NULL);
+}
+
+void CDoorbell::Stop()
+{
+	if (_thread != NULL)
+	{
+		SetEvent(_stopEvent);
+		WaitForSingleObject(_thread, INFINITE);
+		CloseHandle(_thread);
+		CloseHandle(_stopEvent);
+		_thread = NULL;
+		_stopEvent = NULL;
+	}
+	_sharedMemory = NULL;
+}
+
+DWORD WINAPI CDoorbell::DoorbellThread(PVOID v)
+{
+	CDoorbell* doorbell = (CDoorbell*)v;
+	doorbell->Run();
+	return 0;
+}
+
+void CDoorbell::Run()
+{
+	HANDLE events[2] = { _stopEvent, _sharedMemory->GetWaitingEvent() };
+	DWORD count = events[1] != NULL ? 2 : 1;
+	for (;;)
+	{
+		DWORD timeout = _sharedMemory->IsReaderWaiting() ? DoorbellInterval : INFINITE;
+		if (WaitForMultipleObjects(count, events, FALSE, timeout) == WAIT_OBJECT_0)
+		{
+			break;
+		}
+		if (!_sharedMemory->IsReaderWaiting())
+		{
+			continue;
+		}
+
+		// publish what the threads have staged so the ring covers it.
+		_sharedMemory->Quiesce();
+		_sharedMemory->RingDoorbell();
+	}
+}
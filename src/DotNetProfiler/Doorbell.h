@@ -0,0 +1,30 @@
+#pragma once
+
+#include "SharedMemory.h"
+
+// milliseconds between checks while a reader is waiting, shorter waits only last until the
+// next scheduler tick anyway.
+const DWORD DoorbellInterval = 16;
+
+// The writers ring the doorbells themselves when they publish, but a thread that has gone
+// idle keeps its last few records staged.  While any reader is waiting this publishes them
+// and rings for them, as soon as the reader starts waiting and then every DoorbellInterval.
+// Otherwise it sleeps until a reader sets the buffer's waiting event.
+class CDoorbell
+{
+public:
+	CDoorbell();
+	~CDoorbell();
+
+	void Start(CSharedMemory* sharedMemory);
+	void Stop();
+
+private:
+	static DWORD WINAPI DoorbellThread(PVOID v);
+
+	void Run();
+
+	CSharedMemory* _sharedMemory;
+	HANDLE _thread;
+	HANDLE _stopEvent;
+};
@@ -0,0 +1,49 @@
+#include "StdAfx.h"
+#include "FastPath.h"
+
+EXTERN_C volatile long g_fastPathKey = 0;
+__declspec(thread) FastPath t_fastPath;  // C linkage from the header, the stubs refer to it by name
+
+volatile long CFastPath::s_nextKey = 0;
+
+void CFastPath::Update(bool enable)
+{
+	long key = 0;
+	if (enable)
+	{
+		// 0 means off, so skip it if the counter ever wraps.
+		do
+		{
+			key = InterlockedIncrement(&s_nextKey);
+		}
+		while (key == 0);
+	}
+	InterlockedExchange(&g_fastPathKey, key);
+}
+
+void CFastPath::Arm(long key, CSharedMemory* sharedMemory, CShadowStack& shadow)
+{
+	if (key == 0)
+	{
+		return;
+	}
+	FastPath& fastPath = t_fastPath;
+	ChunkWriter* writer = sharedMemory->GetCurrentWriter();
+	if (writer == NULL)
+	{
+		fastPath.key = 0;
+		return;
+	}
+	fastPath.bufferId = sharedMemory->GetId();
+	fastPath.writer = writer;
+	fastPath.frames = shadow._frames;
+	fastPath.depth = &shadow._depth;
+	fastPath.key = key;
+}
+
+void CFastPath::Disarm()
+{
+	FastPath& fastPath = t_fastPath;
+	fastPath.key = 0;
+	fastPath.writer = NULL;
+}
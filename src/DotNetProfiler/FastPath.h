@@ -0,0 +1,67 @@
+#pragma once
+
+#include "SharedMemory.h"
+#include "ShadowStack.h"
+
+// What the x64 stubs in asmhelpers.asm need to handle an Enter, Leave or Tailcall themselves.  In
+// trace mode with the throttle off all the hooks do is push or pop the shadow stack and append a
+// record to the thread's staging buffer, so the stubs do that without saving registers or calling
+// in.  Anything else (a full staging buffer, a new chunk, a suppressed frame, the first call on a
+// thread) goes the long way round through CProfiler, which sets this up again on the way out.
+// Only the thread it belongs to reads or writes it.
+struct FastPath
+{
+	long key;             // g_fastPathKey when this was set up, 0 if it wasn't
+	long bufferId;        // the CSharedMemory the writer's chunk belongs to
+	ChunkWriter* writer;
+	ShadowFrame* frames;  // the thread's shadow stack
+	int* depth;
+	UINT64 savedR10;      // the Enter stub keeps these here instead of on the stack
+	UINT64 savedR11;
+};
+
+#ifdef _AMD64_
+// asmhelpers.asm has its own copy of these offsets.
+C_ASSERT(offsetof(FastPath, key) == 0);
+C_ASSERT(offsetof(FastPath, bufferId) == 4);
+C_ASSERT(offsetof(FastPath, writer) == 8);
+C_ASSERT(offsetof(FastPath, frames) == 16);
+C_ASSERT(offsetof(FastPath, depth) == 24);
+C_ASSERT(offsetof(FastPath, savedR10) == 32);
+C_ASSERT(offsetof(FastPath, savedR11) == 40);
+C_ASSERT(offsetof(ChunkWriter, pos) == 24);
+C_ASSERT(offsetof(ChunkWriter, end) == 32);
+C_ASSERT(offsetof(ChunkWriter, id) == 48);
+C_ASSERT(offsetof(ChunkWriter, timestamp) == 80);
+C_ASSERT(sizeof(ShadowFrame) == 24);
+C_ASSERT(offsetof(ShadowFrame, suppressed) == 4);
+C_ASSERT(offsetof(ShadowFrame, start) == 8);
+C_ASSERT(offsetof(ShadowFrame, children) == 16);
+C_ASSERT(RecordSize == 8 && MaxRecordBytes == 32 && MaxShadowDepth == 1024);
+C_ASSERT(LeaveRecord == 1 && TailcallRecord == 2);
+#endif
+
+// Nonzero while the stubs may take the fast path, and a thread's FastPath is only good for the
+// value it was set up with.  Anything that changes what the stubs would have to check (the mode,
+// the buffer, the throttle, a Reset or a Resume) gives it a new value.
+EXTERN_C volatile long g_fastPathKey;
+EXTERN_C __declspec(thread) FastPath t_fastPath;
+
+class CFastPath
+{
+public:
+	// Turns the fast path on with a new key, every thread has to go the long way once to set up
+	// its FastPath again.  Call it after making the change, with whether the stubs may be used.
+	static void Update(bool enable);
+
+	// The calling thread has just written to the buffer the long way, key is g_fastPathKey as it
+	// was before it looked at anything.  Its next calls can take the fast path if the key is
+	// still the same and its writer has a chunk in this buffer.
+	static void Arm(long key, CSharedMemory* sharedMemory, CShadowStack& shadow);
+
+	// the calling thread is going away, its writer is handed to the next thread.
+	static void Disarm();
+
+private:
+	static volatile long s_nextKey;
+};
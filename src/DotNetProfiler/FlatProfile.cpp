@@ -0,0 +1,289 @@
+#include "StdAfx.h"
+#include "FlatProfile.h"
+
+namespace
+{
+	__declspec(thread) ThreadStats* t_stats;
+}
+
+CFlatProfile::CFlatProfile()
+{
+	_threads = NULL;
+	InitializeCriticalSection(&_lock);
+}
+
+CFlatProfile::~CFlatProfile()
+{
+	ThreadStats* stats = _threads;
+	while (stats != NULL)
+	{
+		ThreadStats* next = stats->next;
+		for (int i = 0; i < MaxFunctionPages; i++)
+		{
+			delete[] stats->pages[i];
+		}
+		delete stats;
+		stats = next;
+	}
+	_threads = NULL;
+	DeleteCriticalSection(&_lock);
+}
+
+void CFlatProfile::Enter(UINT32 index, ShadowFrame* frame)
+{
+	ThreadStats* stats = t_stats;
+	if (stats == NULL)
+	{
+		stats = AttachThread();
+		if (stats == NULL)
+		{
+			return;
+		}
+	}
+
+	ThreadCounters* counters = GetCounters(stats, index);
+	if (counters != NULL)
+	{
+		counters->calls++;
+		if (frame != NULL)
+		{
+			// it is timed when it leaves.
+			counters->active++;
+			frame->counted = 1;
+		}
+	}
+}
+
+void CFlatProfile::Leave(ShadowFrame* frame, ShadowFrame* parent, UINT64 timestamp)
+{
+	ThreadStats* stats = t_stats;
+	if (stats == NULL || frame == NULL)
+	{
+		return;
+	}
+
+	UINT64 elapsed = (timestamp > frame->start) ? timestamp - frame->start : 0;
+	if (frame->counted)
+	{
+		// otherwise we started counting part way through this call.
+		ThreadCounters* counters = GetCounters(stats, frame->index);
+		counters->exclusive += (elapsed > frame->children) ? elapsed - frame->children : 0;
+		if (counters->active > 0 && --counters->active == 0)
+		{
+			// only the outermost call of a recursion adds to the inclusive time.
+			counters->inclusive += elapsed;
+		}
+	}
+	if (parent != NULL)
+	{
+		parent->children += elapsed;
+	}
+}
+
+// Forget the calls on the shadow stack without timing them.
+void CFlatProfile::Unwind(CShadowStack& shadow)
+{
+	ThreadStats* stats = t_stats;
+	if (stats == NULL)
+	{
+		return;
+	}
+	int count;
+	ShadowFrame* frames = shadow.GetFrames(count);
+	for (int i = 0; i < count; i++)
+	{
+		if (!frames[i].counted)
+		{
+			continue;
+		}
+		ThreadCounters* counters = GetCounters(stats, frames[i].index);
+		if (counters->active > 0)
+		{
+			counters->active--;
+		}
+	}
+}
+
+ThreadCounters* CFlatProfile::GetCounters(ThreadStats* stats, UINT32 index)
+{
+	if (index < FirstFunctionIndex)
+	{
+		return NULL;
+	}
+	UINT32 slot = index - FirstFunctionIndex;
+	UINT32 page = slot >> FunctionPageBits;
+	if (page >= MaxFunctionPages)
+	{
+		return NULL;
+	}
+	ThreadCounters* counters = stats->pages[page];
+	if (counters == NULL)
+	{
+		counters = new ThreadCounters[FunctionPageSize];
+		ZeroMemory(counters, sizeof(ThreadCounters) * FunctionPageSize);
+		// Merge reads the pages from the pipe thread.
+		InterlockedExchangePointer((PVOID volatile*)&stats->pages[page], counters);
+	}
+	return &counters[slot & (FunctionPageSize - 1)];
+}
+
+ThreadStats* CFlatProfile::AttachThread()
+{
+	EnterCriticalSection(&_lock);
+
+	ThreadStats* stats = _threads;
+	while (stats != NULL && stats->inUse)
+	{
+		stats = stats->next;
+	}
+	if (stats == NULL)
+	{
+		stats = new ThreadStats;
+		ZeroMemory(stats, sizeof(ThreadStats));
+		stats->next = _threads;
+		_threads = stats;
+	}
+	stats->inUse = true;
+
+	LeaveCriticalSection(&_lock);
+
+	t_stats = stats;
+	return stats;
+}
+
+void CFlatProfile::ReleaseThread()
+{
+	ThreadStats* stats = t_stats;
+	if (stats == NULL)
+	{
+		return;
+	}
+	t_stats = NULL;
+
+	EnterCriticalSection(&_lock);
+
+	// keep what this thread counted, and hand its pages to the next thread that comes along.
+	for (int page = 0; page < MaxFunctionPages; page++)
+	{
+		ThreadCounters* counters = stats->pages[page];
+		if (counters == NULL)
+		{
+			continue;
+		}
+		long end = (page + 1) * FunctionPageSize;
+		if ((long)_retired.size() < end)
+		{
+			_retired.resize(end);
+		}
+		for (int i = 0; i < FunctionPageSize; i++)
+		{
+			FunctionStats& total = _retired[page * FunctionPageSize + i];
+			total.calls += counters[i].calls;
+			total.inclusive += counters[i].inclusive;
+			total.exclusive += counters[i].exclusive;
+		}
+		ZeroMemory(counters, sizeof(ThreadCounters) * FunctionPageSize);
+	}
+	stats->inUse = false;
+
+	LeaveCriticalSection(&_lock);
+}
+
+void CFlatProfile::AddCounters(std::vector<FunctionStats>& totals, ThreadStats* stats, long count)
+{
+	for (long slot = 0; slot < count; )
+	{
+		ThreadCounters* counters = stats->pages[slot >> FunctionPageBits];
+		long end = (slot | (FunctionPageSize - 1)) + 1;
+		if (end > count)
+		{
+			end = count;
+		}
+		if (counters != NULL)
+		{
+			for (long i = slot; i < end; i++)
+			{
+				// these are being updated as we read them, which is fine, we'll get the rest next time.
+				const ThreadCounters& c = counters[i & (FunctionPageSize - 1)];
+				totals[i].calls += c.calls;
+				totals[i].inclusive += c.inclusive;
+				totals[i].exclusive += c.exclusive;
+			}
+		}
+		slot = end;
+	}
+}
+
+void CFlatProfile::Merge(std::vector<FunctionStats>& totals, long count)
+{
+	totals.assign(count, FunctionStats());
+
+	EnterCriticalSection(&_lock);
+
+	long retired = (long)_retired.size() < count ? (long)_retired.size() : count;
+	for (long i = 0; i < retired; i++)
+	{
+		totals[i] = _retired[i];
+	}
+	for (ThreadStats* stats = _threads; stats != NULL; stats = stats->next)
+	{
+		AddCounters(totals, stats, count);
+	}
+
+	long baseline = (long)_baseline.size() < count ? (long)_baseline.size() : count;
+	for (long i = 0; i < baseline; i++)
+	{
+		totals[i].calls -= _baseline[i].calls;
+		totals[i].inclusive -= _baseline[i].inclusive;
+		totals[i].exclusive -= _baseline[i].exclusive;
+	}
+
+	LeaveCriticalSection(&_lock);
+}
+
+// Like Clear, but for one function.  Its code is gone so nothing is adding to its counters.
+void CFlatProfile::Forget(UINT32 index)
+{
+	if (index < FirstFunctionIndex)
+	{
+		return;
+	}
+	long slot = (long)(index - FirstFunctionIndex);
+
+	EnterCriticalSection(&_lock);
+	FunctionStats total = FunctionStats();
+	if (slot < (long)_retired.size())
+	{
+		total = _retired[slot];
+	}
+	for (ThreadStats* stats = _threads; stats != NULL; stats = stats->next)
+	{
+		ThreadCounters* counters = stats->pages[slot >> FunctionPageBits];
+		if (counters != NULL)
+		{
+			const ThreadCounters& c = counters[slot & (FunctionPageSize - 1)];
+			total.calls += c.calls;
+			total.inclusive += c.inclusive;
+			total.exclusive += c.exclusive;
+		}
+	}
+	if (slot >= (long)_baseline.size())
+	{
+		_baseline.resize(slot + 1);
+	}
+	_baseline[slot] = total;
+	LeaveCriticalSection(&_lock);
+}
+
+// The counters belong to their threads so they can't be zeroed from here, instead we
+// remember where they were and subtract that from now on.
+void CFlatProfile::Clear(long count)
+{
+	std::vector<FunctionStats> baseline;
+
+	EnterCriticalSection(&_lock);
+	_baseline.clear();
+	Merge(baseline, count);
+	_baseline.swap(baseline);
+	LeaveCriticalSection(&_lock);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "SharedMemory.h"
+#include "FunctionTable.h"
+#include "ShadowStack.h"
+
+// a thread's own counters for one function.
+struct ThreadCounters
+{
+	UINT64 calls;
+	UINT64 inclusive;
+	UINT64 exclusive;
+	UINT32 active;   // calls to this function on the thread's stack right now
+	UINT32 reserved;
+};
+
+// The counters of one thread, only that thread writes to them.
+struct ThreadStats
+{
+	ThreadCounters* volatile pages[MaxFunctionPages];
+	bool inUse;          // false once the thread has gone and this is waiting to be reused
+	ThreadStats* next;   // all of them, for merging
+};
+
+// In flat profile mode Enter/Leave don't record every call, they just count calls and time
+// per function in thread local counters.  The calls are timed on the thread's shadow stack,
+// the frames deeper than MaxShadowDepth are counted but not timed.
+// The pipe thread merges the counters from all threads on demand and publishes the totals
+// to the stats region of the shared memory.
+class CFlatProfile
+{
+public:
+	CFlatProfile();
+	~CFlatProfile();
+
+	// frame is the call just pushed on the shadow stack, NULL if it is too deep to be kept.
+	void Enter(UINT32 index, ShadowFrame* frame);
+	// frame is the call just popped and parent the one below it, either can be NULL.
+	void Leave(ShadowFrame* frame, ShadowFrame* parent, UINT64 timestamp);
+
+	// the calls on the shadow stack are being forgotten without being timed, after a pause.
+	void Unwind(CShadowStack& shadow);
+
+	// the calling thread is going away, fold its counters into the totals.
+	void ReleaseThread();
+
+	// sum the counters of all threads, count is the number of functions to include.
+	void Merge(std::vector<FunctionStats>& totals, long count);
+
+	// start counting from zero again, count is the number of functions mapped so far.
+	void Clear(long count);
+
+	// the function has unloaded and its index is going to be reused, the next function
+	// to get it starts from zero.
+	void Forget(UINT32 index);
+
+private:
+	ThreadStats* AttachThread();
+	ThreadCounters* GetCounters(ThreadStats* stats, UINT32 index);
+	void AddCounters(std::vector<FunctionStats>& totals, ThreadStats* stats, long count);
+
+	ThreadStats* _threads;
+	std::vector<FunctionStats> _retired;  // counters of threads that have gone
+	std::vector<FunctionStats> _baseline; // totals at the last Clear
+	CRITICAL_SECTION _lock;
+};
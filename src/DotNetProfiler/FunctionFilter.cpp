@@ -0,0 +1,126 @@
+#include "StdAfx.h"
+#include "FunctionFilter.h"
+
+CFunctionFilter::CFunctionFilter()
+{
+	_hasIncludes = false;
+	_empty = true;
+	InitializeCriticalSection(&_lock);
+}
+
+CFunctionFilter::~CFunctionFilter()
+{
+	DeleteCriticalSection(&_lock);
+}
+
+void CFunctionFilter::SetSpec(const WCHAR* spec)
+{
+	std::vector<FilterRule> rules;
+	bool hasIncludes = false;
+
+	const WCHAR* pos = spec;
+	while (pos != NULL && *pos != L'\0')
+	{
+		const WCHAR* end = wcschr(pos, L';');
+		if (end == NULL)
+		{
+			end = pos + wcslen(pos);
+		}
+
+		std::wstring entry(pos, end);
+		pos = (*end == L';') ? end + 1 : end;
+
+		// trim spaces
+		size_t first = entry.find_first_not_of(L" \t");
+		if (first == std::wstring::npos)
+		{
+			continue;
+		}
+		entry = entry.substr(first, entry.find_last_not_of(L" \t") - first + 1);
+
+		FilterRule rule;
+		rule.include = true;
+		if (entry[0] == L'+' || entry[0] == L'-')
+		{
+			rule.include = (entry[0] == L'+');
+			entry = entry.substr(1);
+		}
+
+		rule.assembly = L"*";
+		if (!entry.empty() && entry[0] == L'[')
+		{
+			size_t close = entry.find(L']');
+			if (close == std::wstring::npos)
+			{
+				continue;
+			}
+			rule.assembly = entry.substr(1, close - 1);
+			entry = entry.substr(close + 1);
+		}
+		rule.name = entry.empty() ? L"*" : entry;
+
+		hasIncludes |= rule.include;
+		rules.push_back(rule);
+	}
+
+	EnterCriticalSection(&_lock);
+	_rules.swap(rules);
+	_hasIncludes = hasIncludes;
+	_empty = _rules.empty();
+	LeaveCriticalSection(&_lock);
+}
+
+bool CFunctionFilter::IsEmpty()
+{
+	return _empty;
+}
+
+bool CFunctionFilter::Include(const WCHAR* assemblyName, const WCHAR* methodName)
+{
+	EnterCriticalSection(&_lock);
+	bool result = !_hasIncludes;
+	for (size_t i = 0; i < _rules.size(); i++)
+	{
+		FilterRule& rule = _rules[i];
+		if (Match(rule.assembly.c_str(), assemblyName, true) && Match(rule.name.c_str(), methodName, false))
+		{
+			result = rule.include;
+		}
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+// Wildcard match, backtracking only to the most recent '*' which is enough for these patterns.
+bool CFunctionFilter::Match(const WCHAR* pattern, const WCHAR* text, bool ignoreCase)
+{
+	const WCHAR* star = NULL;
+	const WCHAR* resume = NULL;
+	while (*text != L'\0')
+	{
+		if (*pattern == L'*')
+		{
+			star = pattern++;
+			resume = text;
+		}
+		else if (*pattern == L'?' || *pattern == *text || (ignoreCase && towlower(*pattern) == towlower(*text)))
+		{
+			pattern++;
+			text++;
+		}
+		else if (star != NULL)
+		{
+			pattern = star + 1;
+			text = ++resume;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	while (*pattern == L'*')
+	{
+		pattern++;
+	}
+	return *pattern == L'\0';
+}
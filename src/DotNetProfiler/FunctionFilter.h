@@ -0,0 +1,37 @@
+#pragma once
+
+// Decides which functions get the Enter/Leave hooks.  A filter spec is a list of rules separated
+// by ';', each one an optional '+' (include, the default) or '-' (exclude) followed by a pattern.
+// Patterns match the full method name "Namespace.Class.Method" and can start with an assembly
+// pattern in brackets, so "-[mscorlib]" drops all of mscorlib and "+[MyApp]MyApp.Core.*" keeps one
+// namespace.  '*' matches any run of characters and '?' any one character.  The last rule that
+// matches wins, a function no rule matches is included unless the spec has include rules.
+class CFunctionFilter
+{
+public:
+	CFunctionFilter();
+	~CFunctionFilter();
+
+	// replace the rules, an empty spec includes everything.
+	void SetSpec(const WCHAR* spec);
+
+	// true if there are no rules, so callers can skip looking up the names.
+	bool IsEmpty();
+
+	bool Include(const WCHAR* assemblyName, const WCHAR* methodName);
+
+private:
+	struct FilterRule
+	{
+		bool include;
+		std::wstring assembly;
+		std::wstring name;
+	};
+
+	static bool Match(const WCHAR* pattern, const WCHAR* text, bool ignoreCase);
+
+	std::vector<FilterRule> _rules;
+	bool _hasIncludes;
+	volatile bool _empty;
+	CRITICAL_SECTION _lock;
+};
@@ -0,0 +1,122 @@
+#include "StdAfx.h"
+#include "FunctionTable.h"
+
+CFunctionTable::CFunctionTable()
+{
+	ZeroMemory((void*)_pages, sizeof(_pages));
+	_count = 0;
+	InitializeCriticalSection(&_lock);
+}
+
+CFunctionTable::~CFunctionTable()
+{
+	for (int i = 0; i < MaxFunctionPages; i++)
+	{
+		delete[] _pages[i];
+		_pages[i] = NULL;
+	}
+	DeleteCriticalSection(&_lock);
+}
+
+UINT32 CFunctionTable::Add(FunctionID functionId)
+{
+	UINT32 result = 0;
+	EnterCriticalSection(&_lock);
+
+	// the sampler can see a function on a stack before the CLR asks us to map it.
+	std::unordered_map<FunctionID, UINT32>::iterator found = _indices.find(functionId);
+	if (found != _indices.end())
+	{
+		result = found->second;
+		LeaveCriticalSection(&_lock);
+		return result;
+	}
+
+	if (_retired.size() > RetiredIndexDelay)
+	{
+		result = _retired.front();
+		_retired.pop_front();
+
+		// the generation is kept, the rest starts over.
+		FunctionInfo* info = Get(result);
+		info->suppressed = 0;
+		info->defined = 0;
+		info->module = 0;
+		info->functionId = functionId;
+		_indices[functionId] = result;
+		LeaveCriticalSection(&_lock);
+		return result;
+	}
+
+	long slot = _count;
+	int page = slot >> FunctionPageBits;
+	if (page < MaxFunctionPages)
+	{
+		if (_pages[page] == NULL)
+		{
+			FunctionInfo* entries = new FunctionInfo[FunctionPageSize];
+			ZeroMemory(entries, sizeof(FunctionInfo) * FunctionPageSize);
+			_pages[page] = entries;
+		}
+
+		FunctionInfo* info = &_pages[page][slot & (FunctionPageSize - 1)];
+		info->functionId = functionId;
+
+		// publish the entry before anyone can be given its index.
+		WriteRelease(&_count, slot + 1);
+		result = FirstFunctionIndex + slot;
+		_indices[functionId] = result;
+	}
+
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+FunctionInfo* CFunctionTable::Get(UINT32 index)
+{
+	if (index < FirstFunctionIndex)
+	{
+		return NULL;
+	}
+	long slot = (long)(index - FirstFunctionIndex);
+	if (slot >= ReadAcquire(&_count))
+	{
+		return NULL;
+	}
+	return &_pages[slot >> FunctionPageBits][slot & (FunctionPageSize - 1)];
+}
+
+UINT32 CFunctionTable::Find(FunctionID functionId)
+{
+	UINT32 result = 0;
+	EnterCriticalSection(&_lock);
+	std::unordered_map<FunctionID, UINT32>::iterator found = _indices.find(functionId);
+	if (found != _indices.end())
+	{
+		result = found->second;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+bool CFunctionTable::Retire(UINT32 index)
+{
+	bool result = false;
+	EnterCriticalSection(&_lock);
+	FunctionInfo* info = Get(index);
+	if (info != NULL && info->functionId != 0)
+	{
+		_indices.erase(info->functionId);
+		info->functionId = 0;
+		InterlockedIncrement(&info->generation);
+		_retired.push_back(index);
+		result = true;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+long CFunctionTable::GetCount()
+{
+	return _count;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "SharedMemory.h"
+
+// Per-function data is kept in pages of FunctionPageSize entries indexed by
+// (index - FirstFunctionIndex), pages are allocated as they are needed and never move.
+const int FunctionPageBits = 12;
+const int FunctionPageSize = 1 << FunctionPageBits;
+const int MaxFunctionPages = 4096;
+
+// a retired index is only handed out again once this many others have been retired after it,
+// so records that still refer to the old function are long gone by the time it is reused.
+const size_t RetiredIndexDelay = 1024;
+
+// what we know about each function the CLR has mapped.
+struct FunctionInfo
+{
+	FunctionID functionId;           // 0 once the function has been unloaded
+	volatile long suppressed;        // non-zero while the calls aren't being recorded, see CThrottle
+	volatile long defined;           // CSharedMemory::GetId of the buffer its name was written to
+	UINT32 module;                   // index in the CModuleTable, 0 if the CLR couldn't tell us
+	volatile long generation;        // bumped each time the index is retired, so a reused index can be told apart
+};
+
+// Assigns each mapped function a dense 32-bit index, which the CLR then passes back to the
+// Enter/Leave hooks as the clientData.  The entries live in fixed size pages that never move,
+// so per-function data can be read by index from the hooks without taking a lock.
+// When a function unloads its index is retired and later given to another function, so the
+// table doesn't keep growing in a process that loads and unloads code all day.
+class CFunctionTable
+{
+public:
+	CFunctionTable();
+	~CFunctionTable();
+
+	// returns the index of this function, assigning the next one (starting at FirstFunctionIndex)
+	// the first time it is seen.  Returns 0 if the table is full.
+	UINT32 Add(FunctionID functionId);
+
+	// returns NULL if the index was never handed out.
+	FunctionInfo* Get(UINT32 index);
+
+	// returns the index of a function that was already added, or 0.
+	UINT32 Find(FunctionID functionId);
+
+	// the function has been unloaded, its FunctionID may be reused by the CLR and its index will be.
+	// Returns false if the index was already retired.
+	bool Retire(UINT32 index);
+
+	long GetCount();
+
+private:
+	FunctionInfo* volatile _pages[MaxFunctionPages];
+	volatile long _count;
+	std::unordered_map<FunctionID, UINT32> _indices;
+	std::deque<UINT32> _retired;  // oldest first
+	CRITICAL_SECTION _lock;
+};
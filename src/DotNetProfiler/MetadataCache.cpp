@@ -0,0 +1,412 @@
+#include "StdAfx.h"
+#include "MetadataCache.h"
+
+CMetadataCache::CMetadataCache()
+{
+	_info = NULL;
+	_globalType = 0;
+	InitializeCriticalSection(&_lock);
+}
+
+CMetadataCache::~CMetadataCache()
+{
+	Clear();
+	DeleteCriticalSection(&_lock);
+}
+
+void CMetadataCache::Initialize(ICorProfilerInfo2* info)
+{
+	EnterCriticalSection(&_lock);
+	Clear();
+	_info = info;
+	LeaveCriticalSection(&_lock);
+}
+
+void CMetadataCache::Shutdown()
+{
+	EnterCriticalSection(&_lock);
+	Clear();
+	_info = NULL;
+	LeaveCriticalSection(&_lock);
+}
+
+// called with the lock held.
+void CMetadataCache::Clear()
+{
+	for (std::unordered_map<ModuleID, ModuleEntry*>::iterator i = _modules.begin(); i != _modules.end(); i++)
+	{
+		ModuleEntry* module = i->second;
+		if (module->import != NULL)
+		{
+			module->import->Release();
+		}
+		delete module;
+	}
+	_modules.clear();
+	_classes.clear();
+	_strings.Clear();
+	_globalType = _strings.Intern(L"::");
+}
+
+HRESULT CMetadataCache::GetMethodName(FunctionID functionId, std::wstring& typeName, std::wstring& methodName)
+{
+	ICorProfilerInfo2* info = _info;
+	if (info == NULL)
+	{
+		return E_FAIL;
+	}
+	ClassID classId = 0;
+	ModuleID moduleId = 0;
+	mdToken token = 0;
+	HRESULT hr = info->GetFunctionInfo(functionId, &classId, &moduleId, &token);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+	return GetMethodName(moduleId, token, typeName, methodName);
+}
+
+HRESULT CMetadataCache::GetMethodName(ModuleID moduleId, mdMethodDef token, std::wstring& typeName, std::wstring& methodName)
+{
+	HRESULT hr = S_OK;
+	EnterCriticalSection(&_lock);
+	MethodEntry* method = GetMethod(GetModule(moduleId), token);
+	if (method == NULL)
+	{
+		hr = E_FAIL;
+	}
+	else
+	{
+		typeName = _strings.Get(method->type);
+		methodName = _strings.Get(method->name);
+	}
+	LeaveCriticalSection(&_lock);
+	return hr;
+}
+
+HRESULT CMetadataCache::GetFullMethodName(FunctionID functionId, std::wstring& name)
+{
+	ICorProfilerInfo2* info = _info;
+	if (info == NULL)
+	{
+		return E_FAIL;
+	}
+
+	// the class and type arguments are those of this instantiation, the token is shared by all of them.
+	ClassID classId = 0;
+	ModuleID moduleId = 0;
+	mdToken token = 0;
+	ULONG32 count = 0;
+	ClassID typeArgs[MaxTypeArgs];
+	HRESULT hr = info->GetFunctionInfo2(functionId, 0, &classId, &moduleId, &token, MaxTypeArgs, &count, typeArgs);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	EnterCriticalSection(&_lock);
+	MethodEntry* method = GetMethod(GetModule(moduleId), token);
+	if (method == NULL)
+	{
+		hr = E_FAIL;
+	}
+	else
+	{
+		// looking up the type arguments can grow the tables the entry is in.
+		MethodEntry entry = *method;
+		UINT32 type = classId != 0 ? GetClassName(classId) : 0;
+		name = _strings.Get(type != 0 ? type : entry.type);
+		name += L'.';
+		name += _strings.Get(entry.name);
+		AppendTypeArgs(name, min(count, MaxTypeArgs), typeArgs);
+		if (entry.signature != 0)
+		{
+			WCHAR hash[16];
+			_snwprintf_s(hash, 16, 15, L"#%08x", entry.signature);
+			name += hash;
+		}
+	}
+	LeaveCriticalSection(&_lock);
+	return hr;
+}
+
+HRESULT CMetadataCache::GetAssemblyName(FunctionID functionId, std::wstring& assemblyName)
+{
+	ICorProfilerInfo2* info = _info;
+	if (info == NULL)
+	{
+		return E_FAIL;
+	}
+	ClassID classId = 0;
+	ModuleID moduleId = 0;
+	mdToken token = 0;
+	HRESULT hr = info->GetFunctionInfo(functionId, &classId, &moduleId, &token);
+	if (FAILED(hr))
+	{
+		return hr;
+	}
+
+	EnterCriticalSection(&_lock);
+	ModuleEntry* module = GetModule(moduleId);
+	if (module == NULL || module->assembly == 0)
+	{
+		hr = E_FAIL;
+	}
+	else
+	{
+		assemblyName = _strings.Get(module->assembly);
+	}
+	LeaveCriticalSection(&_lock);
+	return hr;
+}
+
+HRESULT CMetadataCache::GetModuleVersionId(ModuleID moduleId, GUID* mvid)
+{
+	HRESULT hr = E_FAIL;
+	EnterCriticalSection(&_lock);
+	ModuleEntry* module = GetModule(moduleId);
+	if (module != NULL && module->import != NULL)
+	{
+		ULONG cchName = 0;
+		hr = module->import->GetScopeProps(NULL, 0, &cchName, mvid);
+	}
+	LeaveCriticalSection(&_lock);
+	return hr;
+}
+
+void CMetadataCache::ModuleUnloaded(ModuleID moduleId)
+{
+	EnterCriticalSection(&_lock);
+	std::unordered_map<ModuleID, ModuleEntry*>::iterator found = _modules.find(moduleId);
+	if (found != _modules.end())
+	{
+		ModuleEntry* module = found->second;
+		if (module->import != NULL)
+		{
+			module->import->Release();
+		}
+		delete module;
+		_modules.erase(found);
+	}
+
+	// the module's strings are still in the pool, this keeps them from piling up in a process
+	// that loads and unloads code for weeks.
+	if (_strings.GetCount() > MaxCachedStrings)
+	{
+		Clear();
+	}
+	LeaveCriticalSection(&_lock);
+}
+
+void CMetadataCache::ClassUnloaded(ClassID classId)
+{
+	EnterCriticalSection(&_lock);
+	_classes.erase(classId);
+	LeaveCriticalSection(&_lock);
+}
+
+// returns the module's entry, opening its metadata the first time.  Called with the lock held.
+CMetadataCache::ModuleEntry* CMetadataCache::GetModule(ModuleID moduleId)
+{
+	std::unordered_map<ModuleID, ModuleEntry*>::iterator found = _modules.find(moduleId);
+	if (found != _modules.end())
+	{
+		return found->second;
+	}
+	if (_info == NULL)
+	{
+		return NULL;
+	}
+
+	ModuleEntry* module = new ModuleEntry();
+	module->import = NULL;
+	module->assembly = 0;
+	if (FAILED(_info->GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, (LPUNKNOWN *) &module->import)))
+	{
+		module->import = NULL;
+	}
+
+	LPCBYTE baseAddress = NULL;
+	ULONG cchModule = 0;
+	AssemblyID assemblyId = 0;
+	if (SUCCEEDED(_info->GetModuleInfo(moduleId, &baseAddress, 0, &cchModule, NULL, &assemblyId)))
+	{
+		WCHAR szAssembly[MetadataNameChars];
+		ULONG cchAssembly = 0;
+		AppDomainID appDomainId = 0;
+		ModuleID manifestModuleId = 0;
+		if (SUCCEEDED(_info->GetAssemblyInfo(assemblyId, MetadataNameChars, &cchAssembly, szAssembly, &appDomainId, &manifestModuleId)))
+		{
+			module->assembly = _strings.Intern(szAssembly);
+		}
+	}
+
+	_modules[moduleId] = module;
+	return module;
+}
+
+// returns the method's entry, reading its props the first time.  Called with the lock held.
+CMetadataCache::MethodEntry* CMetadataCache::GetMethod(ModuleEntry* module, mdMethodDef token)
+{
+	if (module == NULL || module->import == NULL || TypeFromToken(token) != mdtMethodDef)
+	{
+		return NULL;
+	}
+	ULONG row = RidFromToken(token);
+	if (row >= module->methods.size())
+	{
+		MethodEntry empty = { 0, 0, 0 };
+		module->methods.resize(row + 1, empty);
+	}
+	MethodEntry& method = module->methods[row];
+	if (method.name == 0)
+	{
+		WCHAR szFunction[MetadataNameChars];
+		mdTypeDef classTypeDef = mdTypeDefNil;
+		ULONG cchFunction = 0;
+		PCCOR_SIGNATURE signature = NULL;
+		ULONG signatureBytes = 0;
+		if (FAILED(module->import->GetMethodProps(token, &classTypeDef, szFunction, MetadataNameChars, &cchFunction, 0, &signature, &signatureBytes, 0, 0)))
+		{
+			return NULL;
+		}
+		method.type = GetTypeName(module, classTypeDef);
+		method.name = _strings.Intern(szFunction);
+
+		// overloads share the name, the signature tells them apart.
+		HCORENUM methods = NULL;
+		mdMethodDef overloads[2];
+		ULONG overloadCount = 0;
+		if (SUCCEEDED(module->import->EnumMethodsWithName(&methods, classTypeDef, szFunction, overloads, 2, &overloadCount)) && overloadCount > 1)
+		{
+			// FNV-1a, never 0.
+			UINT32 hash = 2166136261;
+			for (ULONG i = 0; i < signatureBytes; i++)
+			{
+				hash = (hash ^ signature[i]) * 16777619;
+			}
+			method.signature = hash != 0 ? hash : 1;
+		}
+		module->import->CloseEnum(methods);
+	}
+	return &method;
+}
+
+// Called with the lock held.
+UINT32 CMetadataCache::GetTypeName(ModuleEntry* module, mdTypeDef typeDef)
+{
+	ULONG row = RidFromToken(typeDef);
+	if (row == 0)
+	{
+		// a global function.
+		return _globalType;
+	}
+	if (row >= module->types.size())
+	{
+		module->types.resize(row + 1, 0);
+	}
+	UINT32& type = module->types[row];
+	if (type == 0)
+	{
+		WCHAR szClass[MetadataNameChars];
+		ULONG cchClass = 0;
+		mdTypeDef enclosing = mdTypeDefNil;
+		if (FAILED(module->import->GetTypeDefProps(typeDef, szClass, MetadataNameChars, &cchClass, 0, 0)))
+		{
+			// mark this as a weird global object then.
+			type = _globalType;
+		}
+		else if (SUCCEEDED(module->import->GetNestedClassProps(typeDef, &enclosing)) && RidFromToken(enclosing) != 0 && enclosing != typeDef)
+		{
+			// a nested type's name doesn't have the namespace, that is on the outermost type.
+			std::wstring name = _strings.Get(GetTypeName(module, enclosing));
+			name += L'+';
+			name += szClass;
+
+			// the recursion may have grown the table.
+			module->types[row] = _strings.Intern(name.c_str(), name.size());
+			return module->types[row];
+		}
+		else
+		{
+			type = _strings.Intern(szClass);
+		}
+	}
+	return type;
+}
+
+// The name of an instantiated type, "List<System.Int32>".  Returns 0 if the CLR can't tell us
+// about the class.  Called with the lock held.
+UINT32 CMetadataCache::GetClassName(ClassID classId)
+{
+	std::unordered_map<ClassID, UINT32>::iterator found = _classes.find(classId);
+	if (found != _classes.end())
+	{
+		return found->second;
+	}
+
+	UINT32 result = 0;
+	ModuleID moduleId = 0;
+	mdTypeDef typeDef = mdTypeDefNil;
+	ClassID parentId = 0;
+	ULONG32 count = 0;
+	ClassID typeArgs[MaxTypeArgs];
+	CorElementType elementType;
+	ClassID elementId = 0;
+	ULONG rank = 0;
+	if (SUCCEEDED(_info->GetClassIDInfo2(classId, &moduleId, &typeDef, &parentId, MaxTypeArgs, &count, typeArgs)))
+	{
+		ModuleEntry* module = GetModule(moduleId);
+		if (module != NULL && module->import != NULL)
+		{
+			std::wstring name = _strings.Get(GetTypeName(module, typeDef));
+			if (count > 0)
+			{
+				// "List`1" becomes "List<...>".
+				size_t tick = name.rfind(L'`');
+				if (tick != std::wstring::npos && name.find(L'+', tick) == std::wstring::npos)
+				{
+					name.erase(tick);
+				}
+				AppendTypeArgs(name, min(count, MaxTypeArgs), typeArgs);
+			}
+			result = _strings.Intern(name.c_str(), name.size());
+		}
+	}
+	else if (_info->IsArrayClass(classId, &elementType, &elementId, &rank) == S_OK)
+	{
+		// arrays don't have a TypeDef, they are named after what they hold.
+		UINT32 element = elementId != 0 ? GetClassName(elementId) : 0;
+		std::wstring name = element != 0 ? _strings.Get(element) : L"?";
+		name += L'[';
+		name.append(rank > 1 ? rank - 1 : 0, L',');
+		name += L']';
+		result = _strings.Intern(name.c_str(), name.size());
+	}
+
+	if (result != 0)
+	{
+		_classes[classId] = result;
+	}
+	return result;
+}
+
+// Called with the lock held.
+void CMetadataCache::AppendTypeArgs(std::wstring& name, ULONG32 count, const ClassID* typeArgs)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	name += L'<';
+	for (ULONG32 i = 0; i < count; i++)
+	{
+		if (i > 0)
+		{
+			name += L',';
+		}
+		UINT32 arg = GetClassName(typeArgs[i]);
+		name += arg != 0 ? _strings.Get(arg) : L"?";
+	}
+	name += L'>';
+}
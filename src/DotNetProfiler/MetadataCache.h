@@ -0,0 +1,88 @@
+#pragma once
+
+#include "StringPool.h"
+
+// the longest name read from the metadata.
+const ULONG MetadataNameChars = 1024;
+
+// the most generic arguments a type or method can have before we stop listing them.
+const ULONG32 MaxTypeArgs = 32;
+
+// strings are never removed from the pool one at a time, once an unload finds more than this
+// many the whole cache is dropped and refilled from the modules that are still loaded.
+const size_t MaxCachedStrings = 1024 * 1024;
+
+// Looks up the names of functions, and remembers them.  Each module's IMetaDataImport is
+// opened once and kept, and the names found in it are cached by token, so asking again (or
+// asking for every function in a module) only costs a hash probe on the module and an array
+// lookup on the token's row.  Type, method and assembly names are interned in a CStringPool,
+// each method costs 12 bytes plus whatever strings it doesn't share with other methods.
+//
+// Full names are "Namespace.Outer+Inner<TypeArgs>.Method<MethodArgs>", so nested types keep their
+// enclosing type and each generic instantiation gets a name of its own.  Overloads are told apart
+// by a hash of their signature, "Method#1a2b3c4d", which is only added when the type has more
+// than one method of that name.  Generic arguments are looked up through the ClassIDs the CLR
+// gives us, the names of instantiated types are cached by ClassID.
+//
+// The CLR reuses the IDs of modules and classes that have unloaded, so their entries have to be
+// dropped when they do, see ModuleUnloaded and ClassUnloaded.  Names are returned as copies so
+// they stay valid when that happens.
+class CMetadataCache
+{
+public:
+	CMetadataCache();
+	~CMetadataCache();
+
+	void Initialize(ICorProfilerInfo2* info);
+
+	// releases the metadata, lookups fail after this.
+	void Shutdown();
+
+	// typeName is "Namespace.Class" (or "::" for a global function).
+	HRESULT GetMethodName(FunctionID functionId, std::wstring& typeName, std::wstring& methodName);
+	HRESULT GetMethodName(ModuleID moduleId, mdMethodDef token, std::wstring& typeName, std::wstring& methodName);
+
+	// the complete, unambiguous name of the function, see above.
+	HRESULT GetFullMethodName(FunctionID functionId, std::wstring& name);
+
+	HRESULT GetAssemblyName(FunctionID functionId, std::wstring& assemblyName);
+
+	// the MVID from the module's metadata, which tells builds of the same module apart.
+	HRESULT GetModuleVersionId(ModuleID moduleId, GUID* mvid);
+
+	// forget what we know about the module, releasing its metadata.
+	void ModuleUnloaded(ModuleID moduleId);
+
+	// forget the name of the instantiated type.
+	void ClassUnloaded(ClassID classId);
+
+private:
+	struct MethodEntry
+	{
+		UINT32 type;      // string ids, 0 until it is looked up
+		UINT32 name;
+		UINT32 signature; // hash of the signature if the method is overloaded, else 0
+	};
+
+	struct ModuleEntry
+	{
+		IMetaDataImport* import;
+		UINT32 assembly;
+		std::vector<UINT32> types;        // by TypeDef row
+		std::vector<MethodEntry> methods; // by MethodDef row
+	};
+
+	ModuleEntry* GetModule(ModuleID moduleId);
+	MethodEntry* GetMethod(ModuleEntry* module, mdMethodDef token);
+	UINT32 GetTypeName(ModuleEntry* module, mdTypeDef typeDef);
+	UINT32 GetClassName(ClassID classId);
+	void AppendTypeArgs(std::wstring& name, ULONG32 count, const ClassID* typeArgs);
+	void Clear();
+
+	ICorProfilerInfo2* _info;
+	std::unordered_map<ModuleID, ModuleEntry*> _modules;
+	std::unordered_map<ClassID, UINT32> _classes; // names of instantiated types
+	CStringPool _strings;
+	UINT32 _globalType; // "::"
+	CRITICAL_SECTION _lock;
+};
@@ -0,0 +1,164 @@
+#include "StdAfx.h"
+#include "ModuleTable.h"
+
+CModuleTable::CModuleTable(CMetadataCache& metadata) : _metadata(metadata)
+{
+	_info = NULL;
+	InitializeCriticalSection(&_lock);
+}
+
+CModuleTable::~CModuleTable()
+{
+	for (size_t i = 0; i < _modules.size(); i++)
+	{
+		delete _modules[i];
+	}
+	DeleteCriticalSection(&_lock);
+}
+
+void CModuleTable::Initialize(ICorProfilerInfo2* info)
+{
+	EnterCriticalSection(&_lock);
+	_info = info;
+	LeaveCriticalSection(&_lock);
+}
+
+void CModuleTable::Shutdown()
+{
+	EnterCriticalSection(&_lock);
+	_info = NULL;
+	LeaveCriticalSection(&_lock);
+}
+
+UINT32 CModuleTable::Add(ModuleID moduleId)
+{
+	UINT32 result = 0;
+	EnterCriticalSection(&_lock);
+	std::unordered_map<ModuleID, UINT32>::iterator found = _indices.find(moduleId);
+	if (found != _indices.end())
+	{
+		result = found->second;
+	}
+	else if (_info != NULL)
+	{
+		ModuleInfo* module = new ModuleInfo();
+		module->moduleId = moduleId;
+		module->assemblyId = 0;
+		module->baseAddress = 0;
+		ZeroMemory(&module->mvid, sizeof(GUID));
+		module->defined = 0;
+		module->unloaded = false;
+
+		WCHAR szPath[MetadataNameChars];
+		LPCBYTE baseAddress = NULL;
+		ULONG cchPath = 0;
+		AssemblyID assemblyId = 0;
+		if (SUCCEEDED(_info->GetModuleInfo(moduleId, &baseAddress, MetadataNameChars, &cchPath, szPath, &assemblyId)))
+		{
+			module->baseAddress = (UINT64)baseAddress;
+			module->path = szPath;
+			module->assemblyId = assemblyId;
+			ReadAssembly(module);
+		}
+		_metadata.GetModuleVersionId(moduleId, &module->mvid);
+
+		_modules.push_back(module);
+		result = (UINT32)_modules.size();
+		_indices[moduleId] = result;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+UINT32 CModuleTable::AttachToAssembly(ModuleID moduleId, AssemblyID assemblyId)
+{
+	UINT32 result = Add(moduleId);
+	EnterCriticalSection(&_lock);
+	if (result != 0)
+	{
+		ModuleInfo* module = _modules[result - 1];
+		module->assemblyId = assemblyId;
+		ReadAssembly(module);
+		module->defined = 0;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+UINT32 CModuleTable::Find(ModuleID moduleId)
+{
+	UINT32 result = 0;
+	EnterCriticalSection(&_lock);
+	std::unordered_map<ModuleID, UINT32>::iterator found = _indices.find(moduleId);
+	if (found != _indices.end())
+	{
+		result = found->second;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+UINT32 CModuleTable::Remove(ModuleID moduleId)
+{
+	UINT32 result = 0;
+	EnterCriticalSection(&_lock);
+	std::unordered_map<ModuleID, UINT32>::iterator found = _indices.find(moduleId);
+	if (found != _indices.end())
+	{
+		result = found->second;
+		ModuleInfo* module = _modules[result - 1];
+		module->unloaded = true;
+		std::wstring().swap(module->path);
+		std::wstring().swap(module->assembly);
+		_indices.erase(found);
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+bool CModuleTable::Get(UINT32 index, ModuleInfo& module)
+{
+	bool result = false;
+	EnterCriticalSection(&_lock);
+	if (index != 0 && index <= _modules.size())
+	{
+		module = *_modules[index - 1];
+		result = true;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+bool CModuleTable::SetDefined(UINT32 index, long bufferId)
+{
+	bool result = false;
+	EnterCriticalSection(&_lock);
+	if (index != 0 && index <= _modules.size() && _modules[index - 1]->defined != bufferId)
+	{
+		_modules[index - 1]->defined = bufferId;
+		result = true;
+	}
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+long CModuleTable::GetCount()
+{
+	EnterCriticalSection(&_lock);
+	long result = (long)_modules.size();
+	LeaveCriticalSection(&_lock);
+	return result;
+}
+
+// Called with the lock held.
+void CModuleTable::ReadAssembly(ModuleInfo* module)
+{
+	WCHAR szAssembly[MetadataNameChars];
+	ULONG cchAssembly = 0;
+	AppDomainID appDomainId = 0;
+	ModuleID manifestModuleId = 0;
+	if (_info != NULL && module->assemblyId != 0 && SUCCEEDED(_info->GetAssemblyInfo(module->assemblyId, MetadataNameChars, &cchAssembly, szAssembly, &appDomainId, &manifestModuleId)))
+	{
+		module->assembly = szAssembly;
+	}
+}
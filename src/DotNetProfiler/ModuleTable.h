@@ -0,0 +1,62 @@
+#pragma once
+
+#include "MetadataCache.h"
+
+// what we know about each module the CLR has loaded.
+struct ModuleInfo
+{
+	ModuleID moduleId;
+	AssemblyID assemblyId;
+	UINT64 baseAddress;
+	GUID mvid;
+	std::wstring path;     // empty for dynamic modules
+	std::wstring assembly; // empty until the module is attached to its assembly
+	long defined;          // CSharedMemory::GetId of the buffer its ModuleRecord was written to
+	bool unloaded;
+};
+
+// Assigns each loaded module a dense index starting at 1, so functions can be tagged with their
+// module in 4 bytes and the client can roll up by module or assembly with an array lookup.  The
+// entries are kept after the module unloads, a ModuleID the CLR reuses gets a new index.  The
+// strings of an unloaded module are freed, so each one it has seen costs a few dozen bytes.
+class CModuleTable
+{
+public:
+	CModuleTable(CMetadataCache& metadata);
+	~CModuleTable();
+
+	void Initialize(ICorProfilerInfo2* info);
+	void Shutdown();
+
+	// returns the index of this module, looking up its details the first time it is seen.
+	// Modules loaded before we attached are added the first time one of their functions is.
+	UINT32 Add(ModuleID moduleId);
+
+	// the module now knows its assembly, its ModuleRecord has to be written again.
+	UINT32 AttachToAssembly(ModuleID moduleId, AssemblyID assemblyId);
+
+	// returns the index of a module that was already added and hasn't unloaded, or 0.
+	UINT32 Find(ModuleID moduleId);
+
+	// marks the module unloaded and returns its index, or 0 if it was never added.  Only
+	// the IDs of an unloaded module are kept, its record has already been written.
+	UINT32 Remove(ModuleID moduleId);
+
+	// copies the entry, returns false if the index was never handed out.
+	bool Get(UINT32 index, ModuleInfo& module);
+
+	// returns true if the module's record hasn't been written to this buffer yet, and
+	// marks it as written.
+	bool SetDefined(UINT32 index, long bufferId);
+
+	long GetCount();
+
+private:
+	void ReadAssembly(ModuleInfo* module);
+
+	CMetadataCache& _metadata;
+	ICorProfilerInfo2* _info;
+	std::vector<ModuleInfo*> _modules; // by index - 1
+	std::unordered_map<ModuleID, UINT32> _indices;
+	CRITICAL_SECTION _lock;
+};
@@ -15,7 +15,7 @@ static CProfiler* ProfilerInstance;
 
 namespace
 {
-    const int BufferSizeChars = 10*512;
+    const int BufferSizeChars = 10*512;  // 10KB in a Unicode build, the pipe buffers are the same size
    
 
     const std::wstring AddPidToName(const wchar_t* name, DWORD pid)
@@ -27,35 +27,94 @@ namespace
 }
 
 PipeServer::PipeServer(CProfiler &profiler) :
-    _hPipeData(INVALID_HANDLE_VALUE),
-    _hPipeControl(INVALID_HANDLE_VALUE),    
-    _fTerminated(false)
+    _streamSession(NULL),
+    _hStreamPipe(INVALID_HANDLE_VALUE)
 {
     ProfilerInstance = &profiler;
+    InitializeCriticalSection(&_lock);
+    InitializeCriticalSection(&_streamLock);
+    _shutdownEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    _acceptEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    _idleEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
 }
 
 PipeServer::~PipeServer()
 {
-    _fTerminated = true;
+    Shutdown();
+
+    // the sessions close their pipes once their threads see the shutdown.
+    if (WaitForSingleObject(_idleEvent, 5000) != WAIT_OBJECT_0)
+    {
+        // leak the rest rather than pull it out from under a session that is stuck.
+        return;
+    }
 
 	ProfilerInstance = NULL;
 
-    if (_hPipeData != INVALID_HANDLE_VALUE)
+    CloseHandle(_idleEvent);
+    CloseHandle(_acceptEvent);
+    CloseHandle(_shutdownEvent);
+    DeleteCriticalSection(&_streamLock);
+    DeleteCriticalSection(&_lock);
+}
+
+void PipeServer::Shutdown()
+{
+    SetEvent(_shutdownEvent);
+}
+
+bool PipeServer::WaitForShutdown(DWORD milliseconds)
+{
+    return WaitForSingleObject(_shutdownEvent, milliseconds) == WAIT_OBJECT_0;
+}
+
+void PipeServer::CancelDataWrite()
+{
+    HANDLE hPipe = _hStreamPipe;
+    if (hPipe != INVALID_HANDLE_VALUE)
     {
-        FlushFileBuffers(_hPipeData);
-        DisconnectNamedPipe(_hPipeData); 
-        CloseHandle(_hPipeData);
-        _hPipeData = INVALID_HANDLE_VALUE;
+        CancelIoEx(hPipe, NULL);
     }
+}
 
-    if (_hPipeControl != INVALID_HANDLE_VALUE)
+// Waits for an overlapped operation on hPipe to finish, fStarted is what the call that started it returned.
+// If Shutdown is called first the operation is cancelled and this returns false.
+bool PipeServer::CompleteIo(HANDLE hPipe, BOOL fStarted, OVERLAPPED& overlapped, DWORD& cbTransferred)
+{
+    cbTransferred = 0;
+    if (!fStarted && GetLastError() != ERROR_IO_PENDING)
     {
-        FlushFileBuffers(_hPipeControl);
-        DisconnectNamedPipe(_hPipeControl); 
-        CloseHandle(_hPipeControl);
-        _hPipeControl = INVALID_HANDLE_VALUE;
+        return false;
     }
 
+    // the operation's event comes first so one that has finished wins over a shutdown.
+    HANDLE handles[2] = { overlapped.hEvent, _shutdownEvent };
+    if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+    {
+        // the buffer is in use until the cancel has gone through.
+        CancelIoEx(hPipe, &overlapped);
+        GetOverlappedResult(hPipe, &overlapped, &cbTransferred, TRUE);
+        SetLastError(ERROR_OPERATION_ABORTED);
+        return false;
+    }
+    return GetOverlappedResult(hPipe, &overlapped, &cbTransferred, FALSE) == TRUE;
+}
+
+bool PipeServer::WritePipe(HANDLE hPipe, HANDLE hEvent, const void* bytes, DWORD numBytes)
+{
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = hEvent;
+
+    DWORD cbWritten = 0;
+    BOOL fStarted = WriteFile( 
+        hPipe,        // handle to pipe 
+        bytes,     // buffer to write from 
+        numBytes, // number of bytes to write 
+        NULL,   // the count comes from the overlapped result
+        &overlapped);
+
+    return CompleteIo(hPipe, fStarted, overlapped, cbWritten) && cbWritten == numBytes;
 }
 
 
@@ -72,13 +131,13 @@ bool PipeServer::SetupNamedPipe(const wchar_t* pipeName, DWORD pipeMode, HANDLE
     LOG( TEXT("\nPipe Server: Main thread awaiting client connection on %s\n"), pipeName);
     hPipe = CreateNamedPipe( 
         pipeName,
-        pipeMode,
+        pipeMode | FILE_FLAG_OVERLAPPED, // overlapped so we can shut down cleanly
         PIPE_TYPE_MESSAGE |       // message type pipe 
         PIPE_READMODE_MESSAGE |   // message-read mode 
-        PIPE_NOWAIT,                // non-blocking mode so we can shut down cleanly
-        1, // max. instances  
-        BufferSizeChars,                  // output buffer size 
-        BufferSizeChars,                  // input buffer size 
+        PIPE_WAIT,                // blocking mode 
+        PIPE_UNLIMITED_INSTANCES, // each client gets its own instance
+        BufferSizeChars * sizeof(TCHAR),  // output buffer size in bytes
+        BufferSizeChars * sizeof(TCHAR),  // input buffer size in bytes
         0,                        // client time-out 
         NULL);                    // default security attribute 
 
@@ -88,75 +147,166 @@ bool PipeServer::SetupNamedPipe(const wchar_t* pipeName, DWORD pipeMode, HANDLE
         return false;
     }
 
-    // Wait for the client to connect; if it succeeds, 
-    // the function returns a nonzero value. We do this in a non-blocking
-    // way so that we can shutdown cleanly.
-    while (!ConnectNamedPipe(hPipe, NULL)) 
+    // Wait for the client to connect, or for Shutdown.  The thread sleeps until one of them
+    // happens so there is nothing to poll.
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = _acceptEvent;
+    if (ConnectNamedPipe(hPipe, &overlapped)) 
+    {
+        return true;
+    }
+    if (GetLastError() == ERROR_PIPE_CONNECTED)
+    {
+        return true; // we're good!
+    }
+
+    DWORD cbUnused = 0;
+    if (!CompleteIo(hPipe, FALSE, overlapped, cbUnused))
+    {
+        LOG(TEXT("ConnectNamedPipe failed, GLE=%d.\n"), GetLastError()); 
+        return false;
+    }
+    return true;
+}
+
+// This method is called on a background thread.
+int PipeServer::Run() 
+{
+    DWORD currentPid = GetCurrentProcessId();
+    const std::wstring pipeName = AddPidToName(L"\\\\.\\pipe\\D795A307-4F19-4E49-B714-8641DF72F493-Control-", currentPid);
+    const std::wstring pipeDataName = AddPidToName(L"\\\\.\\pipe\\D795A307-4F19-4E49-B714-8641DF72F493-Data-", currentPid); 
+
+    while (!WaitForShutdown(0))
     {
-        HRESULT hr = GetLastError();
-        if (hr == ERROR_PIPE_CONNECTED)
+        // a client connects to the control pipe and then to the data pipe, so they are taken in that order.
+        HANDLE hPipeControl = INVALID_HANDLE_VALUE;
+        HANDLE hPipeData = INVALID_HANDLE_VALUE;
+        bool fConnected = SetupNamedPipe(pipeName.c_str(), PIPE_ACCESS_DUPLEX, hPipeControl) && SetupNamedPipe(pipeDataName.c_str(), PIPE_ACCESS_OUTBOUND, hPipeData);
+        if (fConnected)
         {
-            break; // we're good!
+            StartSession(hPipeControl, hPipeData);
+            continue;
         }
-        else if (hr == ERROR_PIPE_LISTENING)
+
+        if (hPipeControl != INVALID_HANDLE_VALUE)
         {
-           SleepEx(200, false);
+            DisconnectNamedPipe(hPipeControl); 
+            CloseHandle(hPipeControl);
         }
-        else 
+        if (hPipeData != INVALID_HANDLE_VALUE)
         {
-            return false;
+            DisconnectNamedPipe(hPipeData); 
+            CloseHandle(hPipeData);
         }
-
-        if (_fTerminated) {
-            return false;
+        if (!WaitForShutdown(0))
+        {
+            // TODO - better error handling here.
+            return -1;
         }
     }
 
-        
-    DWORD mode = PIPE_READMODE_MESSAGE | PIPE_WAIT;
-    SetNamedPipeHandleState(_hPipeControl, &mode, NULL, NULL);
+    return 0; 
+} 
 
-    return true;
+void PipeServer::StartSession(HANDLE hPipeControl, HANDLE hPipeData)
+{
+    PipeSession* session = new PipeSession();
+    session->server = this;
+    session->hPipeControl = hPipeControl;
+    session->hPipeData = hPipeData;
+    session->controlEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    session->dataEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    session->reader = -1;
+
+    EnterCriticalSection(&_lock);
+    _sessions.push_back(session);
+    ResetEvent(_idleEvent);
+    LeaveCriticalSection(&_lock);
+
+    HANDLE hThread = CreateThread(NULL, 0, &SessionThread, (PVOID)session, 0, NULL);
+    if (hThread == NULL)
+    {
+        EndSession(session);
+        return;
+    }
+    CloseHandle(hThread);
 }
 
-// This method is called on a background thread.
-int PipeServer::Run() 
+DWORD WINAPI PipeServer::SessionThread(PVOID v)
 {
-    BOOL   fConnected = FALSE; 
-    DWORD  dwThreadId = 0; 
-    HANDLE hThread = NULL; 
-    DWORD currentPid = GetCurrentProcessId();
-    const std::wstring pipeName = AddPidToName(L"\\\\.\\pipe\\D795A307-4F19-4E49-B714-8641DF72F493-Control-", currentPid);
-    const std::wstring pipeDataName = AddPidToName(L"\\\\.\\pipe\\D795A307-4F19-4E49-B714-8641DF72F493-Data-", currentPid); 
+    PipeSession* session = (PipeSession*)v;
+    PipeServer* server = session->server;
+    server->ProcessControlRequests(*session);
+    server->EndSession(session);
+    return 0;
+}
 
-    fConnected = SetupNamedPipe(pipeName.c_str(), PIPE_ACCESS_DUPLEX, _hPipeControl) && SetupNamedPipe(pipeDataName.c_str(), PIPE_ACCESS_OUTBOUND, _hPipeData);
+// The client has gone, the profiler only lets go of the shared memory when the last one does.
+void PipeServer::EndSession(PipeSession* session)
+{
+    if (_hStreamPipe == session->hPipeData)
+    {
+        // let the streamer give up on a write that is waiting for this client.
+        CancelIoEx(session->hPipeData, NULL);
+        EnterCriticalSection(&_streamLock);
+        _streamSession = NULL;
+        _hStreamPipe = INVALID_HANDLE_VALUE;
+        LeaveCriticalSection(&_streamLock);
+    }
 
-    if (_hPipeControl == INVALID_HANDLE_VALUE || _hPipeData == INVALID_HANDLE_VALUE) 
+    EnterCriticalSection(&_lock);
+    _sessions.erase(std::remove(_sessions.begin(), _sessions.end(), session), _sessions.end());
+    if (ProfilerInstance != NULL)
     {
-        // TODO - better error handling here.
-        return -1;
+        if (_sessions.empty())
+        {
+            ProfilerInstance->ClientDetached();
+        }
+        else if (session->reader >= 0)
+        {
+            ProfilerInstance->LeaveReader(session->reader);
+        }
     }
+    LeaveCriticalSection(&_lock);
 
-    if (fConnected) 
-    { 
-		ProcessControlRequests();
+    // Flush the pipe to allow the client to read the pipe's contents 
+    // before disconnecting. Then disconnect the pipe, and close the 
+    // handle to this pipe instance. 
+    bool fShutdown = WaitForShutdown(0);
+    HANDLE pipes[2] = { session->hPipeControl, session->hPipeData };
+    for (int i = 0; i < 2; i++)
+    {
+        if (!fShutdown)
+        {
+            FlushFileBuffers(pipes[i]); 
+        }
+        DisconnectNamedPipe(pipes[i]); 
+        CloseHandle(pipes[i]);
     }
+    CloseHandle(session->controlEvent);
+    CloseHandle(session->dataEvent);
+    delete session;
 
-	if (_hPipeData != INVALID_HANDLE_VALUE && !_fTerminated)
+    EnterCriticalSection(&_lock);
+    if (_sessions.empty())
     {
-        FlushFileBuffers(_hPipeData);
-        DisconnectNamedPipe(_hPipeData); 
-        CloseHandle(_hPipeData);
-        _hPipeData = INVALID_HANDLE_VALUE;
+        SetEvent(_idleEvent);
     }
+    LeaveCriticalSection(&_lock);
+}
 
-    return 0; 
-} 
+long PipeServer::GetSessionCount()
+{
+    EnterCriticalSection(&_lock);
+    long count = (long)_sessions.size();
+    LeaveCriticalSection(&_lock);
+    return count;
+}
 
-bool WriteSimpleReply(HANDLE hPipe, LPTSTR msg, TCHAR* pchReplyBuffer)
+bool PipeServer::WriteSimpleReply(PipeSession& session, LPTSTR msg, TCHAR* pchReplyBuffer)
 {
 	DWORD cbReplyBytes;
-	DWORD cbWritten;
 
     // Check the outgoing message to make sure it's not too long for the buffer.
     if (FAILED(StringCchCopy( pchReplyBuffer, BufferSizeChars, msg )))
@@ -170,14 +320,7 @@ bool WriteSimpleReply(HANDLE hPipe, LPTSTR msg, TCHAR* pchReplyBuffer)
 
 	// Write the reply data to the pipe. 
 	LOG( TEXT("Server Reply String:\"%s\"\n"), pchReplyBuffer );
-	BOOL fSuccess = WriteFile( 
-		hPipe,        // handle to pipe 
-		pchReplyBuffer,     // buffer to write from 
-		cbReplyBytes, // number of bytes to write 
-		&cbWritten,   // number of bytes written 
-		NULL);        // not overlapped I/O 
-
-	if (!fSuccess || cbReplyBytes != cbWritten)
+	if (!WritePipe(session.hPipeControl, session.controlEvent, pchReplyBuffer, cbReplyBytes))
 	{   
 		LOG(TEXT("InstanceThread WriteFile failed, GLE=%d.\n"), GetLastError()); 
 		return false;
@@ -187,14 +330,21 @@ bool WriteSimpleReply(HANDLE hPipe, LPTSTR msg, TCHAR* pchReplyBuffer)
 
 void PipeServer::SignalDetach()
 {
-    if (_hPipeControl == INVALID_HANDLE_VALUE)
-        return;
-
+    // the sessions' events belong to their threads, this is called on another one.
+    HANDLE hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
     TCHAR buffer[10];
-    WriteSimpleReply(_hPipeControl, L"Ack", buffer);  
+    EnterCriticalSection(&_lock);
+    for (size_t i = 0; i < _sessions.size(); i++)
+    {
+        PipeSession session = *_sessions[i];
+        session.controlEvent = hEvent;
+        WriteSimpleReply(session, L"Ack", buffer);  
+    }
+    LeaveCriticalSection(&_lock);
+    CloseHandle(hEvent);
 }
 
-DWORD PipeServer::ProcessControlRequests()
+DWORD PipeServer::ProcessControlRequests(PipeSession& session)
 { 
     HANDLE hHeap      = GetProcessHeap();
     DWORD BufferSize = BufferSizeChars * sizeof(TCHAR);
@@ -203,7 +353,7 @@ DWORD PipeServer::ProcessControlRequests()
     
     DWORD cbBytesRead = 0, cbReplyBytes = 0, cbWritten = 0; 
     BOOL fSuccess = FALSE;
-	HANDLE hPipe  = _hPipeControl;
+	HANDLE hPipe  = session.hPipeControl;
 
     // Do some extra error checking since the app will keep running even if this
     // thread fails.
@@ -211,7 +361,7 @@ DWORD PipeServer::ProcessControlRequests()
     if (hPipe == NULL)
     {
         printf( "\nERROR - Pipe Server Failure:\n");
-        printf( "   ProcessControlRequests got an unexpected NULL value in _hPipeControl.\n");
+        printf( "   ProcessControlRequests got an unexpected NULL value in hPipeControl.\n");
         printf( "   ProcessControlRequests exitting.\n");
         return (DWORD)-1;
     }
@@ -237,18 +387,24 @@ DWORD PipeServer::ProcessControlRequests()
     // Print verbose messages. In production code, this should be for debugging only.
     printf("ProcessControlRequests is processing messages...\n");
 
+    OVERLAPPED overlapped;
+
     // Loop until done reading
-    while (ProfilerInstance != NULL && !_fTerminated) 
+    while (ProfilerInstance != NULL) 
     { 
         // Read client requests from the pipe. This simplistic code only allows messages
-        // up to BufferSizeChars characters in length.
+        // up to BufferSizeChars characters in length.  The thread sleeps until a request
+        // arrives or Shutdown is called.
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.hEvent = session.controlEvent;
         fSuccess = ReadFile( 
             hPipe,        // handle to pipe 
             pchRequest,   // buffer to receive data 
             BufferSize - sizeof(TCHAR),   // size of buffer, leaving room for null terminator.
-            &cbBytesRead, // number of bytes read 
-            NULL);        // not overlapped I/O 
+            NULL,         // the count comes from the overlapped result
+            &overlapped);
 
+        fSuccess = CompleteIo(hPipe, fSuccess, overlapped, cbBytesRead);
         if (!fSuccess || cbBytesRead == 0)
         {   
             if (GetLastError() == ERROR_BROKEN_PIPE)
@@ -262,14 +418,21 @@ DWORD PipeServer::ProcessControlRequests()
             break;
         }
 
-		if (_fTerminated) {
-			break;
-		}
-
         // Add null terminator if there is space in the buffer.
 		int charsRead = cbBytesRead / sizeof(TCHAR);
         pchRequest[charsRead] = '\0';
 
+        // binary frames say how long they are, everything else is a text message.
+        const ControlFrameHeader* frame = (const ControlFrameHeader*)pchRequest;
+        if (cbBytesRead >= sizeof(ControlFrameHeader) && frame->magic == ControlFrameMagic && frame->length == cbBytesRead - sizeof(DWORD))
+        {
+            if (!ProcessControlFrame(session, frame, cbBytesRead))
+            {
+                break;
+            }
+            continue;
+        }
+
         // TODO actually read the message. Also send back a reply when the detach has completed.
 		TCHAR firstChar = (charsRead > 0) ?  pchRequest[0] : '\0';
 		TCHAR secondChar = (charsRead > 1) ? pchRequest[1] : '\0';
@@ -279,43 +442,72 @@ DWORD PipeServer::ProcessControlRequests()
         bool isLookupName = firstChar == L'F' && secondChar == L':';
         bool isGetCount = firstChar == L'C' && secondChar == L':';
         bool isDeleteAll = firstChar == L'X' && secondChar == L':';
+        bool isSetMode = firstChar == L'P' && secondChar == L':';
+        bool isSnapshot = firstChar == L'S' && secondChar == L':';
+        bool isSampleRate = firstChar == L'R' && secondChar == L':';
+        bool isFilter = firstChar == L'N' && secondChar == L':';
+        bool isPause = firstChar == L'Z' && secondChar == L':';
+        bool isThrottle = firstChar == L'T' && secondChar == L':';
+        bool isStream = firstChar == L'W' && secondChar == L':';
+        bool isJoin = firstChar == L'J' && secondChar == L':';
+        bool isRecord = firstChar == L'O' && secondChar == L':';
+        bool isEnumerate = firstChar == L'E' && secondChar == L':';
 
         if (isDetach)
         {
 			// client expecting inital acknowledgement
-			fSuccess = WriteSimpleReply(hPipe, TEXT("ok"), pchReply); 
+			fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 
 
+            // Other clients are still reading, only the last one detaches the profiler.
             // This call will not return if the detach succeeds for a V4 app - FreeLibraryAndExitThread is called here.
             // For a CLR V2 app, detach is not available so this method will do nothing.
-            ProfilerInstance->RequestDetach();
+            if (GetSessionCount() == 1)
+            {
+                ProfilerInstance->RequestDetach();
+            }
 			
 			// client expecting additional detach message as part of 2 phase commit.
-			fSuccess = WriteSimpleReply(hPipe, TEXT("detached"), pchReply); 		
+			fSuccess = WriteSimpleReply(session, TEXT("detached"), pchReply); 		
         }
         else if (isSharedMemoryName)
         {
             // separate
+            // "M:<name>,<size>", the reply is "failed" if the buffer couldn't be mapped or is too small.
+            HRESULT hr = E_INVALIDARG;
             TCHAR* comma = wcsrchr(pchRequest, L',');
             if (comma != NULL) {
                 *comma = '\0';
                 int size = _ttoi(comma+1);
-                ProfilerInstance->InitSharedMemory(pchRequest+2, size);
+                EnterCriticalSection(&_lock);
+                hr = ProfilerInstance->InitSharedMemory(pchRequest+2, size);
+                // the reader slots belonged to the old buffer, the clients join the new one again.
+                for (size_t i = 0; i < _sessions.size(); i++)
+                {
+                    _sessions[i]->reader = -1;
+                }
+                LeaveCriticalSection(&_lock);
             }
             
-            // provide simple ack to the fact that we received a message.
-            fSuccess = WriteSimpleReply(hPipe, TEXT("ok"), pchReply); 		
+            fSuccess = WriteSimpleReply(session, SUCCEEDED(hr) ? TEXT("ok") : TEXT("failed"), pchReply); 		
         }
         else if (isLookupName) 
         {
             __int64 functionId = _ttoi64(pchRequest+2);
 
-            ProfilerInstance->GetFunctionName((FunctionID)functionId, pchRequest, BufferSize);
+            ProfilerInstance->GetFunctionName((UINT32)functionId, pchRequest, BufferSize);
 			
 			// client expecting method name reply.
-			fSuccess = WriteSimpleReply(hPipe, pchRequest, pchReply); 	
+			fSuccess = WriteSimpleReply(session, pchRequest, pchReply); 	
         }
         else if (isGetCount)
         {
+            // the client polls this, so it is a good time to have the threads publish what they have staged.
+            ProfilerInstance->Quiesce();
+            if (ProfilerInstance->GetMode() == ProfileFlat)
+            {
+                ProfilerInstance->PublishStats();
+            }
+
             long functions = ProfilerInstance->GetFunctionCount();
             long calls = ProfilerInstance->GetCallCount();
             long version = ProfilerInstance->GetVersion();
@@ -339,14 +531,134 @@ DWORD PipeServer::ProcessControlRequests()
             _ltow_s(version, ptr, MAXDIGITS, 10);            
 
 			// client expecting method name reply.
-			fSuccess = WriteSimpleReply(hPipe, pchRequest, pchReply); 	
+			fSuccess = WriteSimpleReply(session, pchRequest, pchReply); 	
         }
         else if (isDeleteAll) 
         {
             ProfilerInstance->DeleteAll();
             
             // provide simple ack to the fact that we received the message.
-            fSuccess = WriteSimpleReply(hPipe, TEXT("ok"), pchReply); 		
+            fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 		
+        }
+        else if (isSetMode)
+        {
+            // "P:trace" records every call, "P:flat" only counts them, "P:sample" walks the stacks periodically.
+            ProfilerMode mode = ProfileTrace;
+            if (wcscmp(pchRequest + 2, L"flat") == 0)
+            {
+                mode = ProfileFlat;
+            }
+            else if (wcscmp(pchRequest + 2, L"sample") == 0)
+            {
+                mode = ProfileSample;
+            }
+            ProfilerInstance->SetMode(mode);
+
+            fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 		
+        }
+        else if (isSnapshot)
+        {
+            // publish the flat profile totals to the stats region, reply with the snapshot number.
+            LONG64 snapshot = ProfilerInstance->PublishStats();
+            _i64tow_s(snapshot, pchRequest, 50, 10);
+
+            fSuccess = WriteSimpleReply(session, pchRequest, pchReply); 	
+        }
+        else if (isSampleRate)
+        {
+            // "R:<samples per second>"
+            int rate = _ttoi(pchRequest + 2);
+            ProfilerInstance->SetSampleRate(rate > 0 ? (DWORD)rate : DefaultSampleRate);
+
+            fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 		
+        }
+        else if (isFilter)
+        {
+            // "N:<filter spec>", only applies to functions the CLR hasn't mapped yet so send it early.
+            ProfilerInstance->SetFilter(pchRequest + 2);
+
+            fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 		
+        }
+        else if (isThrottle)
+        {
+            // "T:<calls per second>", functions called more often are summarized instead of recorded, 0 turns it off.
+            int limit = _ttoi(pchRequest + 2);
+            ProfilerInstance->SetThrottle(limit > 0 ? (DWORD)limit : 0);
+
+            fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 		
+        }
+        else if (isStream)
+        {
+            // "W:<bytes>" instead of "M:", the records are sent as frames on the data pipe, see CStreamer.
+            int size = _ttoi(pchRequest + 2);
+            EnterCriticalSection(&_streamLock);
+            _streamSession = &session;
+            _hStreamPipe = session.hPipeData;
+            LeaveCriticalSection(&_streamLock);
+            HRESULT hr = ProfilerInstance->InitStream(size);
+
+            fSuccess = WriteSimpleReply(session, SUCCEEDED(hr) ? TEXT("ok") : TEXT("failed"), pchReply); 		
+        }
+        else if (isJoin)
+        {
+            // "J:<pid>" registers the client as a reader of the shared memory, the reply is "<slot>,<name>" where
+            // slot is -1 if they are all taken.  If there is no shared memory to join the reply is "none", the client
+            // maps its own with "M:".
+            DWORD processId = (DWORD)_ttoi(pchRequest + 2);
+            std::wstring name;
+            EnterCriticalSection(&_lock);
+            if (session.reader >= 0)
+            {
+                ProfilerInstance->LeaveReader(session.reader);
+            }
+            session.reader = ProfilerInstance->JoinReader(processId, name);
+            LeaveCriticalSection(&_lock);
+
+            std::wstringstream reply;
+            if (!name.empty())
+            {
+                reply << session.reader << L"," << name;
+            }
+            else
+            {
+                reply << L"none";
+            }
+            StringCchCopy(pchRequest, BufferSizeChars, reply.str().c_str());
+
+            fSuccess = WriteSimpleReply(session, pchRequest, pchReply); 	
+        }
+        else if (isRecord)
+        {
+            // "O:<path>" copies the shared memory to a trace file until "O:" stops it, see CRecorder.
+            EnterCriticalSection(&_lock);
+            HRESULT hr = ProfilerInstance->StartRecording(pchRequest + 2);
+            LeaveCriticalSection(&_lock);
+
+            fSuccess = WriteSimpleReply(session, SUCCEEDED(hr) ? TEXT("ok") : TEXT("failed"), pchReply); 		
+        }
+        else if (isEnumerate)
+        {
+            // "E:" maps every function the CLR has compiled so far, the reply is how many weren't mapped yet.
+            EnterCriticalSection(&_lock);
+            long added = ProfilerInstance->SnapshotFunctions();
+            LeaveCriticalSection(&_lock);
+            _ltow_s(added, pchRequest, 50, 10);
+
+            fSuccess = WriteSimpleReply(session, pchRequest, pchReply); 	
+        }
+        else if (isPause)
+        {
+            // "Z:pause" stops recording and "Z:resume" starts it again, the profiler stays attached.
+            if (wcscmp(pchRequest + 2, L"pause") == 0)
+            {
+                ProfilerInstance->Pause();
+            }
+            else
+            {
+                ProfilerInstance->Resume();
+            }
+
+            fSuccess = WriteSimpleReply(session, TEXT("ok"), pchReply); 		
         }
         else 
         {
@@ -359,16 +671,7 @@ DWORD PipeServer::ProcessControlRequests()
         }
     }
 
-    // Flush the pipe to allow the client to read the pipe's contents 
-    // before disconnecting. Then disconnect the pipe, and close the 
-    // handle to this pipe instance. 
-
-	if (!_fTerminated) {
-		FlushFileBuffers(hPipe); 
-		DisconnectNamedPipe(hPipe); 
-		CloseHandle(hPipe);
-	}
-
+    // the pipes are closed by EndSession.
     TCHAR* buffer = pchRequest;
     pchRequest = NULL;
     HeapFree(hHeap, 0, buffer);
@@ -377,14 +680,78 @@ DWORD PipeServer::ProcessControlRequests()
     pchReply = NULL;
     HeapFree(hHeap, 0, buffer);
 
-	if (ProfilerInstance != NULL) {
-		ProfilerInstance->ClientDetached();
-	}
-
     printf("ProcessControlRequests is finished.\n");
     return 1;
 }
 
+bool PipeServer::ProcessControlFrame(PipeSession& session, const ControlFrameHeader* request, DWORD numBytes)
+{
+    switch (request->opcode)
+    {
+    case ResolveNamesOpcode:
+        return ResolveNames(session, request, numBytes);
+    default:
+        LOG(TEXT("Unknown control frame opcode %d\n"), request->opcode);
+        return WriteControlFrame(session, request, 0, (DWORD)E_NOTIMPL, NULL, 0);
+    }
+}
+
+// Look up a batch of function names and send them back in one frame, as many as fit in MaxDataBytes.
+bool PipeServer::ResolveNames(PipeSession& session, const ControlFrameHeader* request, DWORD numBytes)
+{
+    const UINT32* ids = (const UINT32*)(request + 1);
+    DWORD count = min((DWORD)request->count, (numBytes - sizeof(ControlFrameHeader)) / sizeof(UINT32));
+
+    std::vector<BYTE> payload;
+    WCHAR name[NAME_BUFFER_SIZE];
+    char utf8[NAME_BUFFER_SIZE * 3];
+    WORD resolved = 0;
+    for (; resolved < count; resolved++)
+    {
+        // unknown ids get an empty name.
+        name[0] = L'\0';
+        ProfilerInstance->GetFunctionName(ids[resolved], name, sizeof(name));
+        int bytes = WideCharToMultiByte(CP_UTF8, 0, name, (int)wcslen(name), utf8, sizeof(utf8), NULL, NULL);
+
+        size_t entryBytes = sizeof(UINT32) + sizeof(WORD) + bytes;
+        if (sizeof(ControlFrameHeader) + payload.size() + entryBytes > MaxDataBytes)
+        {
+            break;
+        }
+
+        WORD length = (WORD)bytes;
+        const BYTE* id = (const BYTE*)&ids[resolved];
+        payload.insert(payload.end(), id, id + sizeof(UINT32));
+        payload.insert(payload.end(), (const BYTE*)&length, (const BYTE*)&length + sizeof(WORD));
+        payload.insert(payload.end(), (const BYTE*)utf8, (const BYTE*)utf8 + bytes);
+    }
+
+    return WriteControlFrame(session, request, resolved, S_OK, payload.empty() ? NULL : &payload[0], (DWORD)payload.size());
+}
+
+bool PipeServer::WriteControlFrame(PipeSession& session, const ControlFrameHeader* request, WORD count, DWORD status, const BYTE* payload, DWORD payloadBytes)
+{
+    std::vector<BYTE> frame(sizeof(ControlFrameHeader) + payloadBytes);
+    ControlFrameHeader* reply = (ControlFrameHeader*)&frame[0];
+    reply->length = (DWORD)frame.size() - sizeof(DWORD);
+    reply->magic = ControlFrameMagic;
+    reply->requestId = request->requestId;
+    reply->opcode = request->opcode;
+    reply->count = count;
+    reply->status = status;
+    if (payloadBytes > 0)
+    {
+        memcpy(reply + 1, payload, payloadBytes);
+    }
+
+    if (!WritePipe(session.hPipeControl, session.controlEvent, &frame[0], (DWORD)frame.size()))
+    {
+        LOG(TEXT("WriteControlFrame failed, GLE=%d.\n"), GetLastError()); 
+        return false;
+    }
+    return true;
+}
+
 bool PipeServer::WriteToDataPipe(BYTE* bytes, DWORD numBytes)
 {
     if (numBytes > MaxDataBytes || bytes == nullptr)
@@ -399,16 +766,12 @@ bool PipeServer::WriteToDataPipe(BYTE* bytes, DWORD numBytes)
         return false;
     }
 
-    DWORD numBytesWritten=0;
-    BOOL fSuccess = WriteFile( 
-        _hPipeData,        // handle to pipe 
-        bytes,     // buffer to write from 
-        numBytes, // number of bytes to write 
-        &numBytesWritten,   // number of bytes written 
-        NULL);        // not overlapped I/O 
-
-
-    return fSuccess == TRUE;
+    // waits while the client's end is full, CancelDataWrite or Shutdown end the wait.
+    EnterCriticalSection(&_streamLock);
+    PipeSession* session = _streamSession;
+    bool fSuccess = session != NULL && WritePipe(session->hPipeData, session->dataEvent, bytes, numBytes);
+    LeaveCriticalSection(&_streamLock);
+    return fSuccess;
 }
 
 
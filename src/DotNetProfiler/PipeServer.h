@@ -3,19 +3,68 @@
 class CProfiler;
 class CSharedMemory;
 
+// Binary control frames share the control pipe with the text messages.  Each frame is one pipe message that starts
+// with its length (not counting the length field itself) and ControlFrameMagic, so it can't be mistaken for text.
+// Each reply echoes the request id.  A request is only read once the reply to the one before it has been written,
+// so the client may only have as many requests in flight as fit in the 10KB pipe buffer, or both sides can block
+// writing.  Replies can be up to MaxDataBytes.
+const DWORD ControlFrameMagic = 0x46435453; // "STCF"
+
+enum ControlOpcode
+{
+    // request: count UINT32 function ids.  reply: count entries of [UINT32 id][UINT16 bytes][UTF-8 name], the
+    // reply may hold fewer names than were asked for when they don't fit, the client asks again for the rest.
+    ResolveNamesOpcode = 1,
+};
+
+#pragma pack(push, 1)
+struct ControlFrameHeader
+{
+    DWORD length;
+    DWORD magic;
+    DWORD requestId;
+    WORD opcode;
+    WORD count;
+    DWORD status; // S_OK or a failure HRESULT, only set on replies.
+};
+#pragma pack(pop)
+
+class PipeServer;
+
+// One connected client, each has its own instances of the control and data pipes and its own thread.
+struct PipeSession
+{
+    PipeServer* server;
+    HANDLE hPipeControl;
+    HANDLE hPipeData;
+    HANDLE controlEvent; // for I/O on the control pipe, only the session's thread uses it
+    HANDLE dataEvent;    // for writes to the data pipe, only the streamer uses it
+    long reader;         // the shared memory reader slot it joined with "J:", -1 if none
+};
+
 class PipeServer
 {
 public:
     PipeServer(CProfiler &profiler);
     ~PipeServer(void);
 
-	// call this method on a background thread to process pipe control requests.
+	// call this method on a background thread to accept clients, each is served on a thread of its own.
+	// It returns when Shutdown is called, or -1 if the pipes couldn't be created.
     int Run();
 
+    // Makes Run return and fails any pipe I/O that is waiting, for good.
+    void Shutdown();
+
+    // Waits up to milliseconds for Shutdown, returns true if it has been called.
+    bool WaitForShutdown(DWORD milliseconds);
+
+    // Fails a WriteToDataPipe that is waiting for the client to read, from any thread.
+    void CancelDataWrite();
+
     // Maximum packet size to send = MaxDataBytes
     static const int MaxDataBytes=1024*1024;
 
-    // Send bytes to the data pipe
+    // Send bytes to the data pipe of the client that asked for the stream
     // Returns true if the operation succeeded, false otherwise
     bool WriteToDataPipe(BYTE* bytes, DWORD numBytes);
 
@@ -25,10 +74,29 @@ public:
 
 private:
 	bool SetupNamedPipe(const wchar_t* pipeName, DWORD pipeMode, HANDLE &hPipe);
+    bool CompleteIo(HANDLE hPipe, BOOL fStarted, OVERLAPPED& overlapped, DWORD& cbTransferred);
+    bool WritePipe(HANDLE hPipe, HANDLE hEvent, const void* bytes, DWORD numBytes);
+    bool WriteSimpleReply(PipeSession& session, LPTSTR msg, TCHAR* pchReplyBuffer);
+
+    static DWORD WINAPI SessionThread(PVOID v);
+    void StartSession(HANDLE hPipeControl, HANDLE hPipeData);
+    void EndSession(PipeSession* session);
+    long GetSessionCount();
+
+	DWORD ProcessControlRequests(PipeSession& session);
+    bool ProcessControlFrame(PipeSession& session, const ControlFrameHeader* request, DWORD numBytes);
+    bool ResolveNames(PipeSession& session, const ControlFrameHeader* request, DWORD numBytes);
+    bool WriteControlFrame(PipeSession& session, const ControlFrameHeader* request, WORD count, DWORD status, const BYTE* payload, DWORD payloadBytes);
+
+    // the pipes are overlapped so every wait can also wait for _shutdownEvent instead of polling.
+    HANDLE _shutdownEvent;
+    HANDLE _acceptEvent;   // for connecting new clients, only the Run thread uses it
+    HANDLE _idleEvent;     // set while there are no sessions
 
-	DWORD ProcessControlRequests();
+    CRITICAL_SECTION _lock; // for _sessions
+    std::vector<PipeSession*> _sessions;
 
-    HANDLE _hPipeData;
-    HANDLE _hPipeControl;
-    bool _fTerminated;
+    CRITICAL_SECTION _streamLock;  // held while writing to the stream's data pipe
+    PipeSession* _streamSession;   // the client that sent "W:"
+    volatile HANDLE _hStreamPipe;  // its data pipe, for CancelDataWrite
 };
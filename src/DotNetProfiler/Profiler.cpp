@@ -30,14 +30,19 @@
 #define ARRAY_SIZE(s) (sizeof(s) / sizeof(s[0]))
 #define dimensionof(a) 		(sizeof(a)/sizeof(*(a)))
 
-const UINT_PTR LeaveCallId = 1;
-const UINT_PTR TailCallId = 2;
-
 EXTERN_C IMAGE_DOS_HEADER __ImageBase;
 
 // global reference to the profiler object (this) used by the static functions
 CProfiler* g_pICorProfilerCallback = NULL;
 
+namespace
+{
+	__declspec(thread) CShadowStack t_shadow;
+}
+
+// set while recording is paused, the hooks return straight away without saving any registers.
+EXTERN_C volatile LONG g_recordingPaused = 0;
+
 
 /***************************************************************************************
  ********************                                               ********************
@@ -70,11 +75,11 @@ CProfiler* g_pICorProfilerCallback = NULL;
  *  Notes:
  *
  ***************************************************************************************/
-EXTERN_C void __stdcall EnterStub( FunctionID functionID )
+EXTERN_C void __stdcall EnterStub( UINT_PTR clientData )
 {
 	if (g_pICorProfilerCallback != NULL) 
 	{
-		g_pICorProfilerCallback->Enter( functionID );
+		g_pICorProfilerCallback->Enter( (UINT32)clientData );
 	}
     
 } // EnterStub
@@ -96,11 +101,11 @@ EXTERN_C void __stdcall EnterStub( FunctionID functionID )
  *  Notes:
  *
  ***************************************************************************************/
-EXTERN_C void __stdcall LeaveStub( FunctionID functionID )
+EXTERN_C void __stdcall LeaveStub( UINT_PTR clientData )
 {
 	if (g_pICorProfilerCallback != NULL) 
 	{
-		g_pICorProfilerCallback->Leave( functionID );
+		g_pICorProfilerCallback->Leave( (UINT32)clientData );
 	}
     
 } // LeaveStub
@@ -122,11 +127,11 @@ EXTERN_C void __stdcall LeaveStub( FunctionID functionID )
  *  Notes:
  *
  ***************************************************************************************/
-EXTERN_C void __stdcall TailcallStub( FunctionID functionID )
+EXTERN_C void __stdcall TailcallStub( UINT_PTR clientData )
 {
 	if (g_pICorProfilerCallback != NULL) 
 	{
-	    g_pICorProfilerCallback->Tailcall( functionID );
+	    g_pICorProfilerCallback->Tailcall( (UINT32)clientData );
 	}
     
 } // TailcallStub
@@ -153,6 +158,8 @@ void __declspec( naked ) EnterNaked()
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
@@ -161,6 +168,7 @@ void __declspec( naked ) EnterNaked()
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 4
     }
 } // EnterNaked
@@ -186,6 +194,8 @@ void __declspec( naked ) LeaveNaked()
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
@@ -194,6 +204,7 @@ void __declspec( naked ) LeaveNaked()
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 4
     }
 } // LeaveNaked
@@ -219,6 +230,8 @@ void __declspec( naked ) TailcallNaked()
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
@@ -227,6 +240,7 @@ void __declspec( naked ) TailcallNaked()
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 4
     }
 } // TailcallNaked
@@ -255,14 +269,17 @@ void __declspec( naked ) EnterNaked2(FunctionID funcId,
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
-        push [esp + 16]
+        push [esp + 20] // clientData
         call EnterStub
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 16
     }
 } // EnterNaked
@@ -291,14 +308,17 @@ void __declspec( naked ) LeaveNaked2(FunctionID funcId,
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
-        push [esp + 16]
+        push [esp + 20] // clientData
         call LeaveStub
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 16
     }
 } // LeaveNaked
@@ -326,14 +346,17 @@ void __declspec( naked ) TailcallNaked2(FunctionID funcId,
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
-        push [esp + 16]
+        push [esp + 20] // clientData
         call TailcallStub
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 12
     }
 } // TailcallNaked
@@ -359,6 +382,8 @@ void __declspec( naked ) EnterNaked3(FunctionIDOrClientID functionIDOrClientID)
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
@@ -367,6 +392,7 @@ void __declspec( naked ) EnterNaked3(FunctionIDOrClientID functionIDOrClientID)
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 4
     }
 } // EnterNaked
@@ -392,6 +418,8 @@ void __declspec( naked ) LeaveNaked3(FunctionIDOrClientID functionIDOrClientID)
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
@@ -400,6 +428,7 @@ void __declspec( naked ) LeaveNaked3(FunctionIDOrClientID functionIDOrClientID)
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 4
     }
 } // LeaveNaked
@@ -425,6 +454,8 @@ void __declspec( naked ) TailcallNaked3(FunctionIDOrClientID functionIDOrClientI
 {
     __asm
     {
+        cmp g_recordingPaused, 0 // nothing to do while paused
+        jne paused
         push eax
         push ecx
         push edx
@@ -433,6 +464,7 @@ void __declspec( naked ) TailcallNaked3(FunctionIDOrClientID functionIDOrClientI
         pop edx
         pop ecx
         pop eax
+    paused:
         ret 4
     }
 } // TailcallNaked
@@ -461,11 +493,16 @@ EXTERN_C void TailcallNaked3(FunctionIDOrClientID functionIDOrClientID);
 // CProfiler
 CProfiler::CProfiler() : 
             _pipeServer(*this),
-    _sharedMemory(NULL)
+    _sharedMemory(NULL),
+    _sampler(*this),
+    _throttle(*this, _functions),
+    _streamer(_pipeServer),
+    _modules(_metadata)
 {
 	m_hLogFile = INVALID_HANDLE_VALUE;
-	m_callStackSize = 0;	
+	_resumeEpoch = 0;
     m_terminated = FALSE;
+	_mode = ProfileTrace;
 }
 
 HRESULT CProfiler::FinalConstruct()
@@ -490,6 +527,8 @@ void CProfiler::FinalRelease()
     CloseSharedMemory();
 	
 	m_terminated = true;
+	_pipeServer.Shutdown();
+	FreeRetiredBuffers();
 }
 
 //
@@ -599,99 +638,438 @@ UINT_PTR CProfiler::FunctionMapper(FunctionID functionID, BOOL *pbHookFunction)
 {
 	// make sure the global reference to our profiler is valid.  Forward this
 	// call to our profiler object
-    if (g_pICorProfilerCallback != NULL)
-        g_pICorProfilerCallback->MapFunction(functionID);
+	UINT32 index = 0;
+    CProfiler* profiler = g_pICorProfilerCallback;
+    if (profiler != NULL && profiler->IsIncluded(functionID))
+        index = profiler->MapFunction(functionID);
 
 	if (pbHookFunction != NULL) {
-		// hook all functions.
-		*pbHookFunction = TRUE;
+		// hook all functions that pass the filter and that we were able to give an index to,
+		// the rest run without any profiler overhead.
+		*pbHookFunction = (index != 0);
 	}
 
-	// we must return the function ID passed as a parameter
-	return (UINT_PTR)functionID;
+	// whatever we return here is the clientData the CLR passes to our Enter/Leave hooks, so
+	// return the dense function index, that is what goes in the shared memory records.
+	return (UINT_PTR)index;
 }
 
-static long g_functionCount;
-
 // the static function called by .Net when a function has been mapped to an ID
-void CProfiler::MapFunction(FunctionID functionID)
+UINT32 CProfiler::MapFunction(FunctionID functionID)
 {
-	g_functionCount++;
+	UINT32 index = _functions.Add(functionID);
+	if (index != 0)
+	{
+		// the module is needed to retire the function when the module unloads, client or no client.
+		FunctionInfo* info = _functions.Get(index);
+		ClassID classId = 0;
+		ModuleID moduleId = 0;
+		mdToken token = 0;
+		if (info->module == 0 && SUCCEEDED(m_pICorProfilerInfo->GetFunctionInfo(functionID, &classId, &moduleId, &token)))
+		{
+			info->module = _modules.Add(moduleId);
+		}
+
+		// the client finds the name in the shared memory before it sees the first call.
+		DefineFunction(index);
+	}
+	return index;
 }
 
-HRESULT CProfiler::GetFunctionName(FunctionID functionID, WCHAR* buffer, int bufferSize)
+void CProfiler::RetireFunction(UINT32 index)
 {
-	// see if this function is in the map
-	
-		// declared in this block so they are not created if the function is found
-		
+	FunctionInfo* info = _functions.Get(index);
+	if (info == NULL)
+	{
+		return;
+	}
+	long generation = info->generation;
+	if (!_functions.Retire(index))
+	{
+		return;
+	}
+
+	// the next function to get this index starts counting from zero.
+	_flatProfile.Forget(index);
+
+	CSharedMemory* sharedMemory = _sharedMemory;
+	if (sharedMemory != NULL)
+	{
+		sharedMemory->RetireFunction(index, (UINT32)generation);
+	}
+}
+
+void CProfiler::RetireModule(ModuleID moduleId)
+{
+	// the CLR doesn't always raise FunctionUnloadStarted for the functions in an unloading module.
+	UINT32 module = _modules.Find(moduleId);
+	if (module == 0)
+	{
+		return;
+	}
+	long count = _functions.GetCount();
+	for (long i = 0; i < count; i++)
+	{
+		FunctionInfo* info = _functions.Get(FirstFunctionIndex + i);
+		if (info->module == module && info->functionId != 0)
+		{
+			RetireFunction(FirstFunctionIndex + i);
+		}
+	}
+	DefineModule(module, ModuleUnloaded);
+	_modules.Remove(moduleId);
+}
+
+UINT32 CProfiler::FindFunction(FunctionID functionID)
+{
+	return _functions.Find(functionID);
+}
+
+long CProfiler::SnapshotFunctions()
+{
+	if (m_pICorProfilerInfo3 == NULL)
+	{
+		// the CLR 2 can't enumerate them, the client looks up the names as it sees the functions.
+		return 0;
+	}
+	ICorProfilerFunctionEnum* functions = NULL;
+	if (FAILED(m_pICorProfilerInfo3->EnumJITedFunctions(&functions)))
+	{
+		return 0;
+	}
+
+	// the names come from the metadata cache, so each module is only opened once however many functions it has.
+	long before = _functions.GetCount();
+	COR_PRF_FUNCTION batch[SnapshotBatchSize];
+	ULONG fetched = 0;
+	while (SUCCEEDED(functions->Next(SnapshotBatchSize, batch, &fetched)) && fetched > 0)
+	{
+		for (ULONG i = 0; i < fetched; i++)
+		{
+			FunctionID functionId = batch[i].functionId;
+			if (_functions.Find(functionId) == 0 && IsIncluded(functionId))
+			{
+				MapFunction(functionId);
+			}
+		}
+	}
+	functions->Release();
+	return _functions.GetCount() - before;
+}
+
+void CProfiler::DefineFunction(UINT32 index)
+{
+	CSharedMemory* sharedMemory = _sharedMemory;
+	FunctionInfo* info = _functions.Get(index);
+	if (sharedMemory == NULL || info == NULL || info->functionId == 0)
+	{
+		return;
+	}
+
+	// MapFunction and InitSharedMemory can race to define the same function.
+	long id = sharedMemory->GetId();
+	if (InterlockedExchange(&info->defined, id) == id)
+	{
+		return;
+	}
+
+	ClassID classId = 0;
+	ModuleID moduleId = 0;
+	mdToken token = 0;
+	if (FAILED(m_pICorProfilerInfo->GetFunctionInfo(info->functionId, &classId, &moduleId, &token)))
+	{
+		moduleId = 0;
+		token = 0;
+	}
+
+	// the module's record goes first so the client can tag the function as it reads its definition.
+	DefineModule(info->module, ModuleLoaded);
+
+	WCHAR szMethod[NAME_BUFFER_SIZE];
+	if (FAILED(GetFullMethodName(info->functionId, szMethod, sizeof(szMethod))))
+	{
+		szMethod[0] = L'\0';
+	}
+	sharedMemory->DefineFunction(index, (UINT32)info->generation, token, moduleId, info->module, szMethod);
+}
+
+void CProfiler::DefineModule(UINT32 index, UINT32 flags)
+{
+	CSharedMemory* sharedMemory = _sharedMemory;
+	ModuleInfo module;
+	if (sharedMemory == NULL || !_modules.Get(index, module))
+	{
+		return;
+	}
+	if (flags == ModuleLoaded && (module.unloaded || !_modules.SetDefined(index, sharedMemory->GetId())))
+	{
+		return;
+	}
+	sharedMemory->DefineModule(index, flags, module.moduleId, module.assemblyId, module.baseAddress, module.mvid, module.path.c_str(), module.assembly.c_str());
+}
+
+void CProfiler::SetFilter(const WCHAR* spec)
+{
+	_filter.SetSpec(spec);
+}
+
+// this is called once per function, so looking up the names here costs nothing later.
+bool CProfiler::IsIncluded(FunctionID functionID)
+{
+	if (_filter.IsEmpty())
+	{
+		return true;
+	}
+
+	WCHAR szMethod[NAME_BUFFER_SIZE];
+	WCHAR szAssembly[NAME_BUFFER_SIZE];
+	if (FAILED(GetFullMethodName(functionID, szMethod, sizeof(szMethod))))
+	{
+		szMethod[0] = L'\0';
+	}
+	if (FAILED(GetAssemblyName(functionID, szAssembly, NAME_BUFFER_SIZE)))
+	{
+		szAssembly[0] = L'\0';
+	}
+	return _filter.Include(szAssembly, szMethod);
+}
+
+HRESULT CProfiler::GetFunctionName(UINT32 index, WCHAR* buffer, int bufferSize)
+{
+	FunctionInfo* info = _functions.Get(index);
+	if (info == NULL)
+	{
+		LogString("Unknown function index %u\r\n", index);
+		return E_INVALIDARG;
+	}
+
 	// get the method name
-	HRESULT hr = GetFullMethodName(functionID, buffer, bufferSize); 
+	HRESULT hr = GetFullMethodName(info->functionId, buffer, bufferSize); 
 	if (FAILED(hr))
 	{
 		// if we couldn't get the function name, then log it
-		LogString("Unable to find the name for function %i\r\n", functionID);
+		LogString("Unable to find the name for function %i\r\n", info->functionId);
 	}
     return hr;
 }
 
+// used by CSharedMemory to find the managed thread for threads that were running before
+// we saw their ThreadCreated or ThreadAssignedToOSThread notification.
+static UINT_PTR ResolveCurrentThread()
+{
+	CProfiler* profiler = g_pICorProfilerCallback;
+	return (profiler != NULL) ? profiler->GetCurrentThreadID() : 0;
+}
+
+ThreadID CProfiler::GetCurrentThreadID()
+{
+	ThreadID threadID = 0;
+	if (FAILED(m_pICorProfilerInfo->GetCurrentThreadID(&threadID)))
+	{
+		threadID = 0;
+	}
+	return threadID;
+}
+
 // ----  CALLBACK HANDLER FUNCTIONS ------------------
 
 // our real handler for FunctionEnter notification
-void CProfiler::Enter(FunctionID functionID) // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_INFO *argumentInfo)
+void CProfiler::Enter(UINT32 index) // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_INFO *argumentInfo)
 {	    
-    FunctionID id = functionID;
+    UINT32 id = index;
     if (id != 0) 
     {
-	    static long callCount = 0;
-
-	    if (callCount == 0) 
-	    {		
-			if (getenv("COR_PROFILER_ATTACHING") == NULL) 
-			{		    
-				MessageBox(NULL, L"You can now attach the profiler client.\r\nThe process being profiled will start up slowly so please be patient.", L"Profiler Ready", MB_ICONINFORMATION);
-			}
-	    }
-	    callCount++;
-
-        if (_sharedMemory != NULL) {
-	        _sharedMemory->WriteRecord(id, _currentTime);
+        if (_mode == ProfileFlat) {
+            CShadowStack& shadow = t_shadow;
+            SyncShadow(shadow);
+            shadow.Push(id, CClock::Now(), false);
+            _flatProfile.Enter(id, shadow.GetTopFrame());
+        }
+        else if (_mode == ProfileTrace) {
+            // read them once, CloseSharedMemory can take the buffer away at any time.  The key is
+            // read first so the stubs don't use what we look at here if anything changes after.
+            long key = g_fastPathKey;
+            CSharedMemory* sharedMemory = _sharedMemory;
+            if (sharedMemory == NULL) {
+                return;
+            }
+            UINT64 now = CClock::Now();
+            bool suppress = false;
+            if (_throttle.IsEnabled()) {
+                FunctionInfo* info = _functions.Get(id);
+                suppress = (info != NULL && _throttle.Suppress(id, info));
+            }
+            if (PushFrame(id, now, suppress)) {
+	            sharedMemory->WriteRecord(id, now);
+            }
+            CFastPath::Arm(key, sharedMemory, t_shadow);
         }
     }
-
-	m_callStackSize++;
 }
 
 // our real handler for FunctionLeave notification
-void CProfiler::Leave(FunctionID functionID) // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_RANGE *argumentRange)
+void CProfiler::Leave(UINT32 index) // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_RANGE *argumentRange)
 {    
-    if (_sharedMemory != NULL) {
-        FunctionID leaveId = (FunctionID)LeaveCallId;
-		_sharedMemory->WriteRecord(leaveId, _currentTime);
+    if (_mode == ProfileFlat) {
+        PopFlatFrame(CClock::Now());
+    }
+    else if (_mode == ProfileTrace) {
+        long key = g_fastPathKey;
+        CSharedMemory* sharedMemory = _sharedMemory;
+        if (sharedMemory == NULL) {
+            return;
+        }
+        UINT64 now = CClock::Now();
+        if (PopFrame(now)) {
+		    sharedMemory->WriteRecord(LeaveRecord, now);
+        }
+        CFastPath::Arm(key, sharedMemory, t_shadow);
     }
-
-	// decrement the call stack size
-	if (m_callStackSize > 0)
-		m_callStackSize--;
 }
 
 // our real handler for the FunctionTailcall notification
-void CProfiler::Tailcall(FunctionID functionID) // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo)
+void CProfiler::Tailcall(UINT32 index) // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo)
 {
-    if (_sharedMemory != NULL) {
-        FunctionID id = (FunctionID)TailCallId;
-		_sharedMemory->WriteRecord(id, _currentTime);
+    // The tail calling function is done, the CLR won't call Leave for it, its callee
+    // gets its own Enter and Leave and then returns straight to our caller.
+    if (_mode == ProfileFlat) {
+        PopFlatFrame(CClock::Now());
+    }
+    else if (_mode == ProfileTrace) {
+        long key = g_fastPathKey;
+        CSharedMemory* sharedMemory = _sharedMemory;
+        if (sharedMemory == NULL) {
+            return;
+        }
+        UINT64 now = CClock::Now();
+        if (PopFrame(now)) {
+		    sharedMemory->WriteRecord(TailcallRecord, now);
+        }
+        CFastPath::Arm(key, sharedMemory, t_shadow);
     }
+}
+
+// Returns false if the call is suppressed by the throttle and shouldn't be recorded.
+bool CProfiler::PushFrame(UINT32 index, UINT64 timestamp, bool suppress)
+{
+	CShadowStack& shadow = t_shadow;
+	SyncShadow(shadow);
+	return shadow.Push(index, timestamp, suppress);
+}
+
+// Returns false if the call was suppressed by the throttle, it is counted instead.
+bool CProfiler::PopFrame(UINT64 timestamp)
+{
+	CShadowStack& shadow = t_shadow;
+	if (!SyncShadow(shadow))
+	{
+		return true;
+	}
+	ShadowFrame* frame = shadow.Pop();
+	if (frame != NULL && frame->suppressed)
+	{
+		_throttle.AddSuppressed(frame->index, timestamp > frame->start ? timestamp - frame->start : 0);
+		return false;
+	}
+	return true;
+}
+
+// In flat mode the call is timed from its frame instead of being recorded.
+void CProfiler::PopFlatFrame(UINT64 timestamp)
+{
+	CShadowStack& shadow = t_shadow;
+	if (!SyncShadow(shadow))
+	{
+		return;
+	}
+	ShadowFrame* frame = shadow.Pop();
+	_flatProfile.Leave(frame, shadow.GetTopFrame(), timestamp);
+}
+
+// Returns false if recording was resumed since the thread's last call, the calls on its
+// stack finished while we were paused so it starts over, and flat mode stops counting
+// them as active.
+bool CProfiler::SyncShadow(CShadowStack& shadow)
+{
+	long epoch = _resumeEpoch;
+	if (shadow.IsCurrent(epoch))
+	{
+		return true;
+	}
+	_flatProfile.Unwind(shadow);
+	shadow.Sync(epoch);
+	return false;
+}
+
+// The x64 stubs handle the calls themselves in trace mode with the throttle off, see FastPath.h.
+// Called after anything that changes that, or what the stubs would need to check.
+void CProfiler::UpdateFastPath()
+{
+	CFastPath::Update(_mode == ProfileTrace && _sharedMemory != NULL && !_throttle.IsEnabled() && CClock::UsesTsc());
+}
+
+// The CLR calls these for every managed frame an exception unwinds, hooked or not, and
+// finally blocks can run (and make calls, or even throw) between the two.
+void CProfiler::UnwindFunctionEnter(FunctionID functionID)
+{
+	CShadowStack& shadow = t_shadow;
+	UINT32 index = 0;
+	if ((_mode == ProfileTrace || _mode == ProfileFlat) && !IsPaused() && shadow.IsCurrent(_resumeEpoch) && shadow.GetDepth() > 0)
+	{
+		if (shadow.GetDepth() > MaxShadowDepth)
+		{
+			// too deep to check, so trust that it is ours if we hooked it.
+			index = _functions.Find(functionID);
+		}
+		else
+		{
+			// only the top frame can be ours, which saves a lookup.
+			UINT32 top = shadow.GetTop();
+			FunctionInfo* info = _functions.Get(top);
+			index = (info != NULL && info->functionId == functionID) ? top : 0;
+		}
+	}
+	shadow.UnwindEnter(index);
+}
 
-	// decrement the call stack size
-	if (m_callStackSize > 0)
-		m_callStackSize--;
+void CProfiler::UnwindFunctionLeave()
+{
+	CShadowStack& shadow = t_shadow;
+	if (!shadow.UnwindLeave(_resumeEpoch))
+	{
+		return;
+	}
+
+	UINT64 now = CClock::Now();
+	if (_mode == ProfileFlat)
+	{
+		PopFlatFrame(now);
+	}
+	else if (PopFrame(now))
+	{
+		shadow.AddPendingPop(now);
+	}
 }
 
-void CALLBACK timer_tick(PTP_CALLBACK_INSTANCE i, void* context, PTP_TIMER timer)
+void CProfiler::FlushUnwind()
 {
-	CProfiler* profiler = (CProfiler*)context;
-	profiler->OnTick();
+	CShadowStack& shadow = t_shadow;
+	UINT64 popTime;
+	UINT32 pops = shadow.TakePendingPops(popTime);
+	if (pops == 0)
+	{
+		return;
+	}
+
+	CSharedMemory* sharedMemory = _sharedMemory;
+	if (sharedMemory != NULL && shadow.IsCurrent(_resumeEpoch))
+	{
+		PopPayload pop;
+		pop.timestamp = popTime;
+		pop.count = pops;
+		pop.reserved = 0;
+		sharedMemory->WriteExtended(PopRecord, &pop, sizeof(pop));
+	}
 }
 
 // ----  ICorProfilerCallback IMPLEMENTATION ------------------
@@ -703,6 +1081,36 @@ STDMETHODIMP CProfiler::Initialize(IUnknown *pICorProfilerInfoUnk)
 	
 	// set up our global access pointer
 	g_pICorProfilerCallback = this;
+	CSharedMemory::SetThreadResolver(&ResolveCurrentThread);
+
+	// the hooks read the clock directly, it is calibrated when the shared memory is set up.
+	CClock::Start();
+
+	// SOFTWARETRAILS_FILTER has the same syntax as the client's filter, it has to be set
+	// before the functions are mapped to make a difference.
+	WCHAR* filter = _wgetenv(L"SOFTWARETRAILS_FILTER");
+	if (filter != NULL)
+	{
+		_filter.SetSpec(filter);
+	}
+
+	// SOFTWARETRAILS_THROTTLE=<calls per second> turns on throttling of hot functions in trace mode.
+	char* throttle = getenv("SOFTWARETRAILS_THROTTLE");
+	if (throttle != NULL)
+	{
+		_throttle.SetLimit((DWORD)atol(throttle));
+	}
+
+	// SOFTWARETRAILS_MODE=flat or sample picks the starting mode, the client can also change it later.
+	char* mode = getenv("SOFTWARETRAILS_MODE");
+	if (mode != NULL && _stricmp(mode, "flat") == 0)
+	{
+		_mode = ProfileFlat;
+	}
+	else if (mode != NULL && _stricmp(mode, "sample") == 0)
+	{
+		_mode = ProfileSample;
+	}
 
 	// log that we are initializing
 	LogString("Initializing...\r\n\r\n");
@@ -720,6 +1128,10 @@ STDMETHODIMP CProfiler::Initialize(IUnknown *pICorProfilerInfoUnk)
 		return E_FAIL; // runtime is too old..
 	}
 	
+	// the names of the functions are looked up through this.
+	_metadata.Initialize(m_pICorProfilerInfo2);
+	_modules.Initialize(m_pICorProfilerInfo2);
+
 	// determine if this object implements ICorProfilerInfo3
     hr = pICorProfilerInfoUnk->QueryInterface(IID_ICorProfilerInfo3, (LPVOID*)&m_pICorProfilerInfo3);
     if (FAILED(hr))
@@ -756,13 +1168,13 @@ STDMETHODIMP CProfiler::Initialize(IUnknown *pICorProfilerInfoUnk)
 	// start the thread for handling named pipe
     HANDLE hThread = CreateThread(NULL, 0, &HandlerThread, (PVOID)this, 0, NULL);
     CloseHandle(hThread);
-	
-	_currentTime = GetTickCount();
-	FILETIME relativeTime = { (DWORD)-1000, 0 };
-	_timer = CreateThreadpoolTimer(timer_tick, this, NULL);
 
-	// Get a 1 millisecond callback so we can increment our global time clock efficiently (without having to do it in profiler callbacks).
-	SetThreadpoolTimer(_timer, &relativeTime, 1, 0);
+	// this used to happen on the first call, now the hooks don't have to check for it.
+	// The pipe server is already running so the client can attach while this is up.
+	if (getenv("COR_PROFILER_ATTACHING") == NULL) 
+	{		    
+		MessageBox(NULL, L"You can now attach the profiler client.\r\nThe process being profiled will start up slowly so please be patient.", L"Profiler Ready", MB_ICONINFORMATION);
+	}
 
 	// report our success or failure to the log file
     if (FAILED(hr))
@@ -774,11 +1186,6 @@ STDMETHODIMP CProfiler::Initialize(IUnknown *pICorProfilerInfoUnk)
     return S_OK;
 }
 
-void CProfiler::OnTick() 
-{
-	_currentTime = GetTickCount();
-}
-
 // called when the profiler is being terminated by the CLR
 STDMETHODIMP CProfiler::Shutdown()
 {
@@ -789,9 +1196,11 @@ STDMETHODIMP CProfiler::Shutdown()
 	g_pICorProfilerCallback = NULL;
 
     m_terminated = true;
-
-	CloseThreadpoolTimer(_timer);
-	_timer = NULL;
+	_pipeServer.Shutdown();
+	_sampler.Stop();
+	_throttle.Stop();
+	_modules.Shutdown();
+	_metadata.Shutdown();
 
     return S_OK;
 }
@@ -896,8 +1305,17 @@ HRESULT CProfiler::SetEventMask()
 	//COR_PRF_ALL	= 0x3fffffff,
 	//COR_PRF_MONITOR_IMMUTABLE	= COR_PRF_MONITOR_CODE_TRANSITIONS | COR_PRF_MONITOR_REMOTING | COR_PRF_MONITOR_REMOTING_COOKIE | COR_PRF_MONITOR_REMOTING_ASYNC | COR_PRF_MONITOR_GC | COR_PRF_ENABLE_REJIT | COR_PRF_ENABLE_INPROC_DEBUGGING | COR_PRF_ENABLE_JIT_MAPS | COR_PRF_DISABLE_OPTIMIZATIONS | COR_PRF_DISABLE_INLINING | COR_PRF_ENABLE_OBJECT_ALLOCATED | COR_PRF_ENABLE_FUNCTION_ARGS | COR_PRF_ENABLE_FUNCTION_RETVAL | COR_PRF_ENABLE_FRAME_INFO | COR_PRF_ENABLE_STACK_SNAPSHOT | COR_PRF_USE_PROFILE_IMAGES
 
-	// set the event mask 
-	DWORD eventMask = (DWORD)(COR_PRF_MONITOR_ENTERLEAVE);
+	// set the event mask, stack snapshots can't be turned on later so always ask for them.
+	// Starting in sample mode leaves the hooks out altogether, so the code runs at full speed.
+	// The module events keep the module table current, functions are tagged with their module.  The unload
+	// events retire the indices of functions that have gone and drop what the metadata cache knew about them.
+	DWORD eventMask = (DWORD)(COR_PRF_MONITOR_THREADS | COR_PRF_ENABLE_STACK_SNAPSHOT | COR_PRF_MONITOR_MODULE_LOADS | COR_PRF_MONITOR_ASSEMBLY_LOADS |
+		COR_PRF_MONITOR_FUNCTION_UNLOADS | COR_PRF_MONITOR_CLASS_LOADS);
+	if (_mode != ProfileSample)
+	{
+		// we need to hear about exception unwinds to keep the call stacks balanced.
+		eventMask |= COR_PRF_MONITOR_ENTERLEAVE | COR_PRF_MONITOR_EXCEPTIONS;
+	}
 	return m_pICorProfilerInfo->SetEventMask(eventMask);
 }
 
@@ -906,48 +1324,28 @@ HRESULT CProfiler::SetEventMask()
 // creates the fully scoped name of the method in the provided buffer
 HRESULT CProfiler::GetFullMethodName(FunctionID functionID, LPWSTR wszMethod, int cMethod)
 {
-	IMetaDataImport* pIMetaDataImport = 0;
-	HRESULT hr = S_OK;
-	mdToken funcToken = 0;
-	WCHAR szFunction[NAME_BUFFER_SIZE];
-	WCHAR szClass[NAME_BUFFER_SIZE];
-			
-	// get the token for the function which we will use to get its name	
-	hr = m_pICorProfilerInfo->GetTokenAndMetaDataFromFunction(functionID, IID_IMetaDataImport, (LPUNKNOWN *) &pIMetaDataImport, &funcToken);
-	if(SUCCEEDED(hr))
+	// the names are cached per module, see CMetadataCache for the format.
+	std::wstring name;
+	HRESULT hr = _metadata.GetFullMethodName(functionID, name);
+	if (SUCCEEDED(hr))
 	{
-		mdTypeDef classTypeDef;
-		ULONG cchFunction;
-		ULONG cchClass;
-
-		// retrieve the function properties based on the token
-		hr = pIMetaDataImport->GetMethodProps(funcToken, &classTypeDef, szFunction, NAME_BUFFER_SIZE, &cchFunction, 0, 0, 0, 0, 0);
-		if (SUCCEEDED(hr))
-		{
-			// get the function name
-			hr = pIMetaDataImport->GetTypeDefProps(classTypeDef, szClass, NAME_BUFFER_SIZE, &cchClass, 0, 0);
-			if (!SUCCEEDED(hr))
-			{
-				// mark this as a weird global object then.
-				int bufChars = (NAME_BUFFER_SIZE - 2) / sizeof(TCHAR);
-				_snwprintf_s(szClass, bufChars, bufChars, L"::");
-			}
-
-			// create the fully qualified name
-			int maxChars = (cMethod - 2) / sizeof(TCHAR); // give room for null terminator.
-			_snwprintf_s(wszMethod, maxChars, maxChars, L"%s.%s", szClass, szFunction);                
-		}
-		else {
-			MessageBox(NULL, L"GetMethodProps failed", L"Profiler Debug Prompt", MB_ICONINFORMATION);
-		}
-		// release our reference to the metadata
-		pIMetaDataImport->Release();
+		int maxChars = (cMethod - 2) / sizeof(TCHAR); // give room for null terminator.
+		wcsncpy_s(wszMethod, maxChars, name.c_str(), _TRUNCATE);
 	}
-
-
 	return hr;
 }
 
+// gets the name of the assembly the function is defined in
+HRESULT CProfiler::GetAssemblyName(FunctionID functionID, LPWSTR wszAssembly, int cAssembly)
+{
+	std::wstring assembly;
+	HRESULT hr = _metadata.GetAssemblyName(functionID, assembly);
+	if (SUCCEEDED(hr))
+	{
+		wcsncpy_s(wszAssembly, cAssembly, assembly.c_str(), _TRUNCATE);
+	}
+	return hr;
+}
 
 HRESULT CProfiler::RequestDetach()
 {
@@ -970,51 +1368,246 @@ HRESULT CProfiler::ClientDetached()
 
 HRESULT CProfiler::InitSharedMemory(TCHAR* name, int size)
 {
-    _sharedMemory = new CSharedMemory(name, size);
+    // a new buffer replaces the old one, along with the threads that were using it.
+    CloseSharedMemory();
+    CSharedMemory* sharedMemory = new CSharedMemory(name, size);
+    HRESULT hr = sharedMemory->GetStatus();
+    if (FAILED(hr))
+    {
+        delete sharedMemory;
+        return hr;
+    }
+    _sharedMemory = sharedMemory;
+
+    // the modules first, the function definitions refer to them.
+    long modules = _modules.GetCount();
+    for (long i = 1; i <= modules; i++)
+    {
+        DefineModule((UINT32)i, ModuleLoaded);
+    }
+    // define the functions that were mapped before the client attached.
+    long count = _functions.GetCount();
+    for (long i = 0; i < count; i++)
+    {
+        DefineFunction(FirstFunctionIndex + i);
+    }
+    // and the ones that were compiled before we were attached, in one go.
+    SnapshotFunctions();
+    sharedMemory->FlushThread();
+
+    UpdateFastPath();
+
+    // they write to this buffer, CloseSharedMemory stops them again.  The throttle only runs while it has a limit,
+    // the sampler sits idle unless we are in sample mode.
+    _throttle.Start();
+    _sampler.Start();
+
+    // a private buffer is read by the streamer, it doesn't need waking.
+    if (name != NULL)
+    {
+        _doorbell.Start(sharedMemory);
+    }
     return S_OK;
 }
 
+HRESULT CProfiler::InitStream(long size)
+{
+    HRESULT hr = InitSharedMemory(NULL, max(size, DefaultStreamSize));
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (SUCCEEDED(hr) && sharedMemory != NULL)
+    {
+        _streamer.Start(sharedMemory);
+    }
+    return hr;
+}
+
+long CProfiler::JoinReader(DWORD processId, std::wstring& name)
+{
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory == NULL)
+    {
+        return -1;
+    }
+    name = sharedMemory->GetName();
+    return sharedMemory->RegisterReader(processId);
+}
+
+void CProfiler::LeaveReader(long slot)
+{
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory != NULL)
+    {
+        sharedMemory->ReleaseReader(slot);
+    }
+}
+
+HRESULT CProfiler::StartRecording(const WCHAR* path)
+{
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (path == NULL || path[0] == L'\0')
+    {
+        StopRecording();
+        return S_OK;
+    }
+    if (sharedMemory == NULL)
+    {
+        return E_FAIL;
+    }
+    return _recorder.Start(sharedMemory, path);
+}
+
+void CProfiler::StopRecording()
+{
+    _recorder.Stop();
+}
+
 void CProfiler::CloseSharedMemory()
 {
-    if (_sharedMemory != NULL) 
+    // every thread that uses the buffer goes first.
+    _recorder.Stop();
+    _streamer.Stop();
+    _doorbell.Stop();
+    _throttle.Stop();
+    _sampler.Stop();
+    CSharedMemory* sharedMemory = (CSharedMemory*)InterlockedExchangePointer((PVOID volatile*)&_sharedMemory, NULL);
+    UpdateFastPath();
+    if (sharedMemory != NULL) 
+    {
+        // A hook that read the pointer just before can still be writing to it, and the threads
+        // keep pointers into its chunks, so it can't be freed until the profiler goes away.
+        _retiredBuffers.push_back(sharedMemory);
+    }
+}
+
+// Only once nothing can call the hooks any more.
+void CProfiler::FreeRetiredBuffers()
+{
+    for (size_t i = 0; i < _retiredBuffers.size(); i++)
     {
-        // must be thread safe.
-        CSharedMemory* temp = _sharedMemory;
-        _sharedMemory = NULL;
-        delete temp;
+        delete _retiredBuffers[i];
     }
+    _retiredBuffers.clear();
 }
 
 long CProfiler::GetCallCount()
 {
-    if (_sharedMemory != NULL) 
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory != NULL) 
     {
-        return (long)(_sharedMemory->GetPosition() / RecordSize);
+        return (long)sharedMemory->GetRecordCount();
     }
     return 0;
 }
 
 long CProfiler::GetFunctionCount()
 {
-    return g_functionCount;
+    return _functions.GetCount();
 }
 
 long CProfiler::GetVersion() 
 {
-    if (_sharedMemory != NULL) 
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory != NULL) 
     {
-        return _sharedMemory->GetVersion();
+        return sharedMemory->GetVersion();
     }
     return 0;
 }
 
+void CProfiler::Quiesce()
+{
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory != NULL) 
+    {
+        sharedMemory->Quiesce();
+    }
+}
+
+void CProfiler::Pause()
+{
+    InterlockedExchange(&g_recordingPaused, 1);
+}
+
+void CProfiler::Resume()
+{
+    if (!IsPaused())
+    {
+        return;
+    }
+
+    // the calls that returned while we were paused never got their leave, so tell the
+    // threads to start their stacks over before the hooks come back on.
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory != NULL)
+    {
+        sharedMemory->Resync();
+    }
+    InterlockedIncrement(&_resumeEpoch);
+    UpdateFastPath();
+    InterlockedExchange(&g_recordingPaused, 0);
+}
+
+bool CProfiler::IsPaused()
+{
+    return g_recordingPaused != 0;
+}
+
+ProfilerMode CProfiler::GetMode()
+{
+    return _mode;
+}
+
+void CProfiler::SetMode(ProfilerMode mode)
+{
+    _mode = mode;
+    UpdateFastPath();
+}
+
+void CProfiler::SetSampleRate(DWORD samplesPerSecond)
+{
+    _sampler.SetRate(samplesPerSecond);
+}
+
+void CProfiler::SetThrottle(DWORD callsPerSecond)
+{
+    _throttle.SetLimit(callsPerSecond);
+    UpdateFastPath();
+}
+
+CSharedMemory* CProfiler::GetSharedMemory()
+{
+    return _sharedMemory;
+}
+
+HRESULT CProfiler::WalkStack(ThreadID threadId, StackSnapshotCallback* callback, void* clientData)
+{
+    return m_pICorProfilerInfo2->DoStackSnapshot(threadId, callback, COR_PRF_SNAPSHOT_DEFAULT, clientData, NULL, 0);
+}
+
+LONG64 CProfiler::PublishStats()
+{
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory == NULL)
+    {
+        return 0;
+    }
+    long count = _functions.GetCount();
+    _flatProfile.Merge(_totals, count);
+    return sharedMemory->PublishStats(count > 0 ? &_totals[0] : NULL, count, CClock::Now());
+}
+
 HRESULT CProfiler::DeleteAll()
 {
-    g_functionCount = 0;
-    if (_sharedMemory != NULL) 
+    // the function indices stay valid, the client keeps its names.
+    _flatProfile.Clear(_functions.GetCount());
+    _sampler.Clear();
+    _throttle.Clear();
+    CSharedMemory* sharedMemory = _sharedMemory;
+    if (sharedMemory != NULL) 
     {
-        _sharedMemory->Reset();
+        sharedMemory->Reset();
     }
+    UpdateFastPath();
     return S_OK;
 }
 
@@ -1030,8 +1623,16 @@ HRESULT CProfiler::PipeRequestHandler()
     HRESULT hr = S_OK;
     while (!m_terminated)
     {
-        _pipeServer.Run();
-		Sleep(1); // so we don't spin our wheels too much here...
+        // The pipe server sleeps until clients connect, it only returns on shutdown or if the pipes can't be created.
+        // Staged records are published by the doorbell, recorder and streamer threads and on a client's request.
+        if (_pipeServer.Run() < 0)
+        {
+            // the pipes couldn't be created, try again in a while rather than spin.
+            if (_pipeServer.WaitForShutdown(1000))
+            {
+                break;
+            }
+        }
     }
     return hr;
 }
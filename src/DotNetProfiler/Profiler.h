@@ -21,6 +21,17 @@
 #include "PipeServer.h"
 #include <unordered_map>
 #include "SharedMemory.h"
+#include "FunctionTable.h"
+#include "FlatProfile.h"
+#include "FastPath.h"
+#include "Sampler.h"
+#include "FunctionFilter.h"
+#include "Throttle.h"
+#include "Streamer.h"
+#include "Doorbell.h"
+#include "Recorder.h"
+#include "MetadataCache.h"
+#include "ModuleTable.h"
 
 #if defined(_WIN32_WCE) && !defined(_CE_DCOM) && !defined(_CE_ALLOW_SINGLE_THREADED_OBJECTS_IN_MTA)
 #error "Single-threaded COM objects are not properly supported on Windows CE platform, such as the Windows Mobile platforms that do not include full DCOM support. Define _CE_ALLOW_SINGLE_THREADED_OBJECTS_IN_MTA to force ATL to support creating single-thread COM object's and allow use of it's single-threaded COM object implementations. The threading model in your rgs file was set to 'Free' as that is the only threading model supported in non DCOM Windows CE platforms."
@@ -29,6 +40,20 @@
 #define ASSERT_HR(x) _ASSERT(SUCCEEDED(x))
 #define NAME_BUFFER_SIZE 1024
 
+// functions fetched from EnumJITedFunctions at a time.
+const ULONG SnapshotBatchSize = 256;
+
+// checked by the enter/leave stubs before they do anything else, see CProfiler::Pause.
+EXTERN_C volatile LONG g_recordingPaused;
+
+// what the profiler does on each call
+enum ProfilerMode
+{
+	ProfileTrace, // write a record for every enter and leave to the shared memory
+	ProfileFlat,  // just count calls and time per function, see CFlatProfile
+	ProfileSample // the hooks do nothing, CSampler walks the thread stacks instead
+};
+
 // CProfiler
 class ATL_NO_VTABLE CProfiler :
 	public CComObjectRootEx<CComSingleThreadModel>,
@@ -158,13 +183,23 @@ public:
     STDMETHOD(ProfilerDetachSucceeded)();
 	
 	// callback functions
-	void Enter(FunctionID functionID); //, UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_INFO *argumentInfo);
-	void Leave(FunctionID functionID); // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_RANGE *argumentRange);
-	void Tailcall(FunctionID functionID); // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo);
+	void Enter(UINT32 index); //, UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_INFO *argumentInfo);
+	void Leave(UINT32 index); // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo, COR_PRF_FUNCTION_ARGUMENT_RANGE *argumentRange);
+	void Tailcall(UINT32 index); // , UINT_PTR clientData, COR_PRF_FRAME_INFO frameInfo);
 
 	// mapping functions
 	static UINT_PTR _stdcall FunctionMapper(FunctionID functionId, BOOL *pbHookFunction);
-	void MapFunction(FunctionID);
+	UINT32 MapFunction(FunctionID);
+	// returns the index of a function that was already mapped, or 0.
+	UINT32 FindFunction(FunctionID functionId);
+
+	// map every function the CLR has already compiled, so their names are in the shared memory before the
+	// client sees them on a stack.  Returns the number of functions that weren't mapped yet.
+	long SnapshotFunctions();
+
+	// only functions mapped after this is called are affected, see CFunctionFilter for the spec.
+	void SetFilter(const WCHAR* spec);
+	bool IsIncluded(FunctionID functionId);
 
 	// logging function
     void LogString(char* pszFmtString, ... );
@@ -173,13 +208,53 @@ public:
     HRESULT ClientDetached();
 
     HRESULT InitSharedMemory(TCHAR* name, int size);
-    HRESULT GetFunctionName(FunctionID functionID, WCHAR* buffer, int bufferSize);
+    // record to a private buffer of this size and send it down the data pipe, see CStreamer.
+    HRESULT InitStream(long size);
+    // another client wants to read the shared memory, returns its reader slot and the buffer's name, or -1.
+    long JoinReader(DWORD processId, std::wstring& name);
+    void LeaveReader(long slot);
+    // copy the shared memory to a trace file as it fills, see CRecorder.  A null or empty path stops the recording.
+    HRESULT StartRecording(const WCHAR* path);
+    void StopRecording();
+    HRESULT GetFunctionName(UINT32 index, WCHAR* buffer, int bufferSize);
     long GetCallCount();
     long GetFunctionCount();
     long GetVersion();
     HRESULT DeleteAll();
 
-	void OnTick();
+	// what the Enter/Leave hooks do with each call.
+	ProfilerMode GetMode();
+	void SetMode(ProfilerMode mode);
+
+	// merge the flat profile counters and publish them, returns the snapshot number.
+	LONG64 PublishStats();
+
+	// ask the profiled threads to publish the records they have staged.
+	void Quiesce();
+
+	// stop recording without detaching, the hooks stay installed but return immediately.
+	void Pause();
+	// start recording again, each thread's records start with a ResyncRecord.
+	void Resume();
+	bool IsPaused();
+
+	// returns the managed ThreadID of the calling thread, or 0 if the CLR doesn't know it.
+	ThreadID GetCurrentThreadID();
+
+	// samples per second when in sample mode.
+	void SetSampleRate(DWORD samplesPerSecond);
+
+	// functions called more often than this are only counted in trace mode, 0 turns it off.
+	void SetThrottle(DWORD callsPerSecond);
+
+	// exception unwinding, the CLR doesn't call the Leave hook for the frames it unwinds.
+	void UnwindFunctionEnter(FunctionID functionId);
+	void UnwindFunctionLeave();
+	void FlushUnwind();
+
+	// used by the sampler.
+	CSharedMemory* GetSharedMemory();
+	HRESULT WalkStack(ThreadID threadId, StackSnapshotCallback* callback, void* clientData);
 
 private:
     // container for ICorProfilerInfo reference
@@ -189,14 +264,22 @@ private:
     // container for ICorProfilerInfo3 reference
 	CComQIPtr<ICorProfilerInfo3> m_pICorProfilerInfo3;
 
-	// the number of levels deep we are in the call stack
-	int m_callStackSize;
 	// handle and filename of log file
 	HANDLE m_hLogFile;
 	TCHAR m_logFileName[_MAX_PATH]; 
 
 	// gets the full method name given a function ID
 	HRESULT GetFullMethodName(FunctionID functionId, LPWSTR wszMethod, int cMethod );
+	// gets the name of the assembly the function is defined in
+	HRESULT GetAssemblyName(FunctionID functionId, LPWSTR wszAssembly, int cAssembly);
+	// writes the function's name to the shared memory, once per buffer.
+	void DefineFunction(UINT32 index);
+	// writes a ModuleRecord, a load is only written once per buffer.
+	void DefineModule(UINT32 index, UINT32 flags);
+	// the function has unloaded, its index is handed out again later.
+	void RetireFunction(UINT32 index);
+	// retires the module's functions and writes its unload record.
+	void RetireModule(ModuleID moduleId);
 	// function to set up our event mask
 	HRESULT SetEventMask();
 	// creates the log file
@@ -204,6 +287,13 @@ private:
 	// closes the log file ;)
 	void CloseLogFile();
 
+	// keep the calling thread's shadow stack in step with the hooks.
+	bool PushFrame(UINT32 index, UINT64 timestamp, bool suppress);
+	bool PopFrame(UINT64 timestamp);
+	void PopFlatFrame(UINT64 timestamp);
+	bool SyncShadow(CShadowStack& shadow);
+	void UpdateFastPath();
+
 	// thread for handling pipeserver
 	static DWORD WINAPI HandlerThread(PVOID v);
 	
@@ -212,11 +302,23 @@ private:
     bool m_terminated;
 	PipeServer _pipeServer;
 	CSharedMemory* _sharedMemory;
+	std::vector<CSharedMemory*> _retiredBuffers; // the hooks may still be writing to them
+	CFunctionTable _functions;
+	volatile ProfilerMode _mode;
+	CFlatProfile _flatProfile;
+	std::vector<FunctionStats> _totals;
+	CSampler _sampler;
+	CFunctionFilter _filter;
+	CThrottle _throttle;
+	CStreamer _streamer;
+	CDoorbell _doorbell;
+	CRecorder _recorder;
+	CMetadataCache _metadata;
+	CModuleTable _modules;
+	volatile long _resumeEpoch;  // bumped by Resume, the shadow stacks start over
 
     void CloseSharedMemory();
-
-	PTP_TIMER _timer;
-	DWORD _currentTime;
+    void FreeRetiredBuffers();
 };
 
 OBJECT_ENTRY_AUTO(__uuidof(ClrProfiler), CProfiler)
@@ -42,6 +42,14 @@ STDMETHODIMP CProfiler::AssemblyLoadStarted(AssemblyID assemblyID)
 
 STDMETHODIMP CProfiler::AssemblyLoadFinished(AssemblyID assemblyID, HRESULT hrStatus)
 {
+	// the assembly's name may not have been available when its manifest module was attached.
+	ULONG cchAssembly = 0;
+	AppDomainID appDomainId = 0;
+	ModuleID manifestModuleId = 0;
+	if (SUCCEEDED(hrStatus) && SUCCEEDED(m_pICorProfilerInfo->GetAssemblyInfo(assemblyID, 0, &cchAssembly, NULL, &appDomainId, &manifestModuleId)) && manifestModuleId != 0)
+	{
+		DefineModule(_modules.AttachToAssembly(manifestModuleId, assemblyID), ModuleLoaded);
+	}
     return S_OK;
 }
 
@@ -62,21 +70,30 @@ STDMETHODIMP CProfiler::ModuleLoadStarted(ModuleID moduleID)
 
 STDMETHODIMP CProfiler::ModuleLoadFinished(ModuleID moduleID, HRESULT hrStatus)
 {
+	// its record is written once it is attached to its assembly and we know the assembly's name.
+	if (SUCCEEDED(hrStatus))
+	{
+		_modules.Add(moduleID);
+	}
     return S_OK;
 }
 
 STDMETHODIMP CProfiler::ModuleUnloadStarted(ModuleID moduleID)
 {
+	RetireModule(moduleID);
     return S_OK;
 }
 	  
 STDMETHODIMP CProfiler::ModuleUnloadFinished(ModuleID moduleID, HRESULT hrStatus)
 {
+	// the CLR can give the ModuleID to the next module it loads.
+	_metadata.ModuleUnloaded(moduleID);
 	return S_OK;
 }
 
 STDMETHODIMP CProfiler::ModuleAttachedToAssembly(ModuleID moduleID, AssemblyID assemblyID)
 {
+	DefineModule(_modules.AttachToAssembly(moduleID, assemblyID), ModuleLoaded);
     return S_OK;
 }
 
@@ -97,11 +114,13 @@ STDMETHODIMP CProfiler::ClassUnloadStarted(ClassID classID)
 
 STDMETHODIMP CProfiler::ClassUnloadFinished(ClassID classID, HRESULT hrStatus)
 {
+	_metadata.ClassUnloaded(classID);
     return S_OK;
 }
 
 STDMETHODIMP CProfiler::FunctionUnloadStarted(FunctionID functionID)
 {
+	RetireFunction(_functions.Find(functionID));
     return S_OK;
 }
 
@@ -127,6 +146,8 @@ STDMETHODIMP CProfiler::JITCachedFunctionSearchFinished(FunctionID functionID, C
 
 STDMETHODIMP CProfiler::JITFunctionPitched(FunctionID functionID)
 {
+	// only the code is thrown away, the FunctionID stays valid and the CLR keeps passing our index
+	// to the hooks when it is compiled again, so the index isn't retired.
     return S_OK;
 }
 
@@ -147,16 +168,47 @@ STDMETHODIMP CProfiler::ManagedToUnmanagedTransition(FunctionID functionID, COR_
 
 STDMETHODIMP CProfiler::ThreadCreated(ThreadID threadID)
 {
+	// this is usually raised on the new thread itself, in which case we can tag its records now.
+	if (GetCurrentThreadID() == threadID)
+	{
+		CSharedMemory::SetCurrentThreadId(threadID);
+		_sampler.ThreadAssignedToOSThread(threadID, GetCurrentThreadId());
+	}
+	else
+	{
+		_sampler.ThreadCreated(threadID);
+	}
     return S_OK;
 }
 
 STDMETHODIMP CProfiler::ThreadDestroyed(ThreadID threadID)
 {
+	// seal the chunk this thread was writing so readers don't wait for more records from it.
+	if (GetCurrentThreadID() == threadID)
+	{
+		// an unhandled exception may have unwound the whole stack.
+		FlushUnwind();
+		CSharedMemory* sharedMemory = _sharedMemory;
+		if (sharedMemory != NULL)
+		{
+			sharedMemory->ReleaseThread();
+		}
+		CFastPath::Disarm();
+		CSharedMemory::DetachThread();
+		_flatProfile.ReleaseThread();
+		_throttle.ReleaseThread();
+	}
+	_sampler.ThreadDestroyed(threadID);
     return S_OK;
 }
 
 STDMETHODIMP CProfiler::ThreadAssignedToOSThread(ThreadID managedThreadID, DWORD osThreadID) 
 {
+	if (osThreadID == GetCurrentThreadId())
+	{
+		CSharedMemory::SetCurrentThreadId(managedThreadID);
+	}
+	_sampler.ThreadAssignedToOSThread(managedThreadID, osThreadID);
     return S_OK;
 }
 
@@ -267,11 +319,13 @@ STDMETHODIMP CProfiler::ExceptionThrown(ObjectID thrownObjectID)
 
 STDMETHODIMP CProfiler::ExceptionUnwindFunctionEnter(FunctionID functionID)
 {
+	UnwindFunctionEnter(functionID);
     return S_OK;
 }
 
 STDMETHODIMP CProfiler::ExceptionUnwindFunctionLeave()
 {
+	UnwindFunctionLeave();
     return S_OK;
 }
 
@@ -307,6 +361,7 @@ STDMETHODIMP CProfiler::ExceptionCLRCatcherFound()
 
 STDMETHODIMP CProfiler::ExceptionCLRCatcherExecute()
 {
+	FlushUnwind();
     return S_OK;
 }
 
@@ -322,6 +377,8 @@ STDMETHODIMP CProfiler::ExceptionOSHandlerLeave(FunctionID functionID)
 
 STDMETHODIMP CProfiler::ExceptionUnwindFinallyEnter(FunctionID functionID)
 {
+	// the finally block may make calls, so the frames unwound so far have to go first.
+	FlushUnwind();
     return S_OK;
 }
 
@@ -333,6 +390,7 @@ STDMETHODIMP CProfiler::ExceptionUnwindFinallyLeave()
 STDMETHODIMP CProfiler::ExceptionCatcherEnter(FunctionID functionID,
     											 ObjectID objectID)
 {
+	FlushUnwind();
     return S_OK;
 }
 
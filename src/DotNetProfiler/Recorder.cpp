@@ -0,0 +1,412 @@
+#include "StdAfx.h"
+#include "Recorder.h"
+
+CRecorder::CRecorder()
+{
+	_sharedMemory = NULL;
+	_thread = NULL;
+	_stopEvent = NULL;
+	_file = NULL;
+	_failed = false;
+	_current = 0;
+	_fileOffset = 0;
+	_position = 0;
+	_startSequence = 0;
+	_namesRecorded = 0;
+	ZeroMemory(&_header, sizeof(_header));
+	ZeroMemory(_writes, sizeof(_writes));
+}
+
+CRecorder::~CRecorder()
+{
+	Stop();
+}
+
+HRESULT CRecorder::Start(CSharedMemory* sharedMemory, const WCHAR* path)
+{
+	Stop();
+
+	SharedMemoryHeader* header = sharedMemory->GetHeader();
+	if (header == NULL || sharedMemory->GetName().empty())
+	{
+		return E_INVALIDARG;
+	}
+
+	_file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (_file == INVALID_HANDLE_VALUE)
+	{
+		_file = NULL;
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	for (int i = 0; i < TraceWriteBuffers; i++)
+	{
+		TraceWrite& write = _writes[i];
+		ZeroMemory(&write, sizeof(write));
+		write.buffer = (BYTE*)VirtualAlloc(NULL, TraceWriteSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		write.overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (write.buffer == NULL || write.overlapped.hEvent == NULL)
+		{
+			Close();
+			return E_OUTOFMEMORY;
+		}
+	}
+
+	_sharedMemory = sharedMemory;
+	long chunkCount = sharedMemory->GetChunkCount();
+	_chunkSequence.assign(chunkCount, InvalidSequence);
+	_chunkRecorded.assign(chunkCount, InvalidSequence);
+	_chunk.resize(ChunkSize);
+	_index.clear();
+	_namesRecorded = 0;
+	_failed = false;
+	_current = 0;
+	_fileOffset = 0;
+	_position = 0;
+
+	// whatever is still in the ring is recorded too.
+	_startSequence = max(header->resetSequence, header->nextSequence - chunkCount);
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+
+	ZeroMemory(&_header, sizeof(_header));
+	_header.magic = TraceFileMagic;
+	_header.format = TraceFileFormat;
+	_header.recordFormat = SharedMemoryFormat;
+	_header.chunkSize = ChunkSize;
+	_header.architecture = info.wProcessorArchitecture;
+	_header.pointerSize = sizeof(void*);
+	_header.processId = GetCurrentProcessId();
+	_header.startTime = ((UINT64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+	_header.clock = header->clock;
+	Append(&_header, sizeof(_header));
+
+	_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	_thread = CreateThread(NULL, 0, &RecorderThread, (PVOID)this, 0, NULL);
+	return S_OK;
+}
+
+void CRecorder::Stop()
+{
+	if (_thread != NULL)
+	{
+		// the thread finishes the file before it returns.
+		SetEvent(_stopEvent);
+		WaitForSingleObject(_thread, INFINITE);
+		CloseHandle(_thread);
+		CloseHandle(_stopEvent);
+		_thread = NULL;
+		_stopEvent = NULL;
+	}
+	_sharedMemory = NULL;
+}
+
+DWORD WINAPI CRecorder::RecorderThread(PVOID v)
+{
+	CRecorder* recorder = (CRecorder*)v;
+	recorder->Run();
+	return 0;
+}
+
+void CRecorder::Run()
+{
+	while (WaitForSingleObject(_stopEvent, RecordInterval) == WAIT_TIMEOUT)
+	{
+		Drain(false);
+	}
+
+	// the threads won't seal the chunks they are writing to, so publish and take what they have so far.
+	_sharedMemory->Quiesce();
+	Drain(true);
+	Finish();
+	Close();
+}
+
+// record the chunks sealed since the last pass, or all of them if this is the final pass.
+void CRecorder::Drain(bool final)
+{
+	SharedMemoryHeader* header = _sharedMemory->GetHeader();
+	if (header == NULL || _failed)
+	{
+		return;
+	}
+
+	// names first, a reader should know a function before it sees it called.
+	RecordNames();
+
+	LONG64 resetSequence = header->resetSequence;
+	LONG64 oldest = max(_startSequence, resetSequence);
+	std::vector<std::pair<LONG64, long>> pending;
+	for (long i = 0; i < (long)_chunkSequence.size(); i++)
+	{
+		ChunkHeader* chunk = _sharedMemory->GetChunkAt(i);
+		LONG state = ReadAcquire(&chunk->state);
+		LONG64 sequence = ReadAcquire64(&chunk->sequence);
+		if (state == ChunkFree)
+		{
+			continue;
+		}
+		if (sequence != _chunkSequence[i])
+		{
+			// a chunk we saw but hadn't recorded yet has been overwritten, the writers don't wait for us.
+			LONG64 previous = _chunkSequence[i];
+			if (previous != InvalidSequence && previous != _chunkRecorded[i] && previous >= oldest)
+			{
+				_header.chunksLost++;
+			}
+			_chunkSequence[i] = sequence;
+		}
+		if (sequence == InvalidSequence || sequence < oldest || sequence == _chunkRecorded[i])
+		{
+			continue;
+		}
+		if (state == ChunkSealed || final)
+		{
+			pending.push_back(std::make_pair(sequence, i));
+		}
+	}
+	if (pending.empty())
+	{
+		return;
+	}
+
+	// in the order they were claimed so each thread's records stay in order.
+	std::sort(pending.begin(), pending.end());
+
+	TraceIndexEntry entry;
+	ZeroMemory(&entry, sizeof(entry));
+	entry.offset = _position;
+	entry.firstSequence = pending.front().first;
+	entry.firstTimestamp = MAXUINT64;
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		ChunkHeader* copy = (ChunkHeader*)&_chunk[0];
+		if (RecordChunk(pending[i].second, pending[i].first))
+		{
+			entry.chunks++;
+			entry.lastSequence = pending[i].first;
+			entry.firstTimestamp = min(entry.firstTimestamp, copy->baseTimestamp);
+		}
+	}
+	entry.bytes = _position - entry.offset;
+	if (entry.chunks > 0)
+	{
+		_index.push_back(entry);
+	}
+}
+
+void CRecorder::RecordNames()
+{
+	NamesHeader* names = _sharedMemory->GetNames();
+	if (names == NULL)
+	{
+		return;
+	}
+
+	// the entries are published in order, stop at the first one that isn't finished.
+	LONG used = min((DWORD)names->used, names->capacity);
+	BYTE* start = (BYTE*)(names + 1);
+	LONG pos = _namesRecorded;
+	while (pos + (LONG)sizeof(NameEntry) <= used)
+	{
+		NameEntry* entry = (NameEntry*)(start + pos);
+		if (ReadAcquire((volatile LONG*)&entry->index) == 0)
+		{
+			break;
+		}
+		LONG size = (LONG)((sizeof(NameEntry) + entry->bytes + RecordSize - 1) & ~(RecordSize - 1));
+		if (pos + size > used)
+		{
+			break;
+		}
+		pos += size;
+	}
+	if (pos == _namesRecorded)
+	{
+		return;
+	}
+
+	TraceBlockHeader block;
+	ZeroMemory(&block, sizeof(block));
+	block.kind = TraceNamesBlock;
+	block.bytes = pos - _namesRecorded;
+	block.offset = sizeof(NamesHeader) + _namesRecorded;
+	Append(&block, sizeof(block));
+	Append(start + _namesRecorded, block.bytes);
+	_namesRecorded = pos;
+}
+
+// Copy the chunk aside first, a writer may claim it while we copy and then the copy is thrown away.
+// Returns false if that happened.
+bool CRecorder::RecordChunk(long index, LONG64 sequence)
+{
+	ChunkHeader* chunk = _sharedMemory->GetChunkAt(index);
+	LONG used = min(ReadAcquire(&chunk->used), (LONG)(ChunkSize - sizeof(ChunkHeader)));
+	DWORD bytes = sizeof(ChunkHeader) + (used & ~(RecordSize - 1));
+	memcpy(&_chunk[0], (const void*)chunk, bytes);
+
+	// a writer invalidates the sequence before it touches anything else in the chunk.
+	MemoryBarrier();
+	_chunkRecorded[index] = sequence;
+	if (ReadAcquire64(&chunk->sequence) != sequence)
+	{
+		_header.chunksLost++;
+		return false;
+	}
+
+	ChunkHeader* copy = (ChunkHeader*)&_chunk[0];
+	copy->sequence = sequence;
+	copy->state = ChunkSealed;
+	copy->used = bytes - sizeof(ChunkHeader);
+
+	TraceBlockHeader block;
+	ZeroMemory(&block, sizeof(block));
+	block.kind = TraceChunkBlock;
+	block.bytes = bytes;
+	block.sequence = sequence;
+	Append(&block, sizeof(block));
+	Append(copy, bytes);
+	_header.chunksRecorded++;
+	return true;
+}
+
+void CRecorder::Append(const void* bytes, DWORD count)
+{
+	const BYTE* data = (const BYTE*)bytes;
+	while (count > 0 && !_failed)
+	{
+		TraceWrite& write = _writes[_current];
+		DWORD size = min(count, TraceWriteSize - write.used);
+		memcpy(write.buffer + write.used, data, size);
+		write.used += size;
+		data += size;
+		count -= size;
+		_position += size;
+		if (write.used == TraceWriteSize)
+		{
+			Submit();
+		}
+	}
+}
+
+// start writing the buffer being filled and move on to the next one.
+void CRecorder::Submit()
+{
+	TraceWrite& write = _writes[_current];
+	if (write.used > 0 && !_failed)
+	{
+		write.overlapped.Offset = (DWORD)_fileOffset;
+		write.overlapped.OffsetHigh = (DWORD)(_fileOffset >> 32);
+		if (WriteFile(_file, write.buffer, write.used, NULL, &write.overlapped) || GetLastError() == ERROR_IO_PENDING)
+		{
+			write.pending = true;
+		}
+		else
+		{
+			_failed = true;
+		}
+		_fileOffset += write.used;
+	}
+
+	// this only waits when the disk can't keep up, the writers carry on regardless.
+	_current = (_current + 1) % TraceWriteBuffers;
+	WaitForWrite(_writes[_current]);
+	_writes[_current].used = 0;
+}
+
+void CRecorder::WaitForWrite(TraceWrite& write)
+{
+	if (write.pending)
+	{
+		DWORD written = 0;
+		if (!GetOverlappedResult(_file, &write.overlapped, &written, TRUE) || written != write.used)
+		{
+			_failed = true;
+		}
+		write.pending = false;
+	}
+}
+
+void CRecorder::WriteAt(UINT64 offset, const void* bytes, DWORD count)
+{
+	TraceWrite& write = _writes[_current];
+	WaitForWrite(write);
+
+	OVERLAPPED overlapped;
+	ZeroMemory(&overlapped, sizeof(overlapped));
+	overlapped.Offset = (DWORD)offset;
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	overlapped.hEvent = write.overlapped.hEvent;
+	DWORD written = 0;
+	if ((!WriteFile(_file, bytes, count, NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING) ||
+		!GetOverlappedResult(_file, &overlapped, &written, TRUE) || written != count)
+	{
+		_failed = true;
+	}
+}
+
+// write the index and footer, then the header again now that it knows where the index is.
+void CRecorder::Finish()
+{
+	if (_failed)
+	{
+		return;
+	}
+
+	UINT64 indexOffset = _position;
+	if (!_index.empty())
+	{
+		Append(&_index[0], (DWORD)(_index.size() * sizeof(TraceIndexEntry)));
+	}
+	TraceFileFooter footer;
+	footer.magic = TraceFileMagic;
+	footer.indexCount = (DWORD)_index.size();
+	footer.indexOffset = indexOffset;
+	Append(&footer, sizeof(footer));
+	Submit();
+	for (int i = 0; i < TraceWriteBuffers; i++)
+	{
+		WaitForWrite(_writes[i]);
+	}
+	if (_failed)
+	{
+		return;
+	}
+
+	SharedMemoryHeader* header = _sharedMemory->GetHeader();
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	_header.endTime = ((UINT64)now.dwHighDateTime << 32) | now.dwLowDateTime;
+	_header.clock = header->clock;
+	_header.droppedRecords = header->droppedRecords;
+	_header.indexOffset = indexOffset;
+	_header.indexCount = footer.indexCount;
+	WriteAt(0, &_header, sizeof(_header));
+}
+
+void CRecorder::Close()
+{
+	for (int i = 0; i < TraceWriteBuffers; i++)
+	{
+		TraceWrite& write = _writes[i];
+		WaitForWrite(write);
+		if (write.overlapped.hEvent != NULL)
+		{
+			CloseHandle(write.overlapped.hEvent);
+		}
+		if (write.buffer != NULL)
+		{
+			VirtualFree(write.buffer, 0, MEM_RELEASE);
+		}
+		ZeroMemory(&write, sizeof(write));
+	}
+	if (_file != NULL)
+	{
+		CloseHandle(_file);
+		_file = NULL;
+	}
+	_chunk.clear();
+	_index.clear();
+}
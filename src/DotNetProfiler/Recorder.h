@@ -0,0 +1,129 @@
+#pragma once
+
+#include "SharedMemory.h"
+
+const DWORD RecordInterval = 10; // milliseconds between passes over the ring
+
+// The file is written through TraceWriteBuffers buffers of TraceWriteSize bytes, each is handed to
+// an overlapped WriteFile as soon as it fills and the next one is filled while it is written.
+const DWORD TraceWriteSize = 8 * 1024 * 1024;
+const int TraceWriteBuffers = 4;
+
+// A trace file is a TraceFileHeader followed by blocks, then the index and a TraceFileFooter.  The
+// header is written again when the recording stops, if indexOffset is still 0 the recording didn't
+// finish and a reader has to walk the blocks instead.
+const DWORD TraceFileMagic = 0x46545453; // "STTF"
+const DWORD TraceFileFormat = 1;
+
+struct TraceFileHeader
+{
+	DWORD magic;
+	DWORD format;
+	DWORD recordFormat;      // SharedMemoryFormat of the records
+	DWORD chunkSize;
+	WORD architecture;       // PROCESSOR_ARCHITECTURE_* of the profiled process
+	WORD pointerSize;
+	DWORD processId;
+	UINT64 startTime;        // FILETIME (UTC) when the recording started
+	UINT64 endTime;          // and stopped
+	ClockCalibration clock;  // for turning record timestamps into time, as of the end of the recording
+	UINT64 indexOffset;      // of the first TraceIndexEntry, 0 if the recording didn't finish
+	DWORD indexCount;
+	DWORD reserved;
+	UINT64 chunksRecorded;
+	UINT64 chunksLost;       // overwritten by the writers before they could be recorded
+	UINT64 droppedRecords;   // thrown away by the writers, see SharedMemoryHeader
+	BYTE reserved2[64];
+};
+
+const DWORD TraceChunkBlock = 0; // a ChunkHeader (used is final) and its records, as they were in the ring
+const DWORD TraceNamesBlock = 1; // NameEntry structs copied from the names region, see DefineRecord
+
+struct TraceBlockHeader
+{
+	DWORD kind;
+	DWORD bytes;      // of data following this header, a multiple of 8
+	DWORD offset;     // for TraceNamesBlock, where the entries were in the names region
+	DWORD reserved;
+	LONG64 sequence;  // for TraceChunkBlock, the chunk's claim sequence
+};
+
+// One entry per pass of the recorder that found chunks to record, so a reader can find a stretch of
+// the recording without walking the whole file.
+struct TraceIndexEntry
+{
+	UINT64 offset;          // of the pass's first block
+	UINT64 bytes;           // of all its blocks
+	LONG64 firstSequence;   // of the chunks it recorded
+	LONG64 lastSequence;
+	UINT64 firstTimestamp;  // the earliest chunk baseTimestamp in the pass
+	DWORD chunks;
+	DWORD reserved;
+};
+
+struct TraceFileFooter
+{
+	DWORD magic;
+	DWORD indexCount;
+	UINT64 indexOffset;
+};
+
+// Copies the shared buffer's chunks to a trace file as they are sealed, so a capture can outlive the
+// mapping and be longer than the ring.  The recorder reads the ring like any other reader and never
+// holds up the writers: every RecordInterval it copies each chunk sealed since its last pass, oldest
+// first, and if the ring laps it before a chunk is copied the chunk is counted in chunksLost.  Chunks
+// are copied whole (they are already compact) and the names are copied as they are interned, so
+// the file can be decoded exactly like the shared memory.  Only a mapped buffer can be recorded, the
+// chunks of a private one belong to the CStreamer.
+class CRecorder
+{
+public:
+	CRecorder();
+	~CRecorder();
+
+	HRESULT Start(CSharedMemory* sharedMemory, const WCHAR* path);
+
+	// records what is left, including the chunks that are still open, and finishes the file.
+	void Stop();
+
+	bool IsRecording() { return _thread != NULL; }
+
+private:
+	static DWORD WINAPI RecorderThread(PVOID v);
+
+	struct TraceWrite
+	{
+		BYTE* buffer;
+		DWORD used;
+		bool pending;
+		OVERLAPPED overlapped;
+	};
+
+	void Run();
+	void Drain(bool final);
+	void RecordNames();
+	bool RecordChunk(long index, LONG64 sequence);
+	void Append(const void* bytes, DWORD count);
+	void Submit();
+	void WaitForWrite(TraceWrite& write);
+	void WriteAt(UINT64 offset, const void* bytes, DWORD count);
+	void Finish();
+	void Close();
+
+	CSharedMemory* _sharedMemory;
+	HANDLE _thread;
+	HANDLE _stopEvent;
+	HANDLE _file;
+	bool _failed;                        // a write failed, the rest of the recording is thrown away
+	TraceFileHeader _header;
+	TraceWrite _writes[TraceWriteBuffers];
+	int _current;                        // the buffer being filled
+	UINT64 _fileOffset;                  // where the buffer being filled goes
+	UINT64 _position;                    // bytes appended so far
+	LONG64 _startSequence;               // chunks claimed before this were there before we started
+	std::vector<LONG64> _chunkSequence;  // what was in each chunk when we last looked
+	std::vector<LONG64> _chunkRecorded;  // the last sequence recorded from each chunk
+	std::vector<BYTE> _chunk;            // a copy of the chunk being recorded
+	std::vector<TraceIndexEntry> _index;
+	LONG _namesRecorded;
+};
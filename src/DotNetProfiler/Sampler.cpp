@@ -0,0 +1,243 @@
+#include "StdAfx.h"
+#include "Profiler.h"
+#include "Sampler.h"
+
+CSampler::CSampler(CProfiler& profiler) :
+	_profiler(profiler)
+{
+	_thread = NULL;
+	_stopEvent = NULL;
+	_interval = 1000 / DefaultSampleRate;
+	_clear = false;
+	_sampling = 0;
+	_initialized = false;
+	_lastSharedMemory = NULL;
+	InitializeCriticalSection(&_lock);
+}
+
+CSampler::~CSampler()
+{
+	Stop();
+	DeleteCriticalSection(&_lock);
+}
+
+void CSampler::Start()
+{
+	if (_thread == NULL)
+	{
+		// a new buffer can be allocated where the last one was, it still needs the stacks.
+		_lastSharedMemory = NULL;
+		_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		_thread = CreateThread(NULL, 0, &SamplerThread, (PVOID)this, 0, NULL);
+	}
+}
+
+void CSampler::Stop()
+{
+	if (_thread != NULL)
+	{
+		SetEvent(_stopEvent);
+		WaitForSingleObject(_thread, INFINITE);
+		CloseHandle(_thread);
+		CloseHandle(_stopEvent);
+		_thread = NULL;
+		_stopEvent = NULL;
+	}
+}
+
+void CSampler::SetRate(DWORD samplesPerSecond)
+{
+	DWORD interval = (samplesPerSecond > 0) ? 1000 / samplesPerSecond : 1000;
+	_interval = (interval > 0) ? interval : 1;
+}
+
+void CSampler::Clear()
+{
+	_clear = true;
+}
+
+void CSampler::ThreadCreated(ThreadID threadId)
+{
+	EnterCriticalSection(&_lock);
+	// don't lose the OS thread if we were told about it first.
+	_threads.insert(std::make_pair(threadId, (DWORD)0));
+	LeaveCriticalSection(&_lock);
+}
+
+void CSampler::ThreadAssignedToOSThread(ThreadID threadId, DWORD osThreadId)
+{
+	EnterCriticalSection(&_lock);
+	_threads[threadId] = osThreadId;
+	LeaveCriticalSection(&_lock);
+}
+
+void CSampler::ThreadDestroyed(ThreadID threadId)
+{
+	EnterCriticalSection(&_lock);
+	_threads.erase(threadId);
+	LeaveCriticalSection(&_lock);
+
+	// the ThreadID is about to become invalid, so wait if the sampler is walking it.
+	while (_sampling == threadId)
+	{
+		Sleep(0);
+	}
+}
+
+DWORD WINAPI CSampler::SamplerThread(PVOID v)
+{
+	CSampler* sampler = (CSampler*)v;
+	sampler->Run();
+	return 0;
+}
+
+void CSampler::Run()
+{
+	while (WaitForSingleObject(_stopEvent, _interval) == WAIT_TIMEOUT)
+	{
+		if (_profiler.GetMode() != ProfileSample || _profiler.IsPaused())
+		{
+			continue;
+		}
+
+		CSharedMemory* sharedMemory = _profiler.GetSharedMemory();
+		if (sharedMemory == NULL)
+		{
+			continue;
+		}
+		if (_clear || sharedMemory != _lastSharedMemory)
+		{
+			_clear = false;
+			_lastSharedMemory = sharedMemory;
+			_stacks.Clear();
+			_excluded.clear();
+		}
+		if (!_initialized)
+		{
+			// The first DoStackSnapshot on a thread does some per-thread setup in the CLR which can deadlock
+			// if the target is suspended holding a lock it needs.  Do it with a synchronous walk of our own
+			// stack, which is supported, so every walk of another thread can suspend it.
+			_walk.count = 0;
+			_profiler.WalkStack(0, &StackCallback, &_walk);
+			_initialized = true;
+		}
+		SampleThreads(sharedMemory);
+		sharedMemory->FlushThread();
+	}
+}
+
+void CSampler::SampleThreads(CSharedMemory* sharedMemory)
+{
+	// take a copy, threads come and go while we walk them.
+	EnterCriticalSection(&_lock);
+	_targets.assign(_threads.begin(), _threads.end());
+	LeaveCriticalSection(&_lock);
+
+	DWORD self = GetCurrentThreadId();
+	for (size_t i = 0; i < _targets.size(); i++)
+	{
+		if (_targets[i].second != 0 && _targets[i].second != self)
+		{
+			SampleThread(sharedMemory, _targets[i].first, _targets[i].second);
+		}
+	}
+}
+
+void CSampler::SampleThread(CSharedMemory* sharedMemory, ThreadID threadId, DWORD osThreadId)
+{
+	HANDLE hThread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, osThreadId);
+	if (hThread == NULL)
+	{
+		return;
+	}
+
+	// make sure it is still alive before we start, ThreadDestroyed waits for us after this.
+	EnterCriticalSection(&_lock);
+	bool alive = _threads.find(threadId) != _threads.end();
+	if (alive)
+	{
+		_sampling = threadId;
+	}
+	LeaveCriticalSection(&_lock);
+
+	if (alive)
+	{
+		_walk.count = 0;
+		UINT64 timestamp = CClock::Now();
+		HRESULT hr = E_FAIL;
+		if (SuspendThread(hThread) != (DWORD)-1)
+		{
+			// nothing in here may take a lock or allocate, the target might be holding it.
+			hr = _profiler.WalkStack(threadId, &StackCallback, &_walk);
+			ResumeThread(hThread);
+		}
+		_sampling = 0;
+
+		if (SUCCEEDED(hr) && _walk.count > 0)
+		{
+			WriteSample(sharedMemory, threadId, timestamp);
+		}
+	}
+	CloseHandle(hThread);
+}
+
+HRESULT __stdcall CSampler::StackCallback(FunctionID funcId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo, ULONG32 contextSize, BYTE context[], void *clientData)
+{
+	StackWalk* walk = (StackWalk*)clientData;
+	if (funcId == 0)
+	{
+		// native frames
+		return S_OK;
+	}
+	if (walk->count >= MaxSampleFrames)
+	{
+		return E_ABORT;
+	}
+	walk->frames[walk->count++] = funcId;
+	return S_OK;
+}
+
+void CSampler::WriteSample(CSharedMemory* sharedMemory, ThreadID threadId, UINT64 timestamp)
+{
+	UINT32* frames = _stack + 2;
+	UINT32 count = 0;
+	for (UINT32 i = 0; i < _walk.count; i++)
+	{
+		// the filter looks up names, so remember the functions it left out rather than asking again.
+		FunctionID functionId = _walk.frames[i];
+		UINT32 index = _profiler.FindFunction(functionId);
+		if (index == 0 && _excluded.find(functionId) == _excluded.end())
+		{
+			if (_profiler.IsIncluded(functionId))
+			{
+				index = _profiler.MapFunction(functionId);
+			}
+			else
+			{
+				_excluded.insert(functionId);
+			}
+		}
+		if (index != 0)
+		{
+			frames[count++] = index;
+		}
+	}
+
+	bool isNew = false;
+	UINT32 stackId = _stacks.Intern(frames, count, isNew);
+	if (isNew)
+	{
+		_stack[0] = stackId;
+		_stack[1] = count;
+		frames[count] = 0; // padding
+		UINT32 bytes = ((2 + count) * sizeof(UINT32) + RecordSize - 1) & ~(RecordSize - 1);
+		sharedMemory->WriteExtended(StackRecord, _stack, bytes);
+	}
+
+	SamplePayload sample;
+	sample.timestamp = timestamp;
+	sample.threadId = threadId;
+	sample.stackId = stackId;
+	sample.reserved = 0;
+	sharedMemory->WriteExtended(SampleRecord, &sample, sizeof(sample));
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include "SharedMemory.h"
+#include "StackTable.h"
+
+class CProfiler;
+
+const int MaxSampleFrames = 256;
+const DWORD DefaultSampleRate = 100; // samples per second
+
+// In sample mode nothing is recorded per call, instead the sampler thread wakes up
+// periodically, suspends each managed thread in turn and walks its stack with
+// DoStackSnapshot.  Each distinct stack is written to the shared memory once as a
+// StackRecord, and each sample is a SampleRecord naming the thread and the stack.  Frames of
+// functions the filter leaves out are dropped from the stacks.
+class CSampler
+{
+public:
+	CSampler(CProfiler& profiler);
+	~CSampler();
+
+	void Start();
+	void Stop();
+
+	void SetRate(DWORD samplesPerSecond);
+
+	// the stacks written so far were thrown away (DeleteAll), so send them again.
+	void Clear();
+
+	// keep track of the managed threads.
+	void ThreadCreated(ThreadID threadId);
+	void ThreadAssignedToOSThread(ThreadID threadId, DWORD osThreadId);
+	void ThreadDestroyed(ThreadID threadId);
+
+private:
+	struct StackWalk
+	{
+		FunctionID frames[MaxSampleFrames];
+		UINT32 count;
+	};
+
+	static DWORD WINAPI SamplerThread(PVOID v);
+	static HRESULT __stdcall StackCallback(FunctionID funcId, UINT_PTR ip, COR_PRF_FRAME_INFO frameInfo, ULONG32 contextSize, BYTE context[], void *clientData);
+
+	void Run();
+	void SampleThreads(CSharedMemory* sharedMemory);
+	void SampleThread(CSharedMemory* sharedMemory, ThreadID threadId, DWORD osThreadId);
+	void WriteSample(CSharedMemory* sharedMemory, ThreadID threadId, UINT64 timestamp);
+
+	CProfiler& _profiler;
+	HANDLE _thread;
+	HANDLE _stopEvent;
+	volatile DWORD _interval;     // milliseconds between samples
+	volatile bool _clear;
+	volatile ThreadID _sampling;  // the thread being walked right now
+	bool _initialized;            // the sampler thread has walked its own stack
+
+	std::unordered_map<ThreadID, DWORD> _threads; // managed thread -> OS thread id
+	std::vector<std::pair<ThreadID, DWORD> > _targets;
+	CRITICAL_SECTION _lock;
+
+	// only used on the sampler thread.
+	CSharedMemory* _lastSharedMemory;
+	CStackTable _stacks;
+	std::unordered_set<FunctionID> _excluded; // functions the filter left out
+	StackWalk _walk;
+	UINT32 _stack[2 + MaxSampleFrames + 1]; // StackRecord payload
+};
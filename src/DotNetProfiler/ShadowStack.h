@@ -0,0 +1,148 @@
+﻿#pragma once
+
+const int MaxShadowDepth = 1024;
+
+// a hooked call on a thread's stack.
+struct ShadowFrame
+{
+	UINT32 index;
+	UINT16 suppressed;   // trace mode, the throttle said not to record this call
+	UINT16 counted;      // flat mode, the call was counted so its time is too
+	UINT64 start;
+	UINT64 children;     // flat mode, ticks spent in callees
+};
+
+// The hooked calls on each thread's stack, so that an exception unwind pops exactly the
+// frames we recorded an Enter for, and nothing for the frames we didn't hook.  The CLR tells
+// us about every managed frame an unwind passes, hooked or not, and finally blocks can run
+// (and make calls, or even throw) between its enter and leave for a frame, so each nested
+// unwind remembers whether the frame it is in is one of ours.  In flat mode the frames
+// also carry the time spent in callees, for working out exclusive time.
+//
+// There is no constructor, a zeroed one is empty so it can live in thread local storage.
+class CShadowStack
+{
+public:
+	// Recording was resumed since this thread last looked if epoch has moved on, the calls on
+	// the stack finished while it was paused so they are forgotten.  Returns false if so.
+	bool Sync(long epoch)
+	{
+		if (_epoch == epoch)
+		{
+			return true;
+		}
+		_depth = 0;
+		_pendingPops = 0;
+		_epoch = epoch;
+		return false;
+	}
+
+	bool IsCurrent(long epoch)
+	{
+		return _epoch == epoch;
+	}
+
+	// can be more than MaxShadowDepth, the deeper frames aren't kept.
+	int GetDepth()
+	{
+		return _depth;
+	}
+
+	// the function of the innermost call, only when the depth is 1 to MaxShadowDepth.
+	UINT32 GetTop()
+	{
+		return _frames[_depth - 1].index;
+	}
+
+	// the innermost call, NULL if there is none or it is too deep to be kept.
+	ShadowFrame* GetTopFrame()
+	{
+		return (_depth > 0 && _depth <= MaxShadowDepth) ? &_frames[_depth - 1] : NULL;
+	}
+
+	// the calls that are kept, outermost first.
+	ShadowFrame* GetFrames(int& count)
+	{
+		count = (_depth < MaxShadowDepth) ? _depth : MaxShadowDepth;
+		return _frames;
+	}
+
+	// Returns false if the call is suppressed and shouldn't be recorded.
+	bool Push(UINT32 index, UINT64 timestamp, bool suppress)
+	{
+		if (_depth >= MaxShadowDepth)
+		{
+			// we couldn't tell whether its leave should be recorded, so always record it.
+			_depth++;
+			return true;
+		}
+		ShadowFrame& frame = _frames[_depth++];
+		frame.index = index;
+		frame.suppressed = suppress ? 1 : 0;
+		frame.counted = 0;
+		frame.start = timestamp;
+		frame.children = 0;
+		return !suppress;
+	}
+
+	// Returns the frame that was popped, it is good until the next Push.  NULL if there
+	// wasn't one or it was too deep to be kept, its leave should be recorded either way.
+	ShadowFrame* Pop()
+	{
+		if (_depth == 0)
+		{
+			return NULL;
+		}
+		int depth = --_depth;
+		return (depth < MaxShadowDepth) ? &_frames[depth] : NULL;
+	}
+
+	// An unwind has reached a frame, index is its function's or 0 if it isn't one we hooked
+	// (or we aren't recording).  Past MaxShadowDepth a hooked function is trusted to be ours.
+	void UnwindEnter(UINT32 index)
+	{
+		bool ours = false;
+		if (index != 0 && _depth > 0)
+		{
+			ours = (_depth > MaxShadowDepth) || _frames[_depth - 1].index == index;
+		}
+		_unwinding = (_unwinding << 1) | (ours ? 1 : 0);
+	}
+
+	// The unwind has left the frame, returns true if it was ours and should be popped.  Not if
+	// recording was resumed while a finally block ran, the frame was forgotten with the rest.
+	bool UnwindLeave(long epoch)
+	{
+		bool ours = (_unwinding & 1) != 0;
+		_unwinding >>= 1;
+		return ours && _epoch == epoch && _depth > 0;
+	}
+
+	// Frames that were unwound are written as one PopRecord when the unwind stops or runs a
+	// finally block.
+	void AddPendingPop(UINT64 timestamp)
+	{
+		_pendingPops++;
+		_popTime = timestamp;
+	}
+
+	// returns the frames unwound since the last call and when the last of them was.
+	UINT32 TakePendingPops(UINT64& popTime)
+	{
+		UINT32 pops = _pendingPops;
+		popTime = _popTime;
+		_pendingPops = 0;
+		return pops;
+	}
+
+private:
+	// the x64 stubs push and pop frames themselves, see FastPath.h.
+	friend class CFastPath;
+
+	ShadowFrame _frames[MaxShadowDepth];
+	int _depth;
+	long _epoch;          // the last Resume this thread has seen
+	UINT64 _unwinding;    // one bit per nested unwind, set if the frame being unwound is ours
+	UINT32 _pendingPops;  // frames unwound but not written yet
+	UINT64 _popTime;      // when the last of them was unwound
+};
@@ -1,82 +1,724 @@
 #include "StdAfx.h"
 #include "SharedMemory.h"
+#include <emmintrin.h>
+
+__declspec(thread) ChunkWriter* CSharedMemory::t_writer;
+
+namespace
+{
+	volatile LONG s_nextId;
+
+	// every ChunkWriter there has been, they are reused but never freed.
+	ChunkWriter* volatile s_writers;
+
+	ThreadResolver s_resolver;
+
+	// Copy staged records into the chunk with non-temporal stores, the profiled thread is never
+	// going to read them again so there is no point pulling the chunk into its cache.  Records
+	// are 8 byte aligned, the caller must fence before publishing them.
+	void StreamCopy(BYTE* target, const BYTE* source, size_t bytes)
+	{
+#ifdef _AMD64_
+		__int64* to = (__int64*)target;
+		const __int64* from = (const __int64*)source;
+		for (size_t i = 0, n = bytes / sizeof(__int64); i < n; i++)
+		{
+			_mm_stream_si64x(to + i, from[i]);
+		}
+#else
+		int* to = (int*)target;
+		const int* from = (const int*)source;
+		for (size_t i = 0, n = bytes / sizeof(int); i < n; i++)
+		{
+			_mm_stream_si32(to + i, from[i]);
+		}
+#endif
+	}
+
+	// Convert text to UTF-8 in at most room bytes.  WideCharToMultiByte fails outright if the
+	// buffer is too small, so text that doesn't fit is cut short first, never inside a surrogate pair.
+	int ToUtf8(const WCHAR* text, char* target, int room)
+	{
+		int chars = (int)wcslen(text);
+		int bytes = WideCharToMultiByte(CP_UTF8, 0, text, chars, NULL, 0, NULL, NULL);
+		while (bytes > room && chars > 0)
+		{
+			// each UTF-16 unit is at most 3 bytes, so this never drops more than it has to.
+			chars -= (bytes - room + 2) / 3;
+			if (chars > 0 && IS_HIGH_SURROGATE(text[chars - 1]))
+			{
+				chars--;
+			}
+			bytes = chars > 0 ? WideCharToMultiByte(CP_UTF8, 0, text, chars, NULL, 0, NULL, NULL) : 0;
+		}
+		return chars > 0 ? WideCharToMultiByte(CP_UTF8, 0, text, chars, target, room, NULL, NULL) : 0;
+	}
+}
 
 CSharedMemory::CSharedMemory(TCHAR* name, long size)
 {
-    SetupSharedMemory(name, size);
-	lpCriticalSection = new CRITICAL_SECTION();
-	InitializeCriticalSection(lpCriticalSection);
+	_id = InterlockedIncrement(&s_nextId);
+	_generation = 0;
+	_flushEpoch = 0;
+	_resyncEpoch = 0;
+	_status = SetupSharedMemory(name, size);
 }
 
 
 CSharedMemory::~CSharedMemory(void)
 {
     CloseSharedMemory();
-	DeleteCriticalSection(lpCriticalSection);
-	delete lpCriticalSection;
-	lpCriticalSection = NULL;
 }
 
-HRESULT CSharedMemory::WriteRecord(UINT_PTR data, UINT_PTR timestamp)
+// Everything WriteRecord doesn't do inline: moving to a new chunk, flushing, resync markers
+// and timestamps that don't fit in the delta.
+HRESULT CSharedMemory::WriteRecordSlow(UINT32 id, UINT64 timestamp)
 {
-	UINT_PTR buffer[2] = { data, timestamp };
-	Write(&buffer, RecordSize);
+	ChunkWriter& writer = CurrentWriter();
+	LockWriter(writer);
+	if (writer.id != _id || writer.generation != _generation || writer.pos + MaxRecordBytes > writer.end || writer.epoch != _flushEpoch)
+	{
+		if (!Reserve(writer, MaxRecordBytes, timestamp))
+		{
+			UnlockWriter(writer);
+			DropRecord();
+			return E_OUTOFMEMORY;
+		}
+		if (writer.resync != _resyncEpoch)
+		{
+			// Resync also bumps the flush epoch, so this check stays off the fast path.
+			writer.resync = _resyncEpoch;
+			Record* marker = (Record*)writer.pos;
+			marker->id = ResyncRecord;
+			marker->delta = 0;
+			writer.pos = (BYTE*)(marker + 1);
+		}
+	}
+
+	// bugbug: Shock horror, memcpy corrupts memory on 64bit windows 8, but plain stores don't.
+	// (I'm wondering if the inline memcpy instruction on 64bit machine is using
+	// a register that my assembler code isn't saving...)
+	Record* target = (Record*)writer.pos;
+	UINT64 delta = 0;
+	if (timestamp > writer.timestamp)
+	{
+		delta = timestamp - writer.timestamp;
+		writer.timestamp = timestamp;
+	}
+	if (delta > MAXDWORD)
+	{
+		target->id = TimeBaseRecord;
+		target->delta = 0;
+		*(UINT64*)(target + 1) = timestamp;
+		target += 2;
+		delta = 0;
+	}
+	target->id = id;
+	target->delta = (UINT32)delta;
+	writer.pos = (BYTE*)(target + 1);
+	UnlockWriter(writer);
 	return S_OK;
 }
 
+HRESULT CSharedMemory::WriteExtended(UINT32 tag, const void* payload, UINT32 bytes)
+{
+	if (bytes > MaxExtendedPayload || (bytes % RecordSize) != 0)
+	{
+		return E_INVALIDARG;
+	}
 
-HRESULT CSharedMemory::Write(void* data, int len)
-{	
-    if (_bufferPos != NULL) 
-    {		
-		EnterCriticalSection(lpCriticalSection);
+	ChunkWriter& writer = CurrentWriter();
+	LockWriter(writer);
+	if (!Reserve(writer, RecordSize + bytes, CClock::Now()))
+	{
+		UnlockWriter(writer);
+		DropRecord();
+		return E_OUTOFMEMORY;
+	}
 
-        if ((UINT_PTR)_bufferPos + (UINT_PTR)len > (UINT_PTR)_bufferEnd) 
-        {
-            // start over.
-            Reset();
-        }
-        
-		// bugbug: Shock horror, memcpy corrupts memory on 64bit windows 8, but a manual for-loop doesn't.
-		// (I'm wondering if the inline memcpy instruction on 64bit machine is using
-		// a register that my assembler code isn't saving...)
-		// memcpy(_bufferPos, data, len);		
+	Record* target = (Record*)writer.pos;
+	target->id = tag;
+	target->delta = bytes;
+	memcpy(target + 1, payload, bytes);
+	writer.pos += RecordSize + bytes;
+	UnlockWriter(writer);
+	return S_OK;
+}
 
-		int num = (len / sizeof(UINT_PTR));
-#ifdef DEBUG
-		if (num * sizeof(UINT_PTR) != len) 
+void CSharedMemory::DropRecord()
+{
+	SharedMemoryHeader* header = _header;
+	if (header != NULL)
+	{
+		InterlockedIncrement64(&header->droppedRecords);
+	}
+}
+
+// Any thread may define functions, entries are claimed by bumping used and published by storing their index.
+HRESULT CSharedMemory::DefineFunction(UINT32 index, UINT32 generation, UINT32 token, UINT64 moduleId, UINT32 module, const WCHAR* name)
+{
+	NamesHeader* names = _names;
+	if (names == NULL)
+	{
+		return E_FAIL;
+	}
+
+	DefinePayload payload = { index, token, moduleId, 0, module, generation, 0 };
+
+	int chars = (int)wcslen(name);
+	int bytes = WideCharToMultiByte(CP_UTF8, 0, name, chars, NULL, 0, NULL, NULL);
+	LONG size = (LONG)((sizeof(NameEntry) + bytes + RecordSize - 1) & ~(RecordSize - 1));
+	LONG offset = InterlockedExchangeAdd(&names->used, size);
+	if (offset >= 0 && (DWORD)offset + size <= names->capacity)
+	{
+		NameEntry* entry = (NameEntry*)((BYTE*)(names + 1) + offset);
+		entry->token = token;
+		entry->moduleId = moduleId;
+		entry->bytes = bytes;
+		entry->module = module;
+		WideCharToMultiByte(CP_UTF8, 0, name, chars, (LPSTR)(entry + 1), bytes, NULL, NULL);
+		WriteRelease((volatile LONG*)&entry->index, (LONG)index);
+		payload.nameOffset = sizeof(NamesHeader) + offset;
+	}
+	else
+	{
+		// full, the reader asks the pipe for the names that didn't fit.  Put used back so the
+		// failed claims can't make it wrap around.
+		InterlockedExchangeAdd(&names->used, -size);
+	}
+
+	// functions can be mapped on any thread, so they may be defined out of order.
+	SharedMemoryHeader* header = _header;
+	LONG count = (LONG)(index - FirstFunctionIndex + 1);
+	LONG known;
+	while (header != NULL && (known = header->functionCount) < count && InterlockedCompareExchange(&header->functionCount, count, known) != known)
+	{
+	}
+
+	return WriteExtended(DefineRecord, &payload, sizeof(payload));
+}
+
+HRESULT CSharedMemory::RetireFunction(UINT32 index, UINT32 generation)
+{
+	RetirePayload payload = { index, generation };
+	return WriteExtended(RetireRecord, &payload, sizeof(payload));
+}
+
+HRESULT CSharedMemory::DefineModule(UINT32 module, UINT32 flags, UINT64 moduleId, UINT64 assemblyId, UINT64 baseAddress, const GUID& mvid, const WCHAR* path, const WCHAR* assembly)
+{
+	BYTE payload[MaxExtendedPayload];
+	ModulePayload* header = (ModulePayload*)payload;
+	ZeroMemory(header, sizeof(ModulePayload));
+	header->module = module;
+	header->flags = flags;
+	header->moduleId = moduleId;
+	header->assemblyId = assemblyId;
+	header->baseAddress = baseAddress;
+	header->mvid = mvid;
+
+	// long paths are cut short, there has to be room for the assembly name.
+	char* text = (char*)(header + 1);
+	int room = MaxExtendedPayload - sizeof(ModulePayload) - RecordSize;
+	char assemblyText[MaxExtendedPayload / 2];
+	header->assemblyBytes = ToUtf8(assembly, assemblyText, room / 2);
+	header->pathBytes = ToUtf8(path, text, room - header->assemblyBytes);
+	memcpy(text + header->pathBytes, assemblyText, header->assemblyBytes);
+
+	UINT32 bytes = (UINT32)((sizeof(ModulePayload) + header->pathBytes + header->assemblyBytes + RecordSize - 1) & ~(RecordSize - 1));
+	ZeroMemory(text + header->pathBytes + header->assemblyBytes, bytes - sizeof(ModulePayload) - header->pathBytes - header->assemblyBytes);
+	return WriteExtended(ModuleRecord, payload, bytes);
+}
+
+// Make room in the staging buffer for this many bytes, moving to a new chunk if need be.
+// The writer's lock must be held.
+bool CSharedMemory::Reserve(ChunkWriter& writer, UINT32 bytes, UINT64 timestamp)
+{
+	if (writer.id != _id || writer.generation != _generation)
+	{
+		// anything staged belongs to a buffer we no longer write to, or was cleared by Reset.
+		writer.pos = writer.staging;
+		writer.published = writer.staging;
+		if (!NextChunk(writer, timestamp))
 		{
-			MessageBox(NULL, L"The Write function doesn't support this record length", L"Profiler Debug Prompt", MB_ICONINFORMATION);
+			return false;
 		}
-#endif
-		UINT_PTR* source = (UINT_PTR*)data;
-		UINT_PTR* target = (UINT_PTR*)_bufferPos;
-		for (int i = 0; i < len; i++)
+	}
+	if (writer.pos + bytes > writer.end || writer.epoch != _flushEpoch)
+	{
+		Flush(writer);
+		if (writer.pos + bytes > writer.end && !NextChunk(writer, writer.timestamp))
 		{
-			target[i] = source[i];
+			return false;
 		}
+	}
+	return true;
+}
 
-        _bufferPos = (void*)((UINT_PTR)_bufferPos + (UINT_PTR)len);
+// Move the staged records into the thread's chunk and publish them, then start staging again
+// from the top.  Only the owner does this, it holds the writer's lock.
+void CSharedMemory::Flush(ChunkWriter& writer)
+{
+	Publish(writer);
+	SetStagingLimit(writer);
+}
 
-		LeaveCriticalSection(lpCriticalSection);
-    }
-    return S_OK;
+// Copy whatever has been staged since the last publish into the chunk.  The owner does this
+// from Flush and Quiesce does it for threads that have gone quiet, either way with the writer's
+// lock held.  The owner may be appending past pos while we copy, that is fine because it only
+// moves pos after the record is written.
+void CSharedMemory::Publish(ChunkWriter& writer)
+{
+	BYTE* pos = writer.pos;
+	size_t staged = pos - writer.published;
+	if (staged == 0)
+	{
+		return;
+	}
+
+	ChunkHeader* chunk = writer.chunk;
+	StreamCopy(writer.chunkPos, writer.published, staged);
+	writer.chunkPos += staged;
+	writer.published = pos;
+
+	// publish the records, the reader must not see the new size before it sees the data.
+	_mm_sfence();
+	WriteRelease(&chunk->used, (LONG)(writer.chunkPos - (BYTE*)(chunk + 1)));
+
+	SharedMemoryHeader* header = _header;
+	if (header != NULL)
+	{
+		InterlockedExchangeAdd64(&header->publishedRecords, staged / RecordSize);
+		if (header->readerCount > 0)
+		{
+			// a reader that is waiting wants these now, the rest are skipped.
+			RingDoorbell();
+		}
+	}
+}
+
+// The staging buffer never holds more than will fit in the rest of the chunk, so a flush
+// never has to be split across chunks.  Anything published from staging by Quiesce has
+// already moved chunkPos along by the same amount.
+void CSharedMemory::SetStagingLimit(ChunkWriter& writer)
+{
+	size_t remaining = ((BYTE*)writer.chunk + ChunkSize) - writer.chunkPos;
+	writer.pos = writer.staging;
+	writer.published = writer.staging;
+	writer.end = writer.staging + (remaining < StagingSize ? remaining : StagingSize);
+	writer.epoch = _flushEpoch;
+}
+
+// Wake the waiting readers that haven't been rung since records were last published.
+void CSharedMemory::RingDoorbell()
+{
+	SharedMemoryHeader* header = _header;
+	if (header == NULL)
+	{
+		return;
+	}
+	LONG64 published = header->publishedRecords;
+	for (long i = 0; i < MaxReaders; i++)
+	{
+		ReaderSlot& reader = header->readers[i];
+		if (reader.state != ReaderActive || !reader.waiting)
+		{
+			continue;
+		}
+		LONG64 rung = _rungRecords[i];
+		if (published != rung && InterlockedCompareExchange64(&_rungRecords[i], published, rung) == rung)
+		{
+			InterlockedIncrement64(&reader.rings);
+			SetEvent(_doorbells[i]);
+		}
+	}
+}
+
+bool CSharedMemory::IsReaderWaiting()
+{
+	SharedMemoryHeader* header = _header;
+	if (header == NULL || header->readerCount <= 0)
+	{
+		return false;
+	}
+	for (long i = 0; i < MaxReaders; i++)
+	{
+		if (header->readers[i].state == ReaderActive && header->readers[i].waiting)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+long CSharedMemory::RegisterReader(DWORD processId)
+{
+	SharedMemoryHeader* header = _header;
+	if (header == NULL || _name.empty())
+	{
+		return -1;
+	}
+	for (long i = 0; i < MaxReaders; i++)
+	{
+		ReaderSlot& reader = header->readers[i];
+		if (InterlockedCompareExchange(&reader.state, ReaderActive, ReaderFree) != ReaderFree)
+		{
+			continue;
+		}
+
+		// the reader starts with the oldest chunk that is still there.
+		LONG64 next = header->nextSequence;
+		reader.processId = processId;
+		reader.waiting = 0;
+		reader.cursor = max(header->resetSequence, next - _chunkCount);
+		reader.lag = 0;
+		reader.overruns = 0;
+		reader.rings = 0;
+		_rungRecords[i] = header->publishedRecords;
+
+		// the event outlives the readers of the slot, RingDoorbell may be using it at any time.
+		if (_doorbells[i] == NULL)
+		{
+			std::wstringstream doorbellName;
+			doorbellName << _name << L"_Doorbell" << i;
+			_doorbells[i] = CreateEvent(NULL, FALSE, FALSE, doorbellName.str().c_str());
+		}
+		else
+		{
+			ResetEvent(_doorbells[i]);
+		}
+		InterlockedIncrement(&header->readerCount);
+		return i;
+	}
+	return -1;
+}
+
+void CSharedMemory::ReleaseReader(long slot)
+{
+	SharedMemoryHeader* header = _header;
+	if (header == NULL || slot < 0 || slot >= MaxReaders || header->readers[slot].state != ReaderActive)
+	{
+		return;
+	}
+	// the doorbell is kept for the next reader of the slot, a writer could be ringing it right now.
+	InterlockedDecrement(&header->readerCount);
+	WriteRelease(&header->readers[slot].state, ReaderFree);
+}
+
+// Called with each chunk a writer claims, previous is the sequence of what was in the chunk before.
+// Readers that hadn't finished with it have lost it, nobody waits for them.
+void CSharedMemory::UpdateReaders(LONG64 sequence, LONG64 previous)
+{
+	SharedMemoryHeader* header = _header;
+	if (header->readerCount <= 0)
+	{
+		return;
+	}
+	for (long i = 0; i < MaxReaders; i++)
+	{
+		ReaderSlot& reader = header->readers[i];
+		if (reader.state != ReaderActive)
+		{
+			continue;
+		}
+		LONG64 cursor = reader.cursor;
+		reader.lag = max(sequence + 1 - cursor, 0);
+		if (previous != InvalidSequence && previous >= cursor && previous >= header->resetSequence)
+		{
+			InterlockedIncrement64(&reader.overruns);
+		}
+	}
+}
+
+// Threads that have stopped calling into the profiler would otherwise sit on their last
+// few records until they wrote another batch, so publish them from here.
+void CSharedMemory::Quiesce()
+{
+	for (ChunkWriter* writer = s_writers; writer != NULL; writer = writer->next)
+	{
+		// an unlocked look first, most writers have nothing staged for this buffer.
+		if (writer->id != _id || writer->pos == writer->published)
+		{
+			continue;
+		}
+		LockWriter(*writer);
+		if (writer->id == _id && writer->generation == _generation)
+		{
+			Publish(*writer);
+		}
+		UnlockWriter(*writer);
+	}
+}
+
+void CSharedMemory::Resync()
+{
+	InterlockedIncrement(&_resyncEpoch);
+	InterlockedIncrement(&_flushEpoch);
+}
+
+void CSharedMemory::SetCurrentThreadId(UINT_PTR threadId)
+{
+	CurrentWriter().threadId = threadId;
+}
+
+void CSharedMemory::DetachThread()
+{
+	ChunkWriter* writer = t_writer;
+	if (writer == NULL)
+	{
+		return;
+	}
+	t_writer = NULL;
+
+	// a chunk that is still open can't be sealed without its buffer, ReleaseThread has done
+	// that already if the buffer is still around.
+	LockWriter(*writer);
+	writer->chunk = NULL;
+	writer->id = 0;
+	writer->threadId = 0;
+	writer->pos = writer->staging;
+	writer->published = writer->staging;
+	UnlockWriter(*writer);
+	WriteRelease(&writer->inUse, 0);
+}
+
+// The writer state of the calling thread, one is taken from the list the first time a thread
+// writes.  Writers are never freed so Quiesce can walk the list without a lock.
+ChunkWriter& CSharedMemory::CurrentWriter()
+{
+	ChunkWriter* writer = t_writer;
+	if (writer != NULL)
+	{
+		return *writer;
+	}
+
+	for (writer = s_writers; writer != NULL; writer = writer->next)
+	{
+		if (writer->inUse == 0 && InterlockedCompareExchange(&writer->inUse, 1, 0) == 0)
+		{
+			break;
+		}
+	}
+	if (writer == NULL)
+	{
+		writer = new ChunkWriter;
+		ZeroMemory(writer, sizeof(ChunkWriter));
+		writer->pos = writer->staging;
+		writer->published = writer->staging;
+		writer->end = writer->staging;
+		writer->inUse = 1;
+		ChunkWriter* head;
+		do
+		{
+			head = s_writers;
+			writer->next = head;
+		}
+		while (InterlockedCompareExchangePointer((PVOID volatile*)&s_writers, writer, head) != head);
+	}
+	t_writer = writer;
+	return *writer;
+}
+
+// The owner only holds this on the slow path and Quiesce only for one copy of the staging
+// buffer, so spinning is cheaper than anything that could block.
+void CSharedMemory::LockWriter(ChunkWriter& writer)
+{
+	while (InterlockedCompareExchange(&writer.lock, 1, 0) != 0)
+	{
+		YieldProcessor();
+	}
+}
+
+void CSharedMemory::UnlockWriter(ChunkWriter& writer)
+{
+	WriteRelease(&writer.lock, 0);
+}
+
+void CSharedMemory::SetThreadResolver(ThreadResolver resolver)
+{
+	s_resolver = resolver;
+}
+
+void CSharedMemory::FlushThread()
+{
+	ChunkWriter* writer = t_writer;
+	if (writer == NULL)
+	{
+		return;
+	}
+	LockWriter(*writer);
+	if (writer->id == _id && writer->generation == _generation)
+	{
+		Flush(*writer);
+	}
+	UnlockWriter(*writer);
+}
+
+void CSharedMemory::ReleaseThread()
+{
+	ChunkWriter* writer = t_writer;
+	if (writer == NULL)
+	{
+		return;
+	}
+	LockWriter(*writer);
+	if (writer->id == _id)
+	{
+		if (writer->generation == _generation)
+		{
+			Flush(*writer);
+		}
+		SealChunk(*writer);
+		writer->id = 0;
+	}
+	UnlockWriter(*writer);
+}
+
+// Claim the next free chunk for the calling thread, anything staged must have been flushed
+// already and the writer's lock must be held.  This is the only place writers touch shared state other than publishing their
+// own chunk, and it happens once every ChunkSize bytes.  The first record in the new chunk
+// is relative to timestamp.
+bool CSharedMemory::NextChunk(ChunkWriter& writer, UINT64 timestamp)
+{
+	if (writer.id == _id)
+	{
+		// finished with the previous chunk, or a Reset happened.
+		SealChunk(writer);
+	}
+	writer.id = 0;
+
+	SharedMemoryHeader* header = _header;
+	if (header == NULL)
+	{
+		return false;
+	}
+	if (_holdChunks && _freeChunks <= 0)
+	{
+		// the streamer hasn't caught up, drop the records rather than wait for it.
+		return false;
+	}
+
+	long generation = _generation;
+
+	if (writer.threadId == 0 && s_resolver != NULL)
+	{
+		writer.threadId = s_resolver();
+	}
+
+	// Chunks that are still open belong to threads that haven't filled them yet, so skip
+	// over those instead of overwriting them.  If a whole lap finds nothing then there are
+	// more writer threads than chunks and the record is dropped.
+	for (long i = 0; i < _chunkCount; i++)
+	{
+		LONG64 sequence = InterlockedIncrement64(&header->nextSequence) - 1;
+		if (sequence > 0 && (sequence % _chunkCount) == 0)
+		{
+			// start over.
+			InterlockedIncrement(&header->version);
+		}
+
+		ChunkHeader* chunk = GetChunk(sequence);
+		LONG state = chunk->state;
+		if (state == ChunkOpen || (_holdChunks && state != ChunkFree) || InterlockedCompareExchange(&chunk->state, ChunkOpen, state) != state)
+		{
+			continue;
+		}
+		if (_holdChunks)
+		{
+			InterlockedDecrement(&_freeChunks);
+		}
+
+		// Readers check the sequence before and after reading a record, so it must change
+		// before anything in the chunk is overwritten.
+		LONG64 previous = InterlockedExchange64(&chunk->sequence, InvalidSequence);
+		UpdateReaders(sequence, previous);
+
+		chunk->owner = GetCurrentThreadId();
+		chunk->threadId = writer.threadId;
+		chunk->baseTimestamp = timestamp;
+		chunk->used = 0;
+		WriteRelease64(&chunk->sequence, sequence);
+
+		writer.chunk = chunk;
+		writer.chunkPos = (BYTE*)(chunk + 1);
+		writer.timestamp = timestamp;
+		writer.generation = generation;
+		writer.id = _id;
+		SetStagingLimit(writer);
+		return true;
+	}
+	return false;
+}
+
+void CSharedMemory::SealChunk(ChunkWriter& writer)
+{
+	ChunkHeader* chunk = writer.chunk;
+	if (chunk != NULL)
+	{
+		if (writer.generation == _generation)
+		{
+			InterlockedExchangeAdd64(&_header->committedRecords, chunk->used / RecordSize);
+		}
+		WriteRelease(&chunk->state, ChunkSealed);
+		writer.chunk = NULL;
+	}
+}
+
+ChunkHeader* CSharedMemory::GetChunkAt(long index)
+{
+	return (ChunkHeader*)((BYTE*)_sharedBuffer + (1 + index) * ChunkSize);
+}
+
+// The streamer has sent everything in this sealed chunk, writers can have it again.
+void CSharedMemory::FreeChunk(ChunkHeader* chunk)
+{
+	WriteRelease(&chunk->state, ChunkFree);
+	InterlockedIncrement(&_freeChunks);
+}
+
+ChunkHeader* CSharedMemory::GetChunk(LONG64 sequence)
+{
+	// the first chunk is the SharedMemoryHeader.
+	LONG64 index = 1 + (sequence % _chunkCount);
+	return (ChunkHeader*)((BYTE*)_sharedBuffer + index * ChunkSize);
 }
 
 HRESULT CSharedMemory::SetupSharedMemory(TCHAR* name, long size)
 {
     _bufferSize = size;
-    _bufferPos = NULL;
-    _bufferEnd = NULL;
 	_sharedBuffer = NULL;
-    _version = 0;
- 
-    hMapFile = OpenFileMapping(FILE_MAP_WRITE, TRUE, name);
+	_header = NULL;
+	_stats = NULL;
+	_names = NULL;
+	_chunkCount = 0;
+	_holdChunks = (name == NULL);
+	_freeChunks = 0;
+	_name = name != NULL ? name : L"";
+	_waitingEvent = NULL;
+	for (long i = 0; i < MaxReaders; i++)
+	{
+		_doorbells[i] = NULL;
+		_rungRecords[i] = 0;
+	}
+
+	if (size < MinBufferSize)
+	{
+		return E_INVALIDARG;
+	}
+
+	if (name == NULL)
+	{
+		// private to this process, the streamer sends it to the client.
+		hMapFile = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, NULL);
+	}
+	else
+	{
+		hMapFile = OpenFileMapping(FILE_MAP_WRITE, TRUE, name);
+	}
 
     if (hMapFile == NULL)
     {
-        HRESULT hr = GetLastError();
-		
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+
 		MessageBox(NULL, L"Could not create file mapping object", L"Shared Memory Not Found", MB_ICONINFORMATION);
 
         //LogString("Could not create file mapping object (%d).\n", hr);
@@ -91,50 +733,182 @@ HRESULT CSharedMemory::SetupSharedMemory(TCHAR* name, long size)
 
     if (_sharedBuffer == NULL)
     {
-        HRESULT hr = GetLastError();
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
         //LogString("Could not map view of file (%d).\n", hr);
         CloseHandle(hMapFile);
         return hr;
     }
 
-    ZeroMemory(_sharedBuffer, _bufferSize);
-    _bufferPos = _sharedBuffer;
-    _bufferEnd = (void*)((UINT_PTR)_sharedBuffer + (UINT_PTR)_bufferSize);
-	
+	// The buffer is not cleared, a new mapping is demand-zero so only the pages that are written
+	// get committed, and chunks left over from a previous session are told apart by their sequence.
+	_chunkCount = ((_bufferSize - StatsRegionSize - NamesRegionSize) / ChunkSize) - 1;
+	DWORD namesOffset = (1 + _chunkCount) * ChunkSize;
+	DWORD statsOffset = namesOffset + NamesRegionSize;
+	NamesHeader* names = (NamesHeader*)((BYTE*)_sharedBuffer + namesOffset);
+	StatsHeader* stats = (StatsHeader*)((BYTE*)_sharedBuffer + statsOffset);
+
+	SharedMemoryHeader* header = (SharedMemoryHeader*)_sharedBuffer;
+	if (header->magic == SharedMemoryMagic && header->format == SharedMemoryFormat &&
+		header->chunkSize == ChunkSize && header->chunkCount == (DWORD)_chunkCount)
+	{
+		// We have been given this buffer before, carry on from the old sequence numbers so the
+		// reader can't mistake an old chunk for a new one.  Chunks the old writers never sealed
+		// would otherwise be skipped forever.  The names are kept, the function indices haven't changed.
+		for (long i = 0; i < _chunkCount; i++)
+		{
+			ChunkHeader* chunk = GetChunk(i);
+			if (chunk->state == ChunkOpen)
+			{
+				WriteRelease(&chunk->state, ChunkSealed);
+			}
+		}
+		InterlockedExchange64(&header->committedRecords, 0);
+		InterlockedExchange64(&header->publishedRecords, 0);
+		InterlockedExchange64(&header->resetSequence, header->nextSequence);
+		CClock::Calibrate(header->clock);
+	}
+	else
+	{
+		header->format = SharedMemoryFormat;
+		header->chunkSize = ChunkSize;
+		header->chunkCount = _chunkCount;
+		header->recordSize = RecordSize;
+		header->statsOffset = statsOffset;
+		header->statsSize = _bufferSize - statsOffset;
+		header->namesOffset = namesOffset;
+		header->namesSize = NamesRegionSize;
+		names->capacity = NamesRegionSize - sizeof(NamesHeader);
+		stats->capacity = (header->statsSize - sizeof(StatsHeader)) / sizeof(FunctionStats);
+		CClock::Calibrate(header->clock);
+		// the magic goes last, the reader waits for it.
+		WriteRelease((volatile LONG*)&header->magic, SharedMemoryMagic);
+	}
+	_header = header;
+	_stats = stats;
+	_names = names;
+	_freeChunks = _chunkCount;
+
+	// readers of an earlier session are gone, they register again.
+	ZeroMemory(header->readers, sizeof(header->readers));
+	header->readerCount = 0;
+	if (name != NULL)
+	{
+		std::wstringstream waitingName;
+		waitingName << _name << L"_Waiting";
+		_waitingEvent = CreateEvent(NULL, FALSE, FALSE, waitingName.str().c_str());
+	}
+
     return 0;
 
 }
 
-_int64 CSharedMemory::GetPosition()
+_int64 CSharedMemory::GetRecordCount()
 {
-	EnterCriticalSection(lpCriticalSection);
-    _int64 result = (_int64)_bufferPos - (_int64)_sharedBuffer;
-	LeaveCriticalSection(lpCriticalSection);
+	SharedMemoryHeader* header = _header;
+	if (header == NULL)
+	{
+		return 0;
+	}
+
+	_int64 result = header->committedRecords;
+
+	// add the records in chunks that are still being written to.
+	LONG64 resetSequence = header->resetSequence;
+	for (long i = 0; i < _chunkCount; i++)
+	{
+		ChunkHeader* chunk = GetChunk(i);
+		if (chunk->state == ChunkOpen && chunk->sequence >= resetSequence)
+		{
+			result += chunk->used / RecordSize;
+		}
+	}
 	return result;
 }
 
 long CSharedMemory::GetVersion()
 {
-    return _version;
+	SharedMemoryHeader* header = _header;
+    return header != NULL ? header->version : 0;
 }
 
 void CSharedMemory::CloseSharedMemory()
 {
-	EnterCriticalSection(lpCriticalSection);
-    _bufferPos = NULL;
-    _bufferEnd = NULL;
-    void* buffer = _sharedBuffer;    
-    _sharedBuffer = NULL;    
-    UnmapViewOfFile(buffer);
-    CloseHandle(hMapFile);
-	LeaveCriticalSection(lpCriticalSection);
+	_header = NULL;
+	_stats = NULL;
+	_names = NULL;
+	for (long i = 0; i < MaxReaders; i++)
+	{
+		if (_doorbells[i] != NULL)
+		{
+			CloseHandle(_doorbells[i]);
+			_doorbells[i] = NULL;
+		}
+	}
+	if (_waitingEvent != NULL)
+	{
+		CloseHandle(_waitingEvent);
+		_waitingEvent = NULL;
+	}
+    void* buffer = _sharedBuffer;
+    _sharedBuffer = NULL;
+	if (buffer != NULL)
+	{
+		UnmapViewOfFile(buffer);
+		CloseHandle(hMapFile);
+	}
 }
 
+// Forget everything written so far.  Readers skip the chunks claimed before the reset,
+// and writers notice the new generation and move on to fresh chunks.
 void CSharedMemory::Reset()
 {
-	EnterCriticalSection(lpCriticalSection);
-    ZeroMemory(_sharedBuffer, _bufferSize);
-    _bufferPos = _sharedBuffer;
-    _version++;
-	LeaveCriticalSection(lpCriticalSection);
-}
\ No newline at end of file
+	SharedMemoryHeader* header = _header;
+	if (header != NULL)
+	{
+		InterlockedIncrement(&_generation);
+		InterlockedExchange64(&header->committedRecords, 0);
+		InterlockedExchange64(&header->publishedRecords, 0);
+		for (long i = 0; i < MaxReaders; i++)
+		{
+			_rungRecords[i] = 0;
+		}
+		InterlockedExchange64(&header->resetSequence, header->nextSequence);
+	}
+}
+
+// Only the pipe thread publishes stats, so there is a single writer.
+LONG64 CSharedMemory::PublishStats(const FunctionStats* totals, long count, UINT64 timestamp)
+{
+	StatsHeader* stats = _stats;
+	if (stats == NULL)
+	{
+		return 0;
+	}
+	if (count > (long)stats->capacity)
+	{
+		count = stats->capacity;
+	}
+
+	LONG64 sequence = stats->sequence + 1;
+	InterlockedExchange64(&stats->sequence, sequence); // odd, snapshot in progress
+	UINT64 snapshot = (sequence + 1) / 2;
+
+	FunctionStats* entries = (FunctionStats*)(stats + 1);
+	for (long i = 0; i < count; i++)
+	{
+		const FunctionStats& total = totals[i];
+		FunctionStats& entry = entries[i];
+		if (entry.calls != total.calls || entry.inclusive != total.inclusive || entry.exclusive != total.exclusive)
+		{
+			entry.calls = total.calls;
+			entry.inclusive = total.inclusive;
+			entry.exclusive = total.exclusive;
+			entry.snapshot = snapshot;
+		}
+	}
+	stats->timestamp = timestamp;
+	stats->count = count;
+
+	WriteRelease64(&stats->sequence, sequence + 1);
+	return snapshot;
+}
@@ -1,32 +1,426 @@
-#pragma once
+﻿#pragma once
 
-const int RecordSize = sizeof(UINT_PTR) * 2;
+#include "Clock.h"
+
+// Each call is recorded as one 8 byte Record.  The id is either one of the tags below or the
+// dense function index handed out by MapFunction, and delta is the time since the previous
+// record written by the same thread (the first record in a chunk is relative to the chunk's
+// baseTimestamp).  When a delta doesn't fit in 32 bits a TimeBaseRecord is written instead,
+// followed by the full 64 bit timestamp, and the record after it has a delta of 0.
+struct Record
+{
+	UINT32 id;
+	UINT32 delta;
+};
+
+const int RecordSize = sizeof(Record);
+
+// record tags
+const UINT32 LeaveRecord = 1;
+const UINT32 TailcallRecord = 2;
+const UINT32 TimeBaseRecord = 3;
+const UINT32 ResyncRecord = 4;   // recording was paused, the thread's call stack starts over after this
+const UINT32 OverrunRecord = 5;  // never written, readers return it when records were lost and every call stack starts over
+
+// Tags from here up are extended records, their delta holds the size of the payload that
+// follows (a multiple of RecordSize) and they don't move the thread's clock.
+const UINT32 FirstExtendedRecord = 128;
+const UINT32 StackRecord = 128;  // UINT32 stackId, UINT32 frameCount, then frameCount function indices, leaf first
+const UINT32 SampleRecord = 129; // SamplePayload
+const UINT32 PopRecord = 130;    // PopPayload, frames that were unwound by an exception
+const UINT32 SummaryRecord = 131; // SummaryPayload, calls to a throttled function that weren't recorded
+const UINT32 DefineRecord = 132;  // DefinePayload, a function was mapped, its name is in the names region
+const UINT32 ModuleRecord = 133;  // ModulePayload, a module was loaded or unloaded
+const UINT32 RetireRecord = 134;  // RetirePayload, a function was unloaded and its index will be reused
+
+// ids below this are reserved for tags.
+const UINT32 FirstFunctionIndex = 256;
+
+struct SamplePayload
+{
+	UINT64 timestamp;
+	UINT64 threadId;  // managed ThreadID of the thread that was sampled
+	UINT32 stackId;   // from an earlier StackRecord
+	UINT32 reserved;
+};
+
+struct SummaryPayload
+{
+	UINT32 index;     // the function
+	UINT32 reserved;
+	UINT64 calls;
+	UINT64 ticks;     // total time spent in those calls
+};
+
+struct PopPayload
+{
+	UINT64 timestamp; // when the last of them was unwound
+	UINT32 count;     // the number of calls to pop off the thread's stack
+	UINT32 reserved;
+};
+
+struct DefinePayload
+{
+	UINT32 index;      // the function
+	UINT32 token;      // its mdMethodDef
+	UINT64 moduleId;
+	UINT32 nameOffset; // of its NameEntry from the start of the names region, 0 if the region was full
+	UINT32 module;     // index of its module from the ModuleRecords, 0 if not known
+	UINT32 generation; // of the index, the function is the one defined with the highest generation
+	UINT32 reserved;
+};
+
+// records from other threads may arrive out of order, a RetirePayload is older than a
+// DefinePayload with a higher generation.
+struct RetirePayload
+{
+	UINT32 index;
+	UINT32 generation; // that was retired, the next function to get the index has the one after it
+};
+
+const UINT32 ModuleLoaded = 1;
+const UINT32 ModuleUnloaded = 2;
+
+// followed by pathBytes of UTF-8 path and then assemblyBytes of UTF-8 assembly name, padded to a multiple of 8.
+struct ModulePayload
+{
+	UINT32 module;      // dense index, handed out in load order starting at 1 and never reused
+	UINT32 flags;       // ModuleLoaded or ModuleUnloaded
+	UINT64 moduleId;
+	UINT64 assemblyId;
+	UINT64 baseAddress;
+	GUID mvid;
+	UINT32 pathBytes;
+	UINT32 assemblyBytes;
+};
+
+// the most a single WriteRecord call can append (Resync + TimeBase + timestamp + the record).
+const int MaxRecordBytes = RecordSize * 4;
+
+// Records are staged in thread local memory and copied into the thread's chunk in batches
+// of up to this many bytes, so the hooks don't write to memory the reader is polling.
+const int StagingSize = 4096;
+
+const int MaxExtendedPayload = StagingSize - RecordSize;
+
+// The shared buffer is carved up into fixed size chunks.  Each managed thread claims a chunk
+// for itself and appends records to it, so the Enter/Leave hooks never take a lock.  Records
+// are staged in thread local memory and copied into the chunk in batches, then the number of
+// bytes written is published with a release store, so a reader never sees a partially
+// written record.  The first chunk of the buffer
+// is reserved for the SharedMemoryHeader.  The chunks form a ring that is reused without
+// ever being cleared, each chunk is stamped with the sequence it was claimed with so a
+// reader that falls a lap behind can tell its chunk has been overwritten.
+const int ChunkSize = 64 * 1024;
+
+const DWORD SharedMemoryMagic = 0x4C525453; // 'STRL'
+const DWORD SharedMemoryFormat = 7;
+
+// a chunk's sequence while its header is being rewritten.
+const LONG64 InvalidSequence = -1;
+
+// chunk states
+const LONG ChunkFree = 0;
+const LONG ChunkOpen = 1;   // owned by a writer thread
+const LONG ChunkSealed = 2; // owner has moved on, contents are final
+
+// Several clients can read the same buffer, each registers for one of these (see RegisterReader).
+// The writers never wait for a reader, a reader that falls a lap behind loses the chunks that were
+// overwritten and is told so by overruns.
+const int MaxReaders = 8;
+
+const LONG ReaderFree = 0;
+const LONG ReaderActive = 1;
+
+struct ReaderSlot
+{
+	volatile LONG state;
+	DWORD processId;
+	volatile LONG waiting;     // set by the reader while it is blocked on its doorbell
+	DWORD reserved;
+	volatile LONG64 cursor;    // set by the reader, the oldest chunk sequence it hasn't finished
+	volatile LONG64 lag;       // chunks claimed that the reader hadn't finished, as of the last claim
+	volatile LONG64 overruns;  // chunks overwritten before the reader had finished with them
+	volatile LONG64 rings;     // bumped each time the reader's doorbell is rung
+	BYTE reserved2[16];
+};
+
+// lives at the start of the shared buffer, the layout is shared with SharedMemoryBuffer.cs
+struct SharedMemoryHeader
+{
+	DWORD magic;
+	DWORD format;
+	DWORD chunkSize;
+	DWORD chunkCount;
+	volatile LONG64 nextSequence;     // number of chunks claimed so far
+	volatile LONG64 resetSequence;    // readers skip chunks claimed before this (DeleteAll)
+	volatile LONG64 committedRecords; // records in sealed chunks
+	volatile LONG version;            // bumped each time the ring wraps around
+	DWORD recordSize;
+	ClockCalibration clock;           // for turning record timestamps into time
+	DWORD statsOffset;                // where the StatsHeader is, after the names region
+	DWORD statsSize;
+	DWORD namesOffset;                // where the NamesHeader is, after the last chunk
+	DWORD namesSize;
+	volatile LONG64 droppedRecords;   // records thrown away because no chunk was free
+	volatile LONG64 publishedRecords; // records flushed to the chunks since the last reset
+	volatile LONG functionCount;      // functions defined so far
+	volatile LONG readerCount;        // registered readers
+	DWORD reserved[2];
+	ReaderSlot readers[MaxReaders];
+};
+
+// A reader that has caught up sets its waiting flag, sets the auto-reset event named
+// <shared memory name>_Waiting and waits on the auto-reset event named
+// <shared memory name>_Doorbell<slot> instead of polling.  The writers ring the doorbells each
+// time they publish while a reader is waiting.  CDoorbell sleeps on the _Waiting event and
+// publishes what idle threads have staged while a reader waits, so it costs nothing otherwise.
+
+// Function names are interned in a region between the chunks and the stats, each function's name is
+// written once when the function is mapped.  Unlike the records they are never overwritten, so a
+// reader can always find the name of any function by scanning the entries.
+const int NamesRegionSize = 4 * 1024 * 1024;
+
+struct NamesHeader
+{
+	volatile LONG used; // bytes handed out to entries, past capacity once the region is full
+	DWORD capacity;     // bytes available for entries after this header
+	BYTE reserved[56];
+};
+
+// Entries follow the NamesHeader, each is padded to a multiple of 8 bytes.  index is stored last so a
+// reader that sees an index of 0 knows the entry isn't finished (or the region ends there).
+struct NameEntry
+{
+	volatile UINT32 index;
+	UINT32 token;
+	UINT64 moduleId;
+	UINT32 bytes;      // UTF-8 name follows, not null terminated
+	UINT32 module;     // as in DefinePayload
+};
+
+// The end of the buffer holds the per-function totals published by the flat profile mode.
+const int StatsRegionSize = 8 * 1024 * 1024;
+
+// Smaller buffers are refused, there would be too few chunks to go round the writer threads.
+const long MinChunkCount = 16;
+const long MinBufferSize = (1 + MinChunkCount) * ChunkSize + NamesRegionSize + StatsRegionSize;
+
+// one entry per function index, in the stats region after the StatsHeader.
+struct FunctionStats
+{
+	UINT64 calls;
+	UINT64 inclusive; // timestamp ticks, recursive calls are only counted once
+	UINT64 exclusive; // timestamp ticks spent in the function itself
+	UINT64 snapshot;  // the snapshot this entry last changed in
+};
+
+// Snapshots are published like a seqlock: sequence is odd while the profiler is writing, so
+// a reader copies what it needs and then checks sequence hasn't moved.  Snapshot numbers
+// are sequence / 2.
+struct StatsHeader
+{
+	volatile LONG64 sequence;
+	UINT64 timestamp; // when the snapshot was taken
+	DWORD capacity;   // number of FunctionStats entries that fit in the region
+	DWORD count;      // number of entries in the snapshot
+	BYTE reserved[40];
+};
+
+// lives at the start of each chunk, record data follows.
+struct ChunkHeader
+{
+	volatile LONG64 sequence; // claim sequence, chunk index is sequence % chunkCount
+	volatile LONG state;
+	volatile LONG used;       // bytes of record data committed
+	DWORD owner;              // OS thread id of the writer
+	DWORD reserved;
+	UINT64 threadId;          // managed ThreadID of the writer, 0 if not known yet
+	UINT64 baseTimestamp;     // the first record's delta is relative to this
+	BYTE reserved2[24];       // pad to 64 bytes so records don't share a cache line with the header
+};
+
+// returns the managed ThreadID of the calling thread, or 0.
+typedef UINT_PTR (*ThreadResolver)();
+
+// Per-thread writer state.  Thread local storage points at one of these, they are kept on a
+// list that is never freed so Quiesce can publish what an idle thread has staged.  The owner
+// only takes the lock on the slow path, the fast path just appends and moves pos.
+struct ChunkWriter
+{
+	ChunkHeader* chunk;
+	BYTE* chunkPos;  // where the next flush goes in the chunk
+	BYTE* published; // staging before this has already been copied to the chunk
+	BYTE* volatile pos; // next free byte in staging, stored after the record it covers
+	BYTE* end;       // flush before staging goes past here
+	UINT_PTR threadId; // managed ThreadID of this thread
+	long id;         // the CSharedMemory this chunk belongs to
+	long generation; // the Reset generation this chunk was claimed in
+	long epoch;      // the last Resync flush this thread has seen
+	long resync;     // the last Resync this thread has seen
+	volatile LONG lock; // held while chunk, chunkPos or published change
+	volatile LONG inUse; // 0 once the thread has gone and this is waiting to be reused
+	ChunkWriter* next;
+	UINT64 timestamp; // of the last record written, deltas are relative to this
+	BYTE staging[StagingSize];
+};
 
 class CSharedMemory
 {
 public:
+	// name is the mapping the client created, or NULL for a private buffer that is sent to the
+	// client by a CStreamer.  A private buffer holds on to sealed chunks until the streamer has
+	// sent them and frees them, when there are none left the records are dropped and counted.
 	CSharedMemory(TCHAR* name, long size);
 	~CSharedMemory(void);
-	
-	HRESULT WriteRecord(UINT_PTR data, UINT_PTR timestamp);
 
-    _int64 GetPosition();
+	// whether the constructor managed to map the buffer, nothing is written to it if not.
+	HRESULT GetStatus() { return _status; }
+
+	// id is a function index or one of the record tags.  This is inline so the hooks only pay
+	// for appending to the thread's staging buffer, anything else goes to WriteRecordSlow.
+	HRESULT WriteRecord(UINT32 id, UINT64 timestamp)
+	{
+		ChunkWriter* writer = t_writer;
+		if (writer == NULL)
+		{
+			return WriteRecordSlow(id, timestamp);
+		}
+		UINT64 delta = timestamp - writer->timestamp; // huge if the clock went backwards
+		if (delta > MAXDWORD || writer->id != _id || writer->generation != _generation || writer->pos + MaxRecordBytes > writer->end || writer->epoch != _flushEpoch)
+		{
+			return WriteRecordSlow(id, timestamp);
+		}
+
+		// plain stores, see the note in WriteRecordSlow.  Quiesce may copy the record out as
+		// soon as pos moves past it.
+		Record* target = (Record*)writer->pos;
+		target->id = id;
+		target->delta = (UINT32)delta;
+		writer->timestamp = timestamp;
+		writer->pos = (BYTE*)(target + 1);
+		return S_OK;
+	}
+
+	// the calling thread's writer if its chunk is in this buffer and WriteRecord would append to
+	// it inline, NULL if not.
+	ChunkWriter* GetCurrentWriter()
+	{
+		ChunkWriter* writer = t_writer;
+		if (writer == NULL || writer->id != _id || writer->generation != _generation || writer->epoch != _flushEpoch)
+		{
+			return NULL;
+		}
+		return writer;
+	}
+
+	// write an extended record, bytes must be a multiple of RecordSize and at most MaxExtendedPayload.
+	HRESULT WriteExtended(UINT32 tag, const void* payload, UINT32 bytes);
+
+	// intern the function's name and write a DefineRecord for it, call this once per function.
+	HRESULT DefineFunction(UINT32 index, UINT32 generation, UINT32 token, UINT64 moduleId, UINT32 module, const WCHAR* name);
+
+	// write a RetireRecord, the function with this index and generation has been unloaded.
+	HRESULT RetireFunction(UINT32 index, UINT32 generation);
+
+	// write a ModuleRecord, flags is ModuleLoaded or ModuleUnloaded.
+	HRESULT DefineModule(UINT32 module, UINT32 flags, UINT64 moduleId, UINT64 assemblyId, UINT64 baseAddress, const GUID& mvid, const WCHAR* path, const WCHAR* assembly);
+
+	// wake the readers that are waiting if records were published since their last ring.
+	void RingDoorbell();
+	bool IsReaderWaiting();
+
+	// set by a reader when it starts waiting, NULL for a private buffer.
+	HANDLE GetWaitingEvent() { return _waitingEvent; }
+
+	// Give a client its own reader slot and doorbell, returns the slot or -1 if they are all taken
+	// or this is a private buffer.  Called on the pipe threads.
+	long RegisterReader(DWORD processId);
+	void ReleaseReader(long slot);
+
+	// the name the buffer was mapped with, empty for a private buffer.
+	const std::wstring& GetName() { return _name; }
+
+	// identifies this buffer, a new one is created each time a client attaches.
+	long GetId() { return _id; }
+
+	// used by CStreamer to drain a private buffer.
+	SharedMemoryHeader* GetHeader() { return _header; }
+	NamesHeader* GetNames() { return _names; }
+	long GetChunkCount() { return _chunkCount; }
+	ChunkHeader* GetChunkAt(long index);
+	void FreeChunk(ChunkHeader* chunk);
+
+	// publish the records the calling thread has staged, it keeps its chunk.
+	void FlushThread();
+
+	// flush and seal the chunk owned by the calling thread so readers know it is complete.
+	void ReleaseThread();
+
+	// publish the records every thread has staged for this buffer, including threads that
+	// have gone idle.  When this returns a reader can see everything written before the call.
+	void Quiesce();
+
+	// recording is about to resume after a pause, each thread starts with a ResyncRecord.
+	void Resync();
+
+	// Chunks are stamped with the managed thread that writes them, so readers can rebuild
+	// the call stack of each thread without any per-record cost.  The thread id is cached
+	// in thread local storage, resolver is only used for threads that haven't been told.
+	static void SetCurrentThreadId(UINT_PTR threadId);
+	static void SetThreadResolver(ThreadResolver resolver);
+
+	// the calling thread is going away, its writer state is handed to the next thread.  Call
+	// ReleaseThread on the current buffer first.
+	static void DetachThread();
+
+    _int64 GetRecordCount();
     long GetVersion();
     void Reset();
+
+	// copy totals (indexed by function index - FirstFunctionIndex) to the stats region,
+	// only the entries that changed are written.  Returns the snapshot number.
+	LONG64 PublishStats(const FunctionStats* totals, long count, UINT64 timestamp);
 private:
-		
-	HRESULT Write(void* data, int len);
+
+	// the chunk the current thread is writing to, for whichever CSharedMemory it last wrote to.
+	static __declspec(thread) ChunkWriter* t_writer;
+
+	static ChunkWriter& CurrentWriter();
+	static void LockWriter(ChunkWriter& writer);
+	static void UnlockWriter(ChunkWriter& writer);
+
+	HRESULT WriteRecordSlow(UINT32 id, UINT64 timestamp);
+	void DropRecord();
+	bool NextChunk(ChunkWriter& writer, UINT64 timestamp);
+	void SealChunk(ChunkWriter& writer);
+	bool Reserve(ChunkWriter& writer, UINT32 bytes, UINT64 timestamp);
+	void Flush(ChunkWriter& writer);
+	void Publish(ChunkWriter& writer);
+	void SetStagingLimit(ChunkWriter& writer);
+	ChunkHeader* GetChunk(LONG64 sequence);
+	void UpdateReaders(LONG64 sequence, LONG64 previous);
 
 	// for setting up shared memory buffer.
 	HRESULT SetupSharedMemory(TCHAR* name, long size);
 	void CloseSharedMemory();
 
 	HANDLE hMapFile;
-	void* _bufferPos;
-	long _bufferSize;	
-	void* _bufferEnd;
+	long _bufferSize;
 	void* _sharedBuffer;
-    long _version;
-	LPCRITICAL_SECTION lpCriticalSection;
+	SharedMemoryHeader* _header;
+	StatsHeader* _stats;
+	NamesHeader* _names;
+	bool _holdChunks;             // sealed chunks are only reused once FreeChunk is called
+	volatile long _freeChunks;    // when _holdChunks is set
+	long _chunkCount;
+	HRESULT _status;              // of SetupSharedMemory
+	long _id;                     // identifies this buffer to the thread local writer state
+	volatile long _generation;    // bumped by Reset so writers move to fresh chunks
+	volatile long _flushEpoch;    // bumped by Resync so writers take the slow path
+	volatile long _resyncEpoch;   // bumped by Resync
+	std::wstring _name;
+	HANDLE _doorbells[MaxReaders];            // per reader slot, kept until the buffer closes
+	HANDLE _waitingEvent;                     // <name>_Waiting
+	volatile LONG64 _rungRecords[MaxReaders]; // publishedRecords when each doorbell was last rung
 };
-
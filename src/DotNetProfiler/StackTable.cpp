@@ -0,0 +1,98 @@
+#include "StdAfx.h"
+#include "StackTable.h"
+
+const int InitialStackSlots = 1 << 18;
+
+CStackTable::CStackTable()
+{
+	Clear();
+}
+
+void CStackTable::Clear()
+{
+	_slots.assign(InitialStackSlots, Slot());
+	_frames.clear();
+	_offsets.clear();
+}
+
+UINT32 CStackTable::GetCount()
+{
+	return (UINT32)_offsets.size();
+}
+
+// FNV-1a over the frames.
+UINT32 CStackTable::Hash(const UINT32* frames, UINT32 count)
+{
+	UINT32 hash = 2166136261u;
+	for (UINT32 i = 0; i < count; i++)
+	{
+		hash = (hash ^ frames[i]) * 16777619u;
+	}
+	return hash ^ count;
+}
+
+bool CStackTable::Matches(UINT32 stackId, const UINT32* frames, UINT32 count)
+{
+	const UINT32* stack = &_frames[_offsets[stackId - 1]];
+	if (stack[0] != count)
+	{
+		return false;
+	}
+	return memcmp(stack + 1, frames, count * sizeof(UINT32)) == 0;
+}
+
+UINT32 CStackTable::Intern(const UINT32* frames, UINT32 count, bool& isNew)
+{
+	isNew = false;
+	UINT32 hash = Hash(frames, count);
+	size_t mask = _slots.size() - 1;
+	size_t i = hash & mask;
+	for (;;)
+	{
+		Slot& slot = _slots[i];
+		if (slot.stackId == 0)
+		{
+			break;
+		}
+		if (slot.hash == hash && Matches(slot.stackId, frames, count))
+		{
+			return slot.stackId;
+		}
+		i = (i + 1) & mask;
+	}
+
+	UINT32 stackId = (UINT32)_offsets.size() + 1;
+	_offsets.push_back((UINT32)_frames.size());
+	_frames.push_back(count);
+	_frames.insert(_frames.end(), frames, frames + count);
+	_slots[i].hash = hash;
+	_slots[i].stackId = stackId;
+	isNew = true;
+
+	// keep the table at most 3/4 full so the probes stay short.
+	if (_offsets.size() * 4 > _slots.size() * 3)
+	{
+		Grow();
+	}
+	return stackId;
+}
+
+void CStackTable::Grow()
+{
+	std::vector<Slot> old;
+	old.swap(_slots);
+	_slots.assign(old.size() * 2, Slot());
+	size_t mask = _slots.size() - 1;
+	for (size_t j = 0; j < old.size(); j++)
+	{
+		if (old[j].stackId != 0)
+		{
+			size_t i = old[j].hash & mask;
+			while (_slots[i].stackId != 0)
+			{
+				i = (i + 1) & mask;
+			}
+			_slots[i] = old[j];
+		}
+	}
+}
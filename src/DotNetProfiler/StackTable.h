@@ -0,0 +1,34 @@
+#pragma once
+
+// Interns call stacks, so each distinct stack is sent to the client once and every sample
+// after that is just a stack id.  Only the sampler thread uses it, so there is no locking.
+// The hash table starts big enough for a couple of hundred thousand distinct stacks and
+// doubles as needed, the frames of all stacks are kept back to back in one array.
+class CStackTable
+{
+public:
+	CStackTable();
+
+	// frames are function indices, leaf first.  isNew is set the first time a stack is seen.
+	UINT32 Intern(const UINT32* frames, UINT32 count, bool& isNew);
+
+	UINT32 GetCount();
+
+	// forget all stacks, ids start over.
+	void Clear();
+
+private:
+	struct Slot
+	{
+		UINT32 hash;
+		UINT32 stackId; // 0 means the slot is empty
+	};
+
+	static UINT32 Hash(const UINT32* frames, UINT32 count);
+	bool Matches(UINT32 stackId, const UINT32* frames, UINT32 count);
+	void Grow();
+
+	std::vector<Slot> _slots;      // size is a power of 2
+	std::vector<UINT32> _frames;   // for each stack: count, then the frames
+	std::vector<UINT32> _offsets;  // stackId - 1 -> offset in _frames
+};
@@ -0,0 +1,320 @@
+#include "StdAfx.h"
+#include "Streamer.h"
+#include "PipeServer.h"
+
+namespace
+{
+	BYTE* WriteVarint(BYTE* out, UINT32 value)
+	{
+		while (value >= 0x80)
+		{
+			*out++ = (BYTE)(value | 0x80);
+			value >>= 7;
+		}
+		*out++ = (BYTE)value;
+		return out;
+	}
+
+	// the most EncodeRecords can write for this many bytes of records.
+	DWORD MaxEncodedBytes(DWORD bytes)
+	{
+		return bytes + bytes / 4 + RecordSize;
+	}
+
+	// returns the end of the encoded records, timestamp follows the records' clock.
+	BYTE* EncodeRecords(const BYTE* records, DWORD bytes, BYTE* out, UINT64& timestamp)
+	{
+		const BYTE* pos = records;
+		const BYTE* end = records + bytes;
+		while (pos + RecordSize <= end)
+		{
+			const Record* record = (const Record*)pos;
+			out = WriteVarint(out, record->id);
+			out = WriteVarint(out, record->delta);
+			pos += RecordSize;
+
+			// whatever follows the record isn't worth encoding.
+			DWORD extra = 0;
+			if (record->id == TimeBaseRecord)
+			{
+				extra = sizeof(UINT64);
+				if (pos + extra <= end)
+				{
+					timestamp = *(const UINT64*)pos;
+				}
+			}
+			else if (record->id >= FirstExtendedRecord && record->id < FirstFunctionIndex)
+			{
+				extra = record->delta;
+			}
+			else
+			{
+				timestamp += record->delta;
+			}
+			if (extra > (DWORD)(end - pos))
+			{
+				extra = (DWORD)(end - pos);
+			}
+			memcpy(out, pos, extra);
+			out += extra;
+			pos += extra;
+		}
+		return out;
+	}
+}
+
+CStreamer::CStreamer(PipeServer& pipe) :
+	_pipe(pipe)
+{
+	_sharedMemory = NULL;
+	_thread = NULL;
+	_stopEvent = NULL;
+	_frameUsed = 0;
+	_blockCount = 0;
+	_namesSent = 0;
+	_frameNumber = 0;
+	_droppedFrames = 0;
+	_droppedSent = 0;
+}
+
+CStreamer::~CStreamer()
+{
+	Stop();
+}
+
+void CStreamer::Start(CSharedMemory* sharedMemory)
+{
+	Stop();
+
+	_sharedMemory = sharedMemory;
+	_chunkSequence.assign(sharedMemory->GetChunkCount(), InvalidSequence);
+	_chunkSent.assign(sharedMemory->GetChunkCount(), 0);
+	_chunkTimestamp.assign(sharedMemory->GetChunkCount(), 0);
+	_frame.resize(PipeServer::MaxDataBytes);
+	_frameUsed = sizeof(StreamFrameHeader);
+	_blockCount = 0;
+	_namesSent = 0;
+	_frameNumber = 0;
+	_droppedFrames = 0;
+	_droppedSent = 0;
+
+	_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	_thread = CreateThread(NULL, 0, &StreamerThread, (PVOID)this, 0, NULL);
+}
+
+void CStreamer::Stop()
+{
+	if (_thread != NULL)
+	{
+		SetEvent(_stopEvent);
+
+		// the thread may be stuck writing to a client that stopped reading.
+		while (WaitForSingleObject(_thread, 100) == WAIT_TIMEOUT)
+		{
+			_pipe.CancelDataWrite();
+		}
+		CloseHandle(_thread);
+		CloseHandle(_stopEvent);
+		_thread = NULL;
+		_stopEvent = NULL;
+	}
+	_sharedMemory = NULL;
+}
+
+DWORD WINAPI CStreamer::StreamerThread(PVOID v)
+{
+	CStreamer* streamer = (CStreamer*)v;
+	streamer->Run();
+	return 0;
+}
+
+void CStreamer::Run()
+{
+	while (WaitForSingleObject(_stopEvent, StreamInterval) == WAIT_TIMEOUT)
+	{
+		// publish what the threads have staged so this drain picks it up.
+		_sharedMemory->Quiesce();
+		Drain();
+	}
+}
+
+void CStreamer::Drain()
+{
+	SharedMemoryHeader* header = _sharedMemory->GetHeader();
+	if (header == NULL)
+	{
+		return;
+	}
+
+	// names first, the client should know a function before it sees it called.
+	SendNames();
+
+	// send the chunks in the order they were claimed so each thread's records stay in order.
+	LONG64 resetSequence = header->resetSequence;
+	std::vector<std::pair<LONG64, long>> pending;
+	for (long i = 0; i < (long)_chunkSequence.size(); i++)
+	{
+		ChunkHeader* chunk = _sharedMemory->GetChunkAt(i);
+		LONG state = ReadAcquire(&chunk->state);
+		LONG64 sequence = ReadAcquire64(&chunk->sequence);
+		if (state == ChunkFree || sequence == InvalidSequence)
+		{
+			continue;
+		}
+		if (sequence != _chunkSequence[i])
+		{
+			_chunkSequence[i] = sequence;
+			_chunkSent[i] = 0;
+			_chunkTimestamp[i] = chunk->baseTimestamp;
+		}
+		if (sequence < resetSequence)
+		{
+			// thrown away by DeleteAll, free it once its writer has moved on.
+			if (state == ChunkSealed)
+			{
+				_chunkSequence[i] = InvalidSequence;
+				_sharedMemory->FreeChunk(chunk);
+			}
+			continue;
+		}
+		pending.push_back(std::make_pair(sequence, i));
+	}
+	std::sort(pending.begin(), pending.end());
+
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		long index = pending[i].second;
+		SendChunk(index, _sharedMemory->GetChunkAt(index), pending[i].first);
+	}
+
+	// an empty frame lets the client know records are being dropped.
+	if (_blockCount > 0 || _droppedSent != (UINT64)header->droppedRecords)
+	{
+		SendFrame();
+	}
+}
+
+void CStreamer::SendNames()
+{
+	NamesHeader* names = _sharedMemory->GetNames();
+	if (names == NULL)
+	{
+		return;
+	}
+
+	// the entries are published in order, stop at the first one that isn't finished.
+	LONG used = min((DWORD)names->used, names->capacity);
+	BYTE* start = (BYTE*)(names + 1);
+	while (_namesSent + (LONG)sizeof(NameEntry) <= used)
+	{
+		DWORD maxBytes = min((DWORD)(used - _namesSent), (DWORD)(_frame.size() / 2));
+		StreamBlockHeader* block = BeginBlock(StreamNamesBlock, maxBytes);
+		LONG pos = _namesSent;
+		while (pos + (LONG)sizeof(NameEntry) <= used)
+		{
+			NameEntry* entry = (NameEntry*)(start + pos);
+			if (ReadAcquire((volatile LONG*)&entry->index) == 0)
+			{
+				break;
+			}
+			LONG size = (LONG)((sizeof(NameEntry) + entry->bytes + RecordSize - 1) & ~(RecordSize - 1));
+			if ((DWORD)(pos + size - _namesSent) > maxBytes)
+			{
+				break;
+			}
+			pos += size;
+		}
+		if (pos == _namesSent)
+		{
+			break;
+		}
+
+		BYTE* data = (BYTE*)(block + 1);
+		memcpy(data, start + _namesSent, pos - _namesSent);
+		block->offset = sizeof(NamesHeader) + _namesSent;
+		block->sourceBytes = pos - _namesSent;
+		EndBlock(block, data + (pos - _namesSent));
+		_namesSent = pos;
+	}
+}
+
+void CStreamer::SendChunk(long index, ChunkHeader* chunk, LONG64 sequence)
+{
+	// read the state first, once a chunk is sealed its size is final.
+	LONG state = ReadAcquire(&chunk->state);
+	LONG used = ReadAcquire(&chunk->used);
+	LONG sent = _chunkSent[index];
+	if (used > sent)
+	{
+		DWORD bytes = used - sent;
+		StreamBlockHeader* block = BeginBlock(StreamRecordsBlock, MaxEncodedBytes(bytes));
+		block->offset = sent;
+		block->sourceBytes = bytes;
+		block->sequence = sequence;
+		block->threadId = chunk->threadId;
+		block->baseTimestamp = _chunkTimestamp[index];
+		block->owner = chunk->owner;
+		EndBlock(block, EncodeRecords((BYTE*)(chunk + 1) + sent, bytes, (BYTE*)(block + 1), _chunkTimestamp[index]));
+		_chunkSent[index] = used;
+	}
+
+	if (state == ChunkSealed)
+	{
+		// everything in it has been copied to the frame.
+		_chunkSequence[index] = InvalidSequence;
+		_sharedMemory->FreeChunk(chunk);
+	}
+}
+
+// returns a block with room for maxBytes of data, sending the current frame first if need be.
+StreamBlockHeader* CStreamer::BeginBlock(DWORD kind, DWORD maxBytes)
+{
+	if (_frameUsed + sizeof(StreamBlockHeader) + maxBytes + RecordSize > _frame.size())
+	{
+		SendFrame();
+	}
+	StreamBlockHeader* block = (StreamBlockHeader*)&_frame[_frameUsed];
+	ZeroMemory(block, sizeof(StreamBlockHeader));
+	block->kind = kind;
+	return block;
+}
+
+// the block's data ends at end, pad it so the next block is aligned.
+void CStreamer::EndBlock(StreamBlockHeader* block, BYTE* end)
+{
+	BYTE* data = (BYTE*)(block + 1);
+	DWORD bytes = (DWORD)(end - data);
+	DWORD padded = (bytes + RecordSize - 1) & ~(RecordSize - 1);
+	ZeroMemory(end, padded - bytes);
+	block->bytes = padded;
+	_frameUsed += sizeof(StreamBlockHeader) + padded;
+	_blockCount++;
+}
+
+void CStreamer::SendFrame()
+{
+	SharedMemoryHeader* header = _sharedMemory->GetHeader();
+	StreamFrameHeader* frame = (StreamFrameHeader*)&_frame[0];
+	ZeroMemory(frame, sizeof(StreamFrameHeader));
+	frame->length = (DWORD)(_frameUsed - sizeof(DWORD));
+	frame->magic = StreamFrameMagic;
+	frame->blockCount = _blockCount;
+	frame->frame = _frameNumber++;
+	frame->droppedRecords = header != NULL ? header->droppedRecords : 0;
+	frame->droppedFrames = _droppedFrames;
+	_droppedSent = frame->droppedRecords;
+	if (header != NULL)
+	{
+		frame->clock = header->clock;
+	}
+
+	// this blocks while the client's end of the pipe is full, which is what makes the writers
+	// drop records when the client can't keep up.
+	if (!_pipe.WriteToDataPipe(&_frame[0], (DWORD)_frameUsed))
+	{
+		_droppedFrames++;
+	}
+
+	_frameUsed = sizeof(StreamFrameHeader);
+	_blockCount = 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "SharedMemory.h"
+
+class PipeServer;
+
+const DWORD StreamInterval = 10; // milliseconds between frames
+const long DefaultStreamSize = 32 * 1024 * 1024;
+
+// Frames are written to the data pipe, each is one length-prefixed message (see
+// PipeServer::WriteToDataPipe) made of a StreamFrameHeader followed by blocks.
+const DWORD StreamFrameMagic = 0x46535453; // "STSF"
+
+struct StreamFrameHeader
+{
+	DWORD length;            // bytes after this field
+	DWORD magic;
+	DWORD blockCount;
+	DWORD reserved;
+	UINT64 frame;            // numbered from 0, a gap means frames were lost
+	UINT64 droppedRecords;   // total records the hooks threw away because no chunk was free
+	UINT64 droppedFrames;    // total frames that couldn't be written to the pipe
+	UINT64 reserved2;
+	ClockCalibration clock;  // for turning record timestamps into time
+};
+
+const DWORD StreamRecordsBlock = 0; // records from one chunk, encoded
+const DWORD StreamNamesBlock = 1;   // NameEntry structs copied from the names region, see DefineRecord
+
+struct StreamBlockHeader
+{
+	DWORD kind;
+	DWORD bytes;            // of data following this header, padded to a multiple of 8
+	DWORD offset;           // where the data came from in the chunk (or names region)
+	DWORD sourceBytes;      // how much of the chunk it covers
+	UINT64 sequence;        // ChunkHeader fields, for StreamRecordsBlock
+	UINT64 threadId;
+	UINT64 baseTimestamp;   // the first record in the block is relative to this
+	DWORD owner;
+	DWORD reserved;
+};
+
+// Sends the records in a private CSharedMemory buffer down the data pipe, so the client
+// doesn't need to map the buffer and can record for as long as it keeps reading.  Every
+// StreamInterval the thread asks the writers to flush and sends whatever they have published,
+// oldest chunk first.  Sealed chunks are only freed once they have been sent, so a client that
+// can't keep up makes the hooks drop records (counted in droppedRecords) rather than wait.
+//
+// Records are encoded as two LEB128 varints (id, delta), a TimeBaseRecord's timestamp and
+// extended payloads are copied as they are.  Most records shrink from 8 bytes to 2 or 3.
+class CStreamer
+{
+public:
+	CStreamer(PipeServer& pipe);
+	~CStreamer();
+
+	void Start(CSharedMemory* sharedMemory);
+	void Stop();
+
+private:
+	static DWORD WINAPI StreamerThread(PVOID v);
+
+	void Run();
+	void Drain();
+	void SendNames();
+	void SendChunk(long index, ChunkHeader* chunk, LONG64 sequence);
+	StreamBlockHeader* BeginBlock(DWORD kind, DWORD maxBytes);
+	void EndBlock(StreamBlockHeader* block, BYTE* end);
+	void SendFrame();
+
+	PipeServer& _pipe;
+	CSharedMemory* _sharedMemory;
+	HANDLE _thread;
+	HANDLE _stopEvent;
+	std::vector<LONG64> _chunkSequence; // what was in each chunk when we last looked
+	std::vector<LONG> _chunkSent;       // bytes of it sent so far
+	std::vector<UINT64> _chunkTimestamp; // of the last record sent, so each block can be decoded on its own
+	std::vector<BYTE> _frame;
+	size_t _frameUsed;
+	DWORD _blockCount;
+	LONG _namesSent;
+	UINT64 _frameNumber;
+	UINT64 _droppedFrames;
+	UINT64 _droppedSent; // droppedRecords in the last frame
+};
@@ -0,0 +1,106 @@
+#include "StdAfx.h"
+#include "StringPool.h"
+
+CStringPool::CStringPool()
+{
+	_next = NULL;
+	_left = 0;
+	Clear();
+}
+
+CStringPool::~CStringPool()
+{
+	Clear();
+}
+
+void CStringPool::Clear()
+{
+	for (size_t i = 0; i < _blocks.size(); i++)
+	{
+		delete[] _blocks[i];
+	}
+	_blocks.clear();
+	_next = NULL;
+	_left = 0;
+
+	// id 0 means no string.
+	_strings.assign(1, (const WCHAR*)NULL);
+	_table.assign(1024, 0);
+}
+
+UINT32 CStringPool::Intern(const WCHAR* text, size_t length)
+{
+	size_t mask = _table.size() - 1;
+	size_t slot = Hash(text, length) & mask;
+	for (UINT32 id = _table[slot]; id != 0; id = _table[slot])
+	{
+		const WCHAR* found = _strings[id];
+		if (wcsncmp(found, text, length) == 0 && found[length] == L'\0')
+		{
+			return id;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	WCHAR* copy = Allocate(length + 1);
+	wmemcpy(copy, text, length);
+	copy[length] = L'\0';
+	UINT32 id = (UINT32)_strings.size();
+	_strings.push_back(copy);
+	_table[slot] = id;
+
+	// keep the table at most half full so the probes stay short.
+	if (_strings.size() * 2 > _table.size())
+	{
+		Grow();
+	}
+	return id;
+}
+
+// FNV-1a
+size_t CStringPool::Hash(const WCHAR* text, size_t length)
+{
+	UINT32 hash = 2166136261;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash = (hash ^ text[i]) * 16777619;
+	}
+	return hash;
+}
+
+WCHAR* CStringPool::Allocate(size_t chars)
+{
+	if (chars > _left)
+	{
+		// a string too big for a block gets one of its own, the rest of the current block is kept.
+		if (chars > StringBlockChars / 4)
+		{
+			WCHAR* block = new WCHAR[chars];
+			_blocks.push_back(block);
+			return block;
+		}
+		_next = new WCHAR[StringBlockChars];
+		_left = StringBlockChars;
+		_blocks.push_back(_next);
+	}
+	WCHAR* result = _next;
+	_next += chars;
+	_left -= chars;
+	return result;
+}
+
+void CStringPool::Grow()
+{
+	_table.assign(_table.size() * 2, 0);
+	size_t mask = _table.size() - 1;
+	for (UINT32 id = 1; id < (UINT32)_strings.size(); id++)
+	{
+		const WCHAR* text = _strings[id];
+		size_t slot = Hash(text, wcslen(text)) & mask;
+		while (_table[slot] != 0)
+		{
+			slot = (slot + 1) & mask;
+		}
+		_table[slot] = id;
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Strings are copied into blocks of this many characters that are never freed or moved, so
+// a pointer to an interned string stays valid for as long as the pool.
+const size_t StringBlockChars = 64 * 1024;
+
+// Interns strings so each distinct string is stored once.  Strings are identified by a
+// dense UINT32 id (0 is never used), which is half the size of a pointer to keep the tables
+// that refer to them small.  Not thread safe, the owner locks.
+class CStringPool
+{
+public:
+	CStringPool();
+	~CStringPool();
+
+	// returns the id of the string, the same text always gets the same id.
+	UINT32 Intern(const WCHAR* text, size_t length);
+	UINT32 Intern(const WCHAR* text) { return Intern(text, wcslen(text)); }
+
+	// returns the null terminated string, or NULL if the id wasn't handed out.
+	const WCHAR* Get(UINT32 id)
+	{
+		return (id != 0 && id < _strings.size()) ? _strings[id] : NULL;
+	}
+
+	// the number of distinct strings interned since the last Clear.
+	size_t GetCount()
+	{
+		return _strings.size() - 1;
+	}
+
+	void Clear();
+
+private:
+	static size_t Hash(const WCHAR* text, size_t length);
+	WCHAR* Allocate(size_t chars);
+	void Grow();
+
+	std::vector<WCHAR*> _blocks;
+	WCHAR* _next;                    // free space in the last block
+	size_t _left;
+	std::vector<const WCHAR*> _strings; // by id
+	std::vector<UINT32> _table;      // open addressing on the string's hash, 0 is an empty slot
+};
@@ -0,0 +1,280 @@
+#include "StdAfx.h"
+#include "Profiler.h"
+#include "Throttle.h"
+
+namespace
+{
+	__declspec(thread) ThrottleThread* t_throttle;
+}
+
+CThrottle::CThrottle(CProfiler& profiler, CFunctionTable& functions) :
+	_profiler(profiler),
+	_functions(functions)
+{
+	_thread = NULL;
+	_stopEvent = NULL;
+	_limit = 0;
+	_clear = false;
+	_started = false;
+	_threads = NULL;
+	InitializeCriticalSection(&_lock);
+	InitializeCriticalSection(&_threadLock);
+}
+
+CThrottle::~CThrottle()
+{
+	Stop();
+	ThrottleThread* thread = _threads;
+	while (thread != NULL)
+	{
+		ThrottleThread* next = thread->next;
+		for (int i = 0; i < MaxFunctionPages; i++)
+		{
+			delete[] thread->pages[i];
+		}
+		delete thread;
+		thread = next;
+	}
+	_threads = NULL;
+	DeleteCriticalSection(&_lock);
+	DeleteCriticalSection(&_threadLock);
+}
+
+void CThrottle::Start()
+{
+	EnterCriticalSection(&_threadLock);
+	_started = true;
+	if (_limit != 0)
+	{
+		StartThread();
+	}
+	LeaveCriticalSection(&_threadLock);
+}
+
+void CThrottle::Stop()
+{
+	EnterCriticalSection(&_threadLock);
+	_started = false;
+	StopThread();
+	LeaveCriticalSection(&_threadLock);
+}
+
+// Without a limit there is nothing to look at, so the thread doesn't run.
+void CThrottle::SetLimit(DWORD callsPerSecond)
+{
+	EnterCriticalSection(&_threadLock);
+	_limit = callsPerSecond;
+	if (_limit != 0 && _started)
+	{
+		StartThread();
+	}
+	else if (_limit == 0 && _thread != NULL)
+	{
+		StopThread();
+		// one last look, to record the suppressed functions again and summarize their calls.
+		CSharedMemory* sharedMemory = _profiler.GetSharedMemory();
+		if (sharedMemory != NULL && !_profiler.IsPaused())
+		{
+			Update(sharedMemory);
+			sharedMemory->FlushThread();
+		}
+	}
+	LeaveCriticalSection(&_threadLock);
+}
+
+void CThrottle::StartThread()
+{
+	if (_thread == NULL)
+	{
+		_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		_thread = CreateThread(NULL, 0, &ThrottleThreadProc, (PVOID)this, 0, NULL);
+	}
+}
+
+void CThrottle::StopThread()
+{
+	if (_thread != NULL)
+	{
+		SetEvent(_stopEvent);
+		WaitForSingleObject(_thread, INFINITE);
+		CloseHandle(_thread);
+		CloseHandle(_stopEvent);
+		_thread = NULL;
+		_stopEvent = NULL;
+	}
+}
+
+void CThrottle::AddSuppressed(UINT32 index, UINT64 ticks)
+{
+	ThrottleCounters* counters = GetCounters(index);
+	if (counters != NULL)
+	{
+		counters->calls++;
+		counters->ticks += ticks;
+	}
+}
+
+ThrottleCounters* CThrottle::GetCounters(UINT32 index)
+{
+	ThrottleThread* thread = t_throttle;
+	if (thread == NULL)
+	{
+		thread = AttachThread();
+	}
+	if (index < FirstFunctionIndex)
+	{
+		return NULL;
+	}
+	UINT32 slot = index - FirstFunctionIndex;
+	UINT32 page = slot >> FunctionPageBits;
+	if (page >= MaxFunctionPages)
+	{
+		return NULL;
+	}
+	ThrottleCounters* counters = thread->pages[page];
+	if (counters == NULL)
+	{
+		counters = new ThrottleCounters[FunctionPageSize];
+		ZeroMemory(counters, sizeof(ThrottleCounters) * FunctionPageSize);
+		// Update reads the pages from the throttle thread.
+		InterlockedExchangePointer((PVOID volatile*)&thread->pages[page], counters);
+	}
+	return &counters[slot & (FunctionPageSize - 1)];
+}
+
+ThrottleThread* CThrottle::AttachThread()
+{
+	EnterCriticalSection(&_lock);
+
+	// the counters are running totals, so a thread can carry on where one that has gone left off.
+	ThrottleThread* thread = _threads;
+	while (thread != NULL && thread->inUse)
+	{
+		thread = thread->next;
+	}
+	if (thread == NULL)
+	{
+		thread = new ThrottleThread;
+		ZeroMemory(thread, sizeof(ThrottleThread));
+		thread->next = _threads;
+		_threads = thread;
+	}
+	thread->inUse = true;
+
+	LeaveCriticalSection(&_lock);
+
+	t_throttle = thread;
+	return thread;
+}
+
+void CThrottle::ReleaseThread()
+{
+	ThrottleThread* thread = t_throttle;
+	if (thread != NULL)
+	{
+		t_throttle = NULL;
+		EnterCriticalSection(&_lock);
+		thread->inUse = false;
+		LeaveCriticalSection(&_lock);
+	}
+}
+
+void CThrottle::Clear()
+{
+	_clear = true;
+}
+
+DWORD WINAPI CThrottle::ThrottleThreadProc(PVOID v)
+{
+	CThrottle* throttle = (CThrottle*)v;
+	throttle->Run();
+	return 0;
+}
+
+void CThrottle::Run()
+{
+	while (WaitForSingleObject(_stopEvent, ThrottleInterval) == WAIT_TIMEOUT)
+	{
+		CSharedMemory* sharedMemory = _profiler.GetSharedMemory();
+		if (sharedMemory != NULL && !_profiler.IsPaused())
+		{
+			Update(sharedMemory);
+			sharedMemory->FlushThread();
+		}
+	}
+}
+
+void CThrottle::Update(CSharedMemory* sharedMemory)
+{
+	bool clear = _clear;
+	_clear = false;
+
+	DWORD limit = _limit;
+	long count = _functions.GetCount();
+
+	// sum the running totals of all the threads, a page at a time.
+	std::vector<ThrottleCounters> totals(count, ThrottleCounters());
+	for (ThrottleThread* thread = _threads; thread != NULL; thread = thread->next)
+	{
+		for (long slot = 0; slot < count; slot += FunctionPageSize)
+		{
+			ThrottleCounters* counters = thread->pages[slot >> FunctionPageBits];
+			if (counters == NULL)
+			{
+				continue;
+			}
+			long end = min(slot + FunctionPageSize, count);
+			for (long i = slot; i < end; i++)
+			{
+				// these are being updated as we read them, we'll get the rest next time.
+				const ThrottleCounters& c = counters[i & (FunctionPageSize - 1)];
+				totals[i].hits += c.hits;
+				totals[i].calls += c.calls;
+				totals[i].ticks += c.ticks;
+			}
+		}
+	}
+	_seen.resize(count, ThrottleCounters());
+	_generations.resize(count, 0);
+
+	for (long slot = 0; slot < count; slot++)
+	{
+		UINT32 index = FirstFunctionIndex + slot;
+		FunctionInfo* info = _functions.Get(index);
+		ThrottleCounters seen = _seen[slot];
+		_seen[slot] = totals[slot];
+		if (info->generation != _generations[slot])
+		{
+			// the index was given to another function, what was counted so far belongs to the old one.
+			_generations[slot] = info->generation;
+			continue;
+		}
+		UINT64 hits = totals[slot].hits - seen.hits;
+
+		if (info->suppressed == 0)
+		{
+			if (limit != 0 && (DWORD)hits > limit)
+			{
+				info->suppressed = 1;
+			}
+		}
+		else if (limit == 0 || (DWORD)hits < limit / 2)
+		{
+			info->suppressed = 0;
+		}
+
+		// calls that were already under way when it was restored are still counted here.
+		if (totals[slot].calls != seen.calls)
+		{
+			SummaryPayload summary;
+			summary.index = index;
+			summary.reserved = 0;
+			summary.calls = totals[slot].calls - seen.calls;
+			summary.ticks = totals[slot].ticks - seen.ticks;
+			if (!clear)
+			{
+				sharedMemory->WriteExtended(SummaryRecord, &summary, sizeof(summary));
+			}
+		}
+	}
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "SharedMemory.h"
+#include "FunctionTable.h"
+
+class CProfiler;
+
+const DWORD ThrottleInterval = 1000; // milliseconds
+
+// a thread's own running totals for one function, only that thread writes to them.
+struct ThrottleCounters
+{
+	UINT64 hits;  // calls
+	UINT64 calls; // calls that were suppressed
+	UINT64 ticks; // and the time spent in them
+};
+
+struct ThrottleThread
+{
+	ThrottleCounters* volatile pages[MaxFunctionPages];
+	bool inUse;          // false once the thread has gone and this is waiting to be reused
+	ThrottleThread* next;
+};
+
+// In trace mode a handful of tiny functions (property getters and the like) can make up most
+// of the records.  When throttling is on the hooks count the calls to each function, and once a
+// second the throttle thread looks at the counts.  A function called more often than the limit
+// is suppressed: its calls are only counted and timed, and a SummaryRecord with the totals is
+// written each second instead.  It is recorded again once its rate drops below half the limit.
+// The thread only runs while there is a limit and a buffer to write to.  The hooks only add to counters of their own thread so hot functions don't bounce a shared
+// cache line between cores, the throttle thread sums them and works out what changed.
+class CThrottle
+{
+public:
+	CThrottle(CProfiler& profiler, CFunctionTable& functions);
+	~CThrottle();
+
+	// the buffer is ready, or going away.
+	void Start();
+	void Stop();
+
+	// calls per second, 0 turns throttling off.
+	void SetLimit(DWORD callsPerSecond);
+
+	bool IsEnabled()
+	{
+		return _limit != 0;
+	}
+
+	// called from the Enter hook, returns true if the call shouldn't be recorded.
+	bool Suppress(UINT32 index, FunctionInfo* info)
+	{
+		ThrottleCounters* counters = GetCounters(index);
+		if (counters != NULL)
+		{
+			counters->hits++;
+		}
+		return info->suppressed != 0;
+	}
+
+	// the calling thread is going away, its counters are handed to the next thread.
+	void ReleaseThread();
+
+	// a suppressed call has returned.
+	void AddSuppressed(UINT32 index, UINT64 ticks);
+
+	// the records were thrown away (DeleteAll), drop the counts too.
+	void Clear();
+
+private:
+	static DWORD WINAPI ThrottleThreadProc(PVOID v);
+
+	void StartThread();
+	void StopThread();
+	void Run();
+	void Update(CSharedMemory* sharedMemory);
+	ThrottleCounters* GetCounters(UINT32 index);
+	ThrottleThread* AttachThread();
+
+	CProfiler& _profiler;
+	CFunctionTable& _functions;
+	HANDLE _thread;
+	HANDLE _stopEvent;
+	volatile DWORD _limit;
+	volatile bool _clear;
+	bool _started;       // between Start and Stop
+	ThrottleThread* volatile _threads;
+	CRITICAL_SECTION _lock;
+	CRITICAL_SECTION _threadLock; // Start, Stop and SetLimit come from different threads
+
+	// only used on the throttle thread, what the totals were when it last looked.
+	std::vector<ThrottleCounters> _seen;
+	std::vector<long> _generations;
+};
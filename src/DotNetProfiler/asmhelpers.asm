@@ -1,6 +1,35 @@
 extern EnterStub:proc
 extern LeaveStub:proc
 extern TailcallStub:proc
+extern g_recordingPaused:dword
+extern g_fastPathKey:dword
+extern t_fastPath:byte
+extern _tls_index:dword
+
+; FastPath, ChunkWriter and ShadowFrame, FastPath.h checks these offsets.
+FastPathKey             equ 0
+FastPathBufferId        equ 4
+FastPathWriter          equ 8
+FastPathFrames          equ 16
+FastPathDepth           equ 24
+FastPathSavedR10        equ 32
+FastPathSavedR11        equ 40
+
+WriterPos               equ 24
+WriterEnd               equ 32
+WriterId                equ 48
+WriterTimestamp         equ 80
+
+FrameIndex              equ 0
+FrameSuppressed         equ 4       ; and FrameCounted after it
+FrameStart              equ 8
+FrameChildren           equ 16
+
+RecordSize              equ 8
+MaxRecordBytes          equ 32
+MaxShadowDepth          equ 1024
+LeaveRecord             equ 1
+TailcallRecord          equ 2
 
 
 _TEXT segment para 'CODE'
@@ -17,6 +46,10 @@ _TEXT segment para 'CODE'
 
 EnterNaked2    proc    frame
 
+        ; nothing to do while recording is paused, return before touching the stack
+        cmp     g_recordingPaused, 0
+        jne     EnterNaked2Paused
+
         ; save registers
         push    rax
         .allocstack 8
@@ -32,6 +65,9 @@ EnterNaked2    proc    frame
 
         .endprolog
 
+        ; the stubs take the clientData, which is our function index
+        mov     rcx, rdx
+
         call    EnterStub
 
         add     rsp, 20h
@@ -44,6 +80,9 @@ EnterNaked2    proc    frame
         ; return
         ret
 
+EnterNaked2Paused:
+        ret
+
 EnterNaked2    endp
 
 ;typedef void LeaveNaked2(
@@ -58,6 +97,10 @@ EnterNaked2    endp
 
 LeaveNaked2    proc    frame
 
+        ; nothing to do while recording is paused, return before touching the stack
+        cmp     g_recordingPaused, 0
+        jne     LeaveNaked2Paused
+
         ; save integer return register
         push    rax
         .allocstack 8
@@ -67,6 +110,9 @@ LeaveNaked2    proc    frame
 
         .endprolog
 
+        ; the stubs take the clientData, which is our function index
+        mov     rcx, rdx
+
         call    LeaveStub
 
         add     rsp, 20h
@@ -77,6 +123,9 @@ LeaveNaked2    proc    frame
         ; return
         ret
 
+LeaveNaked2Paused:
+        ret
+
 LeaveNaked2    endp
 
 ;typedef void TailcallNaked2(
@@ -90,6 +139,10 @@ LeaveNaked2    endp
 
 TailcallNaked2   proc    frame
 
+        ; nothing to do while recording is paused, return before touching the stack
+        cmp     g_recordingPaused, 0
+        jne     TailcallNaked2Paused
+
         ; save rax
         push    rax
         .allocstack 8
@@ -99,6 +152,9 @@ TailcallNaked2   proc    frame
 
         .endprolog
 
+        ; the stubs take the clientData, which is our function index
+        mov     rcx, rdx
+
         call    TailcallStub
 
         add     rsp, 20h
@@ -109,16 +165,118 @@ TailcallNaked2   proc    frame
         ; return
         ret
 
+TailcallNaked2Paused:
+        ret
+
 TailcallNaked2   endp
 
 ;typedef void EnterNaked3(
 ;         rcx = FunctionIDOrClientID functionIDOrClientID);
+;
+; The ELT3 stubs first try to handle the call themselves, see FastPath.h.  They are leaves that
+; don't touch the stack, rax is kept in r9 and r8 points at the thread's FastPath.  If anything
+; doesn't check out they put the registers back and jump to the stub that calls into the profiler,
+; which sets up the FastPath again for the next call.
 
         align   16
 
         public  EnterNaked3
 
-EnterNaked3     proc    frame
+EnterNaked3     proc
+
+        ; nothing to do while recording is paused
+        cmp     g_recordingPaused, 0
+        jne     EnterNaked3Done
+
+        ; the profiler ignores index 0
+        test    ecx, ecx
+        jz      EnterNaked3Slow
+
+        mov     r9, rax
+
+        ; r8 = this thread's FastPath
+        mov     eax, _tls_index
+        mov     r8, qword ptr gs:[58h]
+        mov     r8, [r8 + rax * 8]
+        mov     eax, SECTIONREL t_fastPath
+        add     r8, rax
+
+        ; set up for what the profiler is doing now?
+        mov     eax, [r8 + FastPathKey]
+        test    eax, eax
+        jz      EnterNaked3Restore
+        cmp     eax, g_fastPathKey
+        jne     EnterNaked3Restore
+
+        ; r10 and r11 have to be kept too
+        mov     [r8 + FastPathSavedR10], r10
+        mov     [r8 + FastPathSavedR11], r11
+
+        ; r10 = the writer, its chunk must be in this buffer and have room for the record
+        mov     r10, [r8 + FastPathWriter]
+        mov     eax, [r10 + WriterId]
+        cmp     eax, [r8 + FastPathBufferId]
+        jne     EnterNaked3RestoreAll
+        mov     rdx, [r10 + WriterPos]
+        add     rdx, MaxRecordBytes
+        cmp     rdx, [r10 + WriterEnd]
+        ja      EnterNaked3RestoreAll
+
+        ; r11 = the depth, the frame has to be kept
+        mov     r11, [r8 + FastPathDepth]
+        cmp     dword ptr [r11], MaxShadowDepth
+        jae     EnterNaked3RestoreAll
+
+        ; rax = now, the delta has to fit
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     rdx, rax
+        sub     rdx, [r10 + WriterTimestamp]
+        shr     rdx, 32
+        jnz     EnterNaked3RestoreAll
+
+        ; push the frame, they are 24 bytes
+        mov     edx, [r11]
+        lea     rdx, [rdx + rdx * 2]
+        shl     rdx, 3
+        add     rdx, [r8 + FastPathFrames]
+        mov     [rdx + FrameIndex], ecx
+        mov     dword ptr [rdx + FrameSuppressed], 0
+        mov     [rdx + FrameStart], rax
+        mov     qword ptr [rdx + FrameChildren], 0
+        inc     dword ptr [r11]
+
+        ; append the record, pos moves after it is written
+        mov     rdx, [r10 + WriterPos]
+        mov     [rdx], ecx
+        mov     r11, rax
+        sub     r11, [r10 + WriterTimestamp]
+        mov     [rdx + 4], r11d
+        mov     [r10 + WriterTimestamp], rax
+        add     rdx, RecordSize
+        mov     [r10 + WriterPos], rdx
+
+        mov     r10, [r8 + FastPathSavedR10]
+        mov     r11, [r8 + FastPathSavedR11]
+        mov     rax, r9
+
+EnterNaked3Done:
+        ret
+
+EnterNaked3RestoreAll:
+        mov     r10, [r8 + FastPathSavedR10]
+        mov     r11, [r8 + FastPathSavedR11]
+
+EnterNaked3Restore:
+        mov     rax, r9
+        jmp     EnterNaked3Slow
+
+EnterNaked3     endp
+
+        align   16
+
+EnterNaked3Slow proc    frame
 
         ; save registers
         push    rax
@@ -147,7 +305,7 @@ EnterNaked3     proc    frame
         ; return
         ret
 
-EnterNaked3     endp
+EnterNaked3Slow endp
 
 ;typedef void LeaveNaked3(
 ;         rcx = FunctionIDOrClientID functionIDOrClientID);
@@ -156,7 +314,86 @@ EnterNaked3     endp
 
         public  LeaveNaked3
 
-LeaveNaked3     proc    frame
+LeaveNaked3     proc
+
+        ; nothing to do while recording is paused
+        cmp     g_recordingPaused, 0
+        jne     LeaveNaked3Done
+
+        mov     r9, rax
+
+        ; r8 = this thread's FastPath
+        mov     eax, _tls_index
+        mov     r8, qword ptr gs:[58h]
+        mov     r8, [r8 + rax * 8]
+        mov     eax, SECTIONREL t_fastPath
+        add     r8, rax
+
+        ; set up for what the profiler is doing now?
+        mov     eax, [r8 + FastPathKey]
+        test    eax, eax
+        jz      LeaveNaked3Restore
+        cmp     eax, g_fastPathKey
+        jne     LeaveNaked3Restore
+
+        ; r10 = the writer, its chunk must be in this buffer and have room for the record
+        mov     r10, [r8 + FastPathWriter]
+        mov     eax, [r10 + WriterId]
+        cmp     eax, [r8 + FastPathBufferId]
+        jne     LeaveNaked3Restore
+        mov     rdx, [r10 + WriterPos]
+        add     rdx, MaxRecordBytes
+        cmp     rdx, [r10 + WriterEnd]
+        ja      LeaveNaked3Restore
+
+        ; edx = the depth after the pop, there has to be a frame that was kept and wasn't suppressed
+        mov     r11, [r8 + FastPathDepth]
+        mov     edx, [r11]
+        dec     edx
+        cmp     edx, MaxShadowDepth     ; unsigned, so an empty stack goes the long way too
+        jae     LeaveNaked3Restore
+        lea     rdx, [rdx + rdx * 2]
+        shl     rdx, 3
+        add     rdx, [r8 + FastPathFrames]
+        cmp     word ptr [rdx + FrameSuppressed], 0
+        jne     LeaveNaked3Restore
+
+        ; rax = now, the delta has to fit
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     rdx, rax
+        sub     rdx, [r10 + WriterTimestamp]
+        shr     rdx, 32
+        jnz     LeaveNaked3Restore
+
+        ; pop the frame
+        dec     dword ptr [r11]
+
+        ; append the record, pos moves after it is written
+        mov     rdx, [r10 + WriterPos]
+        mov     dword ptr [rdx], LeaveRecord
+        mov     r11, rax
+        sub     r11, [r10 + WriterTimestamp]
+        mov     [rdx + 4], r11d
+        mov     [r10 + WriterTimestamp], rax
+        add     rdx, RecordSize
+        mov     [r10 + WriterPos], rdx
+
+        mov     rax, r9
+
+LeaveNaked3Done:
+        ret
+
+LeaveNaked3Restore:
+        mov     rax, r9
+        jmp     LeaveNaked3Slow
+
+LeaveNaked3     endp
+
+        align   16
+
+LeaveNaked3Slow proc    frame
 
         ; save integer return register
         push    rax
@@ -177,7 +414,7 @@ LeaveNaked3     proc    frame
         ; return
         ret
 
-LeaveNaked3     endp
+LeaveNaked3Slow endp
 
 ;typedef void TailcallNaked3(
 ;         rcx = FunctionIDOrClientID functionIDOrClientID);
@@ -186,7 +423,86 @@ LeaveNaked3     endp
 
         public  TailcallNaked3
 
-TailcallNaked3  proc    frame
+TailcallNaked3  proc
+
+        ; nothing to do while recording is paused
+        cmp     g_recordingPaused, 0
+        jne     TailcallNaked3Done
+
+        mov     r9, rax
+
+        ; r8 = this thread's FastPath
+        mov     eax, _tls_index
+        mov     r8, qword ptr gs:[58h]
+        mov     r8, [r8 + rax * 8]
+        mov     eax, SECTIONREL t_fastPath
+        add     r8, rax
+
+        ; set up for what the profiler is doing now?
+        mov     eax, [r8 + FastPathKey]
+        test    eax, eax
+        jz      TailcallNaked3Restore
+        cmp     eax, g_fastPathKey
+        jne     TailcallNaked3Restore
+
+        ; r10 = the writer, its chunk must be in this buffer and have room for the record
+        mov     r10, [r8 + FastPathWriter]
+        mov     eax, [r10 + WriterId]
+        cmp     eax, [r8 + FastPathBufferId]
+        jne     TailcallNaked3Restore
+        mov     rdx, [r10 + WriterPos]
+        add     rdx, MaxRecordBytes
+        cmp     rdx, [r10 + WriterEnd]
+        ja      TailcallNaked3Restore
+
+        ; edx = the depth after the pop, there has to be a frame that was kept and wasn't suppressed
+        mov     r11, [r8 + FastPathDepth]
+        mov     edx, [r11]
+        dec     edx
+        cmp     edx, MaxShadowDepth     ; unsigned, so an empty stack goes the long way too
+        jae     TailcallNaked3Restore
+        lea     rdx, [rdx + rdx * 2]
+        shl     rdx, 3
+        add     rdx, [r8 + FastPathFrames]
+        cmp     word ptr [rdx + FrameSuppressed], 0
+        jne     TailcallNaked3Restore
+
+        ; rax = now, the delta has to fit
+        rdtsc
+        shl     rdx, 32
+        or      rax, rdx
+        mov     rdx, rax
+        sub     rdx, [r10 + WriterTimestamp]
+        shr     rdx, 32
+        jnz     TailcallNaked3Restore
+
+        ; pop the frame
+        dec     dword ptr [r11]
+
+        ; append the record, pos moves after it is written
+        mov     rdx, [r10 + WriterPos]
+        mov     dword ptr [rdx], TailcallRecord
+        mov     r11, rax
+        sub     r11, [r10 + WriterTimestamp]
+        mov     [rdx + 4], r11d
+        mov     [r10 + WriterTimestamp], rax
+        add     rdx, RecordSize
+        mov     [r10 + WriterPos], rdx
+
+        mov     rax, r9
+
+TailcallNaked3Done:
+        ret
+
+TailcallNaked3Restore:
+        mov     rax, r9
+        jmp     TailcallNaked3Slow
+
+TailcallNaked3  endp
+
+        align   16
+
+TailcallNaked3Slow proc frame
 
         ; save rax
         push    rax
@@ -207,7 +523,7 @@ TailcallNaked3  proc    frame
         ; return
         ret
 
-TailcallNaked3  endp
+TailcallNaked3Slow endp
 
 
 _TEXT ends
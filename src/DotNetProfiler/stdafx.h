@@ -33,6 +33,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <deque>
 #include <limits>
 #include <sstream>
 #include <algorithm>
@@ -0,0 +1,122 @@
+#include "StdAfx.h"
+#include "ProfilerTests.h"
+#include <math.h>
+
+namespace
+{
+	const int ReadCount = 10 * 1000 * 1000;
+
+	// a call that takes about as long as the short calls in our hot paths.
+	const double ShortCallSeconds = 20e-6;
+	const int ShortCalls = 2000;
+
+	volatile UINT64 s_sink;
+
+	template<typename Read>
+	double TimeReads(Read read)
+	{
+		UINT64 sum = 0;
+		double begin = Seconds();
+		for (int i = 0; i < ReadCount; i++)
+		{
+			sum += read();
+		}
+		double elapsed = Seconds() - begin;
+		s_sink = sum;
+		return elapsed * 1e9 / ReadCount;
+	}
+
+	UINT64 ReadTickCount()
+	{
+		return GetTickCount();
+	}
+
+	UINT64 ReadPerformanceCounter()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	UINT64 ReadClock()
+	{
+		return CClock::Now();
+	}
+
+	void SpinFor(double seconds)
+	{
+		double until = Seconds() + seconds;
+		while (Seconds() < until)
+		{
+		}
+	}
+}
+
+// The hooks used to stamp records with the millisecond tick a threadpool timer kept up to date,
+// this compares what reading each clock costs and how well it measures a short call.
+void ClockBenchmark()
+{
+	printf("  clock              ns/read\n");
+	printf("  GetTickCount      %8.2f\n", TimeReads(&ReadTickCount));
+	printf("  performance count %8.2f\n", TimeReads(&ReadPerformanceCounter));
+	printf("  CClock::Now       %8.2f\n", TimeReads(&ReadClock));
+
+	ClockCalibration calibration;
+	CClock::Calibrate(calibration);
+
+	int tickZeros = 0;
+	int clockZeros = 0;
+	double tickTotal = 0;
+	double clockTotal = 0;
+	double actualTotal = 0;
+	for (int i = 0; i < ShortCalls; i++)
+	{
+		DWORD tickStart = GetTickCount();
+		UINT64 clockStart = CClock::Now();
+		double start = Seconds();
+		SpinFor(ShortCallSeconds);
+		double end = Seconds();
+		UINT64 clockEnd = CClock::Now();
+		DWORD tickEnd = GetTickCount();
+
+		tickZeros += (tickEnd == tickStart) ? 1 : 0;
+		clockZeros += (clockEnd == clockStart) ? 1 : 0;
+		tickTotal += (tickEnd - tickStart) / 1000.0;
+		clockTotal += (double)(clockEnd - clockStart) / calibration.frequency;
+		actualTotal += end - start;
+	}
+
+	printf("  %d calls of %.0fus\n", ShortCalls, ShortCallSeconds * 1e6);
+	printf("  clock              read as 0   error\n");
+	printf("  GetTickCount      %10d %6.1f%%\n", tickZeros, (tickTotal - actualTotal) * 100 / actualTotal);
+	printf("  CClock::Now       %10d %6.1f%%\n", clockZeros, (clockTotal - actualTotal) * 100 / actualTotal);
+	Check(clockZeros == 0, "the clock sees every short call take time");
+	Check(fabs(clockTotal - actualTotal) < actualTotal * 0.05, "the clock measures short calls to within 5%");
+}
+
+// timestamps turned into time with the calibration agree with the performance counter.
+void ClockCalibrationTest()
+{
+	ClockCalibration calibration;
+	CClock::Calibrate(calibration);
+	Check(calibration.frequency != 0, "the clock has a frequency");
+	Check(calibration.qpcFrequency != 0, "the performance counter frequency is recorded");
+
+	UINT64 before = CClock::Now();
+	double start = Seconds();
+	Sleep(200);
+	UINT64 after = CClock::Now();
+	double elapsed = Seconds() - start;
+
+	double measured = (double)(after - before) / calibration.frequency;
+	Check(after > before, "the clock moves forward");
+	Check(fabs(measured - elapsed) < elapsed * 0.01, "the calibrated clock agrees with the performance counter to within 1%");
+
+	// the base pair lets a reader line timestamps up with performance counter time.
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	UINT64 now = CClock::Now();
+	double fromClock = (double)(now - calibration.base) / calibration.frequency;
+	double fromCounter = (double)(counter.QuadPart - calibration.qpcBase) / calibration.qpcFrequency;
+	Check(fabs(fromClock - fromCounter) < 0.001, "the calibration base lines the clock up with the performance counter");
+}
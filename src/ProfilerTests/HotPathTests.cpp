@@ -0,0 +1,355 @@
+#include "StdAfx.h"
+#include "ProfilerTests.h"
+#include "ShadowStack.h"
+#include "FastPath.h"
+#include <algorithm>
+
+#ifdef _AMD64_
+// the ELT3 stubs in asmhelpers.asm, the tests call them the way the CLR does.
+EXTERN_C void EnterNaked3(UINT_PTR clientData);
+EXTERN_C void LeaveNaked3(UINT_PTR clientData);
+EXTERN_C void TailcallNaked3(UINT_PTR clientData);
+#endif
+
+namespace
+{
+	const long HotPathBufferSize = 64 * 1024 * 1024;
+	const int HotPathPairs = 4 * 1000 * 1000;
+
+	// What the hooks used to do for each record: take a lock that every thread shares, copy
+	// a pointer sized id and timestamp to the shared cursor and move it along.  The timestamp
+	// was a global the tick timer kept up to date.
+	class COldPath
+	{
+	public:
+		COldPath(BYTE* buffer, long size)
+		{
+			InitializeCriticalSection(&_lock);
+			_buffer = buffer;
+			_pos = buffer;
+			_end = buffer + size;
+			_currentTime = GetTickCount();
+			_callCount = 0;
+		}
+
+		~COldPath()
+		{
+			DeleteCriticalSection(&_lock);
+		}
+
+		void WriteRecord(UINT_PTR id)
+		{
+			UINT_PTR record[2] = { id, _currentTime };
+			EnterCriticalSection(&_lock);
+			if (_pos + sizeof(record) > _end)
+			{
+				// the old Reset zeroed the whole buffer here, which isn't what is being timed.
+				_pos = _buffer;
+			}
+			UINT_PTR* target = (UINT_PTR*)_pos;
+			target[0] = record[0];
+			target[1] = record[1];
+			_pos += sizeof(record);
+			LeaveCriticalSection(&_lock);
+		}
+
+		void Enter(UINT_PTR id)
+		{
+			_callCount++;
+			WriteRecord(id);
+		}
+
+		void Leave()
+		{
+			WriteRecord(LeaveRecord);
+		}
+
+	private:
+		CRITICAL_SECTION _lock;
+		BYTE* _buffer;
+		BYTE* _pos;
+		BYTE* _end;
+		volatile UINT_PTR _currentTime;
+		volatile long _callCount;
+	};
+
+#ifdef _AMD64_
+	// the buffer and shadow stacks the stubs' long way round uses, CProfiler's need the CLR.
+	CSharedMemory* s_stubBuffer;
+	__declspec(thread) CShadowStack t_stubShadow;
+	__declspec(thread) long t_slowCalls;
+
+	struct HotPathArgs
+	{
+		COldPath* oldPath;          // one of these is set
+		CSharedMemory* sharedMemory;
+		HANDLE start;
+		UINT64 cycles;
+		long slowCalls;
+	};
+
+	DWORD WINAPI HotPathThread(PVOID v)
+	{
+		HotPathArgs* args = (HotPathArgs*)v;
+		WaitForSingleObject(args->start, INFINITE);
+
+		UINT64 begin = __rdtsc();
+		if (args->oldPath != NULL)
+		{
+			COldPath* oldPath = args->oldPath;
+			for (int i = 0; i < HotPathPairs; i++)
+			{
+				oldPath->Enter(FirstFunctionIndex + (i & 1023));
+				oldPath->Leave();
+			}
+		}
+		else
+		{
+			for (int i = 0; i < HotPathPairs; i++)
+			{
+				EnterNaked3(FirstFunctionIndex + (i & 1023));
+				LeaveNaked3(FirstFunctionIndex + (i & 1023));
+			}
+		}
+		args->cycles = __rdtsc() - begin;
+
+		if (args->sharedMemory != NULL)
+		{
+			args->slowCalls = t_slowCalls;
+			CFastPath::Disarm();
+			args->sharedMemory->ReleaseThread();
+			CSharedMemory::DetachThread();
+		}
+		return 0;
+	}
+
+	// the average cycles per Enter and Leave pair over the threads, and how many calls went the long way.
+	double TimeHotPath(COldPath* oldPath, CSharedMemory* sharedMemory, int threads, long& slowCalls)
+	{
+		HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+		std::vector<HotPathArgs> args(threads);
+		std::vector<HANDLE> handles(threads);
+		for (int i = 0; i < threads; i++)
+		{
+			args[i].oldPath = oldPath;
+			args[i].sharedMemory = sharedMemory;
+			args[i].start = start;
+			args[i].cycles = 0;
+			args[i].slowCalls = 0;
+			handles[i] = CreateThread(NULL, 0, &HotPathThread, &args[i], 0, NULL);
+		}
+		Sleep(50);
+		SetEvent(start);
+		WaitForMultipleObjects(threads, &handles[0], TRUE, INFINITE);
+
+		UINT64 cycles = 0;
+		slowCalls = 0;
+		for (int i = 0; i < threads; i++)
+		{
+			cycles += args[i].cycles;
+			slowCalls += args[i].slowCalls;
+			CloseHandle(handles[i]);
+		}
+		CloseHandle(start);
+		return (double)cycles / threads / HotPathPairs;
+	}
+
+	bool OlderChunk(ChunkHeader* a, ChunkHeader* b)
+	{
+		return a->sequence < b->sequence;
+	}
+#endif
+}
+
+#ifdef _AMD64_
+
+// The profiler side of the stubs in asmhelpers.asm, for when they can't handle a call themselves.
+// These do what CProfiler::Enter, Leave and Tailcall do in trace mode with the throttle off, and
+// set up the thread's FastPath again the same way.
+EXTERN_C volatile LONG g_recordingPaused = 0;
+
+EXTERN_C void __stdcall EnterStub(UINT_PTR clientData)
+{
+	long key = g_fastPathKey;
+	CShadowStack& shadow = t_stubShadow;
+	UINT64 now = CClock::Now();
+	t_slowCalls++;
+	shadow.Sync(1);
+	if (shadow.Push((UINT32)clientData, now, false))
+	{
+		s_stubBuffer->WriteRecord((UINT32)clientData, now);
+	}
+	CFastPath::Arm(key, s_stubBuffer, shadow);
+}
+
+static void LeaveOrTailcall(UINT_PTR clientData, UINT32 tag)
+{
+	long key = g_fastPathKey;
+	CShadowStack& shadow = t_stubShadow;
+	UINT64 now = CClock::Now();
+	t_slowCalls++;
+	ShadowFrame* frame = shadow.Sync(1) ? shadow.Pop() : NULL;
+	Check(frame == NULL || frame->index == (UINT32)clientData, "the stub passes on the function it was called for");
+	if (frame == NULL || !frame->suppressed)
+	{
+		s_stubBuffer->WriteRecord(tag, now);
+	}
+	CFastPath::Arm(key, s_stubBuffer, shadow);
+}
+
+EXTERN_C void __stdcall LeaveStub(UINT_PTR clientData)
+{
+	LeaveOrTailcall(clientData, LeaveRecord);
+}
+
+EXTERN_C void __stdcall TailcallStub(UINT_PTR clientData)
+{
+	LeaveOrTailcall(clientData, TailcallRecord);
+}
+
+// Calls made through the stubs come out as the same records in the same order as the long way
+// round, nested past the depth the shadow stack keeps and across chunks, and the stubs handle
+// nearly all of them themselves.
+void FastPathTest()
+{
+	const long bufferSize = 32 * 1024 * 1024;  // room for every record, the ring never wraps
+	const int rounds = 20000;
+	CTestMapping mapping(bufferSize);
+	CSharedMemory sharedMemory(mapping.GetName(), bufferSize);
+	Check(sharedMemory.GetStatus() == S_OK, "the buffer is mapped");
+	if (FAILED(sharedMemory.GetStatus()))
+	{
+		return;
+	}
+	s_stubBuffer = &sharedMemory;
+	CFastPath::Update(CClock::UsesTsc());
+	t_slowCalls = 0;
+
+	std::vector<UINT32> expected;
+	UINT64 first = CClock::Now();
+	for (int i = 0; i < rounds; i++)
+	{
+		UINT32 caller = FirstFunctionIndex + (i % 7);
+		UINT32 callee = FirstFunctionIndex + 100 + (i % 5);
+		EnterNaked3(caller);
+		EnterNaked3(callee);
+		LeaveNaked3(callee);
+		TailcallNaked3(caller);
+		EnterNaked3(callee);
+		LeaveNaked3(callee);
+		UINT32 calls[] = { caller, callee, LeaveRecord, TailcallRecord, callee, LeaveRecord };
+		expected.insert(expected.end(), calls, calls + _countof(calls));
+
+		if (i % 5000 == 0)
+		{
+			// deeper than the frames that are kept.
+			for (int depth = 0; depth < MaxShadowDepth + 10; depth++)
+			{
+				EnterNaked3(caller);
+				expected.push_back(caller);
+			}
+			for (int depth = 0; depth < MaxShadowDepth + 10; depth++)
+			{
+				LeaveNaked3(caller);
+				expected.push_back(LeaveRecord);
+			}
+		}
+	}
+	UINT64 finished = CClock::Now();
+	Check(t_stubShadow.GetDepth() == 0, "the shadow stack is empty again");
+	if (CClock::UsesTsc())
+	{
+		Check(t_slowCalls * 100 < (long)expected.size(), "the stubs handle nearly every call themselves");
+	}
+	CFastPath::Disarm();
+	sharedMemory.ReleaseThread();
+	CSharedMemory::DetachThread();
+	CFastPath::Update(false);
+
+	std::vector<ChunkHeader*> chunks;
+	for (long i = 0; i < sharedMemory.GetChunkCount(); i++)
+	{
+		ChunkHeader* chunk = sharedMemory.GetChunkAt(i);
+		if (chunk->state == ChunkSealed)
+		{
+			chunks.push_back(chunk);
+		}
+	}
+	std::sort(chunks.begin(), chunks.end(), &OlderChunk);
+
+	size_t n = 0;
+	bool ordered = true;
+	bool timed = true;
+	UINT64 last = first;
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		Record* record = (Record*)(chunks[i] + 1);
+		Record* end = (Record*)((BYTE*)record + chunks[i]->used);
+		UINT64 timestamp = chunks[i]->baseTimestamp;
+		for (; record < end; record++)
+		{
+			if (record->id == ResyncRecord)
+			{
+				continue;
+			}
+			if (record->id == TimeBaseRecord)
+			{
+				timestamp = *(UINT64*)(record + 1);
+				record++;
+				continue;
+			}
+			timestamp += record->delta;
+			ordered = ordered && n < expected.size() && record->id == expected[n];
+			timed = timed && timestamp >= last && timestamp <= finished;
+			last = timestamp;
+			n++;
+		}
+	}
+	Check(n == expected.size(), "every call has its record");
+	Check(ordered, "the records are the calls in the order they were made");
+	Check(timed, "each record is timed between the one before it and the end of the run");
+}
+
+// Cycles for an Enter and Leave pair on the old locked path and through the x64 stubs that the
+// CLR calls now, first on one thread and then with every core calling at once.  Once a thread
+// is set up the stubs handle its calls themselves, they only call in to move to the next
+// staging buffer.
+void HotPathBenchmark()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int cores = min((int)info.dwNumberOfProcessors, MAXIMUM_WAIT_OBJECTS);
+
+	std::vector<BYTE> oldBuffer(HotPathBufferSize);
+	CTestMapping mapping(HotPathBufferSize);
+	CSharedMemory sharedMemory(mapping.GetName(), HotPathBufferSize);
+	Check(sharedMemory.GetStatus() == S_OK, "the buffer is mapped");
+	if (FAILED(sharedMemory.GetStatus()))
+	{
+		return;
+	}
+	s_stubBuffer = &sharedMemory;
+	CFastPath::Update(CClock::UsesTsc());
+
+	printf("  threads  old cycles/pair  new cycles/pair  calls in\n");
+	for (int threads = 1; threads <= cores; threads = (threads == cores) ? cores + 1 : min(threads * 2, cores))
+	{
+		COldPath oldPath(&oldBuffer[0], HotPathBufferSize);
+		long slowCalls;
+		double oldCycles = TimeHotPath(&oldPath, NULL, threads, slowCalls);
+		double newCycles = TimeHotPath(NULL, &sharedMemory, threads, slowCalls);
+		printf("  %7d %16.1f %16.1f %9ld\n", threads, oldCycles, newCycles, slowCalls);
+	}
+	CFastPath::Update(false);
+}
+#else
+void FastPathTest()
+{
+	printf("  the stubs that handle calls themselves are x64 only\n");
+}
+
+void HotPathBenchmark()
+{
+	printf("  the stubs that handle calls themselves are x64 only\n");
+}
+#endif
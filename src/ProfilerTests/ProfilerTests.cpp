@@ -0,0 +1,159 @@
+#include "StdAfx.h"
+#include "ProfilerTests.h"
+
+namespace
+{
+	long s_failures;
+	volatile LONG s_nextMapping;
+
+	struct TestEntry
+	{
+		const char* name;
+		void (*run)();
+		bool benchmark;
+	};
+
+	const TestEntry s_tests[] =
+	{
+		{ "ClockCalibration", &ClockCalibrationTest, false },
+		{ "Clock", &ClockBenchmark, true },
+		{ "RingWraparound", &RingWraparoundTest, false },
+		{ "UnwindStress", &UnwindStressTest, false },
+		{ "WriterScaling", &WriterScalingBenchmark, true },
+		{ "FastPath", &FastPathTest, false },
+		{ "HotPath", &HotPathBenchmark, true },
+		{ "Recorder", &RecorderBenchmark, true },
+	};
+
+	struct WriterArgs
+	{
+		CSharedMemory* sharedMemory;
+		HANDLE start;
+		UINT_PTR threadId;
+		LONG64 records;
+	};
+
+	DWORD WINAPI WriterThread(PVOID v)
+	{
+		WriterArgs* args = (WriterArgs*)v;
+		CSharedMemory* sharedMemory = args->sharedMemory;
+		CSharedMemory::SetCurrentThreadId(args->threadId);
+		WaitForSingleObject(args->start, INFINITE);
+
+		// what the hooks write for a call, the functions are spread out like they would be.
+		for (LONG64 i = 0; i < args->records; i += 2)
+		{
+			sharedMemory->WriteRecord(FirstFunctionIndex + (UINT32)(i & 1023), CClock::Now());
+			sharedMemory->WriteRecord(LeaveRecord, CClock::Now());
+		}
+		sharedMemory->ReleaseThread();
+		CSharedMemory::DetachThread();
+		return 0;
+	}
+}
+
+void Check(bool condition, const char* what)
+{
+	if (!condition)
+	{
+		printf("  FAILED: %s\n", what);
+		s_failures++;
+	}
+}
+
+double Seconds()
+{
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+CTestMapping::CTestMapping(long size)
+{
+	swprintf_s(_name, _countof(_name), L"ProfilerTests%u_%d", GetCurrentProcessId(), InterlockedIncrement(&s_nextMapping));
+	_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, size, _name);
+}
+
+CTestMapping::~CTestMapping()
+{
+	CloseHandle(_mapping);
+}
+
+double RunWriters(CSharedMemory* sharedMemory, int threads, LONG64 recordsPerThread)
+{
+	HANDLE start = CreateEvent(NULL, TRUE, FALSE, NULL);
+	std::vector<WriterArgs> args(threads);
+	std::vector<HANDLE> handles(threads);
+	for (int i = 0; i < threads; i++)
+	{
+		args[i].sharedMemory = sharedMemory;
+		args[i].start = start;
+		args[i].threadId = i + 1;
+		args[i].records = recordsPerThread;
+		handles[i] = CreateThread(NULL, 0, &WriterThread, &args[i], 0, NULL);
+	}
+
+	// let them get as far as the start line so thread creation isn't timed.
+	Sleep(50);
+	double begin = Seconds();
+	SetEvent(start);
+	WaitForMultipleObjects(threads, &handles[0], TRUE, INFINITE);
+	double elapsed = Seconds() - begin;
+
+	for (int i = 0; i < threads; i++)
+	{
+		CloseHandle(handles[i]);
+	}
+	CloseHandle(start);
+	return elapsed;
+}
+
+// ProfilerTests [bench | all] [name], with no arguments just the tests are run.  The exit code is
+// the number of failed checks.
+int main(int argc, char* argv[])
+{
+	bool tests = true;
+	bool benchmarks = false;
+	const char* only = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (_stricmp(argv[i], "bench") == 0)
+		{
+			tests = false;
+			benchmarks = true;
+		}
+		else if (_stricmp(argv[i], "all") == 0)
+		{
+			tests = true;
+			benchmarks = true;
+		}
+		else
+		{
+			only = argv[i];
+		}
+	}
+
+	CClock::Start();
+	for (int i = 0; i < _countof(s_tests); i++)
+	{
+		const TestEntry& test = s_tests[i];
+		bool run = (only != NULL) ? _stricmp(only, test.name) == 0 : (test.benchmark ? benchmarks : tests);
+		if (run)
+		{
+			printf("%s\n", test.name);
+			test.run();
+		}
+	}
+
+	if (s_failures == 0)
+	{
+		printf("all passed\n");
+	}
+	else
+	{
+		printf("%d checks failed\n", s_failures);
+	}
+	return s_failures;
+}
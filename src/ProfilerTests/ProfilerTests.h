@@ -0,0 +1,50 @@
+#pragma once
+
+#include "SharedMemory.h"
+
+// A console harness for the parts of the profiler that don't need the CLR.  Tests check how
+// things behave and run by default, benchmarks print what they measured and check it against
+// the targets we have set, run them with "ProfilerTests bench" on a Release build.
+
+// counts a failure and says what it was.
+void Check(bool condition, const char* what);
+
+// from the performance counter, for timing the benchmarks.
+double Seconds();
+
+// A named mapping like the one the client creates, CSharedMemory opens it by name.
+class CTestMapping
+{
+public:
+	CTestMapping(long size);
+	~CTestMapping();
+
+	TCHAR* GetName() { return _name; }
+
+private:
+	HANDLE _mapping;
+	TCHAR _name[64];
+};
+
+// Start this many threads that each write recordsPerThread Enter and Leave records as fast as
+// they can, and seal their chunks when they are done.  Returns the seconds from when they were
+// let go until the last one finished.
+double RunWriters(CSharedMemory* sharedMemory, int threads, LONG64 recordsPerThread);
+
+// ClockTests.cpp
+void ClockBenchmark();
+void ClockCalibrationTest();
+
+// HotPathTests.cpp
+void FastPathTest();
+void HotPathBenchmark();
+
+// RecorderTests.cpp
+void RecorderBenchmark();
+
+// ShadowStackTests.cpp
+void UnwindStressTest();
+
+// WriterTests.cpp
+void WriterScalingBenchmark();
+void RingWraparoundTest();
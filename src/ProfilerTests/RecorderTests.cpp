@@ -0,0 +1,111 @@
+#include "StdAfx.h"
+#include "ProfilerTests.h"
+#include "Recorder.h"
+
+namespace
+{
+	const long RecorderBufferSize = 256 * 1024 * 1024;
+	const double RecorderTarget = 50e6; // records per second
+	const LONG64 LiveRecords = 64 * 1000 * 1000;
+
+	const LONG64 RecordsPerChunk = (ChunkSize - sizeof(ChunkHeader)) / RecordSize;
+
+	void GetTracePath(WCHAR* path, DWORD size)
+	{
+		WCHAR folder[MAX_PATH];
+		GetTempPath(MAX_PATH, folder);
+		swprintf_s(path, size, L"%sProfilerTests%u.trace", folder, GetCurrentProcessId());
+	}
+
+	// the header the recorder rewrites when it finishes, false if it can't be read.
+	bool ReadTraceHeader(const WCHAR* path, TraceFileHeader& header)
+	{
+		HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		DWORD read = 0;
+		BOOL ok = ReadFile(file, &header, sizeof(header), &read, NULL);
+		CloseHandle(file);
+		return ok && read == sizeof(header) && header.magic == TraceFileMagic;
+	}
+
+	long CountUsedChunks(CSharedMemory* sharedMemory)
+	{
+		long used = 0;
+		for (long i = 0; i < sharedMemory->GetChunkCount(); i++)
+		{
+			used += (sharedMemory->GetChunkAt(i)->state != ChunkFree) ? 1 : 0;
+		}
+		return used;
+	}
+}
+
+// How fast the recorder can copy the ring to a file, and whether it keeps up with writers
+// going flat out.
+//
+// The first run fills most of the ring before the recorder starts, then times the recorder
+// copying all of it.  That measures only the recorder, whatever the writers on this machine
+// can manage, and it has to beat the 50M records/s target.  The second run records while
+// the writers write, nothing may be lost unless they outrun the target.
+void RecorderBenchmark()
+{
+	WCHAR path[MAX_PATH];
+	GetTracePath(path, MAX_PATH);
+
+	{
+		CTestMapping mapping(RecorderBufferSize);
+		CSharedMemory sharedMemory(mapping.GetName(), RecorderBufferSize);
+		Check(sharedMemory.GetStatus() == S_OK, "the buffer is mapped");
+		if (FAILED(sharedMemory.GetStatus()))
+		{
+			return;
+		}
+
+		// most of a lap, so nothing is overwritten.
+		RunWriters(&sharedMemory, 1, sharedMemory.GetChunkCount() * RecordsPerChunk * 9 / 10);
+		long chunks = CountUsedChunks(&sharedMemory);
+		LONG64 records = sharedMemory.GetHeader()->committedRecords;
+
+		CRecorder recorder;
+		double begin = Seconds();
+		Check(SUCCEEDED(recorder.Start(&sharedMemory, path)), "the recorder starts");
+		recorder.Stop();
+		double seconds = Seconds() - begin;
+
+		printf("  recorded %d chunks, %.0f records/s, %.0f MB/s\n", chunks, records / seconds, chunks * (double)ChunkSize / seconds / (1024 * 1024));
+		Check(records / seconds >= RecorderTarget, "the recorder copies at least 50M records/s");
+
+		TraceFileHeader header;
+		Check(ReadTraceHeader(path, header), "the trace file has a header");
+		Check(header.indexOffset != 0, "the recording finished");
+		Check(header.chunksRecorded == (UINT64)chunks, "every chunk in the ring is recorded");
+		Check(header.chunksLost == 0, "no chunks are lost");
+	}
+
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		int threads = max(1, min((int)info.dwNumberOfProcessors - 1, MAXIMUM_WAIT_OBJECTS));
+
+		CTestMapping mapping(RecorderBufferSize);
+		CSharedMemory sharedMemory(mapping.GetName(), RecorderBufferSize);
+		CRecorder recorder;
+		Check(SUCCEEDED(recorder.Start(&sharedMemory, path)), "the recorder starts");
+		double seconds = RunWriters(&sharedMemory, threads, LiveRecords / threads);
+		recorder.Stop();
+
+		double rate = (double)(LiveRecords / threads) * threads / seconds;
+		TraceFileHeader header;
+		Check(ReadTraceHeader(path, header), "the trace file has a header");
+		printf("  %d writers at %.0f records/s, recorded %llu chunks, lost %llu\n", threads, rate, header.chunksRecorded, header.chunksLost);
+		if (rate <= RecorderTarget)
+		{
+			Check(header.chunksLost == 0, "the recorder keeps up with writers below the target");
+		}
+		Check(header.chunksRecorded + header.chunksLost >= (UINT64)((LiveRecords / threads) * threads / RecordsPerChunk), "every chunk is either recorded or counted as lost");
+	}
+
+	DeleteFile(path);
+}
@@ -0,0 +1,252 @@
+#include "StdAfx.h"
+#include "ProfilerTests.h"
+#include "ShadowStack.h"
+
+namespace
+{
+	const int StressSteps = 2 * 1000 * 1000;
+	const size_t MaxRealDepth = MaxShadowDepth * 2;
+	const int MaxNesting = 8;
+
+	// a frame on the real call stack.
+	struct RealFrame
+	{
+		UINT32 index;     // 0 if the function isn't hooked
+		bool suppressed;
+		bool tracked;     // pushed on the shadow stack since the last resume
+		int shadowDepth;  // where on the shadow stack, if tracked
+		UINT64 start;
+	};
+
+	// Drives a CShadowStack the way the hooks do, and keeps what it ought to contain
+	// alongside so every step can be checked.
+	class CUnwindModel
+	{
+	public:
+		CUnwindModel() :
+			_random(12345),
+			_time(0),
+			_epoch(1),
+			_floor(0),
+			_dive(0),
+			_expectedPops(0),
+			_failures(0)
+		{
+			ZeroMemory(&_shadow, sizeof(_shadow));
+		}
+
+		void Run(int steps)
+		{
+			for (int i = 0; i < steps && _failures == 0; i++)
+			{
+				Step(0);
+			}
+			while (_stack.size() > _floor && _failures == 0)
+			{
+				Return();
+			}
+		}
+
+	private:
+		UINT32 Next(UINT32 range)
+		{
+			_random = _random * 6364136223846793005ULL + 1442695040888963407ULL;
+			return (UINT32)(_random >> 33) % range;
+		}
+
+		void Expect(bool condition, const char* what)
+		{
+			if (!condition && _failures++ == 0)
+			{
+				Check(false, what);
+			}
+		}
+
+		int TrackedDepth()
+		{
+			int depth = 0;
+			for (size_t i = 0; i < _stack.size(); i++)
+			{
+				depth += _stack[i].tracked ? 1 : 0;
+			}
+			return depth;
+		}
+
+		// one random thing happening on the thread, nesting is how many unwinds are under way.
+		void Step(int nesting)
+		{
+			UINT32 choice = Next(100);
+
+			// now and then a run of calls takes the stack past what the shadow stack keeps.
+			if (_dive == 0 && nesting == 0 && Next(5000) == 0)
+			{
+				_dive = MaxShadowDepth * 3 / 2 + Next(MaxShadowDepth / 2);
+			}
+			bool diving = _stack.size() < _dive;
+			if (!diving)
+			{
+				_dive = 0;
+			}
+			if ((diving || choice < 45) && _stack.size() < MaxRealDepth)
+			{
+				Call();
+			}
+			else if (choice < 88)
+			{
+				if (_stack.size() > _floor)
+				{
+					Return();
+				}
+			}
+			else if (choice < 97)
+			{
+				if (_stack.size() > _floor && nesting < MaxNesting)
+				{
+					Throw(nesting, 1 + Next(min((UINT32)(_stack.size() - _floor), 40u)));
+				}
+			}
+			else if (choice < 98 && !diving)
+			{
+				// recording was paused and resumed, nothing on the stack is ours any more.
+				_epoch++;
+				for (size_t i = 0; i < _stack.size(); i++)
+				{
+					_stack[i].tracked = false;
+				}
+				_expectedPops = 0;
+			}
+			else
+			{
+				FlushUnwind();
+			}
+
+			if (_shadow.IsCurrent(_epoch))
+			{
+				Expect(_shadow.GetDepth() == TrackedDepth(), "the shadow stack is as deep as the hooked calls on the stack");
+			}
+		}
+
+		void Call()
+		{
+			RealFrame frame;
+			frame.index = (Next(4) == 0) ? 0 : FirstFunctionIndex + Next(50);
+			frame.suppressed = frame.index != 0 && Next(5) == 0;
+			frame.tracked = false;
+			frame.shadowDepth = 0;
+			frame.start = ++_time;
+			if (frame.index != 0)
+			{
+				_shadow.Sync(_epoch);
+				frame.tracked = true;
+				frame.shadowDepth = TrackedDepth();
+				bool record = _shadow.Push(frame.index, frame.start, frame.suppressed);
+				Expect(record == (!frame.suppressed || frame.shadowDepth >= MaxShadowDepth), "a call is recorded unless it is suppressed and its frame kept");
+			}
+			_stack.push_back(frame);
+		}
+
+		// the Leave hook, or the pop an unwind does for a frame that is ours.
+		void Leave(RealFrame& frame, bool unwound)
+		{
+			bool synced = _shadow.Sync(_epoch);
+			Expect(synced || !frame.tracked, "a frame that is still tracked was pushed in this epoch");
+			if (!synced)
+			{
+				return;
+			}
+			ShadowFrame* popped = _shadow.Pop();
+			bool kept = frame.tracked && frame.shadowDepth < MaxShadowDepth;
+			Expect((popped != NULL) == kept, "only a call that was kept comes back from Pop");
+			if (popped != NULL)
+			{
+				Expect(popped->index == frame.index && popped->start == frame.start, "the call popped is the one that was pushed");
+				Expect((popped->suppressed != 0) == frame.suppressed, "the call popped is suppressed if it was pushed that way");
+			}
+			if ((popped == NULL || !popped->suppressed) && unwound && frame.tracked)
+			{
+				_shadow.AddPendingPop(++_time);
+				_expectedPops++;
+			}
+		}
+
+		void Return()
+		{
+			RealFrame frame = _stack.back();
+			_stack.pop_back();
+			if (frame.index != 0)
+			{
+				Leave(frame, false);
+			}
+		}
+
+		// An exception unwinds count frames, finally blocks may run in any of them and make
+		// calls, throw and catch exceptions of their own.
+		void Throw(int nesting, UINT32 count)
+		{
+			for (UINT32 i = 0; i < count && _failures == 0; i++)
+			{
+				RealFrame& top = _stack.back();
+				bool hooked = top.index != 0 && _shadow.IsCurrent(_epoch);
+				_shadow.UnwindEnter(hooked ? top.index : 0);
+
+				if (Next(8) == 0)
+				{
+					// a finally block, the frames unwound so far are written first.
+					FlushUnwind();
+					size_t floor = _floor;
+					_floor = _stack.size();
+					int steps = Next(20);
+					for (int j = 0; j < steps && _failures == 0; j++)
+					{
+						Step(nesting + 1);
+					}
+					while (_stack.size() > _floor && _failures == 0)
+					{
+						Return();
+					}
+					_floor = floor;
+				}
+
+				RealFrame frame = _stack.back();
+				_stack.pop_back();
+				bool ours = _shadow.UnwindLeave(_epoch);
+				Expect(ours == (frame.tracked && _shadow.IsCurrent(_epoch)), "an unwind pops the frames we hooked and only those");
+				if (ours)
+				{
+					Leave(frame, true);
+				}
+			}
+			FlushUnwind();
+		}
+
+		void FlushUnwind()
+		{
+			UINT64 popTime;
+			UINT32 pops = _shadow.TakePendingPops(popTime);
+			if (_shadow.IsCurrent(_epoch))
+			{
+				Expect(pops == _expectedPops, "the unwound frames are written once each");
+			}
+			_expectedPops = 0;
+		}
+
+		CShadowStack _shadow;
+		std::vector<RealFrame> _stack;
+		UINT64 _random;
+		UINT64 _time;
+		long _epoch;
+		size_t _dive;       // keep calling until the stack is this deep
+		size_t _floor;      // frames below this are running a finally block and can't be left
+		UINT32 _expectedPops;
+		int _failures;
+	};
+}
+
+// Random calls, returns, nested exceptions with finally blocks, pauses and stacks deeper than
+// MaxShadowDepth, checked against a model of what the shadow stack should hold.
+void UnwindStressTest()
+{
+	CUnwindModel* model = new CUnwindModel();
+	model->Run(StressSteps);
+	delete model;
+}
@@ -0,0 +1,225 @@
+#include "StdAfx.h"
+#include "ProfilerTests.h"
+
+namespace
+{
+	// enough for the ring to wrap several times in every run.
+	const long WriterBufferSize = 64 * 1024 * 1024;
+	const LONG64 ScalingRecords = 16 * 1000 * 1000;
+
+	const int RecordsPerChunk = (ChunkSize - sizeof(ChunkHeader)) / RecordSize;
+	const int WraparoundLaps = 4;
+	const UINT64 FirstTimestamp = 1000;
+	const UINT_PTR HolderThreadId = 1;
+	const UINT_PTR MainThreadId = 2;
+	const int HeldRecords = 100;
+
+	// record n is an Enter or a Leave depending on n and is stamped FirstTimestamp + n, so
+	// where it came from can be worked out from its time alone.
+	UINT32 ExpectedId(UINT64 n)
+	{
+		return (n & 1) ? LeaveRecord : FirstFunctionIndex + (UINT32)((n / 2) % 1000);
+	}
+
+	struct HolderArgs
+	{
+		CSharedMemory* sharedMemory;
+		HANDLE written;
+		HANDLE done;
+	};
+
+	// writes a few records and then goes quiet with its chunk still open.
+	DWORD WINAPI HolderThread(PVOID v)
+	{
+		HolderArgs* args = (HolderArgs*)v;
+		CSharedMemory::SetCurrentThreadId(HolderThreadId);
+		for (int n = 0; n < HeldRecords; n++)
+		{
+			args->sharedMemory->WriteRecord(ExpectedId(n), FirstTimestamp + n);
+		}
+		args->sharedMemory->FlushThread();
+		SetEvent(args->written);
+		WaitForSingleObject(args->done, INFINITE);
+		args->sharedMemory->ReleaseThread();
+		CSharedMemory::DetachThread();
+		return 0;
+	}
+
+	bool OlderChunk(ChunkHeader* a, ChunkHeader* b)
+	{
+		return a->sequence < b->sequence;
+	}
+
+	// Decode a sealed chunk, checking each record is the one that was written at its time.
+	// Returns the number of the last record, or -1 if the chunk is empty.
+	LONG64 DecodeChunk(ChunkHeader* chunk, LONG64 expectedFirst, bool* ok)
+	{
+		Record* record = (Record*)(chunk + 1);
+		Record* end = (Record*)((BYTE*)record + chunk->used);
+		UINT64 timestamp = chunk->baseTimestamp;
+		LONG64 n = -1;
+		for (; record < end; record++)
+		{
+			if (record->id == ResyncRecord)
+			{
+				continue;
+			}
+			if (record->id == TimeBaseRecord)
+			{
+				timestamp = *(UINT64*)(record + 1);
+				record++;
+				continue;
+			}
+			timestamp += record->delta;
+			n = (LONG64)(timestamp - FirstTimestamp);
+			if (n != expectedFirst || record->id != ExpectedId(n))
+			{
+				*ok = false;
+				return n;
+			}
+			expectedFirst++;
+		}
+		return n;
+	}
+}
+
+// The writers never share anything but the chunk claim, so the time each thread spends per
+// record should stay about the same as threads are added, up to the number of cores.
+void WriterScalingBenchmark()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int maxThreads = min((int)info.dwNumberOfProcessors * 2, MAXIMUM_WAIT_OBJECTS);
+
+	printf("  threads   records/s  ns/record per thread\n");
+	for (int threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		CTestMapping mapping(WriterBufferSize);
+		CSharedMemory sharedMemory(mapping.GetName(), WriterBufferSize);
+		Check(sharedMemory.GetStatus() == S_OK, "the buffer is mapped");
+		if (FAILED(sharedMemory.GetStatus()))
+		{
+			return;
+		}
+
+		double seconds = RunWriters(&sharedMemory, threads, ScalingRecords);
+		double records = (double)ScalingRecords * threads;
+		printf("  %7d %11.0f %21.2f\n", threads, records / seconds, seconds * 1e9 / ScalingRecords);
+
+		SharedMemoryHeader* header = sharedMemory.GetHeader();
+		Check(header->droppedRecords == 0, "no records are dropped while the ring wraps");
+		Check(header->committedRecords >= ScalingRecords * threads, "every record is committed");
+	}
+}
+
+// Write several laps of the smallest ring while a reader sits at the start and another thread
+// holds a chunk open.  The ring is reused without being cleared, so what is left has to be
+// the last lap with every chunk still telling its sequence and records apart.
+void RingWraparoundTest()
+{
+	CTestMapping mapping(MinBufferSize);
+	CSharedMemory sharedMemory(mapping.GetName(), MinBufferSize);
+	Check(sharedMemory.GetStatus() == S_OK, "the smallest buffer is mapped");
+	if (FAILED(sharedMemory.GetStatus()))
+	{
+		return;
+	}
+	SharedMemoryHeader* header = sharedMemory.GetHeader();
+	long chunkCount = sharedMemory.GetChunkCount();
+	Check(chunkCount == MinChunkCount, "the smallest buffer has the fewest chunks");
+
+	// a reader that never moves its cursor.
+	long slot = sharedMemory.RegisterReader(GetCurrentProcessId());
+	Check(slot >= 0, "a reader can register");
+
+	HolderArgs holder;
+	holder.sharedMemory = &sharedMemory;
+	holder.written = CreateEvent(NULL, TRUE, FALSE, NULL);
+	holder.done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	HANDLE thread = CreateThread(NULL, 0, &HolderThread, &holder, 0, NULL);
+	WaitForSingleObject(holder.written, INFINITE);
+
+	ChunkHeader* held = NULL;
+	for (long i = 0; i < chunkCount; i++)
+	{
+		ChunkHeader* chunk = sharedMemory.GetChunkAt(i);
+		if (chunk->state == ChunkOpen && chunk->threadId == HolderThreadId)
+		{
+			held = chunk;
+		}
+	}
+	Check(held != NULL, "the quiet thread has a chunk open");
+	LONG64 heldSequence = held != NULL ? held->sequence : 0;
+
+	CSharedMemory::SetCurrentThreadId(MainThreadId);
+	LONG64 total = (LONG64)WraparoundLaps * chunkCount * RecordsPerChunk;
+	for (LONG64 n = 0; n < total; n++)
+	{
+		sharedMemory.WriteRecord(ExpectedId(n), FirstTimestamp + n);
+	}
+	sharedMemory.ReleaseThread();
+	CSharedMemory::DetachThread();
+
+	LONG64 next = header->nextSequence;
+	Check(next > WraparoundLaps * chunkCount, "the ring went round once per lap");
+	Check(header->version == (next - 1) / chunkCount, "the version counts the laps");
+	Check(header->droppedRecords == 0, "nothing is dropped when the ring wraps");
+	Check(header->committedRecords >= total, "every record is committed");
+
+	// the quiet thread's chunk was stepped over each lap.
+	if (held != NULL)
+	{
+		Check(held->state == ChunkOpen, "the open chunk is still open");
+		Check(held->sequence == heldSequence, "the open chunk is never reclaimed");
+		Check(held->used == HeldRecords * RecordSize, "the open chunk keeps its records");
+	}
+
+	// what's left is the last lap, in order and intact.
+	std::vector<ChunkHeader*> chunks;
+	for (long i = 0; i < chunkCount; i++)
+	{
+		ChunkHeader* chunk = sharedMemory.GetChunkAt(i);
+		if (chunk == held)
+		{
+			continue;
+		}
+		Check(chunk->state == ChunkSealed, "every other chunk is sealed");
+		Check(chunk->sequence >= next - chunkCount && chunk->sequence < next, "every other chunk is from the last lap");
+		Check(chunk->sequence % chunkCount == i, "each chunk is where its sequence says");
+		Check(chunk->threadId == MainThreadId, "each chunk is stamped with its writer");
+		chunks.push_back(chunk);
+	}
+	std::sort(chunks.begin(), chunks.end(), &OlderChunk);
+
+	bool ok = true;
+	LONG64 expected = -1;
+	for (size_t i = 0; i < chunks.size() && ok; i++)
+	{
+		LONG64 first = expected + 1;
+		if (i == 0)
+		{
+			// the oldest surviving chunk starts wherever the ring overwrote up to.
+			Record* record = (Record*)(chunks[0] + 1);
+			first = (LONG64)(chunks[0]->baseTimestamp + record->delta - FirstTimestamp);
+		}
+		expected = DecodeChunk(chunks[i], first, &ok);
+	}
+	Check(ok, "the records in the last lap decode in the order they were written");
+	Check(expected == total - 1, "the last record written is the last one in the ring");
+
+	// the reader was lapped and is told how badly.
+	if (slot >= 0)
+	{
+		ReaderSlot& reader = header->readers[slot];
+		Check(reader.overruns > 0, "a reader that was lapped is told about the overrun");
+		Check(reader.lag > chunkCount, "the reader's lag shows it is more than a lap behind");
+		sharedMemory.ReleaseReader(slot);
+	}
+
+	SetEvent(holder.done);
+	WaitForSingleObject(thread, INFINITE);
+	Check(held == NULL || held->state == ChunkSealed, "the quiet thread seals its chunk when it is done");
+	CloseHandle(thread);
+	CloseHandle(holder.written);
+	CloseHandle(holder.done);
+}
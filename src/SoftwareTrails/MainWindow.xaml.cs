@@ -572,8 +572,6 @@ namespace SoftwareTrails
             Progress.Visibility = System.Windows.Visibility.Collapsed;
         }
 
-        long lastVersion;
-
         void OnTick(object sender, EventArgs e)
         {
             if (controller != null && controller.IsAttached)
@@ -583,12 +581,6 @@ namespace SoftwareTrails
                 {
                     long functions = result.Item1;
                     long calls = result.Item2;
-                    long version = result.Item3;
-                    if (version != lastVersion)
-                    {
-                        lastVersion = version;
-                        controller.WrapAround();
-                    }
 
                     Progress.Maximum = calls;
                     Progress.Value = watcher.CallsRead;
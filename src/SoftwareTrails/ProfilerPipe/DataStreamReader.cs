@@ -0,0 +1,330 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Threading;
+
+namespace SoftwareTrails
+{
+    /// <summary>
+    /// Decodes the frames the profiler's streamer sends down the data pipe, the layout must match Streamer.h.
+    /// The pipe reader thread adds frames with AddFrame, and the records come out of ReadRecord in the order
+    /// they arrived.  Once MaxQueuedRecords are waiting WaitForRoom holds up the pipe reader, which in turn
+    /// makes the profiler drop records instead of slowing down the target process.
+    /// </summary>
+    class DataStreamReader : IRecordReader
+    {
+        const uint StreamFrameMagic = 0x46535453;
+        const int RecordSize = 8;
+        const uint TimeBaseRecord = 3;
+        const long FirstMethodId = 256;
+
+        // StreamFrameHeader, without the length that NamedPipeReaderWriter.ReadBytes strips off.
+        const int FrameHeaderSize = 76;
+        const int FrameMagicOffset = 0;
+        const int FrameBlockCountOffset = 4;
+        const int FrameNumberOffset = 12;
+        const int FrameDroppedRecordsOffset = 20;
+        const int FrameDroppedFramesOffset = 28;
+        const int FrameClockFrequencyOffset = 44;
+        const int FrameClockBaseOffset = 52;
+
+        // StreamBlockHeader
+        const int BlockHeaderSize = 48;
+        const int BlockKindOffset = 0;
+        const int BlockBytesOffset = 4;
+        const int BlockThreadIdOffset = 24;
+        const int BlockBaseTimestampOffset = 32;
+        const int BlockOwnerOffset = 40;
+        const int StreamRecordsBlock = 0;
+        const int StreamNamesBlock = 1;
+
+        // NameEntry
+        const int NameEntrySize = 24;
+        const int NameBytesOffset = 16;
+
+        internal const int MaxQueuedRecords = 1000000;
+
+        struct StreamRecord
+        {
+            public long Id;
+            public long Timestamp; // raw clock ticks
+            public long Thread;
+            public byte[] Payload;
+        }
+
+        private object sync = new object();
+        private Queue<StreamRecord> records = new Queue<StreamRecord>();
+        private byte[] payload = new byte[0];
+        private long clockFrequency;
+        private long clockBase;
+        private long nextFrame;
+        private long lostFrames;
+        private long droppedRecords;
+        private long droppedFrames;
+        private long overruns;
+
+        /// <summary>
+        /// The number of times records were lost, each adds an OverrunRecord to the stream.
+        /// </summary>
+        public long Overruns
+        {
+            get { return Interlocked.Read(ref overruns); }
+        }
+
+        /// <summary>
+        /// Records the profiler threw away because we weren't reading fast enough.
+        /// </summary>
+        public long DroppedRecords
+        {
+            get { return Interlocked.Read(ref droppedRecords); }
+        }
+
+        /// <summary>
+        /// Frames that never arrived, either the profiler couldn't write them or we couldn't read them.
+        /// </summary>
+        public long DroppedFrames
+        {
+            get { return Interlocked.Read(ref droppedFrames) + Interlocked.Read(ref lostFrames); }
+        }
+
+        /// <summary>
+        /// Decode a frame, the names it carries are passed to define.  Returns false if it isn't a frame.
+        /// </summary>
+        public bool AddFrame(byte[] frame, Action<long, string> define)
+        {
+            if (frame == null || frame.Length < FrameHeaderSize || BitConverter.ToUInt32(frame, FrameMagicOffset) != StreamFrameMagic)
+            {
+                return false;
+            }
+
+            long lost = DroppedRecords + DroppedFrames;
+            long number = BitConverter.ToInt64(frame, FrameNumberOffset);
+            if (number > nextFrame)
+            {
+                Interlocked.Add(ref lostFrames, number - nextFrame);
+            }
+            nextFrame = number + 1;
+            Interlocked.Exchange(ref droppedRecords, BitConverter.ToInt64(frame, FrameDroppedRecordsOffset));
+            Interlocked.Exchange(ref droppedFrames, BitConverter.ToInt64(frame, FrameDroppedFramesOffset));
+            Interlocked.Exchange(ref clockFrequency, BitConverter.ToInt64(frame, FrameClockFrequencyOffset));
+            Interlocked.Exchange(ref clockBase, BitConverter.ToInt64(frame, FrameClockBaseOffset));
+
+            List<StreamRecord> decoded = new List<StreamRecord>();
+            if (DroppedRecords + DroppedFrames != lost)
+            {
+                // the records we lost leave every call stack in doubt.
+                Interlocked.Increment(ref overruns);
+                decoded.Add(new StreamRecord() { Id = SharedMemoryBuffer.OverrunRecord, Timestamp = Interlocked.Read(ref clockBase) });
+            }
+            int blockCount = BitConverter.ToInt32(frame, FrameBlockCountOffset);
+            int pos = FrameHeaderSize;
+            for (int i = 0; i < blockCount && pos + BlockHeaderSize <= frame.Length; i++)
+            {
+                int kind = BitConverter.ToInt32(frame, pos + BlockKindOffset);
+                int bytes = Math.Min(BitConverter.ToInt32(frame, pos + BlockBytesOffset), frame.Length - pos - BlockHeaderSize);
+                int data = pos + BlockHeaderSize;
+                if (kind == StreamRecordsBlock)
+                {
+                    long thread = BitConverter.ToInt64(frame, pos + BlockThreadIdOffset);
+                    if (thread == 0)
+                    {
+                        thread = BitConverter.ToUInt32(frame, pos + BlockOwnerOffset);
+                    }
+                    DecodeRecords(frame, data, data + bytes, thread, BitConverter.ToInt64(frame, pos + BlockBaseTimestampOffset), decoded);
+                }
+                else if (kind == StreamNamesBlock)
+                {
+                    DecodeNames(frame, data, data + bytes, define);
+                }
+                pos = data + bytes;
+            }
+
+            lock (sync)
+            {
+                foreach (StreamRecord record in decoded)
+                {
+                    records.Enqueue(record);
+                }
+                if (decoded.Count > 0)
+                {
+                    // wake the reader.
+                    Monitor.PulseAll(sync);
+                }
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Returns true once there is room for more records, or false if it timed out.
+        /// </summary>
+        public bool WaitForRoom(int timeoutMS)
+        {
+            lock (sync)
+            {
+                if (records.Count < MaxQueuedRecords)
+                {
+                    return true;
+                }
+                Monitor.Wait(sync, timeoutMS);
+                return records.Count < MaxQueuedRecords;
+            }
+        }
+
+        /// <summary>
+        /// Returns true once there are records to read, or false if it timed out.
+        /// </summary>
+        public bool WaitForRecords(int timeoutMS)
+        {
+            lock (sync)
+            {
+                if (records.Count > 0)
+                {
+                    return true;
+                }
+                Monitor.Wait(sync, timeoutMS);
+                return records.Count > 0;
+            }
+        }
+
+        public long ReadRecord(out long timestamp, out long thread)
+        {
+            timestamp = 0;
+            thread = 0;
+            StreamRecord record;
+            lock (sync)
+            {
+                if (records.Count == 0)
+                {
+                    return 0;
+                }
+                record = records.Dequeue();
+                if (records.Count == MaxQueuedRecords - 1)
+                {
+                    Monitor.PulseAll(sync);
+                }
+            }
+
+            timestamp = TicksToMicroseconds(record.Timestamp - Interlocked.Read(ref clockBase));
+            thread = record.Thread;
+            if (record.Payload != null)
+            {
+                payload = record.Payload;
+                if (record.Id == SharedMemoryBuffer.SampleRecord && payload.Length >= 16)
+                {
+                    // the sampler thread writes these on behalf of the thread it sampled.
+                    timestamp = TicksToMicroseconds(BitConverter.ToInt64(payload, 0) - Interlocked.Read(ref clockBase));
+                    thread = BitConverter.ToInt64(payload, 8);
+                }
+                else if (record.Id == SharedMemoryBuffer.PopRecord && payload.Length >= 8)
+                {
+                    timestamp = TicksToMicroseconds(BitConverter.ToInt64(payload, 0) - Interlocked.Read(ref clockBase));
+                }
+            }
+            return record.Id;
+        }
+
+        public byte[] Payload
+        {
+            get { return payload; }
+        }
+
+        public long TicksToMicroseconds(long ticks)
+        {
+            long frequency = Interlocked.Read(ref clockFrequency);
+            if (frequency <= 0)
+            {
+                return 0;
+            }
+            return (ticks / frequency) * 1000000 + (ticks % frequency) * 1000000 / frequency;
+        }
+
+        /// <summary>
+        /// The stream can't be replayed, this throws away what hasn't been read yet.
+        /// </summary>
+        public void Rewind()
+        {
+            lock (sync)
+            {
+                records.Clear();
+                Monitor.PulseAll(sync);
+            }
+        }
+
+        // Each record is two LEB128 varints (id, delta), a TimeBaseRecord is followed by its 64 bit timestamp and
+        // an extended record by delta bytes of payload.
+        private static void DecodeRecords(byte[] frame, int pos, int end, long thread, long timestamp, List<StreamRecord> decoded)
+        {
+            while (pos < end)
+            {
+                long id;
+                long delta;
+                if (!ReadVarint(frame, ref pos, end, out id) || !ReadVarint(frame, ref pos, end, out delta))
+                {
+                    break;
+                }
+                if (id == 0)
+                {
+                    // padding at the end of the block.
+                    break;
+                }
+                if (id == TimeBaseRecord)
+                {
+                    if (pos + 8 > end)
+                    {
+                        break;
+                    }
+                    timestamp = BitConverter.ToInt64(frame, pos);
+                    pos += 8;
+                    continue;
+                }
+
+                StreamRecord record = new StreamRecord() { Id = id, Thread = thread };
+                if (id >= SharedMemoryBuffer.FirstExtendedRecord && id < FirstMethodId)
+                {
+                    // it doesn't move the clock.
+                    int size = (int)Math.Min(delta, end - pos);
+                    record.Payload = new byte[size];
+                    Array.Copy(frame, pos, record.Payload, 0, size);
+                    pos += size;
+                }
+                else
+                {
+                    timestamp += delta;
+                }
+                record.Timestamp = timestamp;
+                decoded.Add(record);
+            }
+        }
+
+        private static bool ReadVarint(byte[] frame, ref int pos, int end, out long value)
+        {
+            value = 0;
+            for (int shift = 0; pos < end && shift < 35; shift += 7)
+            {
+                byte b = frame[pos++];
+                value |= (long)(b & 0x7f) << shift;
+                if ((b & 0x80) == 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        private static void DecodeNames(byte[] frame, int pos, int end, Action<long, string> define)
+        {
+            while (pos + NameEntrySize <= end)
+            {
+                long methodId = BitConverter.ToUInt32(frame, pos);
+                int bytes = Math.Min(BitConverter.ToInt32(frame, pos + NameBytesOffset), end - pos - NameEntrySize);
+                if (methodId == 0 || bytes < 0)
+                {
+                    break;
+                }
+                define(methodId, Encoding.UTF8.GetString(frame, pos + NameEntrySize, bytes));
+                pos += (NameEntrySize + bytes + RecordSize - 1) & ~(RecordSize - 1);
+            }
+        }
+    }
+}
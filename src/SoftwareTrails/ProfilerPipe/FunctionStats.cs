@@ -0,0 +1,26 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace SoftwareTrails
+{
+    /// <summary>
+    /// The flat profile totals for one method since the last Clear, times are in microseconds.
+    /// </summary>
+    public class FunctionStats
+    {
+        public long MethodId { get; set; }
+        public long Calls { get; set; }
+
+        /// <summary>
+        /// Time from entering the method to leaving it, recursive calls are only counted once.
+        /// </summary>
+        public long Inclusive { get; set; }
+
+        /// <summary>
+        /// Time spent in the method itself, not counting the methods it called.
+        /// </summary>
+        public long Exclusive { get; set; }
+    }
+}
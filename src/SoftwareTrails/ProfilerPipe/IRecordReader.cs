@@ -0,0 +1,36 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace SoftwareTrails
+{
+    /// <summary>
+    /// Where ProfilerControlModel gets its records from, either the shared memory buffer or the frames on the data pipe.
+    /// </summary>
+    interface IRecordReader
+    {
+        /// <summary>
+        /// Returns the id of the next record, or 0 if there is nothing new to read.  The timestamp is in microseconds,
+        /// and the thread identifies the managed thread that wrote the record (or the OS thread, if the managed one isn't known).
+        /// </summary>
+        long ReadRecord(out long timestamp, out long thread);
+
+        /// <summary>
+        /// The payload of the last extended record returned by ReadRecord.
+        /// </summary>
+        byte[] Payload { get; }
+
+        /// <summary>
+        /// Blocks until there may be new records to read, or the timeout.  Returns false if it timed out.
+        /// </summary>
+        bool WaitForRecords(int timeoutMS);
+
+        long TicksToMicroseconds(long ticks);
+
+        /// <summary>
+        /// Start reading again from the oldest record that is still available.
+        /// </summary>
+        void Rewind();
+    }
+}
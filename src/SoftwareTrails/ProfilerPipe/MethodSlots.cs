@@ -0,0 +1,69 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace SoftwareTrails
+{
+    /// <summary>
+    /// The module and generation of each method id, as far as the DefineRecords and RetireRecords we have read go.
+    /// The profiler hands the id of an unloaded method to the next method it sees, and the records for an id may
+    /// be written by different threads, so they can arrive in any order.  The caller does the locking.
+    /// </summary>
+    public class MethodSlots
+    {
+        List<int> modules = new List<int>(); // module index by slot, 0 is unknown
+        List<int> generations = new List<int>(); // the generation each slot is on, one past a retired generation
+
+        /// <summary>
+        /// The method in this slot was defined, returns false if a later generation has already been seen.
+        /// recycled is set when this replaces an earlier generation whose retire we haven't read.
+        /// </summary>
+        public bool Define(int slot, int module, int generation, out bool recycled)
+        {
+            Grow(slot);
+            recycled = false;
+            if (generation < generations[slot])
+            {
+                return false;
+            }
+            recycled = generation > generations[slot];
+            generations[slot] = generation;
+            modules[slot] = module;
+            return true;
+        }
+
+        /// <summary>
+        /// The method in this slot was unloaded, returns false if the retire is stale because it was already read
+        /// or the next generation has been defined.
+        /// </summary>
+        public bool Retire(int slot, int generation)
+        {
+            Grow(slot);
+            if (generation + 1 <= generations[slot])
+            {
+                return false;
+            }
+            generations[slot] = generation + 1;
+            modules[slot] = 0;
+            return true;
+        }
+
+        /// <summary>
+        /// Return the module index of the method in this slot, or 0 if we don't know it.
+        /// </summary>
+        public int GetModule(int slot)
+        {
+            return slot >= 0 && slot < modules.Count ? modules[slot] : 0;
+        }
+
+        private void Grow(int slot)
+        {
+            while (modules.Count <= slot)
+            {
+                modules.Add(0);
+                generations.Add(0);
+            }
+        }
+    }
+}
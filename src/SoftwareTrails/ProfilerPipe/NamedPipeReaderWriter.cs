@@ -177,20 +177,26 @@ namespace SoftwareTrails
                 return null;
             }
 
+            // large packets can arrive in more than one read.
             byte[] packetBuffer = new byte[bufferSize];
-            try
-            {
-                numBytesRead = _pipeClient.Read(packetBuffer, 0, packetBuffer.Length);
-            }
-            catch (System.IO.IOException e)
+            int offset = 0;
+            while (offset < packetBuffer.Length)
             {
-                Debug.WriteLine(e.Message);
-                return null;
+                try
+                {
+                    numBytesRead = _pipeClient.Read(packetBuffer, offset, packetBuffer.Length - offset);
+                }
+                catch (System.IO.IOException e)
+                {
+                    Debug.WriteLine(e.Message);
+                    return null;
+                }
+
+                if (numBytesRead <= 0)
+                    return null;
+                offset += numBytesRead;
             }
 
-            if (numBytesRead != bufferSize)
-                return null;
-
             return packetBuffer;
         }
 
@@ -7,6 +7,7 @@ using System.Threading;
 using System.Threading.Tasks;
 using System.Collections.Generic;
 using System.Linq;
+using System.Text;
 using System.Runtime.Serialization;
 using System.Runtime.Serialization.Formatters.Binary;
 using System.IO.Compression;
@@ -21,6 +22,8 @@ namespace SoftwareTrails
     public class ProfilerControlModel : INotifyPropertyChanged, IDisposable
     {
         SharedMemoryBuffer buffer;
+        DataStreamReader stream;
+        IRecordReader records; // whichever of the two we are reading
 
         /// <summary>
         /// The threading model describes how messages are sent. For example, with Multiple, requests
@@ -100,12 +103,55 @@ namespace SoftwareTrails
             using (this.buffer)
             {
             }
-            this.buffer = new SharedMemoryBuffer(is64Bit);
+            this.buffer = null;
+            this.stream = null;
 
-            if (SendMessage("M:" + SharedMemoryBuffer.SharedMemoryName + "," + SharedMemoryBuffer.SharedMemorySize) == null)
+            if (UseDataStream)
             {
-                Status = "Failed to send shared memory name to profiler";
-                return ProfilerErrorCodes.ErrorFileNotFound;
+                // the data pipe reader starts with the control pipe, it needs to see the stream.
+                this.stream = new DataStreamReader();
+                this.records = this.stream;
+                string reply = SendMessage("W:" + DataStreamBufferSize);
+                if (reply == null || reply == "failed")
+                {
+                    Status = "Failed to start streaming from the profiler";
+                    return ProfilerErrorCodes.ErrorFileNotFound;
+                }
+            }
+            else
+            {
+                // another client may be reading this process already, if so we read its buffer too.
+                string join = "J:" + Process.GetCurrentProcess().Id;
+                string joined = SendMessage(join);
+                int slot;
+                string name;
+                if (ParseJoinReply(joined, out slot, out name))
+                {
+                    this.buffer = new SharedMemoryBuffer(name);
+                }
+                else
+                {
+                    this.buffer = new SharedMemoryBuffer();
+                    string reply = SendMessage("M:" + SharedMemoryBuffer.SharedMemoryName + "," + SharedMemoryBuffer.SharedMemorySize);
+                    if (reply == null)
+                    {
+                        Status = "Failed to send shared memory name to profiler";
+                        return ProfilerErrorCodes.ErrorFileNotFound;
+                    }
+                    if (reply == "failed")
+                    {
+                        Status = "The profiler could not map the shared memory";
+                        return ProfilerErrorCodes.ErrorFileNotFound;
+                    }
+                    joined = SendMessage(join);
+                    ParseJoinReply(joined, out slot, out name);
+                }
+                if (slot >= 0)
+                {
+                    this.buffer.Register(slot);
+                }
+                // else the other clients have all the reader slots, we read the buffer without a doorbell.
+                this.records = this.buffer;
             }
 
             // Wait for the target process to exit before enabling the attach button again. For the detach case we remove the event
@@ -120,6 +166,87 @@ namespace SoftwareTrails
 
         public Process AttachedProcess { get { return _attachedProcess; } }
 
+        /// <summary>
+        /// Receive the records as frames on the data pipe instead of mapping a shared buffer, set this before Attach.
+        /// The profiler only needs a small buffer of its own, and the recording can go on for as long as we keep up.
+        /// If we don't, the profiler drops records rather than slow down the process, see DroppedRecords.
+        /// </summary>
+        public bool UseDataStream { get; set; }
+
+        // the reply to "J:" is "<slot>,<name>", slot is -1 if the reader slots are all taken.  It is "none" if
+        // there is no shared memory to join.
+        static bool ParseJoinReply(string reply, out int slot, out string name)
+        {
+            slot = -1;
+            name = null;
+            if (reply == null)
+            {
+                return false;
+            }
+            int comma = reply.IndexOf(',');
+            if (comma < 0 || !int.TryParse(reply.Substring(0, comma), out slot))
+            {
+                slot = -1;
+                return false;
+            }
+            name = reply.Substring(comma + 1);
+            return true;
+        }
+
+        /// <summary>
+        /// The number of times we fell so far behind the profiler that calls were lost, see OverrunMethod.
+        /// </summary>
+        public long Overruns
+        {
+            get
+            {
+                SharedMemoryBuffer memory = buffer;
+                DataStreamReader reader = stream;
+                return memory != null ? memory.Overruns : (reader != null ? reader.Overruns : 0);
+            }
+        }
+
+        /// <summary>
+        /// How many chunks of the shared memory we are behind the profiler, 0 when streaming.
+        /// </summary>
+        public long ReaderLag
+        {
+            get
+            {
+                SharedMemoryBuffer memory = buffer;
+                return memory != null ? memory.Lag : 0;
+            }
+        }
+
+        /// <summary>
+        /// The size of the profiler's own buffer when streaming.
+        /// </summary>
+        public const int DataStreamBufferSize = 32 * 1024 * 1024;
+
+        /// <summary>
+        /// Records the profiler had to drop since we attached because we weren't reading the stream fast enough.
+        /// </summary>
+        public long DroppedRecords
+        {
+            get
+            {
+                DataStreamReader reader = stream;
+                return reader != null ? reader.DroppedRecords : 0;
+            }
+        }
+
+        /// <summary>
+        /// Frames of the stream that were lost since we attached.
+        /// </summary>
+        public long DroppedFrames
+        {
+            get
+            {
+                DataStreamReader reader = stream;
+                return reader != null ? reader.DroppedFrames : 0;
+            }
+        }
+
         /// <summary>
         /// Detach the profiler. Does nothing if not attached.
         /// </summary>
@@ -147,6 +274,8 @@ namespace SoftwareTrails
             {
                 buffer = null;
             }
+            records = null;
+            stream = null;
             return result;
         }
 
@@ -182,6 +311,14 @@ namespace SoftwareTrails
             long calls = 0;
             long version = 0;
 
+            // the shared memory has the counts in its header, only the stream needs to ask.
+            SharedMemoryBuffer memory = buffer;
+            if (memory != null && memory.ReadCounts(out functions, out calls, out version))
+            {
+                Interlocked.Exchange(ref knownFunctions, functions);
+                return new Tuple<long, long, long>(functions, calls, version);
+            }
+
             lock (pipeSync)
             {
                 string result = SendMessage(message);
@@ -199,6 +336,7 @@ namespace SoftwareTrails
                     {
                         functions = 0;
                     }
+                    Interlocked.Exchange(ref knownFunctions, functions);
                     if (!long.TryParse(parts[1], out calls))
                     {
                         calls = 0;
@@ -207,7 +345,6 @@ namespace SoftwareTrails
                     {
                         version = 0;
                     }
-                    buffer.SetSize(calls);
                 }
             }
 
@@ -217,16 +354,80 @@ namespace SoftwareTrails
         public const long LeaveMethod = 1;
         public const long TailCall = 2;
 
-        public long ReadMethod(out long timestamp)
+        /// <summary>
+        /// Recording was paused, the thread's call stack starts over after this record.
+        /// </summary>
+        public const long ResyncMethod = 4;
+
+        /// <summary>
+        /// We fell behind and calls were lost, every call stack starts over after this record.
+        /// </summary>
+        public const long OverrunMethod = 5;
+
+        /// <summary>
+        /// Method ids are dense indices assigned by the profiler, starting here.  Smaller ids are record tags.
+        /// </summary>
+        public const long FirstMethodId = 256;
+
+        /// <summary>
+        /// Call this when ReadMethod returns 0, it returns as soon as the profiler has more calls for us
+        /// (or false when the timeout expires first).
+        /// </summary>
+        public bool WaitForCalls(int timeoutMS)
+        {
+            IRecordReader reader = records;
+            if (reader == null)
+            {
+                Thread.Sleep(timeoutMS);
+                return false;
+            }
+            return reader.WaitForRecords(timeoutMS);
+        }
+
+        /// <summary>
+        /// Read the next method call record, the thread identifies which call stack it belongs to.
+        /// </summary>
+        public long ReadMethod(out long timestamp, out long thread)
         {
             long id = 0;
             timestamp = 0;
-            if (buffer == null)
+            thread = 0;
+            IRecordReader reader = records;
+            if (reader == null)
             {
                 return id;
             }
 
-            id = buffer.ReadRecord(out timestamp);
+            if (pendingPops > 0)
+            {
+                pendingPops--;
+                timestamp = popTimestamp;
+                thread = popThread;
+                return LeaveMethod;
+            }
+
+            id = reader.ReadRecord(out timestamp, out thread);
+            while (id >= SharedMemoryBuffer.FirstExtendedRecord && id < FirstMethodId)
+            {
+                if (id == SharedMemoryBuffer.PopRecord && reader.Payload.Length >= 12)
+                {
+                    // frames unwound by an exception, hand them out as one leave each.
+                    int count = BitConverter.ToInt32(reader.Payload, 8);
+                    if (count > 0)
+                    {
+                        pendingPops = count - 1;
+                        popTimestamp = timestamp;
+                        popThread = thread;
+                        return LeaveMethod;
+                    }
+                }
+                else
+                {
+                    // stacks and samples are collected here, the caller only sees calls.
+                    ReadExtended(id, reader.Payload);
+                }
+                id = reader.ReadRecord(out timestamp, out thread);
+            }
 
             if (id == LeaveMethod)
             {
@@ -238,46 +439,526 @@ namespace SoftwareTrails
                 // do nothing
                 return id;
             }
-            else if (id != 0)
+            else if (id == ResyncMethod)
+            {
+                // do nothing
+                return id;
+            }
+            else if (id == OverrunMethod)
+            {
+                // do nothing
+                return id;
+            }
+            else if (id >= FirstMethodId && GetMethodName(id) == null)
             {
-                // make sure we have the method name.
-                FetchMethodName(id);
+                // the profiler normally defines each method before its first call, if its name didn't fit in the
+                // shared memory ask for every other method it knows about too, so that only costs a few round trips.
+                long last = Math.Max(id, FirstMethodId + Interlocked.Read(ref knownFunctions) - 1);
+                FetchMethodNames(Enumerable.Range(0, (int)(last - id + 1)).Select(i => id + i));
             }                
             return id;
         }
 
-        public void WrapAround()
+        // what is left of the last PopRecord, only used by the reader thread.
+        private int pendingPops;
+        private long popTimestamp;
+        private long popThread;
+
+        // indexed by methodId - FirstMethodId, guarded by nameSync when adding to it.
+        private volatile MethodCall[] functionMap = new MethodCall[1024];
+        private object nameSync = new object();
+
+        public MethodCall GetMethodName(long methodId)
         {
-            buffer.SetSize(0);
+            MethodCall[] map = functionMap;
+            long index = methodId - FirstMethodId;
+            if (index < 0 || index >= map.Length)
+            {
+                return null;
+            }
+            return map[index];
         }
 
-        private ConcurrentDictionary<long, MethodCall> functionMap = new ConcurrentDictionary<long, MethodCall>();
+        // the function count from the last LookupStats, ReadMethod fetches the names up to here in one go.
+        private long knownFunctions;
 
-        public MethodCall GetMethodName(long methodId)
+        private void AddMethodName(long methodId, string name)
         {
-            MethodCall result = null;
-            functionMap.TryGetValue(methodId, out result);
-            return result;
+            long index = methodId - FirstMethodId;
+            if (index < 0 || string.IsNullOrEmpty(name))
+            {
+                return;
+            }
+            lock (nameSync)
+            {
+                MethodCall[] map = functionMap;
+                if (index >= map.Length)
+                {
+                    MethodCall[] larger = new MethodCall[Math.Max(map.Length * 2, index + 1)];
+                    Array.Copy(map, larger, map.Length);
+                    map = larger;
+                }
+                map[index] = new MethodCall(methodId, name, true);
+                functionMap = map;
+            }
         }
 
-        private void FetchMethodName(long methodId)
+        private void RemoveMethodName(long methodId)
         {
-            MethodCall method = GetMethodName(methodId);
-            if (method == null)
+            long index = methodId - FirstMethodId;
+            lock (nameSync)
             {
-                lock (pipeSync)
+                MethodCall[] map = functionMap;
+                if (index >= 0 && index < map.Length)
                 {
-                    string message = "F:" + methodId;
+                    map[index] = null;
+                }
+            }
+        }
+
+        // these match ControlFrameHeader and ControlOpcode in PipeServer.h.
+        private const uint ControlFrameMagic = 0x46435453;
+        private const ushort ResolveNamesOpcode = 1;
+        private const int ControlFrameHeaderSize = 20;
+
+        // keeps each request well inside the profiler's 10K pipe buffer.
+        private const int MaxNamesPerFrame = 1024;
+        // the size in bytes of the profiler's pipe buffers, see PipeServer.cpp.
+        private const int PipeBufferBytes = 10 * 1024;
+        private uint nextRequestId;
+
+        /// <summary>
+        /// Fetch the names of the methods we don't know yet.  The profiler interns them in the shared memory as the
+        /// methods are mapped, so the pipe is only used for the ones that didn't fit.  Those ids are sent in batches
+        /// and each reply carries the names for one batch.  The profiler writes each reply before it reads the next
+        /// request, so only as many requests are in flight as fit in the pipe buffer, any more and both sides could
+        /// block writing.
+        /// </summary>
+        private void FetchMethodNames(IEnumerable<long> methodIds)
+        {
+            List<long> ids = methodIds.Where(id => id >= FirstMethodId && id <= uint.MaxValue).ToList();
+            if (ids.All(id => GetMethodName(id) != null))
+            {
+                return;
+            }
+
+            SharedMemoryBuffer names = buffer;
+            if (names != null)
+            {
+                names.ReadNames(AddMethodName);
+            }
+
+            List<long> missing = ids.Where(id => GetMethodName(id) == null).Distinct().ToList();
+            if (missing.Count == 0)
+            {
+                return;
+            }
+
+            lock (pipeSync)
+            {
+                while (missing.Count > 0)
+                {
+                    Dictionary<uint, List<long>> pending = new Dictionary<uint, List<long>>();
+                    List<long> retry = new List<long>();
+                    int sent = 0;
+                    int bytesInFlight = 0;
+                    while (sent < missing.Count || pending.Count > 0)
+                    {
+                        int batchCount = Math.Min(MaxNamesPerFrame, missing.Count - sent);
+                        int requestBytes = ControlFrameHeaderSize + batchCount * 4;
+                        if (batchCount > 0 && (pending.Count == 0 || bytesInFlight + requestBytes <= PipeBufferBytes))
+                        {
+                            List<long> batch = missing.GetRange(sent, batchCount);
+                            uint requestId = ++nextRequestId;
+                            if (!ControlPipe.WriteBytes(CreateResolveNamesFrame(requestId, batch)))
+                            {
+                                Status = "Failed to send method name request.";
+                                return;
+                            }
+                            pending[requestId] = batch;
+                            bytesInFlight += requestBytes;
+                            sent += batchCount;
+                            continue;
+                        }
+
+                        // the next request has to wait for a reply to make room.
+                        byte[] reply = ControlPipe.ReadBytes();
+                        if (reply == null || reply.Length < ControlFrameHeaderSize - 4 || BitConverter.ToUInt32(reply, 0) != ControlFrameMagic)
+                        {
+                            Status = "Failed to read method names.";
+                            return;
+                        }
+
+                        uint replyId = BitConverter.ToUInt32(reply, 4);
+                        int count = BitConverter.ToUInt16(reply, 10);
+                        uint status = BitConverter.ToUInt32(reply, 12);
+                        List<long> replied;
+                        if (!pending.TryGetValue(replyId, out replied))
+                        {
+                            continue;
+                        }
+                        pending.Remove(replyId);
+                        bytesInFlight -= ControlFrameHeaderSize + replied.Count * 4;
+
+                        int offset = ControlFrameHeaderSize - 4;
+                        int resolved = 0;
+                        for (; resolved < count && offset + 6 <= reply.Length; resolved++)
+                        {
+                            long methodId = BitConverter.ToUInt32(reply, offset);
+                            int length = Math.Min(BitConverter.ToUInt16(reply, offset + 4), reply.Length - offset - 6);
+                            AddMethodName(methodId, Encoding.UTF8.GetString(reply, offset + 6, length));
+                            offset += 6 + length;
+                        }
+
+                        // the names that didn't fit in the reply go in the next round.
+                        if (status == 0 && resolved > 0 && resolved < replied.Count)
+                        {
+                            retry.AddRange(replied.Skip(resolved));
+                        }
+                    }
+                    missing = retry;
+                }
+            }
+        }
 
-                    string name = SendMessage(message);
-                    if (!string.IsNullOrEmpty(name))
+        private static byte[] CreateResolveNamesFrame(uint requestId, List<long> methodIds)
+        {
+            byte[] frame = new byte[ControlFrameHeaderSize + methodIds.Count * 4];
+            BitConverter.GetBytes((uint)(frame.Length - 4)).CopyTo(frame, 0);
+            BitConverter.GetBytes(ControlFrameMagic).CopyTo(frame, 4);
+            BitConverter.GetBytes(requestId).CopyTo(frame, 8);
+            BitConverter.GetBytes(ResolveNamesOpcode).CopyTo(frame, 12);
+            BitConverter.GetBytes((ushort)methodIds.Count).CopyTo(frame, 14);
+            for (int i = 0; i < methodIds.Count; i++)
+            {
+                BitConverter.GetBytes((uint)methodIds[i]).CopyTo(frame, ControlFrameHeaderSize + i * 4);
+            }
+            return frame;
+        }
+
+        /// <summary>
+        /// Switch the profiler between recording every call (false) and only counting calls and time per method (true).
+        /// </summary>
+        public bool SetFlatProfile(bool flat)
+        {
+            return SendMessage("P:" + (flat ? "flat" : "trace")) != null;
+        }
+
+        /// <summary>
+        /// Stop recording without detaching, the profiled process runs at close to full speed until Resume is called.
+        /// </summary>
+        public bool Pause()
+        {
+            return SendMessage("Z:pause") != null;
+        }
+
+        /// <summary>
+        /// Start recording again after Pause.
+        /// </summary>
+        public bool Resume()
+        {
+            return SendMessage("Z:resume") != null;
+        }
+
+        /// <summary>
+        /// Ask the profiler to map every method the CLR has compiled so far and load all their names at once, instead of
+        /// looking them up one by one as they turn up.  The profiler does this itself when we attach, this picks up the
+        /// methods compiled since.  Returns the number of methods that were new to the profiler, or -1 if it failed.
+        /// </summary>
+        public long SnapshotFunctions()
+        {
+            long added;
+            string reply = SendMessage("E:");
+            if (reply == null || !long.TryParse(reply, out added))
+            {
+                return -1;
+            }
+            SharedMemoryBuffer names = buffer;
+            if (names != null)
+            {
+                names.ReadNames(AddMethodName);
+            }
+            return added;
+        }
+
+        /// <summary>
+        /// Have the profiler copy everything it records to a trace file at this path (on the profiled process's machine),
+        /// so the capture can be kept and analyzed later.  It records until StopRecording or we detach.  Only works when
+        /// reading the shared memory, not the data stream.
+        /// </summary>
+        public bool StartRecording(string path)
+        {
+            return SendMessage("O:" + path) == "ok";
+        }
+
+        /// <summary>
+        /// Finish the trace file started by StartRecording.
+        /// </summary>
+        public bool StopRecording()
+        {
+            return SendMessage("O:") == "ok";
+        }
+
+        /// <summary>
+        /// Only hook the methods that pass this filter, for example "-[mscorlib];-System.*;-Microsoft.*".
+        /// Rules are separated by ';', start with '+' to include or '-' to exclude, and match "Namespace.Class.Method"
+        /// with an optional "[assembly]" prefix.  It only applies to methods the CLR hasn't seen yet, so send it as
+        /// soon as we attach, or set SOFTWARETRAILS_FILTER in the environment of the target process.
+        /// </summary>
+        public bool SetFilter(string spec)
+        {
+            return SendMessage("N:" + spec) != null;
+        }
+
+        /// <summary>
+        /// Switch the profiler to sampling the call stacks of all threads, see GetSampledStacks.
+        /// </summary>
+        public bool SetSampleProfile()
+        {
+            return SendMessage("P:sample") != null;
+        }
+
+        /// <summary>
+        /// How many times per second the sampling profiler walks the stacks.
+        /// </summary>
+        public bool SetSampleRate(int samplesPerSecond)
+        {
+            return SendMessage("R:" + samplesPerSecond) != null;
+        }
+
+        // the reader thread adds to these, guarded by sampleSync.
+        private object sampleSync = new object();
+        private Dictionary<int, SampledStack> sampledStacks = new Dictionary<int, SampledStack>();
+        private Dictionary<long, FunctionStats> suppressedCalls = new Dictionary<long, FunctionStats>();
+        private List<ProfilerModule> modules = new List<ProfilerModule>() { null }; // by module index, 0 is unknown
+        private MethodSlots methodSlots = new MethodSlots(); // by methodId - FirstMethodId
+
+        private void ReadExtended(long id, byte[] payload)
+        {
+            if (id == SharedMemoryBuffer.StackRecord && payload.Length >= 8)
+            {
+                int stackId = BitConverter.ToInt32(payload, 0);
+                int count = Math.Min(BitConverter.ToInt32(payload, 4), payload.Length / 4 - 2);
+                long[] methods = new long[Math.Max(count, 0)];
+                for (int i = 0; i < methods.Length; i++)
+                {
+                    methods[i] = BitConverter.ToUInt32(payload, 8 + i * 4);
+                }
+                FetchMethodNames(methods);
+                lock (sampleSync)
+                {
+                    sampledStacks[stackId] = new SampledStack() { StackId = stackId, MethodIds = methods };
+                }
+            }
+            else if (id == SharedMemoryBuffer.SummaryRecord && payload.Length >= 24)
+            {
+                long methodId = BitConverter.ToUInt32(payload, 0);
+                long calls = BitConverter.ToInt64(payload, 8);
+                long time = records.TicksToMicroseconds(BitConverter.ToInt64(payload, 16));
+                FetchMethodNames(new long[] { methodId });
+                lock (sampleSync)
+                {
+                    FunctionStats stats;
+                    if (!suppressedCalls.TryGetValue(methodId, out stats))
+                    {
+                        stats = new FunctionStats() { MethodId = methodId };
+                        suppressedCalls[methodId] = stats;
+                    }
+                    stats.Calls += calls;
+                    stats.Inclusive += time;
+                }
+            }
+            else if (id == SharedMemoryBuffer.DefineRecord && payload.Length >= 24)
+            {
+                long methodId = BitConverter.ToUInt32(payload, 0);
+                long nameOffset = BitConverter.ToUInt32(payload, 16);
+                int module = BitConverter.ToInt32(payload, 20);
+                int generation = payload.Length >= 32 ? BitConverter.ToInt32(payload, 24) : 0;
+                bool recycled;
+                if (DefineMethod(methodId, module, generation, out recycled) && nameOffset != 0 && buffer != null &&
+                    (recycled || GetMethodName(methodId) == null))
+                {
+                    AddMethodName(methodId, buffer.ReadName(methodId, nameOffset));
+                }
+            }
+            else if (id == SharedMemoryBuffer.RetireRecord && payload.Length >= 8)
+            {
+                long methodId = BitConverter.ToUInt32(payload, 0);
+                int generation = BitConverter.ToInt32(payload, 4);
+                if (RetireMethod(methodId, generation))
+                {
+                    // the name is gone until the next method to get this id is defined.
+                    RemoveMethodName(methodId);
+                }
+            }
+            else if (id == SharedMemoryBuffer.ModuleRecord && payload.Length >= 56)
+            {
+                int index = BitConverter.ToInt32(payload, 0);
+                int flags = BitConverter.ToInt32(payload, 4);
+                byte[] mvid = new byte[16];
+                Array.Copy(payload, 32, mvid, 0, 16);
+                int pathBytes = Math.Min(BitConverter.ToInt32(payload, 48), payload.Length - 56);
+                int assemblyBytes = Math.Min(BitConverter.ToInt32(payload, 52), payload.Length - 56 - pathBytes);
+                ProfilerModule module = new ProfilerModule()
+                {
+                    Index = index,
+                    ModuleId = BitConverter.ToInt64(payload, 8),
+                    AssemblyId = BitConverter.ToInt64(payload, 16),
+                    BaseAddress = BitConverter.ToInt64(payload, 24),
+                    Mvid = new Guid(mvid),
+                    Path = Encoding.UTF8.GetString(payload, 56, pathBytes),
+                    Assembly = Encoding.UTF8.GetString(payload, 56 + pathBytes, assemblyBytes),
+                    Unloaded = (flags & SharedMemoryBuffer.ModuleUnloaded) != 0
+                };
+                if (index > 0)
+                {
+                    lock (sampleSync)
+                    {
+                        while (modules.Count <= index)
+                        {
+                            modules.Add(null);
+                        }
+                        modules[index] = module;
+                    }
+                }
+            }
+            else if (id == SharedMemoryBuffer.SampleRecord && payload.Length >= 20)
+            {
+                int stackId = BitConverter.ToInt32(payload, 16);
+                lock (sampleSync)
+                {
+                    SampledStack stack;
+                    if (sampledStacks.TryGetValue(stackId, out stack))
                     {
-                        functionMap[methodId] = new MethodCall(methodId, name, true);
+                        stack.Samples++;
                     }
                 }
             }
         }
 
+        /// <summary>
+        /// Functions called more often than this many times a second are only counted, not recorded, until they
+        /// cool down again.  Their calls are reported by GetSuppressedCalls instead.  0 turns throttling off.
+        /// </summary>
+        public bool SetThrottle(int callsPerSecond)
+        {
+            return SendMessage("T:" + callsPerSecond) != null;
+        }
+
+        /// <summary>
+        /// Return the calls the throttle kept out of the trace since the last Clear, with their total (inclusive) time.
+        /// </summary>
+        public List<FunctionStats> GetSuppressedCalls()
+        {
+            lock (sampleSync)
+            {
+                return (from stats in suppressedCalls.Values
+                        select new FunctionStats() { MethodId = stats.MethodId, Calls = stats.Calls, Inclusive = stats.Inclusive }).ToList();
+            }
+        }
+
+        /// <summary>
+        /// Return the stacks the sampling profiler has seen since the last Clear, most sampled first.
+        /// </summary>
+        public List<SampledStack> GetSampledStacks()
+        {
+            lock (sampleSync)
+            {
+                return (from stack in sampledStacks.Values
+                        where stack.Samples > 0
+                        orderby stack.Samples descending
+                        select new SampledStack() { StackId = stack.StackId, MethodIds = stack.MethodIds, Samples = stack.Samples }).ToList();
+            }
+        }
+
+        // Records the method's module, returns false if we have already seen a later generation of the method id.
+        private bool DefineMethod(long methodId, int module, int generation, out bool recycled)
+        {
+            recycled = false;
+            if (methodId < FirstMethodId)
+            {
+                return false;
+            }
+            lock (sampleSync)
+            {
+                return methodSlots.Define((int)(methodId - FirstMethodId), module, generation, out recycled);
+            }
+        }
+
+        // Returns false if the retire is stale, the next generation of the method id may already have been defined.
+        private bool RetireMethod(long methodId, int generation)
+        {
+            if (methodId < FirstMethodId)
+            {
+                return false;
+            }
+            lock (sampleSync)
+            {
+                return methodSlots.Retire((int)(methodId - FirstMethodId), generation);
+            }
+        }
+
+        /// <summary>
+        /// Return the module the method was loaded from, or null if the profiler hasn't told us yet.
+        /// This is an array lookup, so it is cheap enough to roll up every call by module or assembly.
+        /// </summary>
+        public ProfilerModule GetMethodModule(long methodId)
+        {
+            lock (sampleSync)
+            {
+                long slot = methodId - FirstMethodId;
+                if (slot < 0 || slot > int.MaxValue)
+                {
+                    return null;
+                }
+                int module = methodSlots.GetModule((int)slot);
+                return module < modules.Count ? modules[module] : null;
+            }
+        }
+
+        /// <summary>
+        /// Return the modules the profiler has told us about, in the order they were loaded, including the ones that have since unloaded.
+        /// </summary>
+        public List<ProfilerModule> GetModules()
+        {
+            lock (sampleSync)
+            {
+                return modules.Where(module => module != null).ToList();
+            }
+        }
+
+        private void ClearSamples()
+        {
+            lock (sampleSync)
+            {
+                sampledStacks.Clear();
+                suppressedCalls.Clear();
+            }
+            pendingPops = 0;
+        }
+
+        private long lastSnapshot;
+
+        /// <summary>
+        /// Ask the profiler to publish its flat profile and return the methods whose totals changed since the last call.
+        /// </summary>
+        public List<FunctionStats> GetFunctionStats()
+        {
+            List<FunctionStats> result = new List<FunctionStats>();
+            if (buffer == null || SendMessage("S:") == null)
+            {
+                return result;
+            }
+
+            long snapshot = buffer.ReadStats(lastSnapshot, result);
+            if (snapshot >= 0)
+            {
+                lastSnapshot = snapshot;
+            }
+            FetchMethodNames(from stats in result select stats.MethodId);
+            return result;
+        }
+
         /// <summary>
         /// Clear the shared memory buffer of all call history.
         /// </summary>
@@ -293,7 +974,11 @@ namespace SoftwareTrails
                     Status = String.Format("Failed to get result.");
                 }
 
-                buffer.MoveTo(0);
+                ClearSamples();
+                if (records != null)
+                {
+                    records.Rewind();
+                }
             }
         }
 
@@ -302,9 +987,12 @@ namespace SoftwareTrails
         /// </summary>
         internal void Reset()
         {
+            // only the shared memory can be replayed, the stream has been read already.
             if (buffer != null)
             {
-                buffer.MoveTo(0);
+                // the samples are counted again as they are replayed.
+                ClearSamples();
+                buffer.Rewind();
             }
         }
 
@@ -398,9 +1086,26 @@ namespace SoftwareTrails
             }
             if (_dataPipeReadTask == null)
             {
+                DataStreamReader reader = stream;
+                NamedPipeReaderWriter pipe = _dataPipe;
                 _dataPipeReadTask = new Task(() =>
                     {
-                        // todo: not currently using this datapipe...
+                        // when streaming the records arrive as frames on this pipe, otherwise it isn't used.
+                        while (reader != null && reader == stream)
+                        {
+                            byte[] frame = pipe.ReadBytes();
+                            if (frame == null)
+                            {
+                                // the profiler has gone away.
+                                break;
+                            }
+                            reader.AddFrame(frame, AddMethodName);
+
+                            // stop reading while the records pile up, the profiler drops them instead.
+                            while (!reader.WaitForRoom(100) && reader == stream)
+                            {
+                            }
+                        }
 
                         _dataPipeReadTask = null;
                     });
@@ -643,6 +1348,8 @@ namespace SoftwareTrails
                         }
                     }
 
+                    // lets the data pipe reader finish.
+                    stream = null;
                     if (_dataPipeReadTask != null)
                     {
                         using (_dataPipeReadTask)
@@ -0,0 +1,38 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace SoftwareTrails
+{
+    /// <summary>
+    /// A module the profiled process loaded, as described by the profiler's ModuleRecords.
+    /// </summary>
+    public class ProfilerModule
+    {
+        /// <summary>
+        /// The dense index the profiler tags each method with, starting at 1 and never reused.
+        /// </summary>
+        public int Index { get; set; }
+
+        public long ModuleId { get; set; }
+
+        public long AssemblyId { get; set; }
+
+        public long BaseAddress { get; set; }
+
+        /// <summary>
+        /// The module version id, different for each build of the module.
+        /// </summary>
+        public Guid Mvid { get; set; }
+
+        /// <summary>
+        /// The file the module was loaded from, empty for dynamic modules.
+        /// </summary>
+        public string Path { get; set; }
+
+        public string Assembly { get; set; }
+
+        public bool Unloaded { get; set; }
+    }
+}
@@ -0,0 +1,22 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace SoftwareTrails
+{
+    /// <summary>
+    /// A distinct call stack seen by the sampling profiler, and how many samples landed on it.
+    /// </summary>
+    public class SampledStack
+    {
+        public int StackId { get; set; }
+
+        /// <summary>
+        /// The method ids on the stack, leaf first.
+        /// </summary>
+        public long[] MethodIds { get; set; }
+
+        public long Samples { get; set; }
+    }
+}
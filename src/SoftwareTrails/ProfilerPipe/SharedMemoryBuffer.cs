@@ -7,33 +7,176 @@ using System.Threading;
 
 namespace SoftwareTrails
 {
-    class SharedMemoryBuffer : IDisposable
+    /// <summary>
+    /// Reads the records the profiler writes to shared memory.  The buffer is divided into fixed size
+    /// chunks, each written by a single thread in the target process.  The layout must match SharedMemory.h.
+    /// </summary>
+    class SharedMemoryBuffer : IDisposable, IRecordReader
     {
         internal const string SharedMemoryName = "ProfilerData";
         internal const int SharedMemorySize = 400000000; // 400 megabytes
         private MemoryMappedFile sharedMemory;
         private MemoryMappedViewAccessor sharedMemoryAccessor;
-        private long sharedMemoryPosition;
-        private long sharedMemoryMaximum;
-        private bool is64Bit; // target process is 64bit.
-        private int sharedMemFieldSize;
+        private EventWaitHandle doorbell; // rung by the profiler while our reader slot says we're waiting
+        private EventWaitHandle waitingEvent; // we set this when we start waiting so the profiler looks at our slot
+        private string name;
+        private int readerSlot = -1;
 
-        public SharedMemoryBuffer(bool is64bit)
+        // Record, each is a 32 bit id followed by a 32 bit delta from the previous record's timestamp.
+        const int RecordSize = 8;
+        const uint TimeBaseRecord = 3; // followed by a 64 bit absolute timestamp
+        internal const uint OverrunRecord = 5; // never written, ReadRecord returns it when records were lost
+
+        // Extended records, the delta is the size of the payload that follows.
+        internal const uint FirstExtendedRecord = 128;
+        internal const uint StackRecord = 128;  // int stackId, int frameCount, then frameCount method ids, leaf first
+        internal const uint SampleRecord = 129; // long timestamp, long threadId, int stackId, int reserved
+        internal const uint PopRecord = 130;    // long timestamp, int count, int reserved
+        internal const uint SummaryRecord = 131; // int methodId, int reserved, long calls, long ticks
+        internal const uint DefineRecord = 132;  // int methodId, int token, long moduleId, int nameOffset, int module, int generation, int reserved
+        internal const uint ModuleRecord = 133;  // int module, int flags, long moduleId, long assemblyId, long baseAddress, Guid mvid,
+                                                 // int pathBytes, int assemblyBytes, then the UTF-8 path and assembly name
+        internal const int ModuleUnloaded = 2;   // in the ModuleRecord flags, else it was loaded
+        internal const uint RetireRecord = 134;  // int methodId, int generation, the method unloaded and its id will be reused
+
+        // SharedMemoryHeader
+        const uint SharedMemoryMagic = 0x4C525453;
+        const int MagicOffset = 0;
+        const int ChunkSizeOffset = 8;
+        const int ChunkCountOffset = 12;
+        const int NextSequenceOffset = 16;
+        const int ResetSequenceOffset = 24;
+        const int VersionOffset = 40;
+        const int ClockFrequencyOffset = 48; // timestamp ticks per second
+        const int ClockBaseOffset = 56;      // timestamp at the time the clock was calibrated
+        const int StatsOffsetOffset = 80;
+        const int NamesOffsetOffset = 88;
+        const int PublishedRecordsOffset = 104; // records published since the last reset
+        const int FunctionCountOffset = 112;
+        const int ReadersOffset = 128;
+
+        // ReaderSlot, one per registered reader
+        const int ReaderSlotSize = 64;
+        const int ReaderWaitingOffset = 8;
+        const int ReaderCursorOffset = 16; // the oldest chunk sequence we haven't finished
+        const int ReaderLagOffset = 24;
+
+        // NamesHeader, followed by NameEntry: int methodId, int token, long moduleId, int bytes, int module, UTF-8 name.
+        const int NamesUsedOffset = 0;
+        const int NamesCapacityOffset = 4;
+        const int NamesHeaderSize = 64;
+        const int NameEntrySize = 24;
+        const int NameBytesOffset = 16;
+
+        // StatsHeader, followed by FunctionStats entries of 4 longs: calls, inclusive, exclusive, snapshot.
+        const int StatsHeaderSize = 64;
+        const int StatsSequenceOffset = 0;
+        const int StatsCountOffset = 20;
+        const int FunctionStatsSize = 32;
+        const long FirstMethodId = 256;
+
+        // ChunkHeader
+        const int ChunkHeaderSize = 64;
+        const int ChunkSequenceOffset = 0;
+        const int ChunkStateOffset = 8;
+        const int ChunkUsedOffset = 12;
+        const int ChunkOwnerOffset = 16;
+        const int ChunkThreadIdOffset = 24;
+        const int ChunkBaseTimestampOffset = 32;
+        const int ChunkSealed = 2;
+
+        private int chunkSize;
+        private int chunkCount;
+        private long clockFrequency;
+        private long clockBase;
+        private long statsOffset;
+        private long namesOffset;
+        private long namesScanned; // the next NameEntry ReadNames hasn't seen, from the start of the names region.
+        private object namesSync = new object();
+        private long scanSequence; // next chunk sequence we haven't looked at yet.
+        private List<long> unpublished = new List<long>(); // chunks claimed but not yet stamped with their sequence.
+        private List<ChunkQueue> writers = new List<ChunkQueue>();
+        private Dictionary<int, ChunkQueue> writerMap = new Dictionary<int, ChunkQueue>();
+        private int writerIndex;
+        private volatile bool rewind;
+        private bool overrun; // chunks were overwritten before we read them
+        private long overruns;
+        private byte[] payload = new byte[0];
+
+        /// <summary>
+        /// The chunks written by one thread, oldest first.  Only the oldest chunk is read so
+        /// the records from each thread come out in order.
+        /// </summary>
+        class ChunkQueue
+        {
+            public int Owner;
+            public long ThreadId;
+            public Queue<ChunkCursor> Chunks = new Queue<ChunkCursor>();
+        }
+
+        class ChunkCursor
+        {
+            public long Sequence;
+            public long Offset; // of the ChunkHeader
+            public int Read;    // bytes of record data consumed so far
+            public long Timestamp; // of the last record read
+        }
+
+        public SharedMemoryBuffer()
         {   
             // create large shared buffer for efficient transfer of method call data.
+            name = SharedMemoryName;
             sharedMemory = MemoryMappedFile.CreateNew(SharedMemoryName, SharedMemorySize);
             sharedMemoryAccessor = sharedMemory.CreateViewAccessor();
-            this.is64Bit = is64bit;
-            if (is64Bit)
-            {
-                sharedMemFieldSize = sizeof(Int64);
-            }
-            else
+        }
+
+        /// <summary>
+        /// Read a buffer that another client has already given to the profiler.
+        /// </summary>
+        public SharedMemoryBuffer(string name)
+        {
+            this.name = name;
+            sharedMemory = MemoryMappedFile.OpenExisting(name);
+            sharedMemoryAccessor = sharedMemory.CreateViewAccessor();
+        }
+
+        /// <summary>
+        /// Use the reader slot the profiler gave us, it has our cursor and the doorbell that wakes us.
+        /// Without one WaitForRecords just sleeps.
+        /// </summary>
+        public void Register(int slot)
+        {
+            // the profiler created the event when it gave us the slot.
+            readerSlot = slot;
+            doorbell = new EventWaitHandle(false, EventResetMode.AutoReset, name + "_Doorbell" + slot);
+            waitingEvent = new EventWaitHandle(false, EventResetMode.AutoReset, name + "_Waiting");
+        }
+
+        /// <summary>
+        /// The number of times we fell so far behind that records were lost, ReadRecord returns an OverrunRecord for each.
+        /// </summary>
+        public long Overruns
+        {
+            get { return Interlocked.Read(ref overruns); }
+        }
+
+        /// <summary>
+        /// How many chunks behind the writers we were when the profiler last looked.
+        /// </summary>
+        public long Lag
+        {
+            get
             {
-                sharedMemFieldSize = sizeof(Int32);
+                MemoryMappedViewAccessor accessor = sharedMemoryAccessor;
+                return accessor != null && readerSlot >= 0 ? accessor.ReadInt64(ReaderSlotOffset + ReaderLagOffset) : 0;
             }
         }
 
+        private long ReaderSlotOffset
+        {
+            get { return ReadersOffset + readerSlot * ReaderSlotSize; }
+        }
+
         public void Dispose()
         {
             Dispose(true);
@@ -55,73 +198,517 @@ namespace SoftwareTrails
             {
                 sharedMemory = null;
             }
-            sharedMemoryPosition = 0;
+            using (doorbell)
+            {
+                doorbell = null;
+            }
+            using (waitingEvent)
+            {
+                waitingEvent = null;
+            }
+            chunkCount = 0;
+        }
+
+        /// <summary>
+        /// Start reading again from the oldest chunk that has not been overwritten or cleared.
+        /// This is called from the UI thread, so the reader thread does the actual work.
+        /// </summary>
+        public void Rewind()
+        {
+            rewind = true;
         }
 
-        internal void MoveTo(int pos)
+        /// <summary>
+        /// The payload of the last extended record returned by ReadRecord.
+        /// </summary>
+        public byte[] Payload
         {
-            sharedMemoryPosition = pos;
+            get { return payload; }
         }
 
-        public void SetSize(long calls) 
+        private void RewindChunks()
         {
-            sharedMemoryMaximum = calls * sharedMemFieldSize * 2;
-            if (sharedMemoryPosition > sharedMemoryMaximum)
+            rewind = false;
+            writers.Clear();
+            writerMap.Clear();
+            unpublished.Clear();
+            writerIndex = 0;
+            scanSequence = 0;
+            overrun = false;
+            if (sharedMemoryAccessor != null && chunkCount > 0)
             {
-                // must have wrapped around.
-                sharedMemoryPosition = 0;
+                long next = sharedMemoryAccessor.ReadInt64(NextSequenceOffset);
+                long reset = sharedMemoryAccessor.ReadInt64(ResetSequenceOffset);
+                scanSequence = Math.Max(reset, next - chunkCount);
             }
         }
 
-        public long ReadRecord(out long timestamp)
+        /// <summary>
+        /// Returns the id of the next record, or 0 if there is nothing new to read.  The timestamp is in microseconds,
+        /// and the thread identifies the managed thread that wrote the record (or the OS thread, if the managed one isn't known).
+        /// </summary>
+        public long ReadRecord(out long timestamp, out long thread)
         {
-            long id = 0;
             timestamp = 0;
-            if (sharedMemoryAccessor != null)
+            thread = 0;
+            if (sharedMemoryAccessor == null || !ReadHeader())
             {
-                long pos = sharedMemoryPosition;
-                
-                if (pos >= sharedMemoryMaximum)
+                return 0;
+            }
+            if (rewind)
+            {
+                RewindChunks();
+            }
+            if (overrun)
+            {
+                // the records we lost leave every call stack in doubt.
+                overrun = false;
+                Interlocked.Increment(ref overruns);
+                return OverrunRecord;
+            }
+
+            bool scanned = false;
+            for (int i = 0; i <= writers.Count; i++)
+            {
+                if (writerIndex >= writers.Count)
                 {
-                    // we are at the end, nothing to return yet.
-                    return 0;
+                    if (scanned)
+                    {
+                        break;
+                    }
+                    // pick up any chunks claimed since we last looked.
+                    ScanChunks();
+                    scanned = true;
+                    writerIndex = 0;
+                    if (writers.Count == 0)
+                    {
+                        break;
+                    }
+                }
+
+                ChunkQueue writer = writers[writerIndex];
+                long id = ReadChunks(writer, out timestamp);
+                if (id != 0)
+                {
+                    thread = writer.ThreadId != 0 ? writer.ThreadId : writer.Owner;
+                    if (id == SampleRecord)
+                    {
+                        // the sampler thread writes these on behalf of the thread it sampled.
+                        timestamp = ToMicroseconds(BitConverter.ToInt64(payload, 0));
+                        thread = BitConverter.ToInt64(payload, 8);
+                    }
+                    else if (id == PopRecord)
+                    {
+                        timestamp = ToMicroseconds(BitConverter.ToInt64(payload, 0));
+                    }
+                    return id;
                 }
 
-                if (is64Bit)
+                if (writer.Chunks.Count == 0)
                 {
-                    id = sharedMemoryAccessor.ReadInt64(pos);
+                    writers.RemoveAt(writerIndex);
+                    writerMap.Remove(writer.Owner);
                 }
                 else
                 {
-                    id = sharedMemoryAccessor.ReadInt32(pos);
+                    writerIndex++;
                 }
+            }
+            return 0;
+        }
+
+        /// <summary>
+        /// Blocks until the profiler has published new records, call this once ReadRecord returns 0.
+        /// Returns false if it timed out, which is also what happens if nothing is being recorded.
+        /// </summary>
+        public bool WaitForRecords(int timeoutMS)
+        {
+            MemoryMappedViewAccessor accessor = sharedMemoryAccessor;
+            EventWaitHandle handle = doorbell;
+            EventWaitHandle waiting = waitingEvent;
+            if (accessor == null || handle == null || waiting == null || readerSlot < 0)
+            {
+                Thread.Sleep(timeoutMS);
+                return false;
+            }
 
-                if (id == 0)
+            // the profiler only rings while we say we're waiting, so that's free the rest of the time.
+            try
+            {
+                long waitingFlag = ReaderSlotOffset + ReaderWaitingOffset;
+                accessor.Write(waitingFlag, 1);
+                waiting.Set();
+                bool rung = handle.WaitOne(timeoutMS);
+                accessor.Write(waitingFlag, 0);
+                return rung;
+            }
+            catch (ObjectDisposedException)
+            {
+                // detached while we were waiting.
+                return false;
+            }
+        }
+
+        /// <summary>
+        /// Read the counts the profiler keeps in the header, returns false if it hasn't mapped the buffer yet.
+        /// </summary>
+        public bool ReadCounts(out long functions, out long records, out long version)
+        {
+            functions = 0;
+            records = 0;
+            version = 0;
+            MemoryMappedViewAccessor accessor = sharedMemoryAccessor;
+            if (accessor == null || (uint)accessor.ReadInt32(MagicOffset) != SharedMemoryMagic)
+            {
+                return false;
+            }
+            functions = accessor.ReadInt32(FunctionCountOffset);
+            records = accessor.ReadInt64(PublishedRecordsOffset);
+            version = accessor.ReadInt32(VersionOffset);
+            return true;
+        }
+
+        private bool ReadHeader()
+        {
+            if (chunkCount == 0)
+            {
+                // the profiler fills in the header when it maps the buffer.
+                if ((uint)sharedMemoryAccessor.ReadInt32(MagicOffset) != SharedMemoryMagic)
                 {
-                    // do not advance pointer in this case.
-                    return 0;
+                    return false;
                 }
+                chunkSize = sharedMemoryAccessor.ReadInt32(ChunkSizeOffset);
+                chunkCount = sharedMemoryAccessor.ReadInt32(ChunkCountOffset);
+                clockFrequency = sharedMemoryAccessor.ReadInt64(ClockFrequencyOffset);
+                clockBase = sharedMemoryAccessor.ReadInt64(ClockBaseOffset);
+                statsOffset = (uint)sharedMemoryAccessor.ReadInt32(StatsOffsetOffset);
+                namesOffset = (uint)sharedMemoryAccessor.ReadInt32(NamesOffsetOffset);
+                RewindChunks();
+            }
+            return true;
+        }
 
-                long timestampPosition = pos + sharedMemFieldSize;
+        private long ChunkOffset(long sequence)
+        {
+            // the first chunk is the header.
+            return (1 + (sequence % chunkCount)) * (long)chunkSize;
+        }
 
-                if (is64Bit)
+        private void ScanChunks()
+        {
+            long next = sharedMemoryAccessor.ReadInt64(NextSequenceOffset);
+            if (next - scanSequence > chunkCount)
+            {
+                // we have been lapped, the older chunks are gone.
+                scanSequence = next - chunkCount;
+                overrun = true;
+            }
+
+            for (int i = 0; i < unpublished.Count; )
+            {
+                long sequence = unpublished[i];
+                if (sequence < next - chunkCount || AddChunk(sequence))
                 {
-                    timestamp = sharedMemoryAccessor.ReadInt32(timestampPosition);
+                    unpublished.RemoveAt(i);
                 }
                 else
                 {
-                    timestamp = sharedMemoryAccessor.ReadInt64(timestampPosition);
+                    i++;
                 }
-                if (timestamp == 0)
+            }
+
+            for (; scanSequence < next; scanSequence++)
+            {
+                if (!AddChunk(scanSequence))
                 {
-                    return 0;
+                    // the writer may not have stamped it yet, or it skipped over this one because
+                    // it was still in use, so check again next time.
+                    unpublished.Add(scanSequence);
                 }
+            }
 
-                sharedMemoryPosition += sharedMemFieldSize; // methodid
-                sharedMemoryPosition += sharedMemFieldSize; // timestamp
+            PublishCursor();
+        }
 
+        // Tell the profiler the oldest chunk we haven't finished with, so it can tell us if it gets overwritten.
+        private void PublishCursor()
+        {
+            if (readerSlot < 0)
+            {
+                return;
+            }
+            long cursor = scanSequence;
+            foreach (long sequence in unpublished)
+            {
+                cursor = Math.Min(cursor, sequence);
+            }
+            foreach (ChunkQueue writer in writers)
+            {
+                if (writer.Chunks.Count > 0)
+                {
+                    cursor = Math.Min(cursor, writer.Chunks.Peek().Sequence);
+                }
+            }
+            sharedMemoryAccessor.Write(ReaderSlotOffset + ReaderCursorOffset, cursor);
+        }
+
+        private bool AddChunk(long sequence)
+        {
+            long offset = ChunkOffset(sequence);
+            if (sharedMemoryAccessor.ReadInt64(offset + ChunkSequenceOffset) != sequence)
+            {
+                return false;
+            }
+
+            int owner = sharedMemoryAccessor.ReadInt32(offset + ChunkOwnerOffset);
+            long threadId = sharedMemoryAccessor.ReadInt64(offset + ChunkThreadIdOffset);
+            long baseTimestamp = sharedMemoryAccessor.ReadInt64(offset + ChunkBaseTimestampOffset);
+            if (IsOverwritten(offset, sequence))
+            {
+                // it has already been reused, so it's gone.
+                overrun = true;
+                return true;
+            }
+
+            ChunkQueue writer = null;
+            if (!writerMap.TryGetValue(owner, out writer))
+            {
+                writer = new ChunkQueue() { Owner = owner };
+                writerMap[owner] = writer;
+                writers.Add(writer);
+            }
+            if (threadId != 0)
+            {
+                writer.ThreadId = threadId;
+            }
+            writer.Chunks.Enqueue(new ChunkCursor() { Sequence = sequence, Offset = offset, Timestamp = baseTimestamp });
+            return true;
+        }
+
+        // The chunks are reused without being cleared, and the profiler changes the sequence before it
+        // overwrites anything, so checking it again after reading tells us whether what we read is good.
+        private bool IsOverwritten(long offset, long sequence)
+        {
+            Thread.MemoryBarrier();
+            return sharedMemoryAccessor.ReadInt64(offset + ChunkSequenceOffset) != sequence;
+        }
+
+        // The profiler stamps records with the raw processor clock, the header says how fast it ticks.
+        private long ToMicroseconds(long ticks)
+        {
+            return TicksToMicroseconds(ticks - clockBase);
+        }
+
+        public long TicksToMicroseconds(long ticks)
+        {
+            if (clockFrequency <= 0)
+            {
+                return 0;
+            }
+            return (ticks / clockFrequency) * 1000000 + (ticks % clockFrequency) * 1000000 / clockFrequency;
+        }
+
+        /// <summary>
+        /// Return the name a DefineRecord points to, or null if it isn't there.
+        /// </summary>
+        public string ReadName(long methodId, long nameOffset)
+        {
+            if (sharedMemoryAccessor == null || !ReadHeader() || namesOffset == 0 || nameOffset < NamesHeaderSize)
+            {
+                return null;
+            }
+
+            long pos = namesOffset + nameOffset;
+            if ((uint)sharedMemoryAccessor.ReadInt32(pos) != methodId)
+            {
+                return null;
+            }
+            return ReadNameBytes(pos);
+        }
+
+        /// <summary>
+        /// Pass the names the profiler has interned since the last call to define, this finds the names
+        /// of functions whose DefineRecord we haven't read yet or that was overwritten.
+        /// </summary>
+        public void ReadNames(Action<long, string> define)
+        {
+            if (sharedMemoryAccessor == null || !ReadHeader() || namesOffset == 0)
+            {
+                return;
+            }
+
+            lock (namesSync)
+            {
+                long end = NamesHeaderSize + Math.Min((uint)sharedMemoryAccessor.ReadInt32(namesOffset + NamesUsedOffset),
+                                                      (uint)sharedMemoryAccessor.ReadInt32(namesOffset + NamesCapacityOffset));
+                long pos = Math.Max(namesScanned, NamesHeaderSize);
+                while (pos + NameEntrySize <= end)
+                {
+                    // the index is written last, 0 means the profiler is still writing this one.
+                    long methodId = (uint)sharedMemoryAccessor.ReadInt32(namesOffset + pos);
+                    if (methodId == 0)
+                    {
+                        break;
+                    }
+                    Thread.MemoryBarrier();
+                    int bytes = sharedMemoryAccessor.ReadInt32(namesOffset + pos + NameBytesOffset);
+                    define(methodId, ReadNameBytes(namesOffset + pos));
+                    pos += (NameEntrySize + bytes + RecordSize - 1) & ~(RecordSize - 1);
+                }
+                namesScanned = pos;
+            }
+        }
+
+        private string ReadNameBytes(long pos)
+        {
+            int bytes = sharedMemoryAccessor.ReadInt32(pos + NameBytesOffset);
+            byte[] name = new byte[Math.Max(bytes, 0)];
+            sharedMemoryAccessor.ReadArray(pos + NameEntrySize, name, 0, name.Length);
+            return Encoding.UTF8.GetString(name);
+        }
+
+        /// <summary>
+        /// Read the flat profile totals that changed after the given snapshot.  Returns the number of the
+        /// snapshot that was read, or -1 if the profiler hasn't published one we could read.
+        /// </summary>
+        public long ReadStats(long sinceSnapshot, List<FunctionStats> changed)
+        {
+            if (sharedMemoryAccessor == null || !ReadHeader() || statsOffset == 0)
+            {
+                return -1;
+            }
+
+            for (int retry = 0; retry < 10; retry++)
+            {
+                long sequence = sharedMemoryAccessor.ReadInt64(statsOffset + StatsSequenceOffset);
+                if ((sequence & 1) != 0)
+                {
+                    // the profiler is in the middle of publishing one.
+                    Thread.Sleep(1);
+                    continue;
+                }
+
+                int start = changed.Count;
+                int count = sharedMemoryAccessor.ReadInt32(statsOffset + StatsCountOffset);
+                long pos = statsOffset + StatsHeaderSize;
+                for (int i = 0; i < count; i++, pos += FunctionStatsSize)
+                {
+                    long snapshot = sharedMemoryAccessor.ReadInt64(pos + 24);
+                    if (snapshot > sinceSnapshot)
+                    {
+                        changed.Add(new FunctionStats()
+                        {
+                            MethodId = FirstMethodId + i,
+                            Calls = sharedMemoryAccessor.ReadInt64(pos),
+                            Inclusive = TicksToMicroseconds(sharedMemoryAccessor.ReadInt64(pos + 8)),
+                            Exclusive = TicksToMicroseconds(sharedMemoryAccessor.ReadInt64(pos + 16))
+                        });
+                    }
+                }
+
+                Thread.MemoryBarrier();
+                if (sharedMemoryAccessor.ReadInt64(statsOffset + StatsSequenceOffset) == sequence)
+                {
+                    return sequence / 2;
+                }
+                changed.RemoveRange(start, changed.Count - start);
+            }
+            return -1;
+        }
+
+        // Read the next record from the oldest chunk of this writer, moving on to the next chunk when
+        // the oldest one is finished.
+        private long ReadChunks(ChunkQueue writer, out long timestamp)
+        {
+            timestamp = 0;
+            while (writer.Chunks.Count > 0)
+            {
+                ChunkCursor chunk = writer.Chunks.Peek();
+                if (sharedMemoryAccessor.ReadInt64(chunk.Offset + ChunkSequenceOffset) != chunk.Sequence)
+                {
+                    // overwritten, we fell too far behind.
+                    writer.Chunks.Dequeue();
+                    overrun = true;
+                    continue;
+                }
+
+                // a thread seals its chunk before it claims the next one, so if there is a newer chunk
+                // then this one is finished even if the thread died before sealing it.
+                bool finished = writer.Chunks.Count > 1 || sharedMemoryAccessor.ReadInt32(chunk.Offset + ChunkStateOffset) == ChunkSealed;
+                int used = sharedMemoryAccessor.ReadInt32(chunk.Offset + ChunkUsedOffset);
+
+                bool overwritten = false;
+                while (chunk.Read + RecordSize <= used)
+                {
+                    long pos = chunk.Offset + ChunkHeaderSize + chunk.Read;
+                    uint id = sharedMemoryAccessor.ReadUInt32(pos);
+                    uint delta = sharedMemoryAccessor.ReadUInt32(pos + 4);
+                    if (id == TimeBaseRecord)
+                    {
+                        // the writer publishes the timestamp together with the record that follows it.
+                        if (chunk.Read + 2 * RecordSize > used)
+                        {
+                            break;
+                        }
+                        long time = sharedMemoryAccessor.ReadInt64(pos + RecordSize);
+                        if (IsOverwritten(chunk.Offset, chunk.Sequence))
+                        {
+                            overwritten = true;
+                            break;
+                        }
+                        chunk.Timestamp = time;
+                        chunk.Read += 2 * RecordSize;
+                        continue;
+                    }
+                    if (id >= FirstExtendedRecord && id < FirstMethodId)
+                    {
+                        // published all at once, and it doesn't move the clock.
+                        int size = (int)delta;
+                        if (chunk.Read + RecordSize + size > used)
+                        {
+                            break;
+                        }
+                        if (payload.Length != size)
+                        {
+                            payload = new byte[size];
+                        }
+                        sharedMemoryAccessor.ReadArray(pos + RecordSize, payload, 0, size);
+                        if (IsOverwritten(chunk.Offset, chunk.Sequence))
+                        {
+                            overwritten = true;
+                            break;
+                        }
+                        chunk.Read += RecordSize + size;
+                        timestamp = ToMicroseconds(chunk.Timestamp);
+                        return id;
+                    }
+                    if (IsOverwritten(chunk.Offset, chunk.Sequence))
+                    {
+                        overwritten = true;
+                        break;
+                    }
+                    chunk.Timestamp += delta;
+                    chunk.Read += RecordSize;
+                    timestamp = ToMicroseconds(chunk.Timestamp);
+                    return id;
+                }
+
+                if (overwritten)
+                {
+                    // the writers lapped us while we were reading it.
+                    writer.Chunks.Dequeue();
+                    overrun = true;
+                    continue;
+                }
+
+                if (!finished)
+                {
+                    // nothing more from this thread yet.
+                    return 0;
+                }
+                writer.Chunks.Dequeue();
             }
-            return id;
+            return 0;
         }
 
     }
@@ -12,8 +12,8 @@ namespace SoftwareTrails
     public class CallHistory
     {
         public MethodCall Method { get; set; }
-        public long Timestamp { get; set; }
-        public int Elapsed { get; set; }
+        public long Timestamp { get; set; } // microseconds
+        public int Elapsed { get; set; }    // microseconds
 
         // So we can create very light weight linked list of these objects.
         public CallHistory Next { get; set; } 
@@ -39,13 +39,13 @@ namespace SoftwareTrails
             this.isMethod = isMethodCall;
 
             string label = fullName;
-            int i = fullName.LastIndexOf('.');
+            int i = LastSeparator(fullName);
             if (i >= 0)
             {
                 this.type = fullName.Substring(0, i);
                 this.name = fullName.Substring(i + 1);
 
-                i = type.LastIndexOf('.');
+                i = LastSeparator(type);
                 if (i >= 0)
                 {
                     this.nspace = type.Substring(0, i);
@@ -63,6 +63,33 @@ namespace SoftwareTrails
             }
         }
 
+        /// <summary>
+        /// Names look like "Namespace.Outer+Inner<System.Int32>.Method<T>#1a2b3c4d", so the dots in generic arguments
+        /// don't separate anything, and in "Type..ctor" the method is ".ctor".  Returns the index of the last dot that
+        /// does, or -1.
+        /// </summary>
+        static int LastSeparator(string name)
+        {
+            int depth = 0;
+            for (int i = name.Length - 1; i > 0; i--)
+            {
+                char c = name[i];
+                if (c == '>')
+                {
+                    depth++;
+                }
+                else if (c == '<' && depth > 0)
+                {
+                    depth--;
+                }
+                else if (c == '.' && depth == 0)
+                {
+                    return name[i - 1] == '.' ? i - 1 : i;
+                }
+            }
+            return -1;
+        }
+
         public bool IsMethod 
         { 
             get { return isMethod; } 
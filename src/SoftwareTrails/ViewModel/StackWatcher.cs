@@ -14,8 +14,10 @@ namespace SoftwareTrails
         private ProfilerControlModel controller;
         CancellationTokenSource cancelTokenSource;
         long callsRead;
-        ConcurrentStack<CallHistory> stack = new ConcurrentStack<CallHistory>();
+        // one call stack per thread in the target process.
+        ConcurrentDictionary<long, ConcurrentStack<CallHistory>> stacks = new ConcurrentDictionary<long, ConcurrentStack<CallHistory>>();
         int? location;
+        long locationThread; // the thread whose stack location refers to.
         SpinLock pendingSpinLock = new SpinLock(false);
         CallHistory pending;
         CallHistory pendingTail;
@@ -58,7 +60,8 @@ namespace SoftwareTrails
         internal void Clear()
         {
             pending = null;
-            stack.Clear();
+            stacks.Clear();
+            location = null;
             callsRead = 0;
         }
 
@@ -78,9 +81,12 @@ namespace SoftwareTrails
             }
         }
 
-        public ConcurrentStack<CallHistory> Stack
+        /// <summary>
+        /// Get the current call stack of the given thread.
+        /// </summary>
+        public ConcurrentStack<CallHistory> GetStack(long thread)
         {
-            get { return stack; }
+            return stacks.GetOrAdd(thread, (key) => new ConcurrentStack<CallHistory>());
         }
 
         public void Dispose()
@@ -111,15 +117,35 @@ namespace SoftwareTrails
             while (!token.IsCancellationRequested && controller != null)
             {
                 long timestamp;
-                long methodId = controller.ReadMethod(out timestamp);
+                long thread;
+                long methodId = controller.ReadMethod(out timestamp, out thread);
                 if (methodId == 0)
                 {
-                    // reached end of buffer
-                    Thread.Sleep(1000);
+                    // reached end of buffer, the profiler wakes us when there is more.
+                    controller.WaitForCalls(1000);
                 }                    
+                else if (methodId == ProfilerControlModel.ResyncMethod)
+                {
+                    // recording was paused, the calls on this stack finished while we weren't looking.
+                    GetStack(thread).Clear();
+                    if (location.HasValue && thread == locationThread)
+                    {
+                        location = null;
+                    }
+                }
+                else if (methodId == ProfilerControlModel.OverrunMethod)
+                {
+                    // we fell behind and lost calls on every thread, so no stack can be trusted.
+                    foreach (ConcurrentStack<CallHistory> stack in stacks.Values)
+                    {
+                        stack.Clear();
+                    }
+                    location = null;
+                }
                 else if (methodId == ProfilerControlModel.LeaveMethod || methodId == ProfilerControlModel.TailCall)
                 {
                     CallHistory call = null;
+                    ConcurrentStack<CallHistory> stack = GetStack(thread);
                         
                     if (stack.TryPop(out call))
                     {
@@ -129,7 +155,7 @@ namespace SoftwareTrails
                         AddPending(ref hasLock, call);
                     }
 
-                    if (location.HasValue)
+                    if (location.HasValue && thread == locationThread)
                     {
                         if (stack.Count < location.Value)
                         {
@@ -155,6 +181,7 @@ namespace SoftwareTrails
                     if (method != null)
                     {
                         CallHistory call = GetFree(ref hasFreeLock, method);
+                        ConcurrentStack<CallHistory> stack = GetStack(thread);
                         
                         call.Timestamp = timestamp;
                         call.Elapsed = 0; // don't know yet.
@@ -168,11 +195,12 @@ namespace SoftwareTrails
                         if (view.Watching != null && method.Matches(view.Watching))
                         {
                             location = stack.Count;
+                            locationThread = thread;
 
                             // tell the view about the entire stack that we have so far
                             view.ShowStack(stack);
                         }
-                        else if (location.HasValue)
+                        else if (location.HasValue && thread == locationThread)
                         {
                             // we are going deeper
                             view.EnterMethod(previous, call);
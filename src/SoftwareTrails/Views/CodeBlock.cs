@@ -16,7 +16,7 @@ namespace SoftwareTrails
         Border innerBorder;
         SolidColorBrush background;
         int calls;
-        long elapsed; // milliseconds
+        long elapsed; // microseconds
         TextBlock nameLabel;
         TextBlock callLabel;
         TextBlock nsLabel;
@@ -84,10 +84,7 @@ namespace SoftwareTrails
 
             // label showing total elapsed time inside this method (in milliseconds)
             elapsedLabel = new TextBlock() { FontSize = 8, Margin = new Thickness(10,0,0,0) };
-            elapsedLabel.ToolTip = "Total elapsed time inside this method in milliseconds.  \n" +
-                                   "Since many methods are faster than 1 millisecond those \n" +
-                                   "methods will show zero time.  This way only the really \n" +
-                                   "expensive methods show up here.";
+            elapsedLabel.ToolTip = "Total elapsed time inside this method in milliseconds.";
             Grid.SetRow(elapsedLabel, 2);
             Grid.SetColumn(elapsedLabel, 1);
             labels.Children.Add(elapsedLabel);
@@ -256,14 +253,14 @@ namespace SoftwareTrails
             callLabel.Text = this.calls.ToString();
 
             // we have elapsed time now, so show it too.
-            elapsedLabel.Text = (this.elapsed != 0) ? this.elapsed.ToString() : "";
+            elapsedLabel.Text = (this.elapsed != 0) ? (this.elapsed / 1000.0).ToString("0.###") : "";
 
             return base.MeasureOverride(constraint);
         }
 
-        internal void AddCalls(int calls, long milliseconds, int batch)
+        internal void AddCalls(int calls, long microseconds, int batch)
         {
-            SetCalls(this.calls + calls, this.elapsed + milliseconds, batch);
+            SetCalls(this.calls + calls, this.elapsed + microseconds, batch);
         }
 
         internal void SetCalls(int calls, long elapsed, int batch)
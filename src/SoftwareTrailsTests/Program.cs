@@ -0,0 +1,80 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+namespace SoftwareTrails.Tests
+{
+    /// <summary>
+    /// Checks the client side bookkeeping that doesn't need a profiled process.  Returns the number of failed checks.
+    /// </summary>
+    public class TestProgram
+    {
+        int failures;
+
+        static int Main(string[] args)
+        {
+            TestProgram p = new TestProgram();
+            p.DefineThenRetire();
+            p.RetireAfterNextDefine();
+            p.DefineAfterItsRetire();
+            p.RepeatedRecords();
+            Console.WriteLine(p.failures == 0 ? "all tests passed" : p.failures + " checks failed");
+            return p.failures;
+        }
+
+        void Check(bool condition, string what)
+        {
+            if (!condition)
+            {
+                Console.WriteLine("FAILED: " + what);
+                failures++;
+            }
+        }
+
+        void DefineThenRetire()
+        {
+            MethodSlots slots = new MethodSlots();
+            bool recycled;
+            Check(slots.Define(3, 7, 0, out recycled) && !recycled, "first define is accepted");
+            Check(slots.GetModule(3) == 7, "define records the module");
+            Check(slots.Retire(3, 0), "retire of the defined generation is accepted");
+            Check(slots.GetModule(3) == 0, "retire forgets the module");
+            Check(slots.Define(3, 8, 1, out recycled) && !recycled, "next generation is accepted after the retire");
+            Check(slots.GetModule(3) == 8, "next generation records its module");
+        }
+
+        // the retire of generation N was written by a slower thread than the define of N+1.
+        void RetireAfterNextDefine()
+        {
+            MethodSlots slots = new MethodSlots();
+            bool recycled;
+            slots.Define(0, 1, 0, out recycled);
+            Check(slots.Define(0, 2, 1, out recycled) && recycled, "define of the next generation replaces the old one");
+            Check(!slots.Retire(0, 0), "stale retire is rejected");
+            Check(slots.GetModule(0) == 2, "stale retire leaves the new module alone");
+            Check(slots.Retire(0, 1), "retire of the current generation is accepted");
+        }
+
+        void DefineAfterItsRetire()
+        {
+            MethodSlots slots = new MethodSlots();
+            bool recycled;
+            Check(slots.Retire(5, 2), "retire before any define is accepted");
+            Check(!slots.Define(5, 4, 2, out recycled), "define of a retired generation is rejected");
+            Check(slots.GetModule(5) == 0, "rejected define leaves no module");
+            Check(slots.Define(5, 4, 3, out recycled) && !recycled, "define of the next generation is accepted");
+        }
+
+        void RepeatedRecords()
+        {
+            MethodSlots slots = new MethodSlots();
+            bool recycled;
+            slots.Define(1, 1, 4, out recycled);
+            Check(slots.Define(1, 1, 4, out recycled) && !recycled, "repeated define is accepted but not recycled");
+            Check(slots.Retire(1, 4), "retire is accepted");
+            Check(!slots.Retire(1, 4), "repeated retire is rejected");
+            Check(slots.GetModule(-1) == 0 && slots.GetModule(100) == 0, "unknown slots have no module");
+        }
+    }
+}